@@ -4,43 +4,717 @@
 // Parvathi Puthedath Joshy -110146653
 // Ardra Sanjiv Kumar - 110129179
 //------------------------------------------------------------------
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>  
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <stdint.h>
+#include <endian.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <zlib.h>
+#include <ctype.h>
+#include <openssl/evp.h>
 
 #define PORT 9678
 #define BUF_SIZE 1024
+#define SERVER_NAME "smain"
+#define STATE_DIR ".dfs"  // per-server state under $HOME, outside the served trees
+#define SENDFILE_CHUNK (16 * 1024 * 1024)  // largest single sendfile() call
+
+// Transfer chunks: --chunk-size fixes the buffer bodies are moved through, otherwise small
+// transfers use small buffers and large ones fewer, bigger system calls
+#define CHUNK_SMALL (64 * 1024)      // transfers up to CHUNK_SMALL_FILE bytes
+#define CHUNK_MEDIUM (256 * 1024)
+#define CHUNK_LARGE (1024 * 1024)    // transfers past CHUNK_LARGE_FILE bytes
+#define CHUNK_SMALL_FILE (1024 * 1024)
+#define CHUNK_LARGE_FILE (64 * 1024 * 1024)
+#define CHUNK_KB_MAX 16384
+#define SOCKET_BUFFER_KB_MAX 65536
+
+// Front end models for accepting client connections
+#define MODE_FORK 0
+#define MODE_EPOLL 1
+#define EPOLL_MAX_EVENTS 64
+#define READY_QUEUE_SIZE 4096
+#define EVENT_OFFLOAD_MIN (64 * 1024)  // file bodies from this size are written by the event loop
+#define EVENT_IO_TIMEOUT 60            // seconds a command may wait on a client or server that stalls
+
+// Pooled connections from Smain to the storage servers
+#define POOL_MAX_IDLE 64
+#define POOL_REPORT_EVERY 1000  // print the pool counters after this many checkouts
+
+// Read cache of the files served by the storage servers, keyed by their smain path
+#define CACHE_DEFAULT_MB 64
+#define CACHE_BUCKETS 4096
+#define CACHE_REPORT_EVERY 1000  // print the cache counters after this many lookups
+
+// How proxied .pdf/.txt bytes are moved between the client and the storage servers
+#define RELAY_COPY 0    // recv into a user buffer and send it on
+#define RELAY_SPLICE 1  // splice through a pipe so the bytes stay in the kernel
+#define RELAY_PIPE_SIZE (1024 * 1024)
+
+// Framed protocol shared by client24s, Smain, Spdf and Stext.
+// Every message starts with a fixed header in network byte order:
+//   magic(2) version(1) opcode(1) request_id(4) param(4) name_len(2) path_len(2) payload_len(8)
+// followed by name_len bytes of name, path_len bytes of path and payload_len bytes of payload.
+// A request is answered by zero or more OP_DATA frames and exactly one OP_END frame.
+#define PROTO_MAGIC 0x4446
+#define PROTO_VERSION 1
+#define FRAME_HEADER_SIZE 24
+
+#define OP_UFILE 1    // name = file name, path = destination directory, payload = file body
+#define OP_DFILE 2    // path = file to download, name = optional byte range (see parseByteRange), or the validator with DFILE_IF_MATCH
+#define OP_RMFILE 3   // path = file to remove
+#define OP_DISPLAY 4  // path = directory to list, name = cursor (list after this path), param = page size (0 = all)
+#define OP_DTAR 5     // name = file type, param = compression (DTAR_PARAM)
+#define OP_LINK 6     // name = file name, path = destination directory, payload = SHA-256 of the body in hex
+#define OP_UQUERY 7   // name = upload id, path = destination file; the END name is the committed offset
+#define OP_UCHUNK 8   // name = "<upload id>@<offset>", path = destination file, param = UCHUNK_LAST on the last chunk
+#define OP_INGEST 9   // path = destination directory, payload = tar stream of .c, .pdf and .txt files
+#define OP_DATA 64    // payload = a piece of the response body
+#define OP_END 65     // param = status, payload = message for the user, name = display cursor of the next page
+
+#define STATUS_OK 0
+#define STATUS_ERROR 1
+#define STATUS_MISSING 2  // OP_LINK: the body is not stored, upload it with OP_UFILE
+#define STATUS_RANGE 3    // OP_DFILE: the range starts past the end of the file; OP_UCHUNK: wrong offset
+#define STATUS_NOT_MODIFIED 4  // OP_DFILE with DFILE_IF_MATCH: the client's copy is current, no body follows
+
+#define UCHUNK_LAST 1  // OP_UCHUNK param: the upload is complete after this chunk
+#define UCHUNK_AT 2    // OP_UCHUNK param: write at the given offset without a checkpoint, for parallel streams
+
+#define DFILE_IF_MATCH 1  // OP_DFILE param: name is "<size>@<sec>.<nsec>[#<sha256>]" of the client's copy
+
+// dtar compression: codec in the low byte of param, level (0-9) in the next byte
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define DTAR_PARAM(codec, level) ((uint32_t)(codec) | ((uint32_t)(level) << 8))
+#define DTAR_CODEC(param) ((param) & 0xff)
+#define DTAR_LEVEL(param) (((param) >> 8) & 0xff)
+
+struct frameHeader {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    uint32_t param;
+    uint16_t name_len;
+    uint16_t path_len;
+    uint64_t payload_len;
+};
+
+// Native tar writer used by dtar
+#define TAR_BLOCK_SIZE 512
+#define TAR_HEADER_MAX (TAR_BLOCK_SIZE * 12)  // pax extended header plus the ustar header
+#define TAR_READAHEAD 8                       // files opened and prefetched ahead of the one being sent
+#define TAR_SMALL_FILE (64 * 1024)            // files up to this size are copied into the output buffer
+#define TAR_OUT_BUF_SIZE (512 * 1024)         // headers and small files are batched into sends of this size
+#define COMPRESS_BUF_SIZE (256 * 1024)        // input and output chunk of the gzip stage
+#define SHARD_BUF_SIZE (256 * 1024)           // chunk of a storage server's archive in a merged dtar
+
+// In-memory index of the stored files, used by display and the dfile/rmfile existence checks
+#define INDEX_INITIAL_CAP 1024
+#define INDEX_BATCH_SIZE (64 * 1024)  // display data frame size
+
+// Content store used by --dedup: every stored path is a hard link to $HOME/.dfs/<server>/objects/<hash>
+#define STORE_DIR "objects"
+#define STORE_XATTR "user.dfs.sha256"  // hash of the object, shared by all of its links
+#define STORE_HASH_LEN 64                 // SHA-256 in hex
+#define STORE_BUF_SIZE (64 * 1024)
+
+// Resumable uploads: the partial file and its committed offset live under $HOME/.dfs/<server>/uploads
+#define UPLOAD_DIR "uploads"
+#define UPLOAD_ID_LEN 64                   // SHA-256 in hex, chosen by the client
+#define UPLOAD_BUF_SIZE (64 * 1024)
+#define UPLOAD_EXPIRY (7 * 24 * 60 * 60)   // seconds an unfinished upload is kept
+
+// Durability of stored uploads: the body goes to a temporary file next to its final name, is
+// made durable as the mode asks and is renamed over the final name, so a crash never leaves a
+// partial file under that name
+#define DURABILITY_NONE 0   // the page cache writes the file back in its own time
+#define DURABILITY_FSYNC 1  // every file is synced before it is acknowledged
+#define DURABILITY_GROUP 2  // concurrent uploads share one sync
+#define GROUP_COMMIT_MS 5   // longest a group commit waits for the uploads that usually join it
+
+// Bulk ingest: a tar stream unpacked as it arrives
+#define INGEST_PAX_MAX (64 * 1024)  // larger pax and GNU long name headers are skipped
+#define INGEST_BUF_SIZE (64 * 1024)
+
+// One regular file found by the tar walk
+struct tarEntry {
+    char *name;         // path inside the archive, e.g. "./a/x.c"
+    uint64_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    size_t header_len;  // bytes of header blocks in front of the file body
+};
+
+struct tarList {
+    struct tarEntry *entries;
+    size_t count;
+    size_t cap;
+};
+
+// Raw tar input of the compression stage: a finished archive file, or a list to build from
+struct tarSource {
+    int archive_fd;  // -1 when the archive is built from list
+    uint64_t size;
+    int root_fd;
+    struct tarList *list;
+    const struct route *route;  // set to merge the archives of the route's storage servers instead
+    int out_fd;      // write end of the pipe to the compressor
+    int rc;          // result of the producer thread
+};
+
+// A storage server receiving the .pdf or .txt members of an ingest
+// Members are sent back to back on one pooled connection while a reader thread counts the replies
+struct ingestForwarder {
+    struct backendPool *pool;
+    const char *name;
+    int sock;                // -1 until the first member for this server
+    int broken;              // the connection failed, the remaining members are not sent
+    int done;                // every member has been sent
+    unsigned long members;
+    unsigned long sent;
+    unsigned long answered;
+    unsigned long failed;
+    unsigned long refused;   // copies that could not be sent at all
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Sorted full paths of every .c file under root, so the files of a directory are one range
+struct pathIndex {
+    char root[PATH_MAX];
+    const char *suffix;
+    char **paths;
+    size_t count;
+    size_t cap;
+    int valid;            // 0 until built, or after a change the index could not follow
+    uint64_t generation;  // tar cache generation the index matches
+    int stamp_fd;         // tar cache stamp, read to notice changes made by other processes
+    pthread_rwlock_t lock;
+};
+
+static struct pathIndex path_index = {
+    .suffix = ".c", .stamp_fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// One client connection of the event loop
+// The loop reads every request frame and writes large file bodies itself, so a worker only
+// holds the connection while it runs a command
+struct eventConn {
+    int sock;
+    unsigned char in[FRAME_HEADER_SIZE + 2 * BUF_SIZE];  // request frame received so far
+    size_t in_len;
+    size_t in_need;  // FRAME_HEADER_SIZE until the header gives the name and path lengths
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    // Response left to the loop: the DATA frame, its body from a file or a cache entry, and the END frame
+    unsigned char head[FRAME_HEADER_SIZE + BUF_SIZE];
+    size_t head_len;  // 0 while the connection is not writing
+    size_t head_sent;
+    int body_fd;
+    struct cacheEntry *body_entry;
+    uint64_t body_offset;
+    uint64_t body_left;
+    unsigned char tail[FRAME_HEADER_SIZE];
+    size_t tail_len;
+    size_t tail_sent;
+};
+
+// Ready queue of connections with a complete request, handed from the event loop to the worker threads
+struct readyQueue {
+    struct eventConn *conns[READY_QUEUE_SIZE];
+    int head;
+    int tail;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+static int server_mode = MODE_FORK;
+static int worker_threads = 0;  // 0 means one worker per online core
+static int epoll_fd = -1;
+static int io_timeout = EVENT_IO_TIMEOUT;  // --io-timeout, 0 lets a stalled peer hold a worker
+static __thread struct eventConn *event_conn = NULL;  // connection whose command this worker runs
+static struct readyQueue ready_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+
+// Idle connections to one storage server, kept open between requests
+struct backendPool {
+    const char *name;
+    const char *ip;
+    int port;
+    const char *dir;           // directory under $HOME that takes the place of smain on this server
+    int index;                 // position in backend_pools
+    int idle[POOL_MAX_IDLE];
+    int idle_count;
+    unsigned long hits;        // requests served on a pooled connection
+    unsigned long misses;      // requests that had to open a new connection
+    unsigned long stale;       // pooled connections dropped by the health check
+    unsigned long reconnects;  // requests retried after a pooled connection failed
+    int inflight;              // reads being served by this server, to pick the least loaded copy
+    unsigned long reads;       // reads it served
+    pthread_mutex_t lock;
+};
+
+// File routing: where the files of each extension are stored, from --routes or default_routes
+#define ROUTE_SLOTS 64          // hash slots of the extension lookup, a power of two
+#define ROUTE_MAX 32
+#define ROUTE_EXT_MAX 16
+#define ROUTE_MAX_BACKENDS 16   // storage servers one extension can be spread over
+#define MAX_BACKENDS 64         // storage servers over all routes
+#define ROUTE_VNODES 100        // points of each storage server on a route's hash ring
+#define REPLICA_SUFFIX ".replica"  // the copies a server holds for others live in ~/<dir>.replica
+#define REPLICA_BUF_SIZE (64 * 1024)
+
+// One point on a route's hash ring, owned by a storage server
+struct ringPoint {
+    uint32_t hash;
+    struct backendPool *pool;
+};
+
+// Where the files of one extension are kept: by Smain itself, or sharded over one or more
+// storage servers, each file on the server that owns the hash of its path on the ring
+struct route {
+    char ext[ROUTE_EXT_MAX];
+    int local;
+    int backend_count;
+    struct backendPool *backends[ROUTE_MAX_BACKENDS];
+    struct ringPoint *ring;     // backend_count * ROUTE_VNODES points sorted by hash, with several servers
+    int ring_size;
+};
+
+// Answers of the storage servers holding the copies of one file to a write or a remove
+struct replicaWrite {
+    int count;
+    struct backendPool *pools[ROUTE_MAX_BACKENDS];
+    int socks[ROUTE_MAX_BACKENDS];  // -1 once the server has answered or failed
+    int pending;                    // requests sent and not answered yet
+    int acks;
+    int have_answer;                // answer is the first success, or the first failure until one arrives
+    struct frameHeader answer;
+    char answer_name[BUF_SIZE];
+    char answer_message[BUF_SIZE];
+};
+
+// Listings gathered in parallel by display: Smain's .c files and every storage server
+#define DISPLAY_SOURCES (1 + MAX_BACKENDS)
+
+// One display listing and how long it took
+struct displaySource {
+    const char *name;
+    struct backendPool *pool;  // NULL for the local .c files
+    char path[BUF_SIZE];
+    int sock;                  // connection to the storage server while its list is arriving
+    int reused;
+    int frames;
+    int failed;                // unreachable or lost, its files are listed from their replica copies
+    int timed_out;             // gave up on after --io-timeout, its list may be incomplete
+    struct timespec start;
+    double elapsed_ms;
+};
+
+// Which servers failed a display and how busy the others were when their replicas were asked
+struct replicaListing {
+    int down[MAX_BACKENDS];
+    int inflight[MAX_BACKENDS];
+    unsigned long reads[MAX_BACKENDS];
+};
+
+// One cached file body with the size and mtime its storage server reported
+struct cacheEntry {
+    char *key;
+    char *data;
+    uint64_t size;
+    long long mtime_sec;
+    long mtime_nsec;
+    int refs;                  // senders still using data after the lock was dropped
+    int dead;                  // dropped while in use, freed by the last sender
+    struct cacheEntry *prev;   // LRU list, most recently used first
+    struct cacheEntry *next;
+    struct cacheEntry *chain;  // next entry in the same hash bucket
+};
+
+// A file body kept as it is relayed to the client on a cache miss
+struct cacheFill {
+    char key[BUF_SIZE];
+    uint64_t generation;  // cache generation when the request started
+    int abandoned;        // the body did not come as one whole-file frame
+    char *data;
+    uint64_t size;
+    long long mtime_sec;
+    long mtime_nsec;
+};
+
+// Size-bounded LRU cache, one per Smain process
+struct readCache {
+    struct cacheEntry *buckets[CACHE_BUCKETS];
+    struct cacheEntry *head;
+    struct cacheEntry *tail;
+    uint64_t bytes;
+    uint64_t limit;       // 0 disables the cache
+    uint64_t max_entry;   // larger files are always relayed from their server
+    uint64_t generation;  // bumped by every invalidation, fills started before it are dropped
+    unsigned long lookups, hits, fills, evictions, invalidations;
+    uint64_t hit_bytes;   // bytes actually sent from cached entries
+    pthread_mutex_t lock;
+};
+
+// A byte range a parallel upload has written, as read back from its record
+struct uploadRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+// A file waiting for the group commit thread to make it durable
+struct commitRequest {
+    int fd;
+    dev_t dev;
+    int rc;
+    int done;
+    struct commitRequest *next;
+};
+
+// Files waiting for the next group commit, shared by the uploads of one process
+struct groupCommit {
+    struct commitRequest *pending;
+    int count;    // requests pending
+    int running;
+    pthread_once_t started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // the commit thread has work
+    pthread_cond_t done;  // a commit finished
+};
+
+static int dedup_mode = 0;  // store uploads once per distinct content
+static int durability_mode = DURABILITY_NONE;
+static int group_commit_ms = GROUP_COMMIT_MS;
+static size_t transfer_chunk = 0;  // --chunk-size, 0 sizes the chunks by the transfer
+static int socket_buffer = 0;      // --socket-buffer in bytes, 0 leaves the sizes to the kernel
+static struct groupCommit group_commit = {
+    .started = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+static int relay_mode = RELAY_SPLICE;
+static __thread int relay_pipe[2] = {-1, -1};  // each worker thread (or forked child) splices through its own pipe
+static __thread int relay_pipe_size = 0;
+static int pool_size = POOL_MAX_IDLE;  // idle connections kept per server, 0 disables pooling
+static int replica_count = 1;  // storage servers that get a copy of each file
+static int write_quorum = 0;   // copies stored before a write is acknowledged, 0 for a majority
+static struct readCache read_cache = {.limit = CACHE_DEFAULT_MB * 1024ULL * 1024, .lock = PTHREAD_MUTEX_INITIALIZER};
+static struct backendPool backend_pools[MAX_BACKENDS];
+static int backend_pool_count = 0;
+static struct route routes[ROUTE_MAX];
+static int route_count = 0;
+static struct route *route_slots[ROUTE_SLOTS];  // open addressing on the hash of the extension
+
+// Routing used without --routes, in the same format as the file
+static const char *default_routes =
+    ".c    local\n"
+    ".pdf  127.0.0.1:9801:spdf\n"
+    ".txt  127.0.0.1:9800:stext\n";
 
 //Function declarations
 void prcclient();
+void runForkServer(int server_sock);
+void runEventLoopServer(int server_sock);
+void *eventWorker(void *arg);
+void pushReadyClient(struct eventConn *conn);
+struct eventConn *popReadyClient();
+struct eventConn *openEventConn(int sock);
+void closeEventConn(struct eventConn *conn);
+void armEventConn(struct eventConn *conn, uint32_t events);
+void readEventRequest(struct eventConn *conn);
+void writeEventResponse(struct eventConn *conn);
+int queueEventBody(struct eventConn *conn, uint32_t request_id, const char *content_range, int fd, struct cacheEntry *entry, uint64_t offset, uint64_t length);
+void setIoTimeout(int sock);
+void ioDeadline(struct timespec *deadline);
+int pollTimeout(const struct timespec *deadline);
+int receiveAndHandleCommand(int client_sock);
 void handleClientConnection(int client_sock);
-void handleCommandsfromClient(int client_sock, const char *command);
-void ufileCommandExecution(const char *filename, const char *dest_path, int client_sock);
-void sendFileandPathtoServer(const char *filename, const char *server_ip, int server_port, const char *dest_dir, int client_sock);
+int handleCommandsfromClient(int client_sock, const struct frameHeader *hdr, const char *name, const char *path);
+int ufileCommandExecution(uint8_t opcode, const char *filename, const char *dest_path, uint64_t file_size, uint32_t request_id, int client_sock);
+int uploadCommandExecution(const struct frameHeader *hdr, const char *name, const char *path, int client_sock);
+int sendFileandPathtoServer(uint8_t opcode, uint32_t param, const char *filename, struct backendPool *pool, const char *dest_dir, uint64_t file_size, uint32_t request_id, int client_sock);
 int createDir(const char *path);
-void rmfileCommandExecution(const char *filename, int client_sock);
-void sendRemoveRequesttoServer(const char *filename, const char *server_ip, int server_port, int client_sock);
-void replacesmainPath(char *path, const char *replacement);
-void retrieveAndSendFile(const char *filename, int client_sock);
-void requestFileFromServer(const char *filename, const char *server_ip, int server_port, int client_sock);
-void dfileCommandExecution(const char *filename, int client_sock);
-void requestFileListFromServer(const char *server_ip, int server_port, const char *command, const char *directory, char *file_list);
-void dtarCommandExecution(const char *filetype, int client_sock);
-void displayCommandExecution(const char *pathname, int client_sock);
+int rmfileCommandExecution(const char *filename, uint32_t request_id, int client_sock);
+int sendRemoveRequesttoServer(const char *filename, struct backendPool *pool, uint32_t request_id, int client_sock);
+int loadRoutes(const char *path);
+int addRoute(char *line, const char *source, int line_no);
+struct backendPool *addBackend(const char *target, const char *source, int line_no);
+uint32_t routeHash(const char *key);
+uint32_t ringHash(const char *key);
+int buildRouteRing(struct route *route);
+int compareRingPoints(const void *a, const void *b);
+struct route *findRoute(const char *ext);
+struct route *routeForPath(const char *path);
+int ringPosition(const struct route *route, const char *path);
+int routeReplicas(const struct route *route, const char *path, struct backendPool **replicas);
+int replicaQuorum(int copies);
+void routedPath(const struct backendPool *pool, const char *path, char *out, size_t size, int replica);
+int writeToReplicas(uint8_t opcode, uint32_t param, const char *name, struct backendPool **pools, int count, const char *path, uint64_t size, uint32_t request_id, int client_sock);
+int removeFromReplicas(const struct route *route, const char *path, uint32_t request_id, int client_sock);
+void awaitReplicaAnswers(struct replicaWrite *w, int needed);
+void readReplicaAnswer(struct replicaWrite *w, int i);
+int replyReplicaWrite(struct replicaWrite *w, int quorum, uint32_t request_id, int client_sock);
+void finishReplicaWrite(struct replicaWrite *w);
+void *replicaStragglers(void *arg);
+int readFromReplicas(uint8_t opcode, uint32_t param, const char *path, const char *name, const struct route *route, uint32_t request_id, int client_sock, struct cacheFill *fill);
+int requestFromReplica(uint8_t opcode, uint32_t param, const char *server_path, const char *name, struct backendPool *pool, int last, uint32_t request_id, int client_sock, struct cacheFill *fill);
+int queryUploadReplicas(const struct route *route, const char *path, const char *upload_id, uint32_t request_id, int client_sock);
+void orderReplicasByLoad(struct backendPool **pools, int count, int *order);
+int sendShardArchives(int sock, uint32_t request_id, uint32_t param, const struct route *route);
+int writeShardArchives(int out_fd, int framed, uint32_t request_id, const struct route *route);
+int relayShardArchive(struct backendPool *pool, const char *ext, int sock, int reused, int out_fd, int framed, uint32_t request_id, char *buf, int *written);
+int writeShardOutput(int out_fd, int framed, uint32_t request_id, const void *buf, size_t len);
+int retrieveAndSendFile(const char *filename, const char *range, uint32_t param, uint32_t request_id, int client_sock);
+int requestFileFromServer(uint8_t opcode, uint32_t param, const char *filename, const char *name, struct backendPool *pool, uint32_t request_id, int client_sock, struct cacheFill *fill);
+int dfileCommandExecution(const char *filename, const char *range, uint32_t param, uint32_t request_id, int client_sock);
+int dtarCommandExecution(const char *filetype, uint32_t param, uint32_t request_id, int client_sock);
+int displayCommandExecution(const char *pathname, const char *cursor, uint32_t page_size, uint32_t request_id, int client_sock);
+int sendLocalListing(int client_sock, uint32_t request_id, const char *directory, char *pos, size_t *limit, int *more);
+int sendDisplayPage(int client_sock, uint32_t request_id, struct displaySource *sources, int count, const char *cursor, uint32_t page_size);
+int relayDisplayPage(struct displaySource *source, const char *after, size_t *remaining, int *more, char *last, int client_sock, uint32_t request_id);
+void startDisplaySource(struct displaySource *source);
+void finishDisplaySource(struct displaySource *source);
+int relayDisplayFrame(struct displaySource *source, int client_sock, uint32_t request_id);
+int relayReplicaListings(struct displaySource *sources, int count, const char *pathname, int client_sock, uint32_t request_id);
+int relayReplicaListing(struct backendPool *pool, const char *pathname, const struct replicaListing *state, int client_sock, uint32_t request_id);
+int listedByReplica(const struct backendPool *pool, const char *path, const struct replicaListing *state);
 void tildePathOperation(char *path, char *expanded_path, size_t size);
-void collectFiles(const char *directory, const char *filetype, char *output);
+int sendAll(int sock, const void *buf, size_t len);
+int sendAllFlags(int sock, const void *buf, size_t len, int flags);
+int recvAll(int sock, void *buf, size_t len);
+size_t encodeFrame(unsigned char *out, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len);
+int decodeFrameHeader(const unsigned char *header, struct frameHeader *hdr);
+int sendFrame(int sock, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len);
+int recvFrame(int sock, struct frameHeader *hdr, char *name, char *path);
+int sendData(int sock, uint32_t request_id, const void *buf, size_t len);
+int sendEnd(int sock, uint32_t request_id, uint32_t status, const char *message);
+int drainPayload(int sock, uint64_t len);
+void setNoDelay(int sock);
+void setSocketBuffers(int sock);
+void setCork(int sock, int on);
+size_t transferChunk(uint64_t len);
+int sendFileContents(int sock, int fd, off_t offset, uint64_t len);
+int sendTarArchive(int sock, uint32_t request_id, uint32_t param, const char *root, const char *suffix);
+int sendCompressedArchive(int sock, uint32_t request_id, int level, struct tarSource *source);
+void *tarProducer(void *arg);
+int sendArchiveFile(int sock, uint32_t request_id, int fd, uint64_t size);
+int openTarCache(const char *suffix, char *cache_path, size_t size);
+uint64_t readTarGeneration(int stamp_fd);
+uint64_t invalidateTarCache(const char *suffix);
+int collectTarArchive(const char *root, const char *suffix, struct tarList *list, int *root_fd, uint64_t *total);
+int writeTarArchive(int out_fd, int root_fd, struct tarList *list);
+int collectTarEntries(int root_fd, char *rel, size_t rel_len, const char *suffix, struct tarList *list);
+int addTarEntry(struct tarList *list, const char *name, const struct stat *st);
+void freeTarList(struct tarList *list);
+size_t buildTarHeader(const struct tarEntry *entry, unsigned char *out);
+int sendTarBody(int out_fd, int fd, uint64_t size);
+int writeAll(int fd, const void *buf, size_t len);
+int storeUpload(int sock, const char *fullpath, uint64_t size, char *response, size_t response_size);
+int openUploadTemp(const char *fullpath, char *tmp_path, size_t size);
+int finishUpload(int fd, const char *tmp_path, const char *fullpath);
+int commitFile(int fd);
+int commitDirectory(const char *path);
+void startGroupCommit(void);
+void *groupCommitThread(void *arg);
+void readTarBody(int fd, char *out, uint64_t size);
+void initPathIndex(const char *root);
+int acquirePathIndex(struct pathIndex *index);
+int buildPathIndex(struct pathIndex *index);
+int walkPathIndex(struct pathIndex *index, char *path, size_t len);
+int appendIndexPath(struct pathIndex *index, const char *path);
+int comparePaths(const void *a, const void *b);
+size_t searchPathIndex(const struct pathIndex *index, const char *path);
+int indexedPath(const struct pathIndex *index, const char *path);
+int lookupPathIndex(struct pathIndex *index, const char *path);
+void updatePathIndex(struct pathIndex *index, const char *path, int present, uint64_t generation);
+struct pathIndex *openListing(const char *directory, struct pathIndex *scratch, char *prefix, size_t size);
+void closeListing(struct pathIndex *index);
+size_t fillIndexBatch(struct pathIndex *index, const char *prefix, char *last, char *batch, size_t size, size_t *limit);
+int moreIndexEntries(struct pathIndex *index, const char *prefix, const char *last);
+int relayPayload(int from_sock, int to_sock, uint64_t len);
+int splicePayload(int from_sock, int to_sock, uint64_t *len);
+int copyPayload(int from_sock, int to_sock, uint64_t len);
+int relayResponse(int server_sock, int client_sock, uint32_t request_id, int *server_ok, struct cacheFill *fill);
+int relayFrame(int server_sock, int client_sock, uint32_t request_id, const struct frameHeader *hdr, const char *name, const char *path, struct cacheFill *fill);
+int connectToBackend(struct backendPool *pool);
+int acquireBackend(struct backendPool *pool, int *reused);
+void releaseBackend(struct backendPool *pool, int sock, int reusable);
+int sendBackendRequest(struct backendPool *pool, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len, int *reused);
+void reportPoolStats(struct backendPool *pool);
+void cacheKey(const char *path, char *key, size_t size);
+struct cacheEntry *findCacheEntry(const char *key, struct cacheEntry ***link);
+struct cacheEntry *lookupCache(const char *path);
+void releaseCacheEntry(struct cacheEntry *entry);
+void holdCacheEntry(struct cacheEntry *entry);
+void dropCacheEntry(struct cacheEntry *entry);
+void invalidateCache(const char *path);
+void startCacheFill(struct cacheFill *fill, const char *path);
+int captureCacheFill(struct cacheFill *fill, const char *content_range, uint64_t payload_len);
+void finishCacheFill(struct cacheFill *fill);
+int sendCachedFile(int client_sock, uint32_t request_id, struct cacheEntry *entry, const char *range, uint32_t param, uint64_t *sent);
+void reportCacheStats(void);
+int openObjectStore(char *dir, size_t size);
+int objectPath(const char *dir, const char *hash, char *path, size_t size);
+int storedHash(const char *path, char *hash);
+int lockObjectStore(const char *dir);
+void unlockObjectStore(int lock_fd);
+void releaseObject(const char *dir, const char *hash);
+int linkObject(const char *dir, const char *hash, const char *path);
+int removeStoredFile(const char *path);
+int receiveIntoStore(int sock, uint64_t size, const char *dir, char *tmp_path, size_t tmp_size, char *hash);
+int ufileIntoStore(const char *filename, const char *fullpath, int body_fd, uint64_t file_size, uint32_t request_id, int client_sock);
+int linkCommandExecution(const char *filename, const char *fullpath, uint64_t payload_len, uint32_t request_id, int client_sock);
+void sweepObjectStore(void);
+int parseByteRange(const char *range, const struct stat *st, uint64_t *offset, uint64_t *length);
+int sendFileRange(int client_sock, uint32_t request_id, int fd, const struct stat *st, const char *range, uint32_t param);
+int copyIsCurrent(const char *validator, const struct stat *st, int fd);
+int hashOpenFile(int fd, char *hash);
+int uploadPaths(const char *upload_id, char *part_path, char *record_path, size_t size);
+uint64_t readUploadOffset(const char *record_path);
+int writeUploadOffset(const char *record_path, uint64_t offset);
+int sendUploadOffset(int client_sock, uint32_t request_id, uint32_t status, uint64_t offset);
+int uqueryCommandExecution(const char *upload_id, const char *fullpath, uint32_t request_id, int client_sock);
+int uchunkCommandExecution(const char *chunk, const char *fullpath, uint32_t param, uint64_t payload_len, uint32_t request_id, int client_sock);
+int recordUploadRange(const char *ranges_path, uint64_t offset, uint64_t length);
+int uploadRangesCover(const char *ranges_path, uint64_t size);
+int compareUploadRanges(const void *a, const void *b);
+void expireUploads(void);
+int ingestCommandExecution(const char *dest_path, uint64_t payload_len, uint32_t request_id, int client_sock);
+int ingestMember(struct ingestForwarder *forwarders, const char *dest_path, char *name, uint64_t size, uint32_t request_id, int client_sock, uint64_t *remaining, char *last_c, uint64_t *generation);
+int ingestLocalFile(const char *fullpath, uint64_t size, int client_sock, uint64_t *remaining);
+int forwardIngestFile(struct ingestForwarder **targets, char (*dest_dirs)[BUF_SIZE], int count, const char *filename, uint64_t size, uint32_t request_id, int client_sock, uint64_t *remaining);
+int startIngestMember(struct ingestForwarder *fwd, const char *filename, const char *dest_dir, uint64_t size, uint32_t request_id);
+void breakIngestForwarder(struct ingestForwarder *fwd);
+void *ingestReader(void *arg);
+void finishIngestForwarder(struct ingestForwarder *fwd, int abort);
+int recvIngest(int sock, void *buf, size_t len, uint64_t *remaining);
+int skipIngest(int sock, uint64_t len, uint64_t *remaining);
+int parseTarHeader(const unsigned char *h, char *name, size_t size, uint64_t *member_size);
+uint64_t parseTarNumber(const unsigned char *field, size_t len);
+int parsePaxRecords(char *pax, size_t len, char *name, size_t size, uint64_t *member_size);
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"pool-size", required_argument, NULL, 'p'},
+        {"relay", required_argument, NULL, 'r'},
+        {"dedup", no_argument, NULL, 'd'},
+        {"routes", required_argument, NULL, 'R'},
+        {"replicas", required_argument, NULL, 'c'},
+        {"write-quorum", required_argument, NULL, 'w'},
+        {"cache-size", required_argument, NULL, 'C'},
+        {"durability", required_argument, NULL, 'D'},
+        {"group-commit-ms", required_argument, NULL, 'G'},
+        {"io-timeout", required_argument, NULL, 'T'},
+        {"chunk-size", required_argument, NULL, 'k'},
+        {"socket-buffer", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *routes_path = NULL;
+    int opt;
+
+    // Parse the front end options
+    while ((opt = getopt_long(argc, argv, "m:t:p:r:dR:c:w:C:D:G:k:S:T:", long_options, NULL)) != -1) {
+        if (opt == 'm' && strcmp(optarg, "fork") == 0) {
+            server_mode = MODE_FORK;
+        } else if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+            server_mode = MODE_EPOLL;
+        } else if (opt == 't') {
+            worker_threads = atoi(optarg);
+        } else if (opt == 'r' && strcmp(optarg, "splice") == 0) {
+            relay_mode = RELAY_SPLICE;
+        } else if (opt == 'r' && strcmp(optarg, "copy") == 0) {
+            relay_mode = RELAY_COPY;
+        } else if (opt == 'p' && atoi(optarg) >= 0 && atoi(optarg) <= POOL_MAX_IDLE) {
+            pool_size = atoi(optarg);
+        } else if (opt == 'd') {
+            dedup_mode = 1;
+        } else if (opt == 'R') {
+            routes_path = optarg;
+        } else if (opt == 'c' && atoi(optarg) >= 1 && atoi(optarg) <= ROUTE_MAX_BACKENDS) {
+            replica_count = atoi(optarg);
+        } else if (opt == 'w' && atoi(optarg) >= 1) {
+            write_quorum = atoi(optarg);
+        } else if (opt == 'C' && atoi(optarg) >= 0) {
+            read_cache.limit = (uint64_t)atoi(optarg) * 1024 * 1024;
+        } else if (opt == 'D' && strcmp(optarg, "none") == 0) {
+            durability_mode = DURABILITY_NONE;
+        } else if (opt == 'D' && strcmp(optarg, "fsync") == 0) {
+            durability_mode = DURABILITY_FSYNC;
+        } else if (opt == 'D' && strcmp(optarg, "group") == 0) {
+            durability_mode = DURABILITY_GROUP;
+        } else if (opt == 'G' && atoi(optarg) >= 1) {
+            group_commit_ms = atoi(optarg);
+        } else if (opt == 'k' && atoi(optarg) >= 4 && atoi(optarg) <= CHUNK_KB_MAX) {
+            transfer_chunk = (size_t)atoi(optarg) * 1024;
+        } else if (opt == 'S' && atoi(optarg) >= 0 && atoi(optarg) <= SOCKET_BUFFER_KB_MAX) {
+            socket_buffer = atoi(optarg) * 1024;
+        } else if (opt == 'T' && atoi(optarg) >= 0) {
+            io_timeout = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [--mode fork|epoll] [--threads N] [--pool-size 0-%d] [--relay splice|copy] [--dedup] [--routes FILE] [--replicas 1-%d] [--write-quorum N] [--cache-size MB] [--durability none|fsync|group] [--group-commit-ms N] [--chunk-size KB] [--socket-buffer KB] [--io-timeout SEC]\n",
+                    argv[0], POOL_MAX_IDLE, ROUTE_MAX_BACKENDS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (loadRoutes(routes_path) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Forked children would each fill a private cache that the writes of other clients cannot
+    // invalidate, so only the event loop, where one process serves everyone, caches reads
+    if (server_mode == MODE_FORK) {
+        read_cache.limit = 0;
+    }
+    read_cache.max_entry = read_cache.limit / 8;
+
+    // Index the .c files kept by Smain before serving any request
+    const char *home = getenv("HOME");
+    if (home) {
+        char root[PATH_MAX];
+        snprintf(root, sizeof(root), "%s/smain", home);
+        initPathIndex(root);
+    }
+    if (dedup_mode) {
+        sweepObjectStore();
+    }
+    expireUploads();
 
-int main() {
     //Start the server
     prcclient();
     return 0;
@@ -48,10 +722,8 @@ int main() {
 
 // Function to set up the server and manage incoming connections
 void prcclient() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    pid_t child_pid;
+    int server_sock;
+    struct sockaddr_in server_addr;
 
     // Create a socket using IPv4 and TCP
     if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -59,6 +731,11 @@ void prcclient() {
         exit(EXIT_FAILURE);
     }
 
+    // Allow an immediate restart while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setSocketBuffers(server_sock);
+
     // Set up the address structure for the server
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -72,13 +749,32 @@ void prcclient() {
     }
 
     // Listen for connections
-    if (listen(server_sock, 10) < 0) {
+    if (listen(server_sock, SOMAXCONN) < 0) {
         perror("Listen error");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
 
+    // A client that disconnects mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     printf("Smain server listening on port %d\n", PORT);
+    if (server_mode == MODE_EPOLL) {
+        runEventLoopServer(server_sock);
+    } else {
+        runForkServer(server_sock);
+    }
+    close(server_sock);
+}
+
+// Function to serve clients by forking a process per connection
+void runForkServer(int server_sock) {
+    int client_sock;
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    pid_t child_pid;
+    int i;
+
     // Infinite loop to accept multiple client connections
     while (1) {
         // Accept a connection
@@ -93,7 +789,10 @@ void prcclient() {
             close(server_sock);
             // Handle client communication by calling the function
             handleClientConnection(client_sock);
-            close(client_sock);
+            // Each child has its own pool, so report what this session reused
+            for (i = 0; i < backend_pool_count; i++) {
+                reportPoolStats(&backend_pools[i]);
+            }
             exit(0);
         } else if (child_pid < 0) {
             perror("Fork error");
@@ -101,687 +800,5440 @@ void prcclient() {
         } else {
             // Parent process closes client socket
             close(client_sock);
-            // Clean up zombie processes
-            waitpid(-1, NULL, WNOHANG);
+            // Clean up every zombie process that has exited so far
+            while (waitpid(-1, NULL, WNOHANG) > 0);
         }
     }
-    close(server_sock);
 }
 
-// Function to handle client connections
-void handleClientConnection(int client_sock) {
-    char buffer[BUF_SIZE];
-    ssize_t n;
-
-    while (1) {  // Keep the connection open for multiple commands
-        // Clear the buffer before receiving a new command
-        memset(buffer, 0, BUF_SIZE);
+// Function to serve clients from an epoll event loop and a fixed pool of worker threads
+// Client sockets are non-blocking: the loop reads each request frame as its bytes arrive and
+// only hands complete requests to the workers. A worker runs the command with the socket
+// blocking, bounded by --io-timeout per read or write, and leaves large file bodies of dfile
+// to the loop, which writes them as the client takes them.
+void runEventLoopServer(int server_sock) {
+    struct epoll_event ev, events[EPOLL_MAX_EVENTS];
+    struct eventConn *conn;
+    int i, n, client_sock;
 
-        // Receive the command from the client
-        n = recv(client_sock, buffer, BUF_SIZE, 0);
-        if (n <= 0) {
-            if (n != 0) {
-                printf("Recv error\n");
-            } 
-            break;  // Exit the loop if the client disconnects or an error occurs
+    if (worker_threads <= 0) {
+        worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (worker_threads <= 0) {
+            worker_threads = 1;
         }
-        buffer[n] = '\0';
-        printf("Received command: %s\n", buffer);
-
-        // Call handleCommandsfromClient to process the command
-        handleCommandsfromClient(client_sock, buffer);
     }
 
-    // Close the connection when the loop ends (client disconnects)
-    close(client_sock);
-}
+    // The listening socket is non-blocking so the loop can drain the accept backlog
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL, 0) | O_NONBLOCK);
 
-// Function to handle a single command from the client
-void handleCommandsfromClient(int client_sock, const char *command) {
-    //Getting the command
-    char *cmd = strtok((char *)command, "\n");
-    //Validation for invalid commands
-    if (cmd == NULL) {
-        printf("Invalid command\n");
-        return;
-    }
-    //Option handling for the ufile command
-    if (strncmp(cmd, "ufile", 5) == 0) {
-        char *received_filename = strtok(NULL, "\n");
-        char *received_dest_path = strtok(NULL, "\n");
-        if (!received_filename || !received_dest_path) {
-            printf("Invalid ufile command format\n");
-            return;  // Exit if the command format is invalid
-        }
-        //Calling the function if the validation is successful
-        ufileCommandExecution(received_filename, received_dest_path, client_sock);
-    } 
-    //Option handling for the rmfile command
-    else if (strncmp(cmd, "rmfile", 6) == 0) {
-    // Parse the filename after "rmfile "
-    char *received_filename = cmd + 7;
-    if (!received_filename || strlen(received_filename) == 0) {
-        printf("Invalid rmfile command format\n");
-        return;
-    }
-    //Calling the function if the validation is successful
-    rmfileCommandExecution(received_filename, client_sock);
-    }
-    //Option handling for the dfile command
-    else if (strncmp(cmd, "dfile", 5) == 0) {
-        // Parse the filename after "dfile "
-        char *received_filename = cmd + 6;
-        if (!received_filename || strlen(received_filename) == 0) {
-            printf("Invalid dfile command format\n");
-            return;
-        }
-        //Calling the function if the validation is successful
-        dfileCommandExecution(received_filename, client_sock);
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 error");
+        exit(EXIT_FAILURE);
     }
-    //Option handling for the dfile command
-    else if (strncmp(cmd, "dtar", 4) == 0) {
-    char *filetype = cmd + 5;  // Skip the "dtar " part
-    //Calling the function
-    dtarCommandExecution(filetype, client_sock);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // the listening socket is the only one without a connection
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl error");
+        exit(EXIT_FAILURE);
     }
-    //Option handling for the display command
-    else if (strncmp(cmd, "display", 7) == 0) {
-        char *pathname = cmd + 8;
-        if (!pathname || strlen(pathname) == 0) {
-            printf("Invalid display command format\n");
-            return;
+
+    // Start the worker threads that run the command handlers
+    for (i = 0; i < worker_threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, eventWorker, NULL) != 0) {
+            perror("pthread_create error");
+            exit(EXIT_FAILURE);
         }
-        //Calling the function if the validation is successful
-        displayCommandExecution(pathname, client_sock);
+        pthread_detach(tid);
     }
-}
-
-// Function to handle the "ufile" command
-void ufileCommandExecution(const char *filename, const char *dest_path, int client_sock) {
-    char buffer[BUF_SIZE];
-    ssize_t n;
+    printf("Smain event loop running with %d worker threads\n", worker_threads);
 
-    // Determine file extension
-    char *ext = strrchr(filename, '.');
-    if (ext) {
-        if (strcmp(ext, ".c") == 0) {
-            // Creating the directory if it doesnt exists, to store .c files locally
-            if (createDir(dest_path) != 0) {
-                perror("mkdir error");
-                return;
+    while (1) {
+        n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait error");
             }
-            char fullpath[BUF_SIZE];
-            snprintf(fullpath, BUF_SIZE, "%s/%s", dest_path, filename);
-            FILE *file = fopen(fullpath, "wb");
-            if (!file) {
-                perror("File open error");
-                return;
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+            if (conn != NULL && conn->head_len > 0) {
+                // The client can take more of a response body
+                writeEventResponse(conn);
+                continue;
+            } else if (conn != NULL) {
+                // More of a request (or a hangup) has arrived
+                readEventRequest(conn);
+                continue;
             }
-            // Receive the file data from client24s and write the data to the file
-            while ((n = recv(client_sock, buffer, BUF_SIZE, 0)) > 0) {
-                size_t written = fwrite(buffer, 1, n, file);
-                if (written != n) {
-                    perror("fwrite error");
-                    break;
+            // Accept every pending connection
+            while ((client_sock = accept4(server_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                setNoDelay(client_sock);
+                setIoTimeout(client_sock);
+                if ((conn = openEventConn(client_sock)) == NULL) {
+                    perror("malloc error");
+                    close(client_sock);
+                    continue;
+                }
+                // One-shot so that only the loop or one worker owns the connection until it is re-armed
+                ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                ev.data.ptr = conn;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+                    perror("epoll_ctl error");
+                    closeEventConn(conn);
                 }
-                // Flush the output buffer
-                fflush(file);
-            }
-
-            fclose(file);
-
-        } else if (strcmp(ext, ".pdf") == 0) {
-            // Handle .pdf file, modify path and send to Spdf server
-            char modified_dest_dir[BUF_SIZE];
-            snprintf(modified_dest_dir, BUF_SIZE, "%s", dest_path);
-            // Replacing the smain with spdf before sending it to Spdf server
-            char *replace = strstr(modified_dest_dir, "smain");
-            if (replace) {
-                memmove(replace + 4, replace + 5, strlen(replace + 5) + 1);
-                strncpy(replace, "spdf", 4);
-            }
-            // Creating the directory if it doesn't exists
-            if (createDir(modified_dest_dir) != 0) {
-                perror("mkdir error");
-                return;
             }
-            // Sending the file and path to Spdf server
-            sendFileandPathtoServer(filename, "127.0.0.1", 9801, modified_dest_dir, client_sock);
-
-        } else if (strcmp(ext, ".txt") == 0) {
-            // Handle .txt file, modify path and send to Stext server
-            char modified_dest_dir[BUF_SIZE];
-            snprintf(modified_dest_dir, BUF_SIZE, "%s", dest_path);
-            // Replacing the smain with stext before sending it to Stext server
-            char *replace = strstr(modified_dest_dir, "smain");
-            if (replace) {
-                memmove(replace + 5, replace + 5, strlen(replace + 5) + 1);
-                strncpy(replace, "stext", 5);
-            }
-            // Creating the directory if it doesn't exists
-            if (createDir(modified_dest_dir) != 0) {
-                perror("mkdir error");
-                return;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept error");
             }
-            // Sending the file and path to Stext server
-            sendFileandPathtoServer(filename, "127.0.0.1", 9800, modified_dest_dir, client_sock);
         }
     }
 }
 
-// Function to handle the "rmfile" command, which removes a file from the servers
-void rmfileCommandExecution(const char *filename, int client_sock) {
-    char expanded_filename[BUF_SIZE];
-    char modified_filename[BUF_SIZE];
-    char response[BUF_SIZE];
-
-    // Expand ~ to the full home directory path
-    tildePathOperation((char *)filename, expanded_filename, BUF_SIZE);
+// Worker thread: run the command of one complete request, then give the connection back to the loop
+void *eventWorker(void *arg) {
+    struct eventConn *conn;
+    int rc;
+    (void)arg;
 
-    // Check if the file is a .txt file
-    if (strstr(expanded_filename, ".txt") != NULL) {
-        // Modify the path to use the "stext" directory instead of "smain"
-        strncpy(modified_filename, expanded_filename, BUF_SIZE);
+    while (1) {
+        conn = popReadyClient();
+        printf("Received command: opcode %d %s %s\n", conn->hdr.opcode, conn->name, conn->path);
 
-        char *replace = strstr(modified_filename, "/smain/");
-        if (replace) {
-            // Replace "/smain/" with "/stext/"
-            snprintf(replace, BUF_SIZE - (replace - modified_filename), "/stext/%s", replace + 7);
+        // The handlers read payloads and write responses with blocking calls, which the
+        // socket timeouts keep from waiting on a stalled client for longer than --io-timeout
+        fcntl(conn->sock, F_SETFL, 0);
+        event_conn = conn;
+        rc = handleCommandsfromClient(conn->sock, &conn->hdr, conn->name, conn->path);
+        event_conn = NULL;
+        fcntl(conn->sock, F_SETFL, O_NONBLOCK);
+        if (rc != 0) {
+            closeEventConn(conn);
+        } else if (conn->head_len > 0) {
+            // The handler left a file body for the loop to write
+            armEventConn(conn, EPOLLOUT);
+        } else {
+            armEventConn(conn, EPOLLIN | EPOLLRDHUP);
         }
-        // Send the modified path to the Stext server
-        sendRemoveRequesttoServer(modified_filename, "127.0.0.1", 9800, client_sock);
-
     }
-    // Check if the file is a .pdf file
-    else if (strstr(expanded_filename, ".pdf") != NULL) {
-        // Modify the path to use the "spdf" directory instead of "smain"
-        strncpy(modified_filename, expanded_filename, BUF_SIZE);
+    return NULL;
+}
 
-        char *replace = strstr(modified_filename, "/smain/");
-        if (replace) {
-            // Replace "/smain/" with "/spdf/"
-            snprintf(replace, BUF_SIZE - (replace - modified_filename), "/spdf/%s", replace + 7);
-        }
+// Function to queue a connection with a complete request for the worker threads
+void pushReadyClient(struct eventConn *conn) {
+    pthread_mutex_lock(&ready_queue.lock);
+    while (ready_queue.count == READY_QUEUE_SIZE) {
+        pthread_cond_wait(&ready_queue.not_full, &ready_queue.lock);
+    }
+    ready_queue.conns[ready_queue.tail] = conn;
+    ready_queue.tail = (ready_queue.tail + 1) % READY_QUEUE_SIZE;
+    ready_queue.count++;
+    pthread_cond_signal(&ready_queue.not_empty);
+    pthread_mutex_unlock(&ready_queue.lock);
+}
 
-        // Send the modified path to the Spdf server
-        sendRemoveRequesttoServer(modified_filename, "127.0.0.1", 9801, client_sock);
+// Function to take the next connection with a request, waiting if there is none
+struct eventConn *popReadyClient() {
+    struct eventConn *conn;
 
+    pthread_mutex_lock(&ready_queue.lock);
+    while (ready_queue.count == 0) {
+        pthread_cond_wait(&ready_queue.not_empty, &ready_queue.lock);
     }
-    // Check if the file is a .c file
-    else if (strstr(expanded_filename, ".c") != NULL) {
-        // Directly delete the .c file from the Smain server
-        if (remove(expanded_filename) == 0) {
-            snprintf(response, BUF_SIZE, "File is deleted successfully.\n", expanded_filename);
-        } else {
-            snprintf(response, BUF_SIZE, "File deletion error: %s\n", strerror(errno));
-        }
-    }
-    // Send the response to the client
-    send(client_sock, response, strlen(response), 0);
+    conn = ready_queue.conns[ready_queue.head];
+    ready_queue.head = (ready_queue.head + 1) % READY_QUEUE_SIZE;
+    ready_queue.count--;
+    pthread_cond_signal(&ready_queue.not_full);
+    pthread_mutex_unlock(&ready_queue.lock);
+    return conn;
 }
 
-// Function to send a file and its path to another server
-void sendFileandPathtoServer(const char *filename, const char *server_ip, int server_port, const char *dest_dir, int client_sock) {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUF_SIZE];
-    ssize_t n;
+// Function to set up the state of a new client connection, NULL if there is no memory for it
+struct eventConn *openEventConn(int sock) {
+    struct eventConn *conn = malloc(sizeof(*conn));
 
-    // Create a socket to connect to the other server
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return;
+    if (conn == NULL) {
+        return NULL;
     }
-    // Set up the address structure for the other server
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sock);
-        return;
+    conn->sock = sock;
+    conn->in_len = 0;
+    conn->in_need = FRAME_HEADER_SIZE;
+    conn->head_len = 0;
+    conn->body_fd = -1;
+    conn->body_entry = NULL;
+    conn->body_left = 0;
+    return conn;
+}
+
+// Function to close a connection along with the response body it may still hold
+void closeEventConn(struct eventConn *conn) {
+    if (conn->body_fd >= 0) {
+        close(conn->body_fd);
     }
-    // Connect to the other servers
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return;
+    if (conn->body_entry) {
+        releaseCacheEntry(conn->body_entry);
     }
+    // Closing the socket also removes it from the epoll set
+    close(conn->sock);
+    free(conn);
+}
 
-    // Send filename and destination directory first
-    snprintf(buffer, BUF_SIZE, "%s\n%s\n", filename, dest_dir);
-    send(sock, buffer, strlen(buffer), 0);
+// Function to wait for the next event of a connection, the connection is closed if it cannot be watched
+void armEventConn(struct eventConn *conn, uint32_t events) {
+    struct epoll_event ev;
 
-    // Send the file data from the client to the servers
-    while ((n = recv(client_sock, buffer, BUF_SIZE, 0)) > 0) {
-        send(sock, buffer, n, 0);
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev) < 0) {
+        perror("epoll_ctl error");
+        closeEventConn(conn);
     }
-    // Close the socket to the servers when done
-    close(sock);
 }
 
-// Function to create a directory if it does not exist
-int createDir(const char *path) {
-    char tmp[BUF_SIZE];
-    char *p = NULL;
-    size_t len;
+// Function to read as much of the next request frame as has arrived, without blocking
+// Only the frame header, name and path are read, a payload is left for the command. A
+// complete request goes to a worker, otherwise the loop waits for more.
+void readEventRequest(struct eventConn *conn) {
+    ssize_t n;
 
-    snprintf(tmp, sizeof(tmp), "%s", path);
-    len = strlen(tmp);
-    if (tmp[len - 1] == '/')
-        tmp[len - 1] = 0;
-    for (p = tmp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = 0;
-            if (mkdir(tmp, 0755) && errno != EEXIST) {
-                return -1;
+    while (conn->in_len < conn->in_need) {
+        n = recv(conn->sock, conn->in + conn->in_len, conn->in_need - conn->in_len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            armEventConn(conn, EPOLLIN | EPOLLRDHUP);
+            return;
+        }
+        if (n <= 0) {
+            // The client disconnected, which is only an error in the middle of a frame
+            if (n < 0 || conn->in_len > 0) {
+                printf("Recv error\n");
             }
-            *p = '/';
+            closeEventConn(conn);
+            return;
+        }
+        conn->in_len += n;
+        if (conn->in_len == FRAME_HEADER_SIZE && conn->in_need == FRAME_HEADER_SIZE) {
+            if (decodeFrameHeader(conn->in, &conn->hdr) < 0) {
+                closeEventConn(conn);
+                return;
+            }
+            conn->in_need += conn->hdr.name_len + conn->hdr.path_len;
         }
     }
-    // Create the final directory in the path
-    if (mkdir(tmp, 0755) && errno != EEXIST) {
-        return -1;
-    }
-    return 0;
+    memcpy(conn->name, conn->in + FRAME_HEADER_SIZE, conn->hdr.name_len);
+    conn->name[conn->hdr.name_len] = '\0';
+    memcpy(conn->path, conn->in + FRAME_HEADER_SIZE + conn->hdr.name_len, conn->hdr.path_len);
+    conn->path[conn->hdr.path_len] = '\0';
+    conn->in_len = 0;
+    conn->in_need = FRAME_HEADER_SIZE;
+    pushReadyClient(conn);
 }
 
-// Function to send a remove request to another server
-void sendRemoveRequesttoServer(const char *filename, const char *server_ip, int server_port, int client_sock) {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUF_SIZE];
+// Function to write as much of a queued response as the client takes, without blocking
+// Once all of it is sent the connection goes back to reading requests, a pipelined one may
+// already be waiting
+void writeEventResponse(struct eventConn *conn) {
+    off_t offset;
     ssize_t n;
 
-    // Create a socket to connect to the servers
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return;
+    while (conn->head_sent < conn->head_len || conn->body_left > 0 || conn->tail_sent < conn->tail_len) {
+        if (conn->head_sent < conn->head_len) {
+            n = send(conn->sock, conn->head + conn->head_sent, conn->head_len - conn->head_sent, MSG_MORE);
+        } else if (conn->body_left > 0 && conn->body_entry) {
+            n = send(conn->sock, conn->body_entry->data + conn->body_offset, conn->body_left, MSG_MORE);
+        } else if (conn->body_left > 0) {
+            offset = conn->body_offset;
+            n = sendfile(conn->sock, conn->body_fd, &offset, conn->body_left < SENDFILE_CHUNK ? conn->body_left : SENDFILE_CHUNK);
+        } else {
+            n = send(conn->sock, conn->tail + conn->tail_sent, conn->tail_len - conn->tail_sent, 0);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            armEventConn(conn, EPOLLOUT);
+            return;
+        }
+        if (n <= 0) {
+            // The client went away, or the file shrank after its size was announced
+            perror("Send error");
+            closeEventConn(conn);
+            return;
+        }
+        if (conn->head_sent < conn->head_len) {
+            conn->head_sent += n;
+        } else if (conn->body_left > 0) {
+            conn->body_offset += n;
+            conn->body_left -= n;
+        } else {
+            conn->tail_sent += n;
+        }
     }
 
-    // Set up the address structure for the other server
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sock);
-        return;
+    if (conn->body_fd >= 0) {
+        close(conn->body_fd);
+        conn->body_fd = -1;
     }
+    if (conn->body_entry) {
+        releaseCacheEntry(conn->body_entry);
+        conn->body_entry = NULL;
+    }
+    conn->head_len = 0;
+    setCork(conn->sock, 0);
+    readEventRequest(conn);
+}
 
-    // Connect to the servers
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return;
+// Function to leave a dfile body to the event loop: the DATA frame, length bytes from offset of
+// the file (or of the cache entry) and the END frame. The file descriptor is duplicated and the
+// entry held, so the caller releases its own as usual. Returns 0, or -1 if nothing was queued
+int queueEventBody(struct eventConn *conn, uint32_t request_id, const char *content_range, int fd, struct cacheEntry *entry, uint64_t offset, uint64_t length) {
+    if ((conn->head_len = encodeFrame(conn->head, OP_DATA, request_id, 0, content_range, NULL, length)) == 0) {
+        return -1;
+    }
+    if (entry) {
+        holdCacheEntry(entry);
+    } else if ((conn->body_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        perror("dup error");
+        conn->head_len = 0;
+        return -1;
     }
+    conn->body_entry = entry;
+    conn->tail_len = encodeFrame(conn->tail, OP_END, request_id, STATUS_OK, NULL, NULL, 0);
+    conn->head_sent = conn->tail_sent = 0;
+    conn->body_offset = offset;
+    conn->body_left = length;
+    // Corked until the END frame is out, like a response sent by the worker
+    setCork(conn->sock, 1);
+    return 0;
+}
 
-    // Send the rmfile (delete) command and filename to the other server
-    snprintf(buffer, BUF_SIZE, "rmfile %s", filename);
-    send(sock, buffer, strlen(buffer), 0);
+// Function to bound how long a blocking read or write on a socket waits for its peer
+// A client or storage server that stops moving data then fails the command instead of
+// holding its worker thread
+void setIoTimeout(int sock) {
+    struct timeval tv;
 
-    // Receive the response from the servers
-    while ((n = recv(sock, buffer, BUF_SIZE, 0)) > 0) {
-        buffer[n] = '\0';  // Null-terminate the string
-        send(client_sock, buffer, n, 0);  // Forward the response to the client
+    if (io_timeout > 0) {
+        tv.tv_sec = io_timeout;
+        tv.tv_usec = 0;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
     }
-
-    close(sock);
 }
 
-// Function to replace part of a file path with a different directory name
-void replacesmainPath(char *path, const char *replacement) {
-    char *replace = strstr(path, "/smain/");
-    if (replace) {
-        memmove(replace + strlen(replacement), replace + strlen("/smain/"), strlen(replace) - strlen("/smain/") + 1);
-        memcpy(replace, replacement, strlen(replacement));
-    }
+// Function to set the time by which the storage servers asked in parallel must have answered
+void ioDeadline(struct timespec *deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += io_timeout;
 }
 
-// Function to retrieve a file from the server and send it to the client
-void retrieveAndSendFile(const char *filename, int client_sock) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("File open error");
-        return;
-    }
+// Function to turn a deadline into a poll timeout, -1 (no limit) when --io-timeout is 0
+int pollTimeout(const struct timespec *deadline) {
+    struct timespec now;
+    long long ms;
 
-    char buffer[BUF_SIZE];
-    ssize_t n;
+    if (io_timeout <= 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
 
-    // Ensure the buffer is clean before starting the transfer
-    memset(buffer, 0, BUF_SIZE);
+// Function to receive and run one command, returns 0 once the client is gone
+int receiveAndHandleCommand(int client_sock) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    int rc;
 
-    // Read and send the file content to the client
-    while ((n = fread(buffer, 1, BUF_SIZE, file)) > 0) {
-        if (send(client_sock, buffer, n, 0) == -1) {
-            perror("Send error");
-            break;
+    // Receive the next request frame from the client
+    rc = recvFrame(client_sock, &hdr, name, path);
+    if (rc <= 0) {
+        if (rc != 0) {
+            printf("Recv error\n");
         }
-        memset(buffer, 0, BUF_SIZE);  // Clear buffer after each send to ensure no residual data
+        return 0;  // The client disconnected or an error occurred
     }
+    printf("Received command: opcode %d %s %s\n", hdr.opcode, name, path);
 
-    if (n < 0) {
-        perror("fread error");
-    }
+    // Call handleCommandsfromClient to process the command
+    return handleCommandsfromClient(client_sock, &hdr, name, path) == 0;
+}
 
-    // Properly shut down the connection after sending all data
-    shutdown(client_sock, SHUT_WR);  // Signal to client that we're done sending data
+// Function to handle client connections
+void handleClientConnection(int client_sock) {
+    setNoDelay(client_sock);
+
+    // Keep the connection open for multiple commands
+    while (receiveAndHandleCommand(client_sock));
+
+    // Close the connection when the loop ends (client disconnects)
+    close(client_sock);
+}
+
+// Function to handle a single command from the client
+int handleCommandsfromClient(int client_sock, const struct frameHeader *hdr, const char *name, const char *path) {
+    //Option handling for the ufile command and its link short-circuit, the only ones that carry a payload
+    if (hdr->opcode == OP_UFILE || hdr->opcode == OP_LINK) {
+        if (strlen(name) == 0 || strlen(path) == 0) {
+            printf("Invalid ufile command format\n");
+            if (drainPayload(client_sock, hdr->payload_len) < 0) {
+                return -1;
+            }
+            return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid ufile command format\n");
+        }
+        //Calling the function if the validation is successful
+        return ufileCommandExecution(hdr->opcode, name, path, hdr->payload_len, hdr->request_id, client_sock);
+    }
+    //Option handling for the bulk ingest, a tar stream that is unpacked as it arrives
+    if (hdr->opcode == OP_INGEST) {
+        if (strlen(path) == 0) {
+            printf("Invalid ingest command format\n");
+            if (drainPayload(client_sock, hdr->payload_len) < 0) {
+                return -1;
+            }
+            return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid ingest command format\n");
+        }
+        return ingestCommandExecution(path, hdr->payload_len, hdr->request_id, client_sock);
+    }
+    //Option handling for the resumable upload requests, chunks carry a payload too
+    if (hdr->opcode == OP_UQUERY || hdr->opcode == OP_UCHUNK) {
+        if (strlen(name) == 0 || strlen(path) == 0) {
+            printf("Invalid upload command format\n");
+            if (drainPayload(client_sock, hdr->payload_len) < 0) {
+                return -1;
+            }
+            return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid upload command format\n");
+        }
+        return uploadCommandExecution(hdr, name, path, client_sock);
+    }
+    if (drainPayload(client_sock, hdr->payload_len) < 0) {
+        return -1;
+    }
+    //Option handling for the rmfile command
+    if (hdr->opcode == OP_RMFILE) {
+        if (strlen(path) == 0) {
+            printf("Invalid rmfile command format\n");
+            return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid rmfile command format\n");
+        }
+        //Calling the function if the validation is successful
+        return rmfileCommandExecution(path, hdr->request_id, client_sock);
+    }
+    //Option handling for the dfile command
+    else if (hdr->opcode == OP_DFILE) {
+        if (strlen(path) == 0) {
+            printf("Invalid dfile command format\n");
+            return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid dfile command format\n");
+        }
+        //Calling the function if the validation is successful
+        return dfileCommandExecution(path, name, hdr->param, hdr->request_id, client_sock);
+    }
+    //Option handling for the dtar command
+    else if (hdr->opcode == OP_DTAR) {
+        //Calling the function
+        return dtarCommandExecution(name, hdr->param, hdr->request_id, client_sock);
+    }
+    //Option handling for the display command
+    else if (hdr->opcode == OP_DISPLAY) {
+        if (strlen(path) == 0) {
+            printf("Invalid display command format\n");
+            return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid display command format\n");
+        }
+        //Calling the function if the validation is successful
+        return displayCommandExecution(path, name, hdr->param, hdr->request_id, client_sock);
+    }
+    printf("Invalid command\n");
+    return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Invalid command\n");
+}
+
+// Function to handle the "ufile" command
+int ufileCommandExecution(uint8_t opcode, const char *filename, const char *dest_path, uint64_t file_size, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+
+    // Look up where files of this extension are stored
+    struct route *route = routeForPath(filename);
+    if (route) {
+        if (route->local) {
+            // Creating the directory if it doesnt exists, to store .c files locally
+            if (createDir(dest_path) != 0) {
+                perror("mkdir error");
+                snprintf(response, BUF_SIZE, "Error: cannot create directory '%s': %s\n", dest_path, strerror(errno));
+                if (drainPayload(client_sock, file_size) < 0) {
+                    return -1;
+                }
+                return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+            }
+            char fullpath[BUF_SIZE];
+            snprintf(fullpath, BUF_SIZE, "%s/%s", dest_path, filename);
+            if (opcode == OP_LINK) {
+                return linkCommandExecution(filename, fullpath, file_size, request_id, client_sock);
+            } else if (dedup_mode) {
+                return ufileIntoStore(filename, fullpath, client_sock, file_size, request_id, client_sock);
+            }
+            // A file that shares its content with other paths is unlinked rather than overwritten
+            struct stat st;
+            if (stat(fullpath, &st) == 0 && st.st_nlink > 1) {
+                removeStoredFile(fullpath);
+            }
+            // Receive exactly file_size bytes from client24s into a temporary file that replaces
+            // the old one once it is complete
+            int rc = storeUpload(client_sock, fullpath, file_size, response, BUF_SIZE);
+            if (rc == -1) {
+                // The client went away in the middle of the upload
+                return -1;
+            } else if (rc == -2) {
+                return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+            }
+            // The file was replaced, so the cached dtar archive is out of date
+            updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(".c"));
+            snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+            return sendEnd(client_sock, request_id, STATUS_OK, response);
+
+        } else {
+            // Send the file to the storage servers of its copies, with smain replaced by each
+            // server's directory; the servers create the directory themselves
+            struct backendPool *pools[ROUTE_MAX_BACKENDS];
+            char key[BUF_SIZE];
+            snprintf(key, BUF_SIZE, "%s/%s", dest_path, filename);
+            int count = routeReplicas(route, key, pools);
+            // Invalidated again once the copies answered, a miss in between may have read the old body
+            invalidateCache(key);
+            int rc = writeToReplicas(opcode, 0, filename, pools, count, dest_path, file_size, request_id, client_sock);
+            invalidateCache(key);
+            return rc;
+        }
+    }
+    // Any other file type is rejected after consuming its data
+    if (drainPayload(client_sock, file_size) < 0) {
+        return -1;
+    }
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Unsupported file type\n");
+}
+
+// Function to handle a resumable upload request, kept by Smain for .c files and passed on otherwise
+int uploadCommandExecution(const struct frameHeader *hdr, const char *name, const char *path, int client_sock) {
+    struct backendPool *pools[ROUTE_MAX_BACKENDS];
+    struct route *route = routeForPath(path);
+    int count, rc;
+
+    if (route && route->local) {
+        if (hdr->opcode == OP_UQUERY) {
+            return uqueryCommandExecution(name, path, hdr->request_id, client_sock);
+        }
+        return uchunkCommandExecution(name, path, hdr->param, hdr->payload_len, hdr->request_id, client_sock);
+    }
+    if (route == NULL) {
+        if (drainPayload(client_sock, hdr->payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, hdr->request_id, STATUS_ERROR, "Unsupported file type\n");
+    }
+    // Chunks go to every copy like a ufile, so the upload continues from the least committed copy
+    if (hdr->opcode == OP_UQUERY) {
+        return queryUploadReplicas(route, path, name, hdr->request_id, client_sock);
+    }
+    count = routeReplicas(route, path, pools);
+    invalidateCache(path);
+    rc = writeToReplicas(OP_UCHUNK, hdr->param, name, pools, count, path, hdr->payload_len, hdr->request_id, client_sock);
+    invalidateCache(path);
+    return rc;
+}
+
+// Function to handle the "rmfile" command, which removes a file from the servers
+int rmfileCommandExecution(const char *filename, uint32_t request_id, int client_sock) {
+    char expanded_filename[BUF_SIZE];
+    char response[BUF_SIZE];
+
+    // Expand ~ to the full home directory path
+    tildePathOperation((char *)filename, expanded_filename, BUF_SIZE);
+
+    // Look up where files of this extension are stored
+    struct route *route = routeForPath(expanded_filename);
+    if (route && !route->local) {
+        // Send the path, with smain replaced by the server's directory, to the servers holding the file
+        invalidateCache(expanded_filename);
+        int rc = removeFromReplicas(route, expanded_filename, request_id, client_sock);
+        invalidateCache(expanded_filename);
+        return rc;
+    }
+    // Check if the file is kept here (.c)
+    else if (route) {
+        // A file the index does not know cannot be removed
+        if (lookupPathIndex(&path_index, expanded_filename) == 0) {
+            return sendEnd(client_sock, request_id, STATUS_ERROR, "File deletion error: No such file or directory\n");
+        }
+        // Directly delete the .c file from the Smain server
+        if (removeStoredFile(expanded_filename) == 0) {
+            updatePathIndex(&path_index, expanded_filename, 0, invalidateTarCache(".c"));
+            snprintf(response, BUF_SIZE, "File is deleted successfully.\n");
+            return sendEnd(client_sock, request_id, STATUS_OK, response);
+        }
+        snprintf(response, BUF_SIZE, "File deletion error: %s\n", strerror(errno));
+        // Send the response to the client
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Unsupported file type\n");
+}
+
+// Function to handle the bulk ingest: unpack a tar stream from the client as it arrives
+// .c members are written here while the others are passed on to their storage servers, each
+// over one connection that is not waited on per file, so the servers store while the stream
+// is still being read. Directories are created as needed; links and other entries are skipped
+int ingestCommandExecution(const char *dest_path, uint64_t payload_len, uint32_t request_id, int client_sock) {
+    struct ingestForwarder *forwarders = calloc(backend_pool_count > 0 ? backend_pool_count : 1, sizeof(*forwarders));
+    unsigned char header[TAR_BLOCK_SIZE];
+    char *pax = malloc(INGEST_PAX_MAX + 1);
+    char name[PATH_MAX];
+    char next_name[PATH_MAX] = "";   // from a pax or GNU long name header, for the next member
+    char last_c[PATH_MAX] = "";
+    char response[BUF_SIZE] = "";
+    uint64_t remaining = payload_len;
+    uint64_t size, padded, next_size = 0;
+    uint64_t generation = 0;
+    unsigned long stored = 0, failed = 0, skipped = 0, local = 0, forwarded = 0, copies_failed = 0, refused = 0;
+    struct timespec start, end;
+    int has_next_size = 0;
+    int type, i;
+    int rc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pax == NULL || forwarders == NULL) {
+        free(pax);
+        free(forwarders);
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: out of memory\n");
+    }
+    for (i = 0; i < backend_pool_count; i++) {
+        forwarders[i].pool = &backend_pools[i];
+        forwarders[i].name = backend_pools[i].name;
+        forwarders[i].sock = -1;
+        pthread_mutex_init(&forwarders[i].lock, NULL);
+        pthread_cond_init(&forwarders[i].cond, NULL);
+    }
+    while (rc == 0 && remaining >= TAR_BLOCK_SIZE) {
+        if ((rc = recvIngest(client_sock, header, TAR_BLOCK_SIZE, &remaining)) < 0) {
+            break;
+        }
+        if ((type = parseTarHeader(header, name, sizeof(name), &size)) == 0) {
+            // End of archive, whatever follows is padding
+            break;
+        }
+        if (type < 0) {
+            snprintf(response, BUF_SIZE, "Error: damaged tar header at byte %llu\n", (unsigned long long)(payload_len - remaining - TAR_BLOCK_SIZE));
+            rc = 1;
+            break;
+        }
+        if (type == 'x' || type == 'L') {
+            // Extended headers describe the member that follows them
+            padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+            if (padded > INGEST_PAX_MAX) {
+                rc = skipIngest(client_sock, padded, &remaining);
+            } else if ((rc = recvIngest(client_sock, pax, padded, &remaining)) == 0) {
+                pax[size] = '\0';
+                if (type == 'x') {
+                    has_next_size = parsePaxRecords(pax, size, next_name, sizeof(next_name), &next_size);
+                } else {
+                    snprintf(next_name, sizeof(next_name), "%s", pax);
+                }
+            }
+            continue;
+        }
+        if (next_name[0] != '\0') {
+            snprintf(name, sizeof(name), "%s", next_name);
+        }
+        if (has_next_size) {
+            size = next_size;
+        }
+        next_name[0] = '\0';
+        has_next_size = 0;
+        padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        if (padded > remaining) {
+            rc = -2;
+            break;
+        }
+
+        if (type == '0' || type == '7') {
+            rc = ingestMember(forwarders, dest_path, name, size, request_id, client_sock, &remaining, last_c, &generation);
+            if (rc == 0) {
+                local++;
+            } else if (rc == 1) {
+                failed++;
+                rc = 0;
+            } else if (rc == 2) {
+                skipped++;
+                rc = 0;
+            } else if (rc == 3) {
+                // Handed to the storage servers, their replies are counted by the reader threads
+                forwarded++;
+                rc = 0;
+            }
+            padded -= size;
+        } else if (type == 'g' || type == '5') {
+            // Global pax headers and directories carry nothing to store
+        } else {
+            skipped++;
+        }
+        if (rc == 0) {
+            rc = skipIngest(client_sock, padded, &remaining);
+        }
+    }
+    free(pax);
+
+    // The trailing blocks, or the rest of a damaged or cut off archive, are read and dropped so
+    // the next request starts at a frame header
+    if (rc != -1 && skipIngest(client_sock, remaining, &remaining) < 0) {
+        rc = -1;
+    }
+    if (rc == -2) {
+        snprintf(response, BUF_SIZE, "Error: the tar stream ended in the middle of a file\n");
+    }
+    for (i = 0; i < backend_pool_count; i++) {
+        finishIngestForwarder(&forwarders[i], rc == -1);
+        copies_failed += forwarders[i].failed;
+        refused += forwarders[i].refused;
+    }
+    stored = local + forwarded;
+    if (replica_count == 1) {
+        // Each file has one copy, so a copy that failed is a file that failed
+        stored -= copies_failed;
+        failed += copies_failed;
+        copies_failed = 0;
+    } else {
+        copies_failed += refused;
+    }
+    // The dtar cache and the path index are brought up to date once for the whole archive
+    if (last_c[0] != '\0') {
+        updatePathIndex(&path_index, last_c, 1, invalidateTarCache(".c"));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Ingest into %s: %lu files stored, %lu failed, %lu copies failed, %lu skipped in %.2f ms\n", dest_path, stored, failed, copies_failed, skipped,
+           (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    if (rc == -1) {
+        free(forwarders);
+        return -1;
+    }
+
+    size_t len = strlen(response);
+    snprintf(response + len, BUF_SIZE - len, "Ingested %lu files (%lu on Smain", stored, local);
+    len = strlen(response);
+    for (i = 0; i < backend_pool_count; i++) {
+        if (forwarders[i].members > 0) {
+            snprintf(response + len, BUF_SIZE - len, ", %lu on %s", forwarders[i].members - forwarders[i].failed, forwarders[i].name);
+            len = strlen(response);
+        }
+    }
+    snprintf(response + len, BUF_SIZE - len, ")");
+    len = strlen(response);
+    if (failed > 0) {
+        snprintf(response + len, BUF_SIZE - len, ", %lu failed", failed);
+        len = strlen(response);
+    }
+    if (copies_failed > 0) {
+        snprintf(response + len, BUF_SIZE - len, ", %lu copies failed", copies_failed);
+        len = strlen(response);
+    }
+    if (skipped > 0) {
+        snprintf(response + len, BUF_SIZE - len, ", %lu skipped (links and files of types without a route)", skipped);
+        len = strlen(response);
+    }
+    snprintf(response + len, BUF_SIZE - len, "\n");
+    free(forwarders);
+    return sendEnd(client_sock, request_id, rc == 0 && failed == 0 && copies_failed == 0 ? STATUS_OK : STATUS_ERROR, response);
+}
+
+// Function to store one regular file of an ingest, reading exactly size bytes of its body
+// Returns 0 if it was written here, 3 if it was passed to a storage server, 1 if it failed,
+// 2 if its type is not stored, or -1 if the client connection failed
+int ingestMember(struct ingestForwarder *forwarders, const char *dest_path, char *name, uint64_t size, uint32_t request_id, int client_sock, uint64_t *remaining, char *last_c, uint64_t *generation) {
+    char dir[BUF_SIZE];
+    char fullpath[BUF_SIZE];
+    char *member = name;
+    char *base, *part;
+    struct route *route;
+    int rc;
+
+    // Member names are relative to the destination and must stay inside it
+    while (*member == '/' || strncmp(member, "./", 2) == 0) {
+        member += *member == '/' ? 1 : 2;
+    }
+    base = strrchr(member, '/');
+    base = base ? base + 1 : member;
+    if ((route = routeForPath(base)) == NULL) {
+        return skipIngest(client_sock, size, remaining) < 0 ? -1 : 2;
+    }
+    for (part = member; part; part = strchr(part, '/') ? strchr(part, '/') + 1 : NULL) {
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+            printf("Ingest: refusing '%s', it leaves the destination directory\n", name);
+            return skipIngest(client_sock, size, remaining) < 0 ? -1 : 1;
+        }
+    }
+    if (snprintf(dir, sizeof(dir), "%s/%.*s", dest_path, (int)(base - member), member) >= (int)sizeof(dir) ||
+        snprintf(fullpath, sizeof(fullpath), "%s%s", dir, base) >= (int)sizeof(fullpath)) {
+        printf("Ingest: path too long for '%s'\n", name);
+        return skipIngest(client_sock, size, remaining) < 0 ? -1 : 1;
+    }
+
+    if (!route->local) {
+        // Storage servers take the directory with smain replaced, and create it themselves
+        struct backendPool *pools[ROUTE_MAX_BACKENDS];
+        struct ingestForwarder *targets[ROUTE_MAX_BACKENDS];
+        char server_dirs[ROUTE_MAX_BACKENDS][BUF_SIZE];
+        int count = routeReplicas(route, fullpath, pools);
+        int i;
+        for (i = 0; i < count; i++) {
+            targets[i] = &forwarders[pools[i]->index];
+            routedPath(pools[i], dir, server_dirs[i], BUF_SIZE, i > 0);
+            server_dirs[i][strlen(server_dirs[i]) - 1] = '\0';
+        }
+        invalidateCache(fullpath);
+        rc = forwardIngestFile(targets, server_dirs, count, base, size, request_id, client_sock, remaining);
+        invalidateCache(fullpath);
+        return rc;
+    }
+
+    if (createDir(dir) != 0) {
+        printf("Ingest: cannot create directory '%s': %s\n", dir, strerror(errno));
+        return skipIngest(client_sock, size, remaining) < 0 ? -1 : 1;
+    }
+    rc = ingestLocalFile(fullpath, size, client_sock, remaining);
+    if (rc == 0) {
+        // The first file bumps the cache generation, the rest of the archive shares it
+        if (*generation == 0) {
+            *generation = invalidateTarCache(".c");
+        }
+        updatePathIndex(&path_index, fullpath, 1, *generation);
+        snprintf(last_c, PATH_MAX, "%s", fullpath);
+    }
+    return rc;
+}
+
+// Function to write a .c member of an ingest to fullpath, through a temporary file like ufile
+// Returns 0 on success, 1 if the file could not be written (its body is still read) or -1 if
+// the client connection failed
+int ingestLocalFile(const char *fullpath, uint64_t size, int client_sock, uint64_t *remaining) {
+    char buffer[INGEST_BUF_SIZE];
+    char tmp_path[PATH_MAX];
+    struct stat st;
+    int fd;
+    int failed = 0;
+
+    // A file that shares its content with other paths is unlinked rather than overwritten
+    if (stat(fullpath, &st) == 0 && st.st_nlink > 1) {
+        removeStoredFile(fullpath);
+    }
+    if ((fd = openUploadTemp(fullpath, tmp_path, sizeof(tmp_path))) < 0) {
+        printf("Ingest: cannot open '%s': %s\n", fullpath, strerror(errno));
+        return skipIngest(client_sock, size, remaining) < 0 ? -1 : 1;
+    }
+    while (size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (recvIngest(client_sock, buffer, chunk, remaining) < 0) {
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        if (!failed && writeAll(fd, buffer, chunk) < 0) {
+            printf("Ingest: writing '%s' failed: %s\n", fullpath, strerror(errno));
+            failed = 1;
+        }
+        size -= chunk;
+    }
+    if (failed) {
+        close(fd);
+        unlink(tmp_path);
+        return 1;
+    }
+    if (finishUpload(fd, tmp_path, fullpath) < 0) {
+        printf("Ingest: storing '%s' failed: %s\n", fullpath, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Function to pass one member of an ingest on to the storage servers of its copies without
+// waiting for their replies. With several copies the body is read once and written to each
+// Returns 3 once the body was read, 1 if no server could take it or -1 if the client failed
+int forwardIngestFile(struct ingestForwarder **targets, char (*dest_dirs)[BUF_SIZE], int count, const char *filename, uint64_t size, uint32_t request_id, int client_sock, uint64_t *remaining) {
+    char buffer[INGEST_BUF_SIZE];
+    int sending[ROUTE_MAX_BACKENDS];
+    int live = 0;
+    int i, rc;
+
+    for (i = 0; i < count; i++) {
+        sending[i] = startIngestMember(targets[i], filename, dest_dirs[i], size, request_id);
+        live += sending[i];
+    }
+    if (live == 0) {
+        return skipIngest(client_sock, size, remaining) < 0 ? -1 : 1;
+    }
+    if (count == 1) {
+        // relayPayload reads the whole body unless the client fails
+        rc = relayPayload(client_sock, targets[0]->sock, size);
+        if (rc == -1) {
+            return -1;
+        }
+        *remaining -= size;
+        if (rc < 0) {
+            breakIngestForwarder(targets[0]);
+        }
+        return 3;
+    }
+    while (size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (recvIngest(client_sock, buffer, chunk, remaining) < 0) {
+            return -1;
+        }
+        for (i = 0; i < count; i++) {
+            if (sending[i] && sendAll(targets[i]->sock, buffer, chunk) < 0) {
+                breakIngestForwarder(targets[i]);
+                sending[i] = 0;
+            }
+        }
+        size -= chunk;
+    }
+    return 3;
+}
+
+// Function to send the header of one member to a storage server
+// The first member for a server opens the connection and starts the thread that reads the replies.
+// Returns 1 if the body can follow, 0 if the server cannot take it
+int startIngestMember(struct ingestForwarder *fwd, const char *filename, const char *dest_dir, uint64_t size, uint32_t request_id) {
+    int reused;
+    int broken;
+
+    if (fwd->sock < 0 && !fwd->broken) {
+        fwd->sock = acquireBackend(fwd->pool, &reused);
+        if (fwd->sock >= 0 && pthread_create(&fwd->reader, NULL, ingestReader, fwd) != 0) {
+            close(fwd->sock);
+            fwd->sock = -1;
+        }
+        fwd->broken = fwd->sock < 0;
+    }
+    pthread_mutex_lock(&fwd->lock);
+    broken = fwd->broken;
+    pthread_mutex_unlock(&fwd->lock);
+    if (broken || sendFrame(fwd->sock, OP_UFILE, request_id, 0, filename, dest_dir, size) < 0) {
+        printf("Ingest: %s is unavailable, '%s' is not stored there\n", fwd->name, filename);
+        pthread_mutex_lock(&fwd->lock);
+        fwd->broken = 1;
+        fwd->refused++;
+        pthread_mutex_unlock(&fwd->lock);
+        return 0;
+    }
+    pthread_mutex_lock(&fwd->lock);
+    fwd->members++;
+    fwd->sent++;
+    pthread_cond_signal(&fwd->cond);
+    pthread_mutex_unlock(&fwd->lock);
+    return 1;
+}
+
+// Function to give up on a storage server whose connection is out of step, the reader stops too
+void breakIngestForwarder(struct ingestForwarder *fwd) {
+    pthread_mutex_lock(&fwd->lock);
+    fwd->broken = 1;
+    pthread_mutex_unlock(&fwd->lock);
+    shutdown(fwd->sock, SHUT_RDWR);
+}
+
+// Ingest reader thread: count the replies of one storage server as they come in
+void *ingestReader(void *arg) {
+    struct ingestForwarder *fwd = arg;
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    char message[BUF_SIZE];
+
+    while (1) {
+        pthread_mutex_lock(&fwd->lock);
+        while (fwd->answered == fwd->sent && !fwd->done && !fwd->broken) {
+            pthread_cond_wait(&fwd->cond, &fwd->lock);
+        }
+        if (fwd->answered == fwd->sent || fwd->broken) {
+            pthread_mutex_unlock(&fwd->lock);
+            break;
+        }
+        pthread_mutex_unlock(&fwd->lock);
+
+        message[0] = '\0';
+        if (recvFrame(fwd->sock, &hdr, name, path) <= 0 ||
+            (hdr.payload_len < BUF_SIZE ? recvAll(fwd->sock, message, hdr.payload_len) : drainPayload(fwd->sock, hdr.payload_len)) < 0) {
+            pthread_mutex_lock(&fwd->lock);
+            fwd->broken = 1;
+            pthread_mutex_unlock(&fwd->lock);
+            break;
+        }
+        if (hdr.opcode != OP_END) {
+            continue;
+        }
+        if (hdr.payload_len < BUF_SIZE) {
+            message[hdr.payload_len] = '\0';
+        }
+        pthread_mutex_lock(&fwd->lock);
+        fwd->answered++;
+        if (hdr.param != STATUS_OK) {
+            fwd->failed++;
+            printf("Ingest: %s: %s", fwd->name, message);
+        }
+        pthread_mutex_unlock(&fwd->lock);
+    }
+    return NULL;
+}
+
+// Function to wait for the outstanding replies of a storage server and return its connection
+// Members that were sent but never answered count as failed
+void finishIngestForwarder(struct ingestForwarder *fwd, int abort) {
+    if (fwd->sock < 0) {
+        return;
+    }
+    pthread_mutex_lock(&fwd->lock);
+    fwd->done = 1;
+    if (abort) {
+        fwd->broken = 1;
+        shutdown(fwd->sock, SHUT_RDWR);
+    }
+    pthread_cond_signal(&fwd->cond);
+    pthread_mutex_unlock(&fwd->lock);
+    pthread_join(fwd->reader, NULL);
+
+    fwd->failed += fwd->sent - fwd->answered;
+    releaseBackend(fwd->pool, fwd->sock, !fwd->broken);
+    fwd->sock = -1;
+}
+
+// Function to read len bytes of an ingest stream, which must not run past the request payload
+// Returns 0 on success, -1 if the client connection failed or -2 if the stream ended early
+int recvIngest(int sock, void *buf, size_t len, uint64_t *remaining) {
+    if (len > *remaining) {
+        return -2;
+    }
+    if (recvAll(sock, buf, len) < 0) {
+        return -1;
+    }
+    *remaining -= len;
+    return 0;
+}
+
+// Function to read and drop len bytes of an ingest stream, with the results of recvIngest
+int skipIngest(int sock, uint64_t len, uint64_t *remaining) {
+    if (len > *remaining) {
+        return -2;
+    }
+    if (drainPayload(sock, len) < 0) {
+        return -1;
+    }
+    *remaining -= len;
+    return 0;
+}
+
+// Function to check a tar header block and read the member's name, size and type flag
+// Returns the type flag ('0' for a regular file), 0 for an end-of-archive block or -1 if the
+// checksum does not match
+int parseTarHeader(const unsigned char *h, char *name, size_t size, uint64_t *member_size) {
+    unsigned int sum = 0;
+    size_t i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE && h[i] == 0; i++);
+    if (i == TAR_BLOCK_SIZE) {
+        return 0;
+    }
+    // The checksum is taken with its own field read as spaces
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    }
+    if (sum != parseTarNumber(h + 148, 8)) {
+        return -1;
+    }
+    *member_size = parseTarNumber(h + 124, 12);
+    // ustar keeps the leading directories of a long name in the prefix field
+    if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0') {
+        snprintf(name, size, "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+    } else {
+        snprintf(name, size, "%.100s", (const char *)h);
+    }
+    return h[156] ? h[156] : '0';
+}
+
+// Function to read a numeric tar header field: octal digits, or base-256 when the top bit of
+// the first byte is set (GNU tar's encoding for sizes beyond 8 GB)
+uint64_t parseTarNumber(const unsigned char *field, size_t len) {
+    uint64_t value = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (i = 1; i < len; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+// Function to take the path and size records out of a pax extended header
+// Each record is "<length> <key>=<value>\n", where length counts the whole record
+// Returns 1 if the header sets the size of the member
+int parsePaxRecords(char *pax, size_t len, char *name, size_t size, uint64_t *member_size) {
+    size_t pos = 0;
+    int has_size = 0;
+    char *end;
+
+    while (pos < len) {
+        unsigned long record = strtoul(pax + pos, &end, 10);
+        if (record == 0 || pos + record > len || *end != ' ') {
+            break;
+        }
+        end++;
+        if (strncmp(end, "path=", 5) == 0) {
+            snprintf(name, size, "%.*s", (int)(pax + pos + record - 1 - end - 5), end + 5);
+        } else if (strncmp(end, "size=", 5) == 0) {
+            *member_size = strtoull(end + 5, NULL, 10);
+            has_size = 1;
+        }
+        pos += record;
+    }
+    return has_size;
+}
+
+// Function to send a file and its path to another server
+int sendFileandPathtoServer(uint8_t opcode, uint32_t param, const char *filename, struct backendPool *pool, const char *dest_dir, uint64_t file_size, uint32_t request_id, int client_sock) {
+    int sock;
+    int reused;
+    int server_ok;
+    int rc;
+
+    // Send filename, destination directory and file size first
+    if ((sock = sendBackendRequest(pool, opcode, request_id, param, filename, dest_dir, file_size, &reused)) < 0) {
+        // The client's data still has to be consumed to keep the connection usable
+        if (drainPayload(client_sock, file_size) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the storage server is unavailable.\n");
+    }
+
+    // Send the file data from the client to the servers
+    rc = relayPayload(client_sock, sock, file_size);
+    if (rc == -1) {
+        close(sock);
+        return -1;
+    } else if (rc < 0) {
+        close(sock);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: lost connection to the storage server.\n");
+    }
+
+    // Forward the result from the server to the client, the body is gone so there is no retry
+    rc = relayResponse(sock, client_sock, request_id, &server_ok, NULL);
+    releaseBackend(pool, sock, server_ok);
+    if (rc == -2) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: lost connection to the storage server.\n");
+    }
+    return rc;
+}
+
+// Function to store a file from the client on the servers of its copies, the primary first
+// The body is read once and written to all of them. The client gets its answer as soon as a
+// quorum of copies is stored, and a thread collects the answers of the slower servers.
+// path is the smain path sent to the servers, with smain replaced by each server's directory
+int writeToReplicas(uint8_t opcode, uint32_t param, const char *name, struct backendPool **pools, int count, const char *path, uint64_t size, uint32_t request_id, int client_sock) {
+    char server_path[BUF_SIZE];
+    char response[BUF_SIZE];
+    struct replicaWrite *w;
+    uint64_t left;
+    size_t n;
+    char *buf;
+    int quorum = replicaQuorum(count);
+    int reused, i, rc;
+
+    if (count == 1) {
+        routedPath(pools[0], path, server_path, BUF_SIZE, 0);
+        return sendFileandPathtoServer(opcode, param, name, pools[0], server_path, size, request_id, client_sock);
+    }
+    w = calloc(1, sizeof(*w));
+    buf = malloc(REPLICA_BUF_SIZE);
+    if (w == NULL || buf == NULL) {
+        free(w);
+        free(buf);
+        if (drainPayload(client_sock, size) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: out of memory\n");
+    }
+    w->count = count;
+    for (i = 0; i < count; i++) {
+        w->pools[i] = pools[i];
+        routedPath(pools[i], path, server_path, BUF_SIZE, i > 0);
+        w->socks[i] = sendBackendRequest(pools[i], opcode, request_id, param, name, server_path, size, &reused);
+        if (w->socks[i] >= 0) {
+            w->pending++;
+        }
+    }
+    if (w->pending < quorum) {
+        // The quorum cannot be reached, so nothing is written
+        snprintf(response, BUF_SIZE, "Error: only %d of the %d storage servers for this file are available, %d needed.\n", w->pending, count, quorum);
+        for (i = 0; i < count; i++) {
+            if (w->socks[i] >= 0) {
+                close(w->socks[i]);
+            }
+        }
+        free(w);
+        free(buf);
+        if (drainPayload(client_sock, size) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+
+    for (left = size; left > 0; left -= n) {
+        n = left < REPLICA_BUF_SIZE ? left : REPLICA_BUF_SIZE;
+        if (recvAll(client_sock, buf, n) < 0) {
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            if (w->socks[i] >= 0 && sendAll(w->socks[i], buf, n) < 0) {
+                printf("Copy of %s on %s failed: %s\n", name, pools[i]->name, strerror(errno));
+                close(w->socks[i]);
+                w->socks[i] = -1;
+                w->pending--;
+            }
+        }
+    }
+    free(buf);
+    if (left > 0) {
+        // The client went away mid-file, the servers are left with a short body
+        for (i = 0; i < count; i++) {
+            if (w->socks[i] >= 0) {
+                close(w->socks[i]);
+            }
+        }
+        free(w);
+        return -1;
+    }
+
+    awaitReplicaAnswers(w, quorum);
+    rc = replyReplicaWrite(w, quorum, request_id, client_sock);
+    finishReplicaWrite(w);
+    return rc;
+}
+
+// Function to remove a file from the servers of its copies
+// The remove succeeds if any copy was removed, since a copy whose write failed may not exist
+int removeFromReplicas(const struct route *route, const char *path, uint32_t request_id, int client_sock) {
+    struct backendPool *pools[ROUTE_MAX_BACKENDS];
+    char server_path[BUF_SIZE];
+    struct replicaWrite *w;
+    int count = routeReplicas(route, path, pools);
+    int reused, i, rc;
+
+    if (count == 1) {
+        routedPath(pools[0], path, server_path, BUF_SIZE, 0);
+        return sendRemoveRequesttoServer(server_path, pools[0], request_id, client_sock);
+    }
+    if ((w = calloc(1, sizeof(*w))) == NULL) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: out of memory\n");
+    }
+    w->count = count;
+    for (i = 0; i < count; i++) {
+        w->pools[i] = pools[i];
+        routedPath(pools[i], path, server_path, BUF_SIZE, i > 0);
+        w->socks[i] = sendBackendRequest(pools[i], OP_RMFILE, request_id, 0, NULL, server_path, 0, &reused);
+        if (w->socks[i] >= 0) {
+            w->pending++;
+        }
+    }
+    awaitReplicaAnswers(w, count);
+    rc = replyReplicaWrite(w, 1, request_id, client_sock);
+    free(w);
+    return rc;
+}
+
+// Function to read the servers' answers until needed of them succeeded or none is outstanding
+// A server that has not answered within --io-timeout counts as a failed copy
+void awaitReplicaAnswers(struct replicaWrite *w, int needed) {
+    struct pollfd fds[ROUTE_MAX_BACKENDS];
+    int index[ROUTE_MAX_BACKENDS];
+    struct timespec deadline;
+    int nfds, ready, i;
+
+    ioDeadline(&deadline);
+
+    while (w->pending > 0 && w->acks < needed) {
+        nfds = 0;
+        for (i = 0; i < w->count; i++) {
+            if (w->socks[i] >= 0) {
+                fds[nfds].fd = w->socks[i];
+                fds[nfds].events = POLLIN;
+                index[nfds++] = i;
+            }
+        }
+        if ((ready = poll(fds, nfds, pollTimeout(&deadline))) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            break;
+        }
+        if (ready == 0) {
+            for (i = 0; i < nfds; i++) {
+                printf("%s did not answer within %d seconds\n", w->pools[index[i]]->name, io_timeout);
+                close(w->socks[index[i]]);
+                w->socks[index[i]] = -1;
+                w->pending--;
+            }
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents) {
+                readReplicaAnswer(w, index[i]);
+            }
+        }
+    }
+}
+
+// Function to read the answer of server i, keeping the first success (or failure, until a success comes)
+void readReplicaAnswer(struct replicaWrite *w, int i) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    char message[BUF_SIZE];
+    int sock = w->socks[i];
+    size_t keep;
+
+    w->socks[i] = -1;
+    w->pending--;
+    if (recvFrame(sock, &hdr, name, path) <= 0 || hdr.opcode != OP_END) {
+        printf("%s did not answer\n", w->pools[i]->name);
+        close(sock);
+        return;
+    }
+    keep = hdr.payload_len < BUF_SIZE ? hdr.payload_len : BUF_SIZE - 1;
+    if (recvAll(sock, message, keep) < 0 || drainPayload(sock, hdr.payload_len - keep) < 0) {
+        printf("%s did not answer\n", w->pools[i]->name);
+        close(sock);
+        return;
+    }
+    message[keep] = '\0';
+    releaseBackend(w->pools[i], sock, 1);
+    if (hdr.param == STATUS_OK) {
+        w->acks++;
+    } else {
+        printf("%s: %s", w->pools[i]->name, message);
+    }
+    if (!w->have_answer || (hdr.param == STATUS_OK && w->answer.param != STATUS_OK)) {
+        w->answer = hdr;
+        w->answer.payload_len = keep;
+        snprintf(w->answer_name, BUF_SIZE, "%s", name);
+        memcpy(w->answer_message, message, keep + 1);
+        w->have_answer = 1;
+    }
+}
+
+// Function to answer the client once quorum servers succeeded, or with the reason they did not
+int replyReplicaWrite(struct replicaWrite *w, int quorum, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+
+    if (w->acks >= quorum || (w->have_answer && w->answer.param != STATUS_OK)) {
+        if (sendFrame(client_sock, OP_END, request_id, w->answer.param, w->answer_name[0] ? w->answer_name : NULL, NULL, w->answer.payload_len) < 0) {
+            return -1;
+        }
+        return sendAll(client_sock, w->answer_message, w->answer.payload_len);
+    }
+    if (w->acks > 0) {
+        snprintf(response, BUF_SIZE, "Error: only %d of the %d copies were stored, %d needed.\n", w->acks, w->count, quorum);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: lost connection to the storage servers.\n");
+}
+
+// Function to leave the answers still outstanding to a thread, so the client does not wait for them
+void finishReplicaWrite(struct replicaWrite *w) {
+    pthread_t thread;
+
+    if (w->pending > 0 && pthread_create(&thread, NULL, replicaStragglers, w) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    replicaStragglers(w);
+}
+
+// Thread function: read the answers of the servers that had not answered when the client was
+void *replicaStragglers(void *arg) {
+    struct replicaWrite *w = arg;
+
+    awaitReplicaAnswers(w, w->count);
+    free(w);
+    return NULL;
+}
+
+// Function to request a file from the least loaded server holding a copy of it
+// A server that is unavailable, does not have the copy or cannot read it is skipped for the
+// next one; the answer of the last one is passed on whatever it is
+int readFromReplicas(uint8_t opcode, uint32_t param, const char *path, const char *name, const struct route *route, uint32_t request_id, int client_sock, struct cacheFill *fill) {
+    struct backendPool *pools[ROUTE_MAX_BACKENDS];
+    int order[ROUTE_MAX_BACKENDS];
+    char server_path[BUF_SIZE];
+    int count = routeReplicas(route, path, pools);
+    int i, rc;
+
+    if (count == 1) {
+        routedPath(pools[0], path, server_path, BUF_SIZE, 0);
+        return requestFileFromServer(opcode, param, server_path, name, pools[0], request_id, client_sock, fill);
+    }
+    orderReplicasByLoad(pools, count, order);
+    for (i = 0; i < count; i++) {
+        routedPath(pools[order[i]], path, server_path, BUF_SIZE, order[i] > 0);
+        rc = requestFromReplica(opcode, param, server_path, name, pools[order[i]], i == count - 1, request_id, client_sock, fill);
+        if (rc != 1) {
+            return rc;
+        }
+    }
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: no storage server holding the file is available.\n");
+}
+
+// Function to request a file from one copy and pass the answer to the client
+// Returns 1 without answering the client if the server is unavailable, or if its copy is
+// missing or unreadable and it is not the last copy to try; otherwise the result of relaying
+// the answer. Any other answer, such as a range past the end, is the same on every copy
+int requestFromReplica(uint8_t opcode, uint32_t param, const char *server_path, const char *name, struct backendPool *pool, int last, uint32_t request_id, int client_sock, struct cacheFill *fill) {
+    struct frameHeader hdr;
+    char fname[BUF_SIZE];
+    char fpath[BUF_SIZE];
+    int retried = 0;
+    int reused, server_ok, sock, rc;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->inflight++;
+    pthread_mutex_unlock(&pool->lock);
+    while (1) {
+        if ((sock = sendBackendRequest(pool, opcode, request_id, param, name, server_path, 0, &reused)) < 0) {
+            rc = 1;
+            break;
+        }
+        if (recvFrame(sock, &hdr, fname, fpath) <= 0) {
+            close(sock);
+            rc = 1;
+            // Retry once on a fresh connection if a pooled one was closed before answering
+            if (reused && !retried) {
+                retried = 1;
+                pthread_mutex_lock(&pool->lock);
+                pool->reconnects++;
+                pthread_mutex_unlock(&pool->lock);
+                continue;
+            }
+            break;
+        }
+        if (hdr.opcode == OP_END && (hdr.param == STATUS_MISSING || hdr.param == STATUS_ERROR) && !last) {
+            // This copy is missing or unreadable, another one may be fine
+            releaseBackend(pool, sock, drainPayload(sock, hdr.payload_len) == 0);
+            rc = 1;
+            break;
+        }
+        if (relayFrame(sock, client_sock, request_id, &hdr, fname, fpath, fill) < 0) {
+            close(sock);
+            rc = -1;
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            releaseBackend(pool, sock, 1);
+            rc = 0;
+            break;
+        }
+        rc = relayResponse(sock, client_sock, request_id, &server_ok, fill);
+        releaseBackend(pool, sock, server_ok);
+        if (rc == -2) {
+            rc = sendEnd(client_sock, request_id, STATUS_ERROR, "Error: lost connection to the storage server.\n");
+        }
+        break;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->inflight--;
+    if (rc == 0) {
+        pool->reads++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return rc;
+}
+
+// Function to ask every copy how much of an upload it has committed and answer with the least
+// A copy that is unavailable is left out; if none answers, the first refusal is passed on
+int queryUploadReplicas(const struct route *route, const char *path, const char *upload_id, uint32_t request_id, int client_sock) {
+    struct backendPool *pools[ROUTE_MAX_BACKENDS];
+    struct frameHeader hdr;
+    char server_path[BUF_SIZE];
+    char fname[BUF_SIZE];
+    char fpath[BUF_SIZE];
+    char message[BUF_SIZE] = "Error: no storage server holding the file is available.\n";
+    uint64_t offset, least = 0;
+    int count = routeReplicas(route, path, pools);
+    int answered = 0, refused = 0;
+    int reused, retried, sock, i;
+
+    for (i = 0; i < count; i++) {
+        routedPath(pools[i], path, server_path, BUF_SIZE, i > 0);
+        retried = 0;
+        while ((sock = sendBackendRequest(pools[i], OP_UQUERY, request_id, 0, upload_id, server_path, 0, &reused)) >= 0 &&
+               recvFrame(sock, &hdr, fname, fpath) <= 0) {
+            close(sock);
+            sock = -1;
+            // Retry once on a fresh connection if a pooled one was closed before answering
+            if (!reused || retried) {
+                break;
+            }
+            retried = 1;
+        }
+        if (sock < 0) {
+            continue;
+        }
+        if (hdr.opcode != OP_END) {
+            close(sock);
+            continue;
+        }
+        if (hdr.param != STATUS_OK && !refused && hdr.payload_len < BUF_SIZE) {
+            // Kept in case no copy knows the upload
+            if (recvAll(sock, message, hdr.payload_len) < 0) {
+                close(sock);
+                continue;
+            }
+            message[hdr.payload_len] = '\0';
+            refused = 1;
+            releaseBackend(pools[i], sock, 1);
+            continue;
+        }
+        releaseBackend(pools[i], sock, drainPayload(sock, hdr.payload_len) == 0);
+        if (hdr.param != STATUS_OK) {
+            continue;
+        }
+        offset = strtoull(fname, NULL, 10);
+        if (answered == 0 || offset < least) {
+            least = offset;
+        }
+        answered++;
+    }
+    if (answered == 0) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, message);
+    }
+    return sendUploadOffset(client_sock, request_id, STATUS_OK, least);
+}
+
+// Function to order the copies of a file by the load of their servers
+// A slow server keeps its reads in progress longer, so the one with the fewest is tried first;
+// between equally busy servers the one that served fewer reads goes first, to spread them out.
+// Ties keep the ring order, so the primary comes first
+void orderReplicasByLoad(struct backendPool **pools, int count, int *order) {
+    int inflight[ROUTE_MAX_BACKENDS];
+    unsigned long reads[ROUTE_MAX_BACKENDS];
+    int i, j, k;
+
+    for (i = 0; i < count; i++) {
+        pthread_mutex_lock(&pools[i]->lock);
+        inflight[i] = pools[i]->inflight;
+        reads[i] = pools[i]->reads;
+        pthread_mutex_unlock(&pools[i]->lock);
+        // Insertion sort, the lists are short
+        for (j = i; j > 0; j--) {
+            k = order[j - 1];
+            if (inflight[k] < inflight[i] || (inflight[k] == inflight[i] && reads[k] <= reads[i])) {
+                break;
+            }
+            order[j] = k;
+        }
+        order[j] = i;
+    }
+}
+
+// Function to create a directory if it does not exist
+int createDir(const char *path) {
+    char tmp[BUF_SIZE];
+    char *p = NULL;
+    size_t len;
+
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    len = strlen(tmp);
+    if (tmp[len - 1] == '/')
+        tmp[len - 1] = 0;
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            if (mkdir(tmp, 0755) && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    // Create the final directory in the path
+    if (mkdir(tmp, 0755) && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send a remove request to another server
+int sendRemoveRequesttoServer(const char *filename, struct backendPool *pool, uint32_t request_id, int client_sock) {
+    // Send the rmfile (delete) command and filename to the other server
+    return requestFileFromServer(OP_RMFILE, 0, filename, NULL, pool, request_id, client_sock, NULL);
+}
+
+// Function to load the routing table from path, or the default routes when path is NULL
+// Each line names an extension and where its files go: "local" for Smain itself, or the
+// storage servers as ip:port:dir, where dir takes the place of smain in the server's paths
+int loadRoutes(const char *path) {
+    const char *source = path ? path : "default routes";
+    char line[BUF_SIZE];
+    char *comment;
+    FILE *fp;
+    int line_no = 0;
+    int rc = 0;
+    int i, j;
+
+    if (path) {
+        fp = fopen(path, "r");
+    } else {
+        fp = fmemopen((void *)default_routes, strlen(default_routes), "r");
+    }
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+    while (rc == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        if ((comment = strchr(line, '#')) != NULL) {
+            *comment = '\0';
+        }
+        rc = addRoute(line, source, line_no);
+    }
+    fclose(fp);
+    if (rc == 0 && findRoute(".c") == NULL) {
+        fprintf(stderr, "%s: no route for .c files, add \".c local\"\n", source);
+        rc = -1;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < route_count; i++) {
+        printf("Route %s:", routes[i].ext);
+        if (routes[i].local) {
+            printf(" Smain");
+        }
+        for (j = 0; j < routes[i].backend_count; j++) {
+            printf(" %s (%s:%d)", routes[i].backends[j]->name, routes[i].backends[j]->ip, routes[i].backends[j]->port);
+        }
+        if (routes[i].ring_size > 0) {
+            int copies = replica_count < routes[i].backend_count ? replica_count : routes[i].backend_count;
+            printf(", sharded on a ring of %d points", routes[i].ring_size);
+            if (copies > 1) {
+                printf(", %d copies of each file with a write quorum of %d", copies, replicaQuorum(copies));
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// Function to add the route on one line of the routing table, blank lines are skipped
+// .c files stay on Smain, which indexes and deduplicates them; every other type needs servers
+int addRoute(char *line, const char *source, int line_no) {
+    char *save = NULL;
+    char *ext = strtok_r(line, " \t\r\n", &save);
+    char *target;
+    struct backendPool *pool;
+    struct route *route;
+    uint32_t slot;
+    int j;
+
+    if (ext == NULL) {
+        return 0;
+    }
+    if (ext[0] != '.' || ext[1] == '\0' || strlen(ext) >= ROUTE_EXT_MAX || strchr(ext + 1, '.') || strchr(ext, '/')) {
+        fprintf(stderr, "%s:%d: '%s' is not a file extension such as .txt\n", source, line_no, ext);
+        return -1;
+    }
+    if (findRoute(ext) != NULL) {
+        fprintf(stderr, "%s:%d: %s is routed twice\n", source, line_no, ext);
+        return -1;
+    }
+    if (route_count == ROUTE_MAX) {
+        fprintf(stderr, "%s:%d: more than %d routes\n", source, line_no, ROUTE_MAX);
+        return -1;
+    }
+    route = &routes[route_count];
+    memset(route, 0, sizeof(*route));
+    snprintf(route->ext, sizeof(route->ext), "%s", ext);
+
+    while ((target = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if (strcmp(target, "local") == 0) {
+            route->local = 1;
+            continue;
+        }
+        if (route->backend_count == ROUTE_MAX_BACKENDS) {
+            fprintf(stderr, "%s:%d: more than %d servers for %s\n", source, line_no, ROUTE_MAX_BACKENDS, ext);
+            return -1;
+        }
+        if ((pool = addBackend(target, source, line_no)) == NULL) {
+            return -1;
+        }
+        for (j = 0; j < route->backend_count; j++) {
+            if (route->backends[j] == pool) {
+                fprintf(stderr, "%s:%d: %s is listed twice for %s\n", source, line_no, target, ext);
+                return -1;
+            }
+        }
+        route->backends[route->backend_count++] = pool;
+    }
+    if (route->local == (route->backend_count > 0)) {
+        fprintf(stderr, "%s:%d: %s needs either \"local\" or its storage servers\n", source, line_no, ext);
+        return -1;
+    }
+    if (route->local != (strcmp(ext, ".c") == 0)) {
+        fprintf(stderr, "%s:%d: .c files are kept by Smain and other types by storage servers\n", source, line_no);
+        return -1;
+    }
+    if (route->backend_count > 1 && buildRouteRing(route) < 0) {
+        fprintf(stderr, "%s:%d: out of memory\n", source, line_no);
+        return -1;
+    }
+
+    slot = routeHash(ext) & (ROUTE_SLOTS - 1);
+    while (route_slots[slot] != NULL) {
+        slot = (slot + 1) & (ROUTE_SLOTS - 1);
+    }
+    route_slots[slot] = route;
+    route_count++;
+    return 0;
+}
+
+// Function to find or add the storage server named by ip:port:dir
+// Routes may share a server. Each server needs its own directory name, since display and
+// dtar tell the servers' paths apart by it
+struct backendPool *addBackend(const char *target, const char *source, int line_no) {
+    struct backendPool *pool;
+    struct in_addr addr;
+    char ip[64];
+    char dir[64];
+    int port;
+    int used = 0;
+    int i;
+
+    if (sscanf(target, "%63[^:]:%d:%63[^:/]%n", ip, &port, dir, &used) != 3 || target[used] != '\0' ||
+        port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &addr) != 1) {
+        fprintf(stderr, "%s:%d: '%s' is not a server such as 127.0.0.1:9800:stext\n", source, line_no, target);
+        return NULL;
+    }
+    for (i = 0; i < backend_pool_count; i++) {
+        pool = &backend_pools[i];
+        int same_address = strcmp(pool->ip, ip) == 0 && pool->port == port;
+        if (same_address && strcmp(pool->dir, dir) == 0) {
+            return pool;
+        }
+        if (same_address || strcmp(pool->dir, dir) == 0) {
+            fprintf(stderr, "%s:%d: %s clashes with %s:%d:%s, each server needs its own address and directory\n",
+                    source, line_no, target, pool->ip, pool->port, pool->dir);
+            return NULL;
+        }
+    }
+    if (backend_pool_count == MAX_BACKENDS) {
+        fprintf(stderr, "%s:%d: more than %d storage servers\n", source, line_no, MAX_BACKENDS);
+        return NULL;
+    }
+
+    pool = &backend_pools[backend_pool_count];
+    char *name = strdup(dir);
+    pool->ip = strdup(ip);
+    pool->dir = strdup(dir);
+    if (name == NULL || pool->ip == NULL || pool->dir == NULL) {
+        fprintf(stderr, "%s:%d: out of memory\n", source, line_no);
+        return NULL;
+    }
+    // The server is named after its directory, spdf runs as Spdf
+    name[0] = toupper((unsigned char)name[0]);
+    pool->name = name;
+    pool->port = port;
+    pool->index = backend_pool_count++;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// Function to hash an extension or a path (FNV-1a), repeated slashes count as one
+uint32_t routeHash(const char *key) {
+    uint32_t hash = 2166136261u;
+    const char *p;
+
+    for (p = key; *p; p++) {
+        if (*p == '/' && p[1] == '/') {
+            continue;
+        }
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to hash a key onto a hash ring: FNV-1a followed by a final mix, so that keys
+// differing only in their last characters still spread over the whole ring
+uint32_t ringHash(const char *key) {
+    uint32_t hash = routeHash(key);
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Function to place the route's storage servers on its hash ring
+// Each server gets ROUTE_VNODES points hashed from its address and directory, not from its
+// position in the list, so a server added to a route takes over about 1/N of the paths
+// and the others keep theirs
+int buildRouteRing(struct route *route) {
+    char key[BUF_SIZE];
+    int i, j;
+
+    route->ring = malloc(route->backend_count * ROUTE_VNODES * sizeof(*route->ring));
+    if (route->ring == NULL) {
+        return -1;
+    }
+    route->ring_size = 0;
+    for (i = 0; i < route->backend_count; i++) {
+        struct backendPool *pool = route->backends[i];
+        for (j = 0; j < ROUTE_VNODES; j++) {
+            snprintf(key, sizeof(key), "%s:%d:%s#%d", pool->ip, pool->port, pool->dir, j);
+            route->ring[route->ring_size].hash = ringHash(key);
+            route->ring[route->ring_size].pool = pool;
+            route->ring_size++;
+        }
+    }
+    qsort(route->ring, route->ring_size, sizeof(*route->ring), compareRingPoints);
+    return 0;
+}
+
+// qsort comparator for ring points, by hash and then by server so ties are stable
+int compareRingPoints(const void *a, const void *b) {
+    const struct ringPoint *pa = a;
+    const struct ringPoint *pb = b;
+
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->pool->index - pb->pool->index;
+}
+
+// Function to look up the route of an extension such as ".txt", NULL if it has none
+struct route *findRoute(const char *ext) {
+    uint32_t slot = routeHash(ext) & (ROUTE_SLOTS - 1);
+
+    while (route_slots[slot] != NULL) {
+        if (strcmp(route_slots[slot]->ext, ext) == 0) {
+            return route_slots[slot];
+        }
+        slot = (slot + 1) & (ROUTE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Function to look up the route of a file from the extension of its name
+struct route *routeForPath(const char *path) {
+    const char *base = strrchr(path, '/');
+    const char *ext;
+
+    base = base ? base + 1 : path;
+    ext = strrchr(base, '.');
+    return ext ? findRoute(ext) : NULL;
+}
+
+// Function to find the ring point that owns a file of the route
+// The path below smain is hashed onto the ring and the first server point at or after it owns
+// the file, so every command finds the file on the same server
+int ringPosition(const struct route *route, const char *path) {
+    const char *key = strstr(path, "/smain/");
+    uint32_t hash;
+    int lo = 0;
+    int hi = route->ring_size;
+    int mid;
+
+    key = key ? key + strlen("/smain/") : path;
+    while (*key == '/') {
+        key++;
+    }
+    hash = ringHash(key);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (route->ring[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // Past the last point the ring wraps around to the first
+    return lo == route->ring_size ? 0 : lo;
+}
+
+// Function to list the servers that hold the copies of a file of the route, the primary first
+// They are the first replica_count distinct servers met walking the ring from the file's point.
+// Returns how many there are
+int routeReplicas(const struct route *route, const char *path, struct backendPool **replicas) {
+    int want = replica_count < route->backend_count ? replica_count : route->backend_count;
+    int count = 0;
+    int i, j, k;
+
+    if (route->ring_size == 0) {
+        replicas[0] = route->backends[0];
+        return 1;
+    }
+    i = ringPosition(route, path);
+    for (k = 0; k < route->ring_size && count < want; k++) {
+        struct backendPool *pool = route->ring[(i + k) % route->ring_size].pool;
+        j = 0;
+        while (j < count && replicas[j] != pool) {
+            j++;
+        }
+        if (j == count) {
+            replicas[count++] = pool;
+        }
+    }
+    return count;
+}
+
+// Function to get how many of a file's copies must be stored before a write is acknowledged
+int replicaQuorum(int copies) {
+    if (write_quorum == 0) {
+        return copies / 2 + 1;
+    }
+    return write_quorum < copies ? write_quorum : copies;
+}
+
+// Function to translate a path under smain into the same path under the server's directory,
+// or under its replica directory for the copies it holds for other servers.
+// Both "~/smain" and "~/smain/..." are replaced, other paths are copied as they are
+void routedPath(const struct backendPool *pool, const char *path, char *out, size_t size, int replica) {
+    const char *p = path;
+
+    while ((p = strstr(p, "/smain")) != NULL && p[6] != '/' && p[6] != '\0') {
+        p++;
+    }
+    if (p == NULL) {
+        snprintf(out, size, "%s", path);
+        return;
+    }
+    snprintf(out, size, "%.*s/%s%s%s", (int)(p - path), path, pool->dir, replica ? REPLICA_SUFFIX : "", p + strlen("/smain"));
+}
+
+// Function to retrieve a file from the server and send it to the client
+int retrieveAndSendFile(const char *filename, const char *range, uint32_t param, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    struct stat st;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("File open error");
+        snprintf(response, BUF_SIZE, "Error: cannot open '%s': %s\n", filename, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+
+    // Send the requested part of the file to the client straight from the page cache
+    int rc = sendFileRange(client_sock, request_id, fd, &st, range, param);
+    if (rc < 0) {
+        printf("File '%s' could not be sent completely\n", filename);
+    } else {
+        printf("File '%s' sent to client.\n", filename);
+    }
+    close(fd);
+    return rc;
+}
+
+// Function to request a file from servers
+int requestFileFromServer(uint8_t opcode, uint32_t param, const char *filename, const char *name, struct backendPool *pool, uint32_t request_id, int client_sock, struct cacheFill *fill) {
+    int sock;
+    int reused;
+    int server_ok;
+    int rc;
+
+    while (1) {
+        // Send the request to the server, dtar names the file type and the others the path,
+        // with the dfile byte range or the upload id in the name
+        sock = sendBackendRequest(pool, opcode, request_id, param, opcode == OP_DTAR ? filename : name, opcode == OP_DTAR ? NULL : filename, 0, &reused);
+        if (sock < 0) {
+            return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the storage server is unavailable.\n");
+        }
+
+        // Receive the response from the server and forward it to the client immediately
+        rc = relayResponse(sock, client_sock, request_id, &server_ok, fill);
+        releaseBackend(pool, sock, server_ok);
+
+        // A pooled connection that the server closed before answering is retried once on a
+        // fresh one; rmfile is not retried because the server may already have removed the file
+        if (rc != -2 || !reused || opcode == OP_RMFILE) {
+            break;
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->reconnects++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (rc == -2) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: lost connection to the storage server.\n");
+    }
+    return rc;
+}
+
+// Function to handle the dfile command, which downloads a file from the servers
+int dfileCommandExecution(const char *filename, const char *range, uint32_t param, uint32_t request_id, int client_sock) {
+    char file_path[BUF_SIZE];
+    strncpy(file_path, filename, BUF_SIZE);
+
+    // Look up where files of this extension are stored
+    struct route *route = routeForPath(file_path);
+    if (route && route->local) {
+        // Check if the file/folder exists before proceeding, from the index when it can tell
+        int found = lookupPathIndex(&path_index, file_path);
+        if (found == 0 || (found < 0 && access(file_path, F_OK) == -1)) {
+        char response[BUF_SIZE];
+        snprintf(response, BUF_SIZE, "Error: File/Directory does not exist.\n");
+        //Sending the response to client if the file/directory doesnt exists.
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+        }
+        // Process .c file locally
+        return retrieveAndSendFile(file_path, range, param, request_id, client_sock);
+    }
+    // Otherwise request the file, with smain replaced by the server's directory, from a server holding it
+    // A file in the read cache is answered without asking the servers, and a miss fills the cache
+    else if (route) {
+        struct cacheEntry *entry = lookupCache(filename);
+        struct cacheFill fill;
+        uint64_t sent = 0;
+        int rc;
+        if (entry) {
+            rc = sendCachedFile(client_sock, request_id, entry, range, param, &sent);
+            releaseCacheEntry(entry);
+            // A ranged or revalidated hit only serves part or none of the entry
+            pthread_mutex_lock(&read_cache.lock);
+            read_cache.hit_bytes += sent;
+            pthread_mutex_unlock(&read_cache.lock);
+            return rc;
+        }
+        startCacheFill(&fill, filename);
+        rc = readFromReplicas(OP_DFILE, param, filename, range, route, request_id, client_sock, read_cache.limit ? &fill : NULL);
+        free(fill.data);
+        return rc;
+    } else {
+        printf("Unsupported file type\n");
+    }
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Unsupported file type\n");
+}
+
+// Function to handle the "dtar" command, which sends a tar archive of files to the client
+int dtarCommandExecution(const char *filetype, uint32_t param, uint32_t request_id, int client_sock) {
+    char cwd[BUF_SIZE];
+
+    // Get the user's home directory
+    const char *home = getenv("HOME");
+    if (!home) {
+        perror("Unable to get the home directory");
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: unable to get the home directory.\n");
+    }
+
+    // Construct the path to smain under the home directory
+    snprintf(cwd, sizeof(cwd), "%s/smain", home);
+    struct route *route = findRoute(filetype);
+    // Check if the file type is kept here (.c)
+    if (route && route->local) {
+        // Handle .c file type by streaming a tar archive of ~/smain directly to the client
+        return sendTarArchive(client_sock, request_id, param, cwd, filetype);
+    }
+    // A type on a single storage server is archived (and compressed) there and relayed as it is
+    else if (route && route->backend_count == 1) {
+        printf("Forwarding the %s tar file from the %s server to the client.\n", filetype, route->backends[0]->name);
+        return requestFileFromServer(OP_DTAR, param, filetype, NULL, route->backends[0], request_id, client_sock, NULL);
+    }
+    // A type spread over several servers is merged into one archive here
+    else if (route) {
+        printf("Merging the %s tar files of %d servers for the client.\n", filetype, route->backend_count);
+        return sendShardArchives(client_sock, request_id, param, route);
+    } else {
+        printf("Unsupported file type\n");
+    }
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Unsupported file type\n");
+}
+
+// Function to send the .c files under a directory to the client, straight from the path index
+// pos is the cursor in the listing and is advanced past every path sent. With a limit, at
+// most *limit paths are sent and *more tells whether any are left after them
+int sendLocalListing(int client_sock, uint32_t request_id, const char *directory, char *pos, size_t *limit, int *more) {
+    struct pathIndex scratch;
+    struct pathIndex *index;
+    char prefix[PATH_MAX];
+    char *batch;
+    size_t len;
+    int rc = 0;
+
+    batch = malloc(INDEX_BATCH_SIZE);
+    if (batch == NULL || (index = openListing(directory, &scratch, prefix, sizeof(prefix))) == NULL) {
+        perror("Failed to list the directory");
+        free(batch);
+        return 0;
+    }
+    while ((len = fillIndexBatch(index, prefix, pos, batch, INDEX_BATCH_SIZE, limit)) > 0) {
+        if (sendData(client_sock, request_id, batch, len) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0 && limit != NULL && *limit == 0) {
+        *more = moreIndexEntries(index, prefix, pos);
+    }
+    closeListing(index);
+    free(batch);
+    return rc;
+}
+
+// Function to send one page of a display listing
+// A paged listing is ordered by source (.c, then each storage server in turn) and sorted within
+// each, and the cursor is the last path of the previous page, so its directory says where to resume.
+// The final frame names the cursor of the next page, or nothing when the listing is complete
+int sendDisplayPage(int client_sock, uint32_t request_id, struct displaySource *sources, int count, const char *cursor, uint32_t page_size) {
+    char last[PATH_MAX] = "";  // last path sent to the client
+    char pos[PATH_MAX];        // cursor inside the source being listed
+    size_t remaining = page_size;
+    int first = 0;
+    int more = 0;
+    int i;
+
+    if (cursor[0]) {
+        for (i = count - 1; i > 0 && first == 0; i--) {
+            size_t len = strlen(sources[i].path);
+            if (strncmp(cursor, sources[i].path, len) == 0 && (cursor[len] == '/' || (len > 0 && cursor[len - 1] == '/'))) {
+                first = i;
+            }
+        }
+        snprintf(last, sizeof(last), "%s", cursor);
+    }
+
+    // Keep going after the page is full until one more path shows whether another page exists
+    for (i = first; i < count && !more; i++) {
+        snprintf(pos, sizeof(pos), "%s", i == first ? cursor : "");
+        if (i == 0) {
+            if (sendLocalListing(client_sock, request_id, sources[0].path, pos, &remaining, &more) < 0) {
+                return -1;
+            }
+            if (strcmp(pos, i == first ? cursor : "") != 0) {
+                snprintf(last, sizeof(last), "%s", pos);
+            }
+        } else if (relayDisplayPage(&sources[i], pos, &remaining, &more, last, client_sock, request_id) < 0) {
+            return -1;
+        }
+    }
+    if (strlen(last) >= BUF_SIZE) {
+        // The cursor would not fit in a frame, end the listing here
+        more = 0;
+    }
+    return sendFrame(client_sock, OP_END, request_id, STATUS_OK, more ? last : NULL, NULL, 0);
+}
+
+// Function to pass up to *remaining paths of one server's listing to the client
+// The server is asked for one path more than needed; if it comes, *more is set and it is dropped.
+// last is set to the last path passed on. Returns -1 if the client connection failed
+int relayDisplayPage(struct displaySource *source, const char *after, size_t *remaining, int *more, char *last, int client_sock, uint32_t request_id) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    char *batch;
+    int reused;
+    int frames = 0;
+    int rc = 0;
+    int sock;
+
+    batch = malloc(INDEX_BATCH_SIZE);
+    if (batch == NULL) {
+        return 0;
+    }
+    while (1) {
+        if ((sock = sendBackendRequest(source->pool, OP_DISPLAY, 0, *remaining + 1, after, source->path, 0, &reused)) < 0) {
+            // An unreachable server contributes no files
+            free(batch);
+            return 0;
+        }
+        while ((rc = recvFrame(sock, &hdr, name, path)) > 0) {
+            frames++;
+            if (hdr.opcode == OP_END) {
+                break;
+            }
+            // The servers send whole lines in frames of at most INDEX_BATCH_SIZE bytes
+            if (hdr.payload_len > INDEX_BATCH_SIZE || recvAll(sock, batch, hdr.payload_len) < 0) {
+                rc = -1;
+                break;
+            }
+            size_t len = 0;
+            while (len < hdr.payload_len && *remaining > 0) {
+                char *end = memchr(batch + len, '\n', hdr.payload_len - len);
+                size_t line_len = end ? (size_t)(end - (batch + len)) : hdr.payload_len - len;
+                if (line_len < PATH_MAX) {
+                    memcpy(last, batch + len, line_len);
+                    last[line_len] = '\0';
+                }
+                len += line_len + 1;
+                (*remaining)--;
+            }
+            if (len > hdr.payload_len) {
+                len = hdr.payload_len;
+            }
+            if (len < hdr.payload_len) {
+                *more = 1;
+            }
+            if (len > 0 && sendData(client_sock, request_id, batch, len) < 0) {
+                close(sock);
+                free(batch);
+                return -1;
+            }
+        }
+        if (rc > 0 && drainPayload(sock, hdr.payload_len) == 0) {
+            releaseBackend(source->pool, sock, 1);
+            break;
+        }
+        close(sock);
+        // Retry once on a fresh connection if a pooled one was closed before answering
+        if (frames > 0 || !reused) {
+            break;
+        }
+        pthread_mutex_lock(&source->pool->lock);
+        source->pool->reconnects++;
+        pthread_mutex_unlock(&source->pool->lock);
+    }
+    free(batch);
+    return 0;
+}
+
+int displayCommandExecution(const char *pathname, const char *cursor, uint32_t page_size, uint32_t request_id, int client_sock) {
+    struct displaySource sources[DISPLAY_SOURCES];
+    char pos[PATH_MAX] = "";
+    struct pollfd fds[DISPLAY_SOURCES];
+    struct displaySource *active[DISPLAY_SOURCES];
+    struct timespec deadline;
+    char timings[BUF_SIZE];
+    size_t len;
+    int count = 0;
+    int nfds, ready, i, rc;
+
+    // The .c files are listed from the original path
+    sources[count].name = "Smain";
+    sources[count].pool = NULL;
+    sources[count].sock = -1;
+    sources[count].failed = 0;
+    sources[count].timed_out = 0;
+    snprintf(sources[count].path, BUF_SIZE, "%s", pathname);
+    count++;
+
+    // Every storage server lists the same directory under its own name for smain
+    for (i = 0; i < backend_pool_count; i++) {
+        sources[count].name = backend_pools[i].name;
+        sources[count].pool = &backend_pools[i];
+        sources[count].sock = -1;
+        sources[count].failed = 0;
+        sources[count].timed_out = 0;
+        routedPath(&backend_pools[i], pathname, sources[count].path, BUF_SIZE, 0);
+        printf("Path sent to %s: %s\n", sources[count].name, sources[count].path);
+        count++;
+    }
+
+    // A page is listed one source after another, in the order the cursor relies on
+    if (page_size > 0) {
+        return sendDisplayPage(client_sock, request_id, sources, count, cursor, page_size);
+    }
+
+    // Ask the storage servers first so they search while the .c files are collected here;
+    // display then takes as long as the slowest source instead of the sum of all of them
+    ioDeadline(&deadline);
+    for (i = 1; i < count; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &sources[i].start);
+        startDisplaySource(&sources[i]);
+    }
+
+    // Stream the .c files from the provided directory meanwhile
+    clock_gettime(CLOCK_MONOTONIC, &sources[0].start);
+    rc = sendLocalListing(client_sock, request_id, pathname, pos, NULL, NULL);
+    finishDisplaySource(&sources[0]);
+
+    // Forward the servers' lists frame by frame, from whichever server answers first
+    while (rc == 0) {
+        nfds = 0;
+        for (i = 1; i < count; i++) {
+            if (sources[i].sock >= 0) {
+                fds[nfds].fd = sources[i].sock;
+                fds[nfds].events = POLLIN;
+                active[nfds++] = &sources[i];
+            }
+        }
+        if (nfds == 0) {
+            break;
+        }
+        if ((ready = poll(fds, nfds, pollTimeout(&deadline))) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            break;
+        }
+        if (ready == 0) {
+            // A stalled server only loses its own files, the lists that arrived are answered
+            for (i = 0; i < nfds; i++) {
+                close(active[i]->sock);
+                active[i]->sock = -1;
+                active[i]->failed = 1;
+                active[i]->timed_out = 1;
+                finishDisplaySource(active[i]);
+            }
+            break;
+        }
+        for (i = 0; i < nfds && rc == 0; i++) {
+            if (fds[i].revents) {
+                rc = relayDisplayFrame(active[i], client_sock, request_id);
+            }
+        }
+    }
+    if (rc == 0) {
+        rc = relayReplicaListings(sources, count, pathname, client_sock, request_id);
+    }
+
+    // The client is gone, the unfinished server responses cannot be resumed
+    len = 0;
+    timings[0] = '\0';
+    for (i = 0; i < count; i++) {
+        if (i > 0 && sources[i].sock >= 0) {
+            close(sources[i].sock);
+        }
+        if (len < sizeof(timings)) {
+            len += snprintf(timings + len, sizeof(timings) - len, "%s%s %.2f ms%s", i > 0 ? ", " : "", sources[i].name, sources[i].elapsed_ms,
+                            sources[i].timed_out ? " (timed out)" : sources[i].failed ? " (unavailable)" : "");
+        }
+    }
+    printf("Display sources for %s: %s\n", pathname, timings);
+    if (rc < 0) {
+        return -1;
+    }
+    return sendEnd(client_sock, request_id, STATUS_OK, NULL);
+}
+
+// Function to send the display request for one source to its storage server
+void startDisplaySource(struct displaySource *source) {
+    source->frames = 0;
+    source->sock = sendBackendRequest(source->pool, OP_DISPLAY, 0, 0, NULL, source->path, 0, &source->reused);
+    if (source->sock < 0) {
+        // An unreachable server's files are listed from their copies once the others are done
+        source->failed = 1;
+        finishDisplaySource(source);
+    }
+}
+
+// Function to record how long a source took to list its files
+void finishDisplaySource(struct displaySource *source) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    source->elapsed_ms = (end.tv_sec - source->start.tv_sec) * 1000.0 + (end.tv_nsec - source->start.tv_nsec) / 1e6;
+}
+
+// Function to pass one frame of a server's file list on to the client
+// Returns -1 if the client connection failed, otherwise 0
+int relayDisplayFrame(struct displaySource *source, int client_sock, uint32_t request_id) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+
+    if (recvFrame(source->sock, &hdr, name, path) <= 0) {
+        close(source->sock);
+        // Retry once on a fresh connection if a pooled one was closed before answering
+        if (source->frames == 0 && source->reused) {
+            pthread_mutex_lock(&source->pool->lock);
+            source->pool->reconnects++;
+            pthread_mutex_unlock(&source->pool->lock);
+            startDisplaySource(source);
+            return 0;
+        }
+        // Whatever part of this server's list arrived has been sent already
+        source->sock = -1;
+        source->failed = 1;
+        finishDisplaySource(source);
+        return 0;
+    }
+    source->frames++;
+
+    if (hdr.opcode == OP_END) {
+        if (drainPayload(source->sock, hdr.payload_len) < 0) {
+            close(source->sock);
+        } else {
+            releaseBackend(source->pool, source->sock, 1);
+        }
+        source->sock = -1;
+        finishDisplaySource(source);
+        return 0;
+    }
+
+    // The servers batch whole lines into each data frame, so frames can be interleaved
+    if (sendFrame(client_sock, OP_DATA, request_id, 0, NULL, NULL, hdr.payload_len) < 0) {
+        return -1;
+    }
+    // A short payload would leave the client mid-frame, so any failure closes it
+    if (relayPayload(source->sock, client_sock, hdr.payload_len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to list the files of the servers that failed the display from their replica copies
+// Every reachable server lists its replica directory and passes on the files whose primary
+// failed and of which it is the least busy reachable copy, so those listings are spread over
+// the copies. A server that failed part way may have its first files listed twice.
+// Returns -1 if the client connection failed, otherwise 0
+int relayReplicaListings(struct displaySource *sources, int count, const char *pathname, int client_sock, uint32_t request_id) {
+    struct replicaListing state;
+    int any = 0;
+    int i;
+
+    if (replica_count < 2) {
+        return 0;
+    }
+    memset(&state, 0, sizeof(state));
+    for (i = 1; i < count; i++) {
+        if (sources[i].failed) {
+            state.down[sources[i].pool - backend_pools] = 1;
+            any = 1;
+        }
+    }
+    if (!any) {
+        return 0;
+    }
+    for (i = 0; i < backend_pool_count; i++) {
+        pthread_mutex_lock(&backend_pools[i].lock);
+        state.inflight[i] = backend_pools[i].inflight;
+        state.reads[i] = backend_pools[i].reads;
+        pthread_mutex_unlock(&backend_pools[i].lock);
+    }
+    for (i = 0; i < backend_pool_count; i++) {
+        if (!state.down[i] && relayReplicaListing(&backend_pools[i], pathname, &state, client_sock, request_id) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to pass on the files of one server's replica directory that it lists for a failed server
+// Returns -1 if the client connection failed, otherwise 0
+int relayReplicaListing(struct backendPool *pool, const char *pathname, const struct replicaListing *state, int client_sock, uint32_t request_id) {
+    struct frameHeader hdr;
+    char server_path[BUF_SIZE];
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    char file[PATH_MAX];
+    size_t dir_len = strlen(pathname);
+    size_t server_len, len, line_len, out_len;
+    char *batch, *out, *end;
+    int reused, sock, rc;
+
+    // The servers list paths under the replica directory, which map back to paths under pathname
+    routedPath(pool, pathname, server_path, BUF_SIZE, 1);
+    server_len = strlen(server_path);
+    while (dir_len > 1 && pathname[dir_len - 1] == '/') {
+        dir_len--;
+    }
+    while (server_len > 1 && server_path[server_len - 1] == '/') {
+        server_len--;
+    }
+    batch = malloc(INDEX_BATCH_SIZE);
+    out = malloc(INDEX_BATCH_SIZE + 1);
+    if (batch == NULL || out == NULL ||
+        (sock = sendBackendRequest(pool, OP_DISPLAY, 0, 0, NULL, server_path, 0, &reused)) < 0) {
+        free(batch);
+        free(out);
+        return 0;
+    }
+    while ((rc = recvFrame(sock, &hdr, name, path)) > 0 && hdr.opcode != OP_END) {
+        if (hdr.payload_len > INDEX_BATCH_SIZE || recvAll(sock, batch, hdr.payload_len) < 0) {
+            rc = -1;
+            break;
+        }
+        out_len = 0;
+        for (len = 0; len < hdr.payload_len; len += line_len + 1) {
+            end = memchr(batch + len, '\n', hdr.payload_len - len);
+            line_len = end ? (size_t)(end - (batch + len)) : hdr.payload_len - len;
+            if (line_len > server_len && strncmp(batch + len, server_path, server_len) == 0 && batch[len + server_len] == '/' &&
+                snprintf(file, sizeof(file), "%.*s%.*s", (int)dir_len, pathname, (int)(line_len - server_len), batch + len + server_len) < (int)sizeof(file) &&
+                listedByReplica(pool, file, state)) {
+                memcpy(out + out_len, batch + len, line_len);
+                out_len += line_len;
+                out[out_len++] = '\n';
+            }
+        }
+        if (out_len > 0 && sendData(client_sock, request_id, out, out_len) < 0) {
+            close(sock);
+            free(batch);
+            free(out);
+            return -1;
+        }
+    }
+    if (rc > 0 && drainPayload(sock, hdr.payload_len) == 0) {
+        releaseBackend(pool, sock, 1);
+    } else {
+        close(sock);
+    }
+    free(batch);
+    free(out);
+    return 0;
+}
+
+// Function to decide whether pool lists path for a display whose servers in state.down failed
+// The file is listed when its primary failed and pool is the least busy of its reachable copies
+int listedByReplica(const struct backendPool *pool, const char *path, const struct replicaListing *state) {
+    struct backendPool *copies[ROUTE_MAX_BACKENDS];
+    struct route *route = routeForPath(path);
+    int best = -1;
+    int count, i, k;
+
+    if (route == NULL || route->local) {
+        return 0;
+    }
+    count = routeReplicas(route, path, copies);
+    if (!state->down[copies[0] - backend_pools]) {
+        return 0;
+    }
+    for (i = 1; i < count; i++) {
+        k = copies[i] - backend_pools;
+        if (state->down[k]) {
+            continue;
+        }
+        if (best < 0 || state->inflight[k] < state->inflight[best] ||
+            (state->inflight[k] == state->inflight[best] && state->reads[k] < state->reads[best])) {
+            best = k;
+        }
+    }
+    return best >= 0 && &backend_pools[best] == pool;
+}
+
+// Function to expand ~ to the user's home directory
+void tildePathOperation(char *path, char *expanded_path, size_t size) {
+    if (path[0] == '~') {
+        const char *home_dir = getenv("HOME");
+        if (!home_dir) {
+            struct passwd *pw = getpwuid(getuid());
+            home_dir = pw->pw_dir;
+        }
+        snprintf(expanded_path, size, "%s%s", home_dir, path + 1);
+    } else {
+        snprintf(expanded_path, size, "%s", path);
+    }
+}
+
+// Function to send the whole buffer, returns 0 on success
+int sendAll(int sock, const void *buf, size_t len) {
+    return sendAllFlags(sock, buf, len, 0);
+}
+
+// Function to send the whole buffer with send flags such as MSG_MORE
+int sendAllFlags(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(sock, p, len, flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to receive exactly len bytes, returns 0 on success and -1 on error or EOF
+int recvAll(int sock, void *buf, size_t len) {
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(sock, p, len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to build a frame header with its name and path in header, which needs room for
+// FRAME_HEADER_SIZE bytes plus the name and path
+// Returns the length of the frame, or 0 if the name or path is too long
+size_t encodeFrame(unsigned char *header, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t path_len = path ? strlen(path) : 0;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    if (name_len >= BUF_SIZE || path_len >= BUF_SIZE) {
+        return 0;
+    }
+    v16 = htons(PROTO_MAGIC);
+    memcpy(header, &v16, 2);
+    header[2] = PROTO_VERSION;
+    header[3] = opcode;
+    v32 = htonl(request_id);
+    memcpy(header + 4, &v32, 4);
+    v32 = htonl(param);
+    memcpy(header + 8, &v32, 4);
+    v16 = htons((uint16_t)name_len);
+    memcpy(header + 12, &v16, 2);
+    v16 = htons((uint16_t)path_len);
+    memcpy(header + 14, &v16, 2);
+    v64 = htobe64(payload_len);
+    memcpy(header + 16, &v64, 8);
+    if (name_len > 0) {
+        memcpy(header + FRAME_HEADER_SIZE, name, name_len);
+    }
+    if (path_len > 0) {
+        memcpy(header + FRAME_HEADER_SIZE + name_len, path, path_len);
+    }
+    return FRAME_HEADER_SIZE + name_len + path_len;
+}
+
+// Function to send a frame header with its name and path, the payload is sent by the caller
+int sendFrame(int sock, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len) {
+    unsigned char header[FRAME_HEADER_SIZE + 2 * BUF_SIZE];
+    size_t len = encodeFrame(header, opcode, request_id, param, name, path, payload_len);
+
+    if (len == 0) {
+        return -1;
+    }
+    // Header, name and path go out in one send, held back with MSG_MORE when a payload follows
+    return sendAllFlags(sock, header, len, payload_len > 0 ? MSG_MORE : 0);
+}
+
+// Function to receive a frame header with its name and path (each up to BUF_SIZE - 1 bytes)
+// Returns 1 on success, 0 if the peer closed the connection between frames and -1 on error
+int recvFrame(int sock, struct frameHeader *hdr, char *name, char *path) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    ssize_t n;
+
+    // Distinguish a clean close before the next frame from a truncated frame
+    do {
+        n = recv(sock, header, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n == 0 ? 0 : -1;
+    }
+    if (recvAll(sock, header + 1, FRAME_HEADER_SIZE - 1) < 0 || decodeFrameHeader(header, hdr) < 0) {
+        return -1;
+    }
+    if (recvAll(sock, name, hdr->name_len) < 0 || recvAll(sock, path, hdr->path_len) < 0) {
+        return -1;
+    }
+    name[hdr->name_len] = '\0';
+    path[hdr->path_len] = '\0';
+    return 1;
+}
+
+// Function to decode and check the fixed part of a frame header
+// Returns 0, or -1 if the header breaks the protocol
+int decodeFrameHeader(const unsigned char *header, struct frameHeader *hdr) {
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    memcpy(&v16, header, 2);
+    if (ntohs(v16) != PROTO_MAGIC) {
+        fprintf(stderr, "Protocol error: bad frame magic\n");
+        return -1;
+    }
+    hdr->version = header[2];
+    hdr->opcode = header[3];
+    memcpy(&v32, header + 4, 4);
+    hdr->request_id = ntohl(v32);
+    memcpy(&v32, header + 8, 4);
+    hdr->param = ntohl(v32);
+    memcpy(&v16, header + 12, 2);
+    hdr->name_len = ntohs(v16);
+    memcpy(&v16, header + 14, 2);
+    hdr->path_len = ntohs(v16);
+    memcpy(&v64, header + 16, 8);
+    hdr->payload_len = be64toh(v64);
+
+    if (hdr->version != PROTO_VERSION) {
+        fprintf(stderr, "Protocol error: unsupported version %d\n", hdr->version);
+        return -1;
+    }
+    if (hdr->name_len >= BUF_SIZE || hdr->path_len >= BUF_SIZE) {
+        fprintf(stderr, "Protocol error: name or path too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send one piece of a response body
+int sendData(int sock, uint32_t request_id, const void *buf, size_t len) {
+    if (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, len) < 0) {
+        return -1;
+    }
+    return sendAll(sock, buf, len);
+}
+
+// Function to finish a response with a status and a message for the user
+int sendEnd(int sock, uint32_t request_id, uint32_t status, const char *message) {
+    size_t len = message ? strlen(message) : 0;
+
+    if (sendFrame(sock, OP_END, request_id, status, NULL, NULL, len) < 0) {
+        return -1;
+    }
+    return len > 0 ? sendAll(sock, message, len) : 0;
+}
+
+// Function to read and discard a payload the receiver cannot use
+int drainPayload(int sock, uint64_t len) {
+    char buffer[BUF_SIZE];
+
+    while (len > 0) {
+        size_t chunk = len < BUF_SIZE ? len : BUF_SIZE;
+        if (recvAll(sock, buffer, chunk) < 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to copy len payload bytes from one socket to another
+// Returns 0 on success, -1 if reading failed and -2 if writing failed (the rest is still read)
+int relayPayload(int from_sock, int to_sock, uint64_t len) {
+    int rc;
+
+    if (len > 0 && relay_mode == RELAY_SPLICE) {
+        rc = splicePayload(from_sock, to_sock, &len);
+        if (rc != 1) {
+            return rc;
+        }
+        // splice is not available here, copy whatever is left
+    }
+    return copyPayload(from_sock, to_sock, len);
+}
+
+// Function to move payload bytes between sockets with splice() through a per-thread pipe
+// Returns 1 without consuming anything if splice cannot be used, otherwise like relayPayload
+int splicePayload(int from_sock, int to_sock, uint64_t *len) {
+    char discard[BUF_SIZE];
+    int write_failed = 0;
+    int moved = 0;
+    ssize_t n, m;
+
+    if (relay_pipe[0] < 0) {
+        if (pipe2(relay_pipe, O_CLOEXEC) < 0) {
+            return 1;
+        }
+        // A bigger pipe means fewer splice calls per file, the default size is kept if this fails
+        fcntl(relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+        relay_pipe_size = fcntl(relay_pipe[1], F_GETPIPE_SZ);
+        if (relay_pipe_size <= 0) {
+            relay_pipe_size = 65536;
+        }
+    }
+
+    while (*len > 0) {
+        n = splice(from_sock, NULL, relay_pipe[1], NULL, *len < (uint64_t)relay_pipe_size ? *len : (uint64_t)relay_pipe_size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && !moved && (errno == EINVAL || errno == ENOSYS)) {
+            return 1;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        moved = 1;
+        *len -= n;
+
+        // Empty the pipe before reading more, so it never holds bytes between calls
+        while (n > 0) {
+            if (write_failed) {
+                m = read(relay_pipe[0], discard, n < BUF_SIZE ? n : BUF_SIZE);
+            } else {
+                m = splice(relay_pipe[0], NULL, to_sock, NULL, n, SPLICE_F_MOVE | (*len > 0 ? SPLICE_F_MORE : 0));
+            }
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0 && write_failed) {
+                // The pipe cannot be drained, start over with a new one next time
+                close(relay_pipe[0]);
+                close(relay_pipe[1]);
+                relay_pipe[0] = relay_pipe[1] = -1;
+                return -1;
+            }
+            if (m <= 0) {
+                perror("Forwarding error");
+                write_failed = 1;
+                continue;
+            }
+            n -= m;
+        }
+    }
+    return write_failed ? -2 : 0;
+}
+
+// Function to copy payload bytes between sockets through a user space buffer
+int copyPayload(int from_sock, int to_sock, uint64_t len) {
+    size_t chunk = transferChunk(len);
+    char *buffer;
+    int write_failed = 0;
+    ssize_t n;
+
+    if (len == 0) {
+        return 0;
+    }
+    if ((buffer = malloc(chunk)) == NULL) {
+        return drainPayload(from_sock, len) < 0 ? -1 : -2;
+    }
+    while (len > 0) {
+        n = recv(from_sock, buffer, len < chunk ? len : chunk, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return -1;
+        }
+        if (!write_failed && sendAll(to_sock, buffer, n) < 0) {
+            perror("Forwarding error");
+            write_failed = 1;
+        }
+        len -= n;
+    }
+    free(buffer);
+    return write_failed ? -2 : 0;
+}
+
+// Function to forward a server's response frames to the client until the final OP_END
+// Returns 0 when the client connection is still usable
+int relayResponse(int server_sock, int client_sock, uint32_t request_id, int *server_ok, struct cacheFill *fill) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    int frames = 0;
+
+    *server_ok = 0;
+    while (recvFrame(server_sock, &hdr, name, path) > 0) {
+        frames++;
+        if (relayFrame(server_sock, client_sock, request_id, &hdr, name, path, fill) < 0) {
+            return -1;
+        }
+        if (hdr.opcode == OP_END) {
+            // The whole response was read, the server connection can be reused
+            *server_ok = 1;
+            return 0;
+        }
+    }
+    if (frames == 0) {
+        // Nothing reached the client yet, the caller decides whether to retry
+        return -2;
+    }
+    // The server went away between frames
+    return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: lost connection to the storage server.\n");
+}
+
+// Function to pass one frame of a server's answer, with its payload, on to the client
+// With a fill, a whole file that fits the read cache is kept as it passes and cached once the
+// server ends its answer successfully. A short payload would leave the client mid-frame, so any
+// failure returns -1 and the caller closes it
+int relayFrame(int server_sock, int client_sock, uint32_t request_id, const struct frameHeader *hdr, const char *name, const char *path, struct cacheFill *fill) {
+    if (sendFrame(client_sock, hdr->opcode, request_id, hdr->param, name, path, hdr->payload_len) < 0) {
+        return -1;
+    }
+    if (fill && hdr->opcode == OP_DATA && captureCacheFill(fill, name, hdr->payload_len)) {
+        if (recvAll(server_sock, fill->data, hdr->payload_len) < 0 || sendAll(client_sock, fill->data, hdr->payload_len) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (relayPayload(server_sock, client_sock, hdr->payload_len) < 0) {
+        return -1;
+    }
+    if (fill && hdr->opcode == OP_END && hdr->param == STATUS_OK) {
+        finishCacheFill(fill);
+    }
+    return 0;
+}
+
+// Function to open a new connection to a storage server
+int connectToBackend(struct backendPool *pool) {
+    int sock;
+    struct sockaddr_in server_addr;
+
+    // Create a socket to connect to the other server
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Socket creation error");
+        return -1;
+    }
+    // Set up the address structure for the other server
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(pool->port);
+    if (inet_pton(AF_INET, pool->ip, &server_addr.sin_addr) <= 0) {
+        perror("Invalid address/ Address not supported");
+        close(sock);
+        return -1;
+    }
+    setSocketBuffers(sock);
+    setIoTimeout(sock);
+    // Connect to the other servers
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connection failed");
+        close(sock);
+        return -1;
+    }
+    setNoDelay(sock);
+    return sock;
+}
+
+// Function to take a healthy idle connection from the pool, or open a new one
+// Sets *reused so the caller knows a failure may just mean the pooled connection was stale
+int acquireBackend(struct backendPool *pool, int *reused) {
+    struct pollfd pfd;
+    unsigned long checkouts;
+    int sock = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idle_count > 0) {
+        sock = pool->idle[--pool->idle_count];
+        // An idle connection must have nothing to read: readable means the server closed it
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) == 0) {
+            break;
+        }
+        pool->stale++;
+        close(sock);
+        sock = -1;
+    }
+    if (sock >= 0) {
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    checkouts = pool->hits + pool->misses;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (server_mode == MODE_EPOLL && checkouts % POOL_REPORT_EVERY == 0) {
+        reportPoolStats(pool);
+    }
+    *reused = sock >= 0;
+    if (sock < 0) {
+        sock = connectToBackend(pool);
+    }
+    return sock;
+}
+
+// Function to return a connection to the pool, or close it if it is out of step or the pool is full
+void releaseBackend(struct backendPool *pool, int sock, int reusable) {
+    pthread_mutex_lock(&pool->lock);
+    if (reusable && pool->idle_count < pool_size) {
+        pool->idle[pool->idle_count++] = sock;
+        sock = -1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+// Function to send a request header to a storage server on a pooled connection
+// A pooled connection that fails on send is replaced by a fresh one, returns the socket or -1
+int sendBackendRequest(struct backendPool *pool, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len, int *reused) {
+    int sock = acquireBackend(pool, reused);
+
+    if (sock >= 0 && sendFrame(sock, opcode, request_id, param, name, path, payload_len) < 0) {
+        close(sock);
+        sock = -1;
+        if (*reused) {
+            pthread_mutex_lock(&pool->lock);
+            pool->reconnects++;
+            pthread_mutex_unlock(&pool->lock);
+            *reused = 0;
+            if ((sock = connectToBackend(pool)) >= 0 && sendFrame(sock, opcode, request_id, param, name, path, payload_len) < 0) {
+                close(sock);
+                sock = -1;
+            }
+        }
+    }
+    return sock;
+}
+
+// Function to print the pool counters for one storage server
+void reportPoolStats(struct backendPool *pool) {
+    unsigned long hits, misses, stale, reconnects;
+
+    pthread_mutex_lock(&pool->lock);
+    hits = pool->hits;
+    misses = pool->misses;
+    stale = pool->stale;
+    reconnects = pool->reconnects;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (hits + misses == 0) {
+        return;
+    }
+    printf("%s pool: %lu requests, hit rate %.1f%%, %lu new connections, %lu stale, %lu reconnects\n",
+           pool->name, hits + misses, 100.0 * hits / (hits + misses), misses, stale, reconnects);
+    fflush(stdout);
+}
+
+// Function to turn a path into its read cache key: ~ expanded and repeated '/' collapsed, so every
+// spelling of a path finds the same entry
+void cacheKey(const char *path, char *key, size_t size) {
+    char expanded[BUF_SIZE];
+    size_t i, len = 0;
+
+    tildePathOperation((char *)path, expanded, BUF_SIZE);
+    for (i = 0; expanded[i] && len + 1 < size; i++) {
+        if (expanded[i] == '/' && len > 0 && key[len - 1] == '/') {
+            continue;
+        }
+        key[len++] = expanded[i];
+    }
+    key[len] = '\0';
+}
+
+// Function to find a cached file, with the link pointing at it in its bucket chain
+// Called with the cache lock held
+struct cacheEntry *findCacheEntry(const char *key, struct cacheEntry ***link) {
+    struct cacheEntry **pos = &read_cache.buckets[routeHash(key) % CACHE_BUCKETS];
+
+    while (*pos && strcmp((*pos)->key, key) != 0) {
+        pos = &(*pos)->chain;
+    }
+    *link = pos;
+    return *pos;
+}
+
+// Function to take a cached file out of the LRU list and its bucket
+// Called with the cache lock held; an entry still being sent is freed by its last sender
+void dropCacheEntry(struct cacheEntry *entry) {
+    struct cacheEntry **link;
+
+    findCacheEntry(entry->key, &link);
+    *link = entry->chain;
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        read_cache.head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        read_cache.tail = entry->prev;
+    }
+    read_cache.bytes -= entry->size;
+    if (entry->refs > 0) {
+        entry->dead = 1;
+        return;
+    }
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+// Function to look up a file in the read cache and move it to the front of the LRU list
+// Returns the entry with a reference the caller gives back with releaseCacheEntry, or NULL
+struct cacheEntry *lookupCache(const char *path) {
+    struct cacheEntry *entry, **link;
+    char key[BUF_SIZE];
+    unsigned long lookups;
+
+    if (read_cache.limit == 0) {
+        return NULL;
+    }
+    cacheKey(path, key, sizeof(key));
+    pthread_mutex_lock(&read_cache.lock);
+    lookups = ++read_cache.lookups;
+    if ((entry = findCacheEntry(key, &link)) != NULL) {
+        if (entry->prev) {
+            entry->prev->next = entry->next;
+            if (entry->next) {
+                entry->next->prev = entry->prev;
+            } else {
+                read_cache.tail = entry->prev;
+            }
+            entry->prev = NULL;
+            entry->next = read_cache.head;
+            read_cache.head->prev = entry;
+            read_cache.head = entry;
+        }
+        entry->refs++;
+        read_cache.hits++;
+    }
+    pthread_mutex_unlock(&read_cache.lock);
+
+    if (lookups % CACHE_REPORT_EVERY == 0) {
+        reportCacheStats();
+    }
+    return entry;
+}
+
+// Function to take another reference to an entry, for a body the event loop sends later
+void holdCacheEntry(struct cacheEntry *entry) {
+    pthread_mutex_lock(&read_cache.lock);
+    entry->refs++;
+    pthread_mutex_unlock(&read_cache.lock);
+}
+
+// Function to drop a reference taken by lookupCache or holdCacheEntry
+void releaseCacheEntry(struct cacheEntry *entry) {
+    int gone;
+
+    pthread_mutex_lock(&read_cache.lock);
+    gone = --entry->refs == 0 && entry->dead;
+    pthread_mutex_unlock(&read_cache.lock);
+    if (gone) {
+        free(entry->key);
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// Function to drop a file that is being written or removed through Smain from the read cache
+// Bumping the generation also keeps out the bodies of misses that were already being read
+void invalidateCache(const char *path) {
+    struct cacheEntry *entry, **link;
+    char key[BUF_SIZE];
+
+    if (read_cache.limit == 0) {
+        return;
+    }
+    cacheKey(path, key, sizeof(key));
+    pthread_mutex_lock(&read_cache.lock);
+    read_cache.generation++;
+    if ((entry = findCacheEntry(key, &link)) != NULL) {
+        dropCacheEntry(entry);
+        read_cache.invalidations++;
+    }
+    pthread_mutex_unlock(&read_cache.lock);
+}
+
+// Function to get ready to keep the body of a file fetched on a cache miss
+void startCacheFill(struct cacheFill *fill, const char *path) {
+    cacheKey(path, fill->key, sizeof(fill->key));
+    fill->abandoned = 0;
+    fill->data = NULL;
+    pthread_mutex_lock(&read_cache.lock);
+    fill->generation = read_cache.generation;
+    pthread_mutex_unlock(&read_cache.lock);
+}
+
+// Function to decide whether a data frame from a storage server is kept for the cache
+// Only a whole file in one frame, "0/<size>@<sec>.<nsec>", small enough for the cache is kept;
+// returns 1 with the buffer for its payload allocated
+int captureCacheFill(struct cacheFill *fill, const char *content_range, uint64_t payload_len) {
+    unsigned long long offset, size;
+
+    if (fill->abandoned || fill->data) {
+        // More than one data frame, the file is not cached
+        free(fill->data);
+        fill->data = NULL;
+        fill->abandoned = 1;
+        return 0;
+    }
+    if (sscanf(content_range, "%llu/%llu@%lld.%ld", &offset, &size, &fill->mtime_sec, &fill->mtime_nsec) != 4 ||
+        offset != 0 || size != payload_len || size == 0 || size > read_cache.max_entry ||
+        (fill->data = malloc(size)) == NULL) {
+        fill->abandoned = 1;
+        return 0;
+    }
+    fill->size = size;
+    return 1;
+}
+
+// Function to store a file body kept by a fill in the read cache, evicting the least recently
+// used files to make room. The body is dropped if the file was invalidated since the fill started
+void finishCacheFill(struct cacheFill *fill) {
+    struct cacheEntry *entry, **link;
+
+    if (fill->abandoned || fill->data == NULL || (entry = calloc(1, sizeof(*entry))) == NULL) {
+        return;
+    }
+    if ((entry->key = strdup(fill->key)) == NULL) {
+        free(entry);
+        return;
+    }
+    entry->data = fill->data;
+    entry->size = fill->size;
+    entry->mtime_sec = fill->mtime_sec;
+    entry->mtime_nsec = fill->mtime_nsec;
+    fill->data = NULL;
+
+    pthread_mutex_lock(&read_cache.lock);
+    if (fill->generation != read_cache.generation) {
+        pthread_mutex_unlock(&read_cache.lock);
+        free(entry->key);
+        free(entry->data);
+        free(entry);
+        return;
+    }
+    if (findCacheEntry(entry->key, &link) != NULL) {
+        dropCacheEntry(*link);
+    }
+    while (read_cache.tail && read_cache.bytes + entry->size > read_cache.limit) {
+        dropCacheEntry(read_cache.tail);
+        read_cache.evictions++;
+    }
+    findCacheEntry(entry->key, &link);
+    *link = entry;
+    entry->next = read_cache.head;
+    if (read_cache.head) {
+        read_cache.head->prev = entry;
+    } else {
+        read_cache.tail = entry;
+    }
+    read_cache.head = entry;
+    read_cache.bytes += entry->size;
+    read_cache.fills++;
+    pthread_mutex_unlock(&read_cache.lock);
+}
+
+// Function to answer a dfile from the read cache, the same way sendFileRange answers from a file
+// Sets sent to the number of bytes of the entry that went to the client
+int sendCachedFile(int client_sock, uint32_t request_id, struct cacheEntry *entry, const char *range, uint32_t param, uint64_t *sent) {
+    char content_range[BUF_SIZE];
+    struct stat st;
+    uint64_t offset, length;
+    int rc;
+
+    // The range check only needs the size and mtime of the file
+    memset(&st, 0, sizeof(st));
+    st.st_size = entry->size;
+    st.st_mtim.tv_sec = entry->mtime_sec;
+    st.st_mtim.tv_nsec = entry->mtime_nsec;
+    if (param & DFILE_IF_MATCH) {
+        if (copyIsCurrent(range, &st, -1)) {
+            return sendEnd(client_sock, request_id, STATUS_NOT_MODIFIED, NULL);
+        }
+        range = NULL;
+    }
+    rc = parseByteRange(range, &st, &offset, &length);
+    if (rc == -1) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid byte range.\n");
+    } else if (rc == -2) {
+        return sendEnd(client_sock, request_id, STATUS_RANGE, "Error: the requested range starts past the end of the file.\n");
+    }
+    snprintf(content_range, sizeof(content_range), "%llu/%llu@%lld.%09ld", (unsigned long long)offset,
+             (unsigned long long)entry->size, entry->mtime_sec, entry->mtime_nsec);
+    // In the event loop a large body is written by the loop, not by this worker
+    if (event_conn && event_conn->sock == client_sock && length >= EVENT_OFFLOAD_MIN) {
+        rc = queueEventBody(event_conn, request_id, content_range, -1, entry, offset, length);
+        if (rc == 0) {
+            *sent = length;
+        }
+        return rc;
+    }
+    setCork(client_sock, 1);
+    if (sendFrame(client_sock, OP_DATA, request_id, 0, content_range, NULL, length) < 0 ||
+        sendAll(client_sock, entry->data + offset, length) < 0) {
+        perror("Send error");
+        rc = -1;
+    } else {
+        *sent = length;
+        rc = sendEnd(client_sock, request_id, STATUS_OK, NULL);
+    }
+    setCork(client_sock, 0);
+    return rc;
+}
+
+// Function to print the read cache counters
+void reportCacheStats(void) {
+    unsigned long lookups, hits, fills, evictions, invalidations;
+    uint64_t hit_bytes, bytes;
+    int files = 0;
+    struct cacheEntry *entry;
+
+    pthread_mutex_lock(&read_cache.lock);
+    lookups = read_cache.lookups;
+    hits = read_cache.hits;
+    fills = read_cache.fills;
+    evictions = read_cache.evictions;
+    invalidations = read_cache.invalidations;
+    hit_bytes = read_cache.hit_bytes;
+    bytes = read_cache.bytes;
+    for (entry = read_cache.head; entry; entry = entry->next) {
+        files++;
+    }
+    pthread_mutex_unlock(&read_cache.lock);
+
+    if (lookups == 0) {
+        return;
+    }
+    printf("Read cache: %lu lookups, hit rate %.1f%%, %.1f MB served from memory, %d files in %.1f of %.1f MB, %lu filled, %lu evicted, %lu invalidated\n",
+           lookups, 100.0 * hits / lookups, hit_bytes / 1048576.0, files, bytes / 1048576.0,
+           read_cache.limit / 1048576.0, fills, evictions, invalidations);
+    fflush(stdout);
+}
+
+// Function to turn off Nagle's algorithm, frames are already written in as few sends as possible
+// and a small END frame would otherwise wait for the peer's delayed ACK
+void setNoDelay(int sock) {
+    int one = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Function to size the kernel buffers of a socket when --socket-buffer is given
+// Fixed sizes turn off the kernel's autotuning, so by default they are left alone. Set on the
+// listening socket they are inherited by every accepted connection.
+void setSocketBuffers(int sock) {
+    if (socket_buffer > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer));
+    }
+}
+
+// Function to hold back partial segments while a frame header, its body and the END frame are
+// written, uncorking sends whatever is left at once
+void setCork(int sock, int on) {
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Function to pick the chunk size bodies of len bytes are moved in
+size_t transferChunk(uint64_t len) {
+    size_t chunk = transfer_chunk;
+
+    if (chunk == 0) {
+        chunk = len <= CHUNK_SMALL_FILE ? CHUNK_SMALL : len <= CHUNK_LARGE_FILE ? CHUNK_MEDIUM : CHUNK_LARGE;
+    }
+    // A buffer bigger than the transfer itself is never filled
+    if (len > 0 && len < chunk) {
+        chunk = len;
+    }
+    return chunk;
+}
+
+// Function to send len bytes of a file starting at offset, using sendfile() so the data
+// goes from the page cache to the socket without a user space copy
+// Falls back to large read/send chunks if sendfile() is not supported, returns 0 on success
+int sendFileContents(int sock, int fd, off_t offset, uint64_t len) {
+    char *buffer;
+    size_t chunk;
+    ssize_t n;
+
+    while (len > 0) {
+        n = sendfile(sock, fd, &offset, len < SENDFILE_CHUNK ? len : SENDFILE_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        if (n <= 0) {
+            // Send error, or the file shrank after its size was announced
+            return -1;
+        }
+        len -= n;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    chunk = transferChunk(len);
+    if ((buffer = malloc(chunk)) == NULL) {
+        return -1;
+    }
+    while (len > 0) {
+        n = pread(fd, buffer, len < chunk ? len : chunk, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || writeAll(sock, buffer, n) < 0) {
+            free(buffer);
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    free(buffer);
+    return 0;
+}
+
+// Function to send the tar archive of every regular file under root whose name ends in suffix
+// The archive is kept in the server's state directory and only rebuilt after a ufile or rmfile
+// of that type, so a repeated dtar is served from the cached file with sendfile().
+// param selects an optional compression codec and level (see DTAR_PARAM)
+int sendTarArchive(int sock, uint32_t request_id, uint32_t param, const char *root, const char *suffix) {
+    struct tarList list = {NULL, 0, 0};
+    struct tarSource source;
+    char cache_path[PATH_MAX];
+    char tmp_path[PATH_MAX + 64];
+    struct stat st;
+    uint64_t generation = 0;
+    uint64_t total = 0;
+    int root_fd = -1;
+    int fd = -1;
+    int stamp_fd, rc;
+
+    // Serve the cached archive while nothing of this type has changed
+    stamp_fd = openTarCache(suffix, cache_path, sizeof(cache_path));
+    if (stamp_fd >= 0 && (fd = open(cache_path, O_RDONLY | O_CLOEXEC)) >= 0 && fstat(fd, &st) == 0) {
+        total = st.st_size;
+        printf("Tar archive of %s files served from the cache\n", suffix);
+    } else {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (stamp_fd >= 0) {
+            flock(stamp_fd, LOCK_SH);
+            generation = readTarGeneration(stamp_fd);
+            flock(stamp_fd, LOCK_UN);
+        }
+
+        if (collectTarArchive(root, suffix, &list, &root_fd, &total) < 0) {
+            if (stamp_fd >= 0) {
+                close(stamp_fd);
+            }
+            return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot create the tar archive.\n");
+        }
+
+        // Build the archive into a temporary file next to the cache
+        if (stamp_fd >= 0) {
+            snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lx.tmp", cache_path, (int)getpid(), (unsigned long)pthread_self());
+            fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+        if (fd >= 0 && writeTarArchive(fd, root_fd, &list) < 0) {
+            unlink(tmp_path);
+            close(fd);
+            fd = -1;
+        } else if (fd >= 0) {
+            // Install it only if no ufile/rmfile of this type ran while it was being built
+            flock(stamp_fd, LOCK_EX);
+            if (readTarGeneration(stamp_fd) != generation || rename(tmp_path, cache_path) < 0) {
+                unlink(tmp_path);
+            }
+            flock(stamp_fd, LOCK_UN);
+        }
+        printf("Tar archive of %zu files (%llu bytes) built from %s\n", list.count, (unsigned long long)total, root);
+    }
+
+    source.archive_fd = fd;
+    source.size = total;
+    source.root_fd = root_fd;
+    source.list = &list;
+    source.route = NULL;
+    if (DTAR_CODEC(param) == CODEC_GZIP && total > 0) {
+        rc = sendCompressedArchive(sock, request_id, DTAR_LEVEL(param), &source);
+    } else if (fd >= 0) {
+        rc = sendArchiveFile(sock, request_id, fd, total);
+    } else {
+        // Without a usable state directory the archive is streamed straight to the socket,
+        // corked so small headers and file tails are packed into full segments
+        rc = 0;
+        setCork(sock, 1);
+        if (total > 0 && (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, total) < 0 || writeTarArchive(sock, root_fd, &list) < 0)) {
+            // The frame promised more bytes than were sent, so the connection is unusable
+            rc = -1;
+        }
+        setCork(sock, 0);
+        if (rc == 0) {
+            rc = sendEnd(sock, request_id, STATUS_OK, NULL);
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (root_fd >= 0) {
+        close(root_fd);
+    }
+    if (stamp_fd >= 0) {
+        close(stamp_fd);
+    }
+    freeTarList(&list);
+    return rc;
+}
+
+// Function to send a gzip compressed archive
+// A producer thread feeds the raw tar (from the archive file or built on the fly) into a pipe
+// while this thread compresses, so reading the files and deflating run in parallel.
+// The compressed size is not known in advance, so it goes out as a series of data frames
+int sendCompressedArchive(int sock, uint32_t request_id, int level, struct tarSource *source) {
+    unsigned char *in, *out;
+    pthread_t producer;
+    z_stream zs;
+    int pipefd[2];
+    int flush = Z_NO_FLUSH;
+    int send_failed = 0;
+    ssize_t n;
+
+    if (level < 0 || level > 9) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 writes a gzip header and trailer instead of a raw zlib stream
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot start compression.\n");
+    }
+    in = malloc(COMPRESS_BUF_SIZE);
+    out = malloc(COMPRESS_BUF_SIZE);
+    if (in == NULL || out == NULL || pipe2(pipefd, O_CLOEXEC) < 0) {
+        free(in);
+        free(out);
+        deflateEnd(&zs);
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot start compression.\n");
+    }
+    source->out_fd = pipefd[1];
+    source->rc = 0;
+    if (pthread_create(&producer, NULL, tarProducer, source) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        free(in);
+        free(out);
+        deflateEnd(&zs);
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot start compression.\n");
+    }
+
+    while (flush != Z_FINISH && !send_failed) {
+        n = read(pipefd[0], in, COMPRESS_BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // End of the tar stream (or a broken pipe, which the producer reports below)
+            n = 0;
+            flush = Z_FINISH;
+        }
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = COMPRESS_BUF_SIZE;
+            deflate(&zs, flush);
+            if (zs.avail_out < COMPRESS_BUF_SIZE && sendData(sock, request_id, out, COMPRESS_BUF_SIZE - zs.avail_out) < 0) {
+                send_failed = 1;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    }
+
+    // Closing the read end stops a producer that is still writing
+    close(pipefd[0]);
+    pthread_join(producer, NULL);
+    printf("Compressed archive: %lu bytes in, %lu bytes out\n", zs.total_in, zs.total_out);
+    deflateEnd(&zs);
+    free(in);
+    free(out);
+    if (send_failed) {
+        return -1;
+    }
+    if (source->rc < 0) {
+        // The gzip stream was cut short, tell the client not to keep it
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: the tar archive could not be read completely.\n");
+    }
+    return sendEnd(sock, request_id, STATUS_OK, NULL);
+}
+
+// Thread function: write the raw tar archive into the compression pipe
+void *tarProducer(void *arg) {
+    struct tarSource *source = arg;
+
+    if (source->archive_fd >= 0) {
+        source->rc = sendFileContents(source->out_fd, source->archive_fd, 0, source->size);
+    } else if (source->route) {
+        source->rc = writeShardArchives(source->out_fd, 0, 0, source->route);
+    } else {
+        source->rc = writeTarArchive(source->out_fd, source->root_fd, source->list);
+    }
+    close(source->out_fd);
+    return NULL;
+}
+
+// Function to send a finished archive file as one data frame followed by the END frame
+int sendArchiveFile(int sock, uint32_t request_id, int fd, uint64_t size) {
+    if (size > 0) {
+        if (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, size) < 0 || sendFileContents(sock, fd, 0, size) < 0) {
+            return -1;
+        }
+    }
+    return sendEnd(sock, request_id, STATUS_OK, NULL);
+}
+
+// Function to send the archive of a type spread over several storage servers
+// Each server archives its own files and the archives are merged here into one tar,
+// compressed in the same way as a local archive when the client asked for gzip
+int sendShardArchives(int sock, uint32_t request_id, uint32_t param, const struct route *route) {
+    struct tarSource source;
+    int rc;
+
+    if (DTAR_CODEC(param) == CODEC_GZIP) {
+        source.archive_fd = -1;
+        source.size = 0;
+        source.root_fd = -1;
+        source.list = NULL;
+        source.route = route;
+        return sendCompressedArchive(sock, request_id, DTAR_LEVEL(param), &source);
+    }
+    rc = writeShardArchives(sock, 1, request_id, route);
+    if (rc == -1) {
+        return -1;
+    }
+    if (rc < 0) {
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: a storage server did not send its archive.\n");
+    }
+    return sendEnd(sock, request_id, STATUS_OK, NULL);
+}
+
+// Function to write the archives of a route's storage servers one after another as one tar
+// All servers are asked at once, so each builds its archive while the earlier ones are relayed.
+// Each archive ends in two zero blocks, which would end the merged one early, so they are
+// dropped and written once at the end. With framed set the output goes out as data frames.
+// Returns 0 on success, -1 if the output failed and -2 if a server did not send its archive
+int writeShardArchives(int out_fd, int framed, uint32_t request_id, const struct route *route) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE * 2];
+    int socks[ROUTE_MAX_BACKENDS];
+    int reused[ROUTE_MAX_BACKENDS];
+    char *buf;
+    int written = 0;
+    int rc = 0;
+    int i;
+
+    if ((buf = malloc(SHARD_BUF_SIZE + sizeof(zeros))) == NULL) {
+        return -2;
+    }
+    for (i = 0; i < route->backend_count; i++) {
+        socks[i] = sendBackendRequest(route->backends[i], OP_DTAR, 0, DTAR_PARAM(CODEC_NONE, 0), route->ext, NULL, 0, &reused[i]);
+    }
+    for (i = 0; i < route->backend_count; i++) {
+        if (rc == 0) {
+            rc = relayShardArchive(route->backends[i], route->ext, socks[i], reused[i], out_fd, framed, request_id, buf, &written);
+        } else if (socks[i] >= 0) {
+            // The merge failed, the answers still on their way cannot be used
+            close(socks[i]);
+        }
+    }
+    free(buf);
+    if (rc == 0 && written && writeShardOutput(out_fd, framed, request_id, zeros, sizeof(zeros)) < 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+// Function to copy one server's plain archive, requested on sock, to out_fd without its two end blocks
+// The last 2 * TAR_BLOCK_SIZE bytes received are held back in buf until more data follows
+int relayShardArchive(struct backendPool *pool, const char *ext, int sock, int reused, int out_fd, int framed, uint32_t request_id, char *buf, int *written) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    size_t held, n;
+    uint64_t left;
+    int frames, broken, rc;
+
+    while (1) {
+        if (sock < 0) {
+            return -2;
+        }
+        held = 0;
+        frames = 0;
+        broken = 0;
+        rc = -2;
+        while (!broken && recvFrame(sock, &hdr, name, path) > 0) {
+            frames++;
+            if (hdr.opcode == OP_END) {
+                if (drainPayload(sock, hdr.payload_len) == 0) {
+                    rc = hdr.param == STATUS_OK ? 0 : -2;
+                }
+                break;
+            }
+            for (left = hdr.payload_len; left > 0; left -= n) {
+                n = left < SHARD_BUF_SIZE ? left : SHARD_BUF_SIZE;
+                if (recvAll(sock, buf + held, n) < 0) {
+                    broken = 1;
+                    break;
+                }
+                held += n;
+                if (held > TAR_BLOCK_SIZE * 2) {
+                    if (writeShardOutput(out_fd, framed, request_id, buf, held - TAR_BLOCK_SIZE * 2) < 0) {
+                        close(sock);
+                        return -1;
+                    }
+                    *written = 1;
+                    memmove(buf, buf + held - TAR_BLOCK_SIZE * 2, TAR_BLOCK_SIZE * 2);
+                    held = TAR_BLOCK_SIZE * 2;
+                }
+            }
+        }
+        if (rc == 0) {
+            releaseBackend(pool, sock, 1);
+            return 0;
+        }
+        close(sock);
+        // Retry once on a fresh connection if a pooled one was closed before answering
+        if (frames > 0 || !reused) {
+            return rc;
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->reconnects++;
+        pthread_mutex_unlock(&pool->lock);
+        sock = sendBackendRequest(pool, OP_DTAR, 0, DTAR_PARAM(CODEC_NONE, 0), ext, NULL, 0, &reused);
+    }
+}
+
+// Function to write part of a merged archive, as a data frame to the client or raw to a pipe
+int writeShardOutput(int out_fd, int framed, uint32_t request_id, const void *buf, size_t len) {
+    if (framed) {
+        return sendData(out_fd, request_id, buf, len);
+    }
+    return writeAll(out_fd, buf, len);
+}
+
+// Function to open the stamp file that guards the cached archive for suffix
+// The stamp holds a generation counter bumped by every invalidation; the cache path is
+// stored in cache_path. Returns the stamp descriptor or -1 if there is no state directory
+int openTarCache(const char *suffix, char *cache_path, size_t size) {
+    char path[PATH_MAX];
+    const char *home = getenv("HOME");
+
+    if (!home) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", home, STATE_DIR, SERVER_NAME);
+    if (createDir(path) != 0) {
+        return -1;
+    }
+    snprintf(cache_path, size, "%s/%s.tar", path, suffix + 1);
+    snprintf(path, sizeof(path), "%s.stamp", cache_path);
+    return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// Function to read the generation counter from a stamp file (0 if it was never written)
+uint64_t readTarGeneration(int stamp_fd) {
+    uint64_t generation = 0;
+
+    if (pread(stamp_fd, &generation, sizeof(generation), 0) != sizeof(generation)) {
+        return 0;
+    }
+    return generation;
+}
+
+// Function to drop the cached archive for suffix after a file of that type changed
+// Bumping the generation also stops a dtar that is building right now from installing its result.
+// Returns the new generation, or 0 if there is no state directory
+uint64_t invalidateTarCache(const char *suffix) {
+    char cache_path[PATH_MAX];
+    uint64_t generation;
+    int stamp_fd = openTarCache(suffix, cache_path, sizeof(cache_path));
+
+    if (stamp_fd < 0) {
+        return 0;
+    }
+    flock(stamp_fd, LOCK_EX);
+    generation = readTarGeneration(stamp_fd) + 1;
+    if (pwrite(stamp_fd, &generation, sizeof(generation), 0) != sizeof(generation)) {
+        perror("Tar cache stamp write error");
+    }
+    unlink(cache_path);
+    flock(stamp_fd, LOCK_UN);
+    close(stamp_fd);
+    return generation;
+}
+
+// Function to walk root and list the files of the archive, with the archive's total size
+// A missing root gives an empty list, like find on a missing directory
+int collectTarArchive(const char *root, const char *suffix, struct tarList *list, int *root_fd, uint64_t *total) {
+    char rel[PATH_MAX] = ".";
+    size_t i;
+
+    *total = 0;
+    if ((*root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    if (collectTarEntries(*root_fd, rel, 1, suffix, list) < 0) {
+        close(*root_fd);
+        *root_fd = -1;
+        freeTarList(list);
+        return -1;
+    }
+    if (list->count == 0) {
+        return 0;
+    }
+    *total = TAR_BLOCK_SIZE * 2;  // two zero blocks end the archive
+    for (i = 0; i < list->count; i++) {
+        *total += list->entries[i].header_len + (list->entries[i].size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// Function to write the archive for a collected list to a socket or file
+// Headers and small files are batched in one buffer, larger bodies go out with sendfile()
+int writeTarArchive(int out_fd, int root_fd, struct tarList *list) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE * 2];
+    int fds[TAR_READAHEAD];
+    size_t i, next_open = 0;
+    size_t out_len = 0;
+    char *out;
+    int rc = 0;
+
+    if (list->count == 0) {
+        return 0;
+    }
+    if ((out = malloc(TAR_OUT_BUF_SIZE)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < list->count && rc == 0; i++) {
+        struct tarEntry *entry = &list->entries[i];
+        size_t padded = (entry->size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        int fd;
+
+        // Keep the next few files open, with read-ahead requested for the large ones,
+        // so the disk works ahead of the output
+        while (next_open < list->count && next_open < i + TAR_READAHEAD) {
+            fd = openat(root_fd, list->entries[next_open].name, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0 && list->entries[next_open].size > TAR_SMALL_FILE) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            }
+            fds[next_open % TAR_READAHEAD] = fd;
+            next_open++;
+        }
+        fd = fds[i % TAR_READAHEAD];
+
+        // Flush the batch when this entry might not fit behind it
+        if (out_len + TAR_HEADER_MAX + (entry->size <= TAR_SMALL_FILE ? padded : 0) > TAR_OUT_BUF_SIZE) {
+            if (writeAll(out_fd, out, out_len) < 0) {
+                rc = -1;
+            }
+            out_len = 0;
+        }
+        out_len += buildTarHeader(entry, (unsigned char *)out + out_len);
+        if (rc == 0 && entry->size <= TAR_SMALL_FILE) {
+            // Small files are copied behind their header, padding included
+            readTarBody(fd, out + out_len, entry->size);
+            memset(out + out_len + entry->size, 0, padded - entry->size);
+            out_len += padded;
+        } else if (rc == 0) {
+            if (writeAll(out_fd, out, out_len) < 0 ||
+                sendTarBody(out_fd, fd, entry->size) < 0 ||
+                writeAll(out_fd, zeros, padded - entry->size) < 0) {
+                rc = -1;
+            }
+            out_len = 0;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    // Close the files that were opened ahead if the output failed early
+    for (; i < next_open; i++) {
+        if (fds[i % TAR_READAHEAD] >= 0) {
+            close(fds[i % TAR_READAHEAD]);
+        }
+    }
+    if (rc == 0 && (writeAll(out_fd, out, out_len) < 0 || writeAll(out_fd, zeros, sizeof(zeros)) < 0)) {
+        rc = -1;
+    }
+    free(out);
+    return rc;
+}
+
+// Function to walk the directory rel (relative to root_fd) and add the matching regular files
+// Like find, symbolic links are not followed and unreadable subdirectories are skipped
+int collectTarEntries(int root_fd, char *rel, size_t rel_len, const char *suffix, struct tarList *list) {
+    size_t suffix_len = strlen(suffix);
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int fd;
+    int rc = 0;
+
+    if ((fd = openat(root_fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return 0;
+    }
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (rel_len + 1 + name_len >= PATH_MAX) {
+            fprintf(stderr, "Skipping %s/%s: path too long\n", rel, de->d_name);
+            continue;
+        }
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        rel[rel_len] = '/';
+        memcpy(rel + rel_len + 1, de->d_name, name_len + 1);
+        if (S_ISDIR(st.st_mode)) {
+            rc = collectTarEntries(root_fd, rel, rel_len + 1 + name_len, suffix, list);
+        } else if (S_ISREG(st.st_mode) && name_len >= suffix_len && strcmp(de->d_name + name_len - suffix_len, suffix) == 0) {
+            rc = addTarEntry(list, rel, &st);
+        }
+        rel[rel_len] = '\0';
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Function to append a file to the tar list, returns -1 if out of memory
+int addTarEntry(struct tarList *list, const char *name, const struct stat *st) {
+    unsigned char header[TAR_HEADER_MAX];
+    struct tarEntry *entry;
+
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        struct tarEntry *entries = realloc(list->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        list->entries = entries;
+        list->cap = cap;
+    }
+    entry = &list->entries[list->count];
+    if ((entry->name = strdup(name)) == NULL) {
+        return -1;
+    }
+    entry->size = st->st_size;
+    entry->mode = st->st_mode & 07777;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->mtime = st->st_mtime;
+    entry->header_len = buildTarHeader(entry, header);
+    list->count++;
+    return 0;
+}
+
+// Function to release the tar list
+void freeTarList(struct tarList *list) {
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = list->cap = 0;
+}
+
+// Function to build the header blocks for one file: a ustar header, preceded by a pax
+// extended header when the path does not fit ustar's name/prefix fields or the size needs
+// more than 11 octal digits. Returns the number of bytes written to out
+size_t buildTarHeader(const struct tarEntry *entry, unsigned char *out) {
+    unsigned char *h = out;
+    size_t name_len = strlen(entry->name);
+    size_t split = 0;
+    size_t pax_len = 0;
+    char pax[TAR_HEADER_MAX - 2 * TAR_BLOCK_SIZE];
+    int need_path = 0;
+    int need_size = entry->size > 077777777777ULL;
+    unsigned int sum;
+    size_t i;
+
+    // ustar keeps up to 100 bytes of name plus a 155 byte prefix split at a '/'
+    if (name_len > 100) {
+        need_path = 1;
+        for (i = name_len - 1; i > 0; i--) {
+            if (entry->name[i] == '/' && i <= 155 && name_len - i - 1 <= 100 && name_len - i - 1 > 0) {
+                split = i;
+                need_path = 0;
+                break;
+            }
+        }
+    }
+
+    if (need_path || need_size) {
+        // Each pax record is "<length> <key>=<value>\n", where length counts the whole record
+        const char *keys[2] = {"path", "size"};
+        char size_value[32];
+        const char *values[2] = {entry->name, size_value};
+        int k;
+
+        snprintf(size_value, sizeof(size_value), "%llu", (unsigned long long)entry->size);
+        for (k = 0; k < 2; k++) {
+            size_t body, len, digits = 1;
+            if ((k == 0 && !need_path) || (k == 1 && !need_size)) {
+                continue;
+            }
+            body = strlen(keys[k]) + strlen(values[k]) + 3;  // space, '=' and newline
+            while (1) {
+                len = body + digits;
+                if (snprintf(NULL, 0, "%zu", len) == (int)digits) {
+                    break;
+                }
+                digits++;
+            }
+            pax_len += snprintf(pax + pax_len, sizeof(pax) - pax_len, "%zu %s=%s\n", len, keys[k], values[k]);
+        }
+
+        memset(h, 0, TAR_BLOCK_SIZE);
+        snprintf((char *)h, 100, "./PaxHeaders/%.80s", strrchr(entry->name, '/') + 1);
+        snprintf((char *)h + 100, 8, "%07o", 0644);
+        snprintf((char *)h + 108, 8, "%07o", (unsigned int)entry->uid & 07777777);
+        snprintf((char *)h + 116, 8, "%07o", (unsigned int)entry->gid & 07777777);
+        snprintf((char *)h + 124, 12, "%011zo", pax_len);
+        snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)entry->mtime & 077777777777ULL);
+        h[156] = 'x';
+        memcpy(h + 257, "ustar", 6);
+        memcpy(h + 263, "00", 2);
+        memset(h + 148, ' ', 8);
+        for (sum = 0, i = 0; i < TAR_BLOCK_SIZE; i++) {
+            sum += h[i];
+        }
+        snprintf((char *)h + 148, 8, "%06o", sum);
+        h += TAR_BLOCK_SIZE;
+
+        memset(h, 0, (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+        memcpy(h, pax, pax_len);
+        h += (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+
+    memset(h, 0, TAR_BLOCK_SIZE);
+    if (split) {
+        memcpy(h, entry->name + split + 1, name_len - split - 1);
+        memcpy(h + 345, entry->name, split);
+    } else {
+        // A pax path record overrides this (possibly truncated) name
+        memcpy(h, entry->name, name_len < 100 ? name_len : 100);
+    }
+    snprintf((char *)h + 100, 8, "%07o", (unsigned int)entry->mode);
+    snprintf((char *)h + 108, 8, "%07o", (unsigned int)entry->uid & 07777777);
+    snprintf((char *)h + 116, 8, "%07o", (unsigned int)entry->gid & 07777777);
+    snprintf((char *)h + 124, 12, "%011llo", need_size ? 0ULL : (unsigned long long)entry->size);
+    snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)entry->mtime & 077777777777ULL);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    for (sum = 0, i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += h[i];
+    }
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    h += TAR_BLOCK_SIZE;
+
+    return h - out;
+}
+
+// Function to send exactly size bytes of a file body for the tar stream
+// A file that shrank or can no longer be read is padded with zeros, as tar does, so the
+// archive keeps the size announced up front; returns -1 only if the output fails
+int sendTarBody(int out_fd, int fd, uint64_t size) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE * 8];
+    off_t offset = 0;
+    ssize_t n;
+
+    while (fd >= 0 && size > 0) {
+        n = sendfile(out_fd, fd, &offset, size < SENDFILE_CHUNK ? size : SENDFILE_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // sendfile() is not supported here, send the rest through a buffer
+            return sendFileContents(out_fd, fd, offset, size);
+        }
+        if (n <= 0) {
+            // An output error shows up again when the padding is written
+            break;
+        }
+        size -= n;
+    }
+    if (size > 0) {
+        fprintf(stderr, "A file shrank or became unreadable while archiving, padding %llu bytes with zeros\n", (unsigned long long)size);
+    }
+    while (size > 0) {
+        size_t chunk = size < sizeof(zeros) ? size : sizeof(zeros);
+        if (writeAll(out_fd, zeros, chunk) < 0) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function to write the whole buffer to a socket, pipe or file, returns 0 on success
+int writeAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to receive an upload body into a temporary file and store it under fullpath
+// Returns 0 when stored, -1 if the connection failed, or -2 if the file could not be stored
+// (response then says why and the body has been consumed)
+int storeUpload(int sock, const char *fullpath, uint64_t size, char *response, size_t response_size) {
+    char tmp_path[PATH_MAX];
+    size_t chunk = transferChunk(size);
+    char *buffer = malloc(chunk);
+    int write_failed = 0;
+    int fd = -1;
+    ssize_t n;
+
+    if (buffer == NULL || (fd = openUploadTemp(fullpath, tmp_path, sizeof(tmp_path))) < 0) {
+        perror("File open error");
+        snprintf(response, response_size, "Error: cannot open '%s': %s\n", fullpath, strerror(errno));
+        free(buffer);
+        return drainPayload(sock, size) < 0 ? -1 : -2;
+    }
+    while (size > 0) {
+        n = recv(sock, buffer, size < chunk ? size : chunk, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+        // After a failed write the rest of the body is still read, to keep the connection in step
+        if (!write_failed && writeAll(fd, buffer, n) < 0) {
+            perror("File write error");
+            snprintf(response, response_size, "Error: writing '%s' failed: %s\n", fullpath, strerror(errno));
+            write_failed = 1;
+        }
+    }
+    free(buffer);
+    if (size > 0 || write_failed) {
+        close(fd);
+        unlink(tmp_path);
+        return size > 0 ? -1 : -2;
+    }
+    if (finishUpload(fd, tmp_path, fullpath) < 0) {
+        perror("File commit error");
+        snprintf(response, response_size, "Error: storing '%s' failed: %s\n", fullpath, strerror(errno));
+        return -2;
+    }
+    return 0;
+}
+
+// Function to create the temporary file of an upload, in the directory of its final name so the
+// rename stays on one file system. Its name does not end in a served suffix, so the index and
+// dtar never see it. Returns the descriptor or -1
+int openUploadTemp(const char *fullpath, char *tmp_path, size_t size) {
+    const char *base = strrchr(fullpath, '/');
+    int fd;
+
+    base = base ? base + 1 : fullpath;
+    if (snprintf(tmp_path, size, "%.*s.%s.XXXXXX", (int)(base - fullpath), fullpath, base) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = mkostemp(tmp_path, O_CLOEXEC)) >= 0) {
+        fchmod(fd, 0644);
+    }
+    return fd;
+}
+
+// Function to make a written upload durable and put it under its final name
+// Closes fd. On failure the temporary file is removed and errno says why. Returns 0 or -1
+int finishUpload(int fd, const char *tmp_path, const char *fullpath) {
+    int rc, saved;
+
+    rc = commitFile(fd);
+    saved = errno;
+    if (close(fd) < 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc == 0 && rename(tmp_path, fullpath) < 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc < 0) {
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return commitDirectory(fullpath);
+}
+
+// Function to make a new name durable by committing the directory holding it, returns 0 or -1
+int commitDirectory(const char *path) {
+    char dir[PATH_MAX];
+    const char *base = strrchr(path, '/');
+    int dir_fd, rc, saved;
+
+    if (durability_mode == DURABILITY_NONE || base == NULL) {
+        return 0;
+    }
+    snprintf(dir, sizeof(dir), "%.*s", base == path ? 1 : (int)(base - path), path);
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    rc = commitFile(dir_fd);
+    saved = errno;
+    close(dir_fd);
+    errno = saved;
+    return rc;
+}
+
+// Function to make a file durable as durability_mode asks, returns 0 or -1
+// In group mode the caller waits for the commit thread, which syncs the files of every upload
+// that arrived meanwhile at once
+int commitFile(int fd) {
+    struct commitRequest request;
+    struct stat st;
+
+    if (durability_mode == DURABILITY_NONE) {
+        return 0;
+    }
+    if (durability_mode == DURABILITY_GROUP) {
+        pthread_once(&group_commit.started, startGroupCommit);
+    }
+    if (durability_mode == DURABILITY_FSYNC || !group_commit.running || fstat(fd, &st) < 0) {
+        return fdatasync(fd);
+    }
+    request.fd = fd;
+    request.dev = st.st_dev;
+    request.rc = 0;
+    request.done = 0;
+    pthread_mutex_lock(&group_commit.lock);
+    request.next = group_commit.pending;
+    group_commit.pending = &request;
+    group_commit.count++;
+    pthread_cond_signal(&group_commit.wake);
+    while (!request.done) {
+        pthread_cond_wait(&group_commit.done, &group_commit.lock);
+    }
+    pthread_mutex_unlock(&group_commit.lock);
+    if (request.rc < 0) {
+        errno = EIO;
+    }
+    return request.rc;
+}
+
+// Function to start the group commit thread of this process, the first time an upload needs it
+// Each forked process gets its own, so group commit pays off with the threaded models
+void startGroupCommit(void) {
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, groupCommitThread, NULL) != 0) {
+        perror("Group commit thread error");
+        return;
+    }
+    pthread_detach(tid);
+    group_commit.running = 1;
+}
+
+// Group commit thread: sync each file system of a batch once and wake every upload in it
+// Uploads that arrive during a sync make up the next batch. Once a batch is started, the thread
+// waits up to group_commit_ms for as many uploads as the last batch had, so a lone upload is
+// synced at once and concurrent ones keep sharing their syncs
+void *groupCommitThread(void *arg) {
+    struct commitRequest *batch, *request, *first;
+    struct timespec deadline;
+    int expected = 1;
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&group_commit.lock);
+        while (group_commit.pending == NULL) {
+            pthread_cond_wait(&group_commit.wake, &group_commit.lock);
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += group_commit_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (group_commit.count < expected &&
+               pthread_cond_timedwait(&group_commit.wake, &group_commit.lock, &deadline) == 0) {
+        }
+        batch = group_commit.pending;
+        expected = group_commit.count;
+        group_commit.pending = NULL;
+        group_commit.count = 0;
+        pthread_mutex_unlock(&group_commit.lock);
+
+        // syncfs writes back every file of the file system, so one call covers the whole batch
+        for (request = batch; request; request = request->next) {
+            for (first = batch; first != request && first->dev != request->dev; first = first->next) {
+            }
+            request->rc = first == request ? syncfs(request->fd) : first->rc;
+        }
+
+        // A request lives on its uploader's stack, so it is not touched once marked done and unlocked
+        pthread_mutex_lock(&group_commit.lock);
+        for (request = batch; request; request = request->next) {
+            request->done = 1;
+        }
+        pthread_cond_broadcast(&group_commit.done);
+        pthread_mutex_unlock(&group_commit.lock);
+    }
+    return NULL;
+}
+
+// Function to read a small file body into the tar output buffer
+// Bytes that can no longer be read are left as zeros, like sendTarBody does for large files
+void readTarBody(int fd, char *out, uint64_t size) {
+    uint64_t done = 0;
+    ssize_t n;
+
+    while (fd >= 0 && done < size) {
+        n = pread(fd, out + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done < size) {
+        fprintf(stderr, "A file shrank or became unreadable while archiving, padding %llu bytes with zeros\n", (unsigned long long)(size - done));
+        memset(out + done, 0, size - done);
+    }
+}
+
+// Function to set up the path index of root and build it
+// Called once at startup, before any worker exists
+void initPathIndex(const char *root) {
+    char cache_path[PATH_MAX];
+
+    snprintf(path_index.root, sizeof(path_index.root), "%s", root);
+    path_index.stamp_fd = openTarCache(path_index.suffix, cache_path, sizeof(cache_path));
+    pthread_rwlock_wrlock(&path_index.lock);
+    if (buildPathIndex(&path_index) == 0) {
+        printf("Indexed %zu %s files under %s\n", path_index.count, path_index.suffix, root);
+    }
+    pthread_rwlock_unlock(&path_index.lock);
+}
+
+// Function to take the read lock of an index, rebuilding it first if it is out of date
+// The index is stale when another process (a forked worker) changed files of this type,
+// which shows as a tar cache generation the index has not seen. Returns -1 if it cannot be built
+int acquirePathIndex(struct pathIndex *index) {
+    while (1) {
+        pthread_rwlock_rdlock(&index->lock);
+        if (index->valid && (index->stamp_fd < 0 || readTarGeneration(index->stamp_fd) == index->generation)) {
+            return 0;
+        }
+        pthread_rwlock_unlock(&index->lock);
+
+        pthread_rwlock_wrlock(&index->lock);
+        if ((!index->valid || (index->stamp_fd >= 0 && readTarGeneration(index->stamp_fd) != index->generation)) &&
+            buildPathIndex(index) < 0) {
+            pthread_rwlock_unlock(&index->lock);
+            return -1;
+        }
+        pthread_rwlock_unlock(&index->lock);
+    }
+}
+
+// Function to walk the root of an index and replace its contents, caller holds the write lock
+int buildPathIndex(struct pathIndex *index) {
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < index->count; i++) {
+        free(index->paths[i]);
+    }
+    index->count = 0;
+    index->valid = 0;
+    // Read the generation first so a change during the walk makes the next lookup rebuild
+    index->generation = index->stamp_fd >= 0 ? readTarGeneration(index->stamp_fd) : 0;
+    snprintf(path, sizeof(path), "%s", index->root);
+    if (walkPathIndex(index, path, strlen(path)) < 0) {
+        fprintf(stderr, "Path index of %s: out of memory\n", index->root);
+        return -1;
+    }
+    qsort(index->paths, index->count, sizeof(char *), comparePaths);
+    index->valid = 1;
+    return 0;
+}
+
+// Function to add every regular file under path whose name ends in the index suffix
+// Like find -type f, symbolic links are not followed and a missing directory adds nothing
+int walkPathIndex(struct pathIndex *index, char *path, size_t len) {
+    size_t suffix_len = strlen(index->suffix);
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int rc = 0;
+
+    if ((dir = opendir(path)) == NULL) {
+        return 0;
+    }
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+        unsigned char type = de->d_type;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (len + 1 + name_len >= PATH_MAX) {
+            fprintf(stderr, "Skipping %s/%s: path too long\n", path, de->d_name);
+            continue;
+        }
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, name_len + 1);
+        if (type == DT_DIR) {
+            rc = walkPathIndex(index, path, len + 1 + name_len);
+        } else if (type == DT_REG && name_len >= suffix_len && strcmp(de->d_name + name_len - suffix_len, index->suffix) == 0) {
+            rc = appendIndexPath(index, path);
+        }
+        path[len] = '\0';
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Function to append a path to an index without keeping it sorted, returns -1 if out of memory
+int appendIndexPath(struct pathIndex *index, const char *path) {
+    if (index->count == index->cap) {
+        size_t cap = index->cap ? index->cap * 2 : INDEX_INITIAL_CAP;
+        char **paths = realloc(index->paths, cap * sizeof(char *));
+        if (paths == NULL) {
+            return -1;
+        }
+        index->paths = paths;
+        index->cap = cap;
+    }
+    if ((index->paths[index->count] = strdup(path)) == NULL) {
+        return -1;
+    }
+    index->count++;
+    return 0;
+}
+
+int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to find the position of the first indexed path not less than path
+size_t searchPathIndex(const struct pathIndex *index, const char *path) {
+    size_t lo = 0, hi = index->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(index->paths[mid], path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Function to check that a file path can be answered from the index
+// It must lie under the root, carry the suffix and be written the way the walk writes it
+int indexedPath(const struct pathIndex *index, const char *path) {
+    size_t root_len = strlen(index->root);
+    size_t len = strlen(path);
+    size_t suffix_len = strlen(index->suffix);
+
+    if (root_len == 0 || len <= root_len + 1 || strncmp(path, index->root, root_len) != 0 || path[root_len] != '/') {
+        return 0;
+    }
+    if (len < suffix_len || strcmp(path + len - suffix_len, index->suffix) != 0) {
+        return 0;
+    }
+    return strstr(path + root_len, "//") == NULL && strstr(path + root_len, "/./") == NULL && strstr(path + root_len, "/../") == NULL;
+}
+
+// Function to check if a file exists using the index
+// Returns 1 or 0, or -1 if the index cannot answer and the caller has to look at the disk
+int lookupPathIndex(struct pathIndex *index, const char *path) {
+    size_t i;
+    int found;
+
+    if (!indexedPath(index, path) || acquirePathIndex(index) < 0) {
+        return -1;
+    }
+    i = searchPathIndex(index, path);
+    found = i < index->count && strcmp(index->paths[i], path) == 0;
+    pthread_rwlock_unlock(&index->lock);
+    return found;
+}
+
+// Function to record that a file was created (present = 1) or removed by this process
+// generation is the tar cache generation the change produced; if it is not the next one
+// after the index's, someone else changed files too and the index is rebuilt on next use
+void updatePathIndex(struct pathIndex *index, const char *path, int present, uint64_t generation) {
+    size_t i;
+    int found;
+
+    pthread_rwlock_wrlock(&index->lock);
+    if (!index->valid) {
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    // An ingest applies all of its files under the one generation it bumped the cache to
+    if ((generation != 0 && generation != index->generation + 1 && generation != index->generation) || !indexedPath(index, path)) {
+        index->valid = 0;
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    index->generation = generation;
+    i = searchPathIndex(index, path);
+    found = i < index->count && strcmp(index->paths[i], path) == 0;
+    if (present && !found) {
+        // Append to grow the array, then move the new path into its sorted position
+        if (appendIndexPath(index, path) < 0) {
+            index->valid = 0;
+        } else {
+            char *added = index->paths[index->count - 1];
+            memmove(index->paths + i + 1, index->paths + i, (index->count - 1 - i) * sizeof(char *));
+            index->paths[i] = added;
+        }
+    } else if (!present && found) {
+        free(index->paths[i]);
+        memmove(index->paths + i, index->paths + i + 1, (index->count - i - 1) * sizeof(char *));
+        index->count--;
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to get the index that lists directory, and the prefix its files share there
+// A directory inside the root is served from the server's index; anything else is walked
+// into scratch. Release the result with closeListing. Returns NULL if out of memory
+struct pathIndex *openListing(const char *directory, struct pathIndex *scratch, char *prefix, size_t size) {
+    size_t root_len = strlen(path_index.root);
+    size_t len = strlen(directory);
+
+    // Trailing slashes do not change what is listed
+    while (len > 1 && directory[len - 1] == '/') {
+        len--;
+    }
+    if (len + 2 > size) {
+        return NULL;
+    }
+    memcpy(prefix, directory, len);
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+    if (root_len > 0 && len >= root_len && strncmp(prefix, path_index.root, root_len) == 0 && prefix[root_len] == '/' &&
+        strstr(prefix + root_len, "//") == NULL && strstr(prefix + root_len, "/./") == NULL && strstr(prefix + root_len, "/../") == NULL) {
+        return &path_index;
+    }
+
+    memset(scratch, 0, sizeof(*scratch));
+    scratch->suffix = path_index.suffix;
+    scratch->stamp_fd = -1;
+    pthread_rwlock_init(&scratch->lock, NULL);
+    snprintf(scratch->root, sizeof(scratch->root), "%.*s", (int)len, directory);
+    if (buildPathIndex(scratch) < 0) {
+        closeListing(scratch);
+        return NULL;
+    }
+    // Paths from the walk start with the directory as it was given
+    snprintf(prefix, size, "%s/", scratch->root);
+    return scratch;
+}
+
+// Function to release a listing from openListing
+void closeListing(struct pathIndex *index) {
+    size_t i;
+
+    if (index == &path_index) {
+        return;
+    }
+    for (i = 0; i < index->count; i++) {
+        free(index->paths[i]);
+    }
+    free(index->paths);
+    pthread_rwlock_destroy(&index->lock);
+}
+
+// Function to copy the next indexed paths under prefix into batch, one per line
+// last is the cursor: the last path already copied, or empty to start at the beginning.
+// With a limit, at most *limit paths are copied and *limit is reduced by the number copied.
+// The lock is only held per batch, so changes between batches are picked up in order
+size_t fillIndexBatch(struct pathIndex *index, const char *prefix, char *last, char *batch, size_t size, size_t *limit) {
+    size_t prefix_len = strlen(prefix);
+    size_t used = 0;
+    size_t i;
+
+    if ((limit != NULL && *limit == 0) || acquirePathIndex(index) < 0) {
+        return 0;
+    }
+    // Resume after the cursor, or at the start of the directory if the cursor lies before it
+    i = searchPathIndex(index, strcmp(last, prefix) > 0 ? last : prefix);
+    if (i < index->count && strcmp(index->paths[i], last) == 0) {
+        i++;
+    }
+    for (; i < index->count && strncmp(index->paths[i], prefix, prefix_len) == 0 && (limit == NULL || *limit > 0); i++) {
+        size_t len = strlen(index->paths[i]);
+        if (used + len + 1 > size) {
+            break;
+        }
+        memcpy(batch + used, index->paths[i], len);
+        batch[used + len] = '\n';
+        used += len + 1;
+        memcpy(last, index->paths[i], len + 1);
+        if (limit != NULL) {
+            (*limit)--;
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return used;
+}
+
+// Function to check if any indexed path under prefix comes after last
+int moreIndexEntries(struct pathIndex *index, const char *prefix, const char *last) {
+    size_t i;
+    int more;
+
+    if (acquirePathIndex(index) < 0) {
+        return 0;
+    }
+    i = searchPathIndex(index, strcmp(last, prefix) > 0 ? last : prefix);
+    if (i < index->count && strcmp(index->paths[i], last) == 0) {
+        i++;
+    }
+    more = i < index->count && strncmp(index->paths[i], prefix, strlen(prefix)) == 0;
+    pthread_rwlock_unlock(&index->lock);
+    return more;
+}
+
+// Function to find the content store under the server's state directory, creating it if needed
+// Returns 0 with the store directory in dir, or -1 if there is none
+int openObjectStore(char *dir, size_t size) {
+    const char *home = getenv("HOME");
 
-    fclose(file);
-    printf("File '%s' sent to client.\n", filename);
+    if (!home) {
+        return -1;
+    }
+    if (snprintf(dir, size, "%s/%s/%s/%s", home, STATE_DIR, SERVER_NAME, STORE_DIR) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return createDir(dir);
 }
 
-// Function to request a file from servers
-void requestFileFromServer(const char *filename, const char *server_ip, int server_port, int client_sock) {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUF_SIZE];
-    ssize_t n;
+// Function to build the store path of the object with the given hash
+// Returns 0, or -1 if the path does not fit
+int objectPath(const char *dir, const char *hash, char *path, size_t size) {
+    if (snprintf(path, size, "%s/%.2s/%s", dir, hash, hash) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
 
-    // Create a socket to connect to the servers
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return;
+// Function to read the hash of the object a stored path links to
+// Returns 0, or -1 if the path is not a link into the content store
+int storedHash(const char *path, char *hash) {
+    if (getxattr(path, STORE_XATTR, hash, STORE_HASH_LEN) != STORE_HASH_LEN) {
+        return -1;
     }
-    
-    // Set up the address structure for the servers
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sock);
-        return;
+    hash[STORE_HASH_LEN] = '\0';
+    return 0;
+}
+
+// Function to take the lock that serialises linking and releasing objects between workers
+// Returns the lock descriptor, or -1 if the store cannot be locked
+int lockObjectStore(const char *dir) {
+    char path[PATH_MAX];
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/.lock", dir) >= (int)sizeof(path)) {
+        return -1;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        return -1;
     }
+    flock(fd, LOCK_EX);
+    return fd;
+}
 
-    // Connect to the servers
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        printf("Connection closed");
-        close(sock);
-        return;
+void unlockObjectStore(int lock_fd) {
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// Function to remove an object once no stored path links to it any more
+// The object's own name is one link and every path referencing it adds one. Caller holds the lock
+void releaseObject(const char *dir, const char *hash) {
+    char object[PATH_MAX];
+    struct stat st;
+
+    if (objectPath(dir, hash, object, sizeof(object)) == 0 && stat(object, &st) == 0 && st.st_nlink == 1) {
+        unlink(object);
+        printf("Released stored object %s\n", hash);
     }
+}
 
-    // Send the download request of the filename to the server
-    snprintf(buffer, BUF_SIZE, "dfile %s", filename);
-    send(sock, buffer, strlen(buffer), 0);
+// Function to point path at the stored object with the given hash
+// The link is made under a temporary name and renamed over path, so a file that was there
+// before is replaced in one step and its own object released. Caller holds the lock
+// Returns 0, 1 if the object is not stored, or -1 on error
+int linkObject(const char *dir, const char *hash, const char *path) {
+    char object[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char old_hash[STORE_HASH_LEN + 1];
+    int replaced;
 
-    // Receive the file data from the server and forward it to the client immediately
-    while ((n = recv(sock, buffer, BUF_SIZE, 0)) > 0) {
-        if (send(client_sock, buffer, n, 0) == -1) {
-            perror("Forwarding error");
-            break;
-        }
+    if (objectPath(dir, hash, object, sizeof(object)) < 0 ||
+        snprintf(tmp_path, sizeof(tmp_path), "%s.link-%d", path, (int)getpid()) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    unlink(tmp_path);
+    if (link(object, tmp_path) < 0) {
+        return errno == ENOENT ? 1 : -1;
+    }
+    replaced = storedHash(path, old_hash) == 0;
+    if (rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
     }
+    // rename() leaves both names alone when path already was this object
+    unlink(tmp_path);
+    if (replaced) {
+        releaseObject(dir, old_hash);
+    }
+    return 0;
+}
 
-    if (n < 0) {
-        perror("Receive error from server");
+// Function to remove a stored file, releasing its object when it was the last path linked to it
+// Returns 0 or -1 with errno set, like remove()
+int removeStoredFile(const char *path) {
+    char hash[STORE_HASH_LEN + 1];
+    char dir[PATH_MAX];
+    int lock_fd;
+    int rc;
+
+    if (storedHash(path, hash) < 0 || openObjectStore(dir, sizeof(dir)) < 0 || (lock_fd = lockObjectStore(dir)) < 0) {
+        return remove(path);
+    }
+    rc = remove(path);
+    if (rc == 0) {
+        releaseObject(dir, hash);
     }
-    // Properly shut down the socket after sending all the data
-    shutdown(sock, SHUT_WR);  // Ensure the server closes the sending side
-    close(sock);
-    
-    // Signal the client that the data transmission is complete
-    shutdown(client_sock, SHUT_WR);  // Close the writing side of the client socket
+    unlockObjectStore(lock_fd);
+    return rc;
 }
 
-// Function to handle the dfile command, which downloads a file from the servers
-void dfileCommandExecution(const char *filename, int client_sock) {
-    char file_path[BUF_SIZE];
-    strncpy(file_path, filename, BUF_SIZE);
+// Function to receive a file body into a temporary file of the store, hashing it on the way
+// sock may also be the file of a finished resumable upload
+// Returns 0 with the temporary file in tmp_path and its SHA-256 in hash, -1 if the connection
+// failed, or -2 if the file could not be stored (the body has then been consumed)
+int receiveIntoStore(int sock, uint64_t size, const char *dir, char *tmp_path, size_t tmp_size, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i, digest_len;
+    EVP_MD_CTX *ctx;
+    char *buffer;
+    int write_failed = 0;
+    ssize_t n = 0;
+    int fd;
 
-    // Check if the file type is .c
-    if (strstr(file_path, ".c") != NULL) {
-        // Check if the file/folder exists before proceeding
-        if (access(file_path, F_OK) == -1) {
-        char response[BUF_SIZE];
-        snprintf(response, BUF_SIZE, "Error: File/Directory does not exist.\n");
-        //Sending the response to client if the file/directory doesnt exists.
-        send(client_sock, response, strlen(response), 0);
-        // Properly shut down the write side of the socket to signal the end of the communication
-        shutdown(client_sock, SHUT_WR);
-        return;
+    if (snprintf(tmp_path, tmp_size, "%s/upload-XXXXXX", dir) >= (int)tmp_size) {
+        fprintf(stderr, "Store path too long\n");
+        return drainPayload(sock, size) < 0 ? -1 : -2;
+    }
+    buffer = malloc(STORE_BUF_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL || (fd = mkstemp(tmp_path)) < 0) {
+        perror("Store open error");
+        free(buffer);
+        EVP_MD_CTX_free(ctx);
+        return drainPayload(sock, size) < 0 ? -1 : -2;
+    }
+    fchmod(fd, 0644);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+    while (size > 0) {
+        n = read(sock, buffer, size < STORE_BUF_SIZE ? size : STORE_BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+        EVP_DigestUpdate(ctx, buffer, n);
+        if (!write_failed && writeAll(fd, buffer, n) < 0) {
+            perror("Store write error");
+            write_failed = 1;
         }
-        // Process .c file locally
-        retrieveAndSendFile(file_path, client_sock);
-    }
-    // Check if the file type is .txt
-    else if (strstr(file_path, ".txt") != NULL) {
-        // Replace smain with stext and request the file from Stext
-        replacesmainPath(file_path, "/stext/");
-        requestFileFromServer(file_path, "127.0.0.1", 9800, client_sock);
-    } 
-    // Check if the file type is .pdf
-    else if (strstr(file_path, ".pdf") != NULL) {
-        // Replace smain with spdf and request the file from Spdf
-        replacesmainPath(file_path, "/spdf/");
-        requestFileFromServer(file_path, "127.0.0.1", 9801, client_sock);
-    } else {
-        printf("Unsupported file type\n");
     }
-}
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
 
-// Function to handle the "dtar" command, which sends a tar archive of files to the client
-void dtarCommandExecution(const char *filetype, int client_sock) {
-    char command[BUF_SIZE];
-    char cwd[BUF_SIZE];
-    int pipefd[2];
-    pid_t pid;
+    for (i = 0; i < digest_len; i++) {
+        sprintf(hash + i * 2, "%02x", digest[i]);
+    }
+    // Every path linked to the object shares this attribute, so rmfile can find the object again
+    if (size == 0 && !write_failed && fsetxattr(fd, STORE_XATTR, hash, STORE_HASH_LEN, 0) < 0) {
+        perror("Store xattr error");
+        write_failed = 1;
+    }
+    if (size == 0 && !write_failed && commitFile(fd) < 0) {
+        perror("Store sync error");
+        write_failed = 1;
+    }
+    close(fd);
 
-    // Get the user's home directory
-    const char *home = getenv("HOME");
-    if (!home) {
-        perror("Unable to get the home directory");
-        return;
+    if (size > 0 || write_failed) {
+        unlink(tmp_path);
+        if (size > 0) {
+            return -1;
+        }
+        return -2;
     }
+    return 0;
+}
 
-    // Construct the path to smain under the home directory
-    snprintf(cwd, sizeof(cwd), "%s/smain", home);
-    // Check if the file type is .c
-    if (strcmp(filetype, ".c") == 0) {
-        // Handle .c file type by creating a tar archive and sending it directly to the client
-        // Create a pipe to connect the tar output to the socket
-        if (pipe(pipefd) == -1) {
-            perror("pipe error");
-            return;
+// Function to handle ufile in dedup mode: keep the body once under its hash and link fullpath to it
+// The body is read from body_fd, which is client_sock unless a finished resumable upload is stored
+int ufileIntoStore(const char *filename, const char *fullpath, int body_fd, uint64_t file_size, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    char dir[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char object[PATH_MAX];
+    char bucket[PATH_MAX];
+    char hash[STORE_HASH_LEN + 1];
+    int lock_fd;
+    int rc;
+
+    if (openObjectStore(dir, sizeof(dir)) < 0) {
+        if (body_fd == client_sock && drainPayload(client_sock, file_size) < 0) {
+            return -1;
         }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the file store is unavailable.\n");
+    }
+    rc = receiveIntoStore(body_fd, file_size, dir, tmp_path, sizeof(tmp_path), hash);
+    if (rc == -1 && body_fd == client_sock) {
+        // Smain or the client went away in the middle of the upload
+        return -1;
+    } else if (rc < 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s'\n", fullpath);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
 
-        // Fork a process to run the tar command
-        pid = fork();
-        if (pid == -1) {
-            perror("fork error");
-            return;
-        } else if (pid == 0) {
-            // Child process: execute the tar command
-            close(pipefd[0]);  // Close the read end of the pipe
+    if ((lock_fd = lockObjectStore(dir)) < 0) {
+        unlink(tmp_path);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the file store is unavailable.\n");
+    }
+    // A body that is already stored is dropped, otherwise it becomes the object
+    if (objectPath(dir, hash, object, sizeof(object)) < 0 ||
+        snprintf(bucket, sizeof(bucket), "%s/%.2s", dir, hash) >= (int)sizeof(bucket)) {
+        // Nothing is linked to a store path that was cut short
+        unlink(tmp_path);
+        unlockObjectStore(lock_fd);
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s': %s\n", fullpath, strerror(ENAMETOOLONG));
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    if (access(object, F_OK) == 0) {
+        unlink(tmp_path);
+        printf("File '%s' is a duplicate of stored object %s\n", fullpath, hash);
+    } else if (createDir(bucket) != 0 || rename(tmp_path, object) < 0) {
+        perror("Store rename error");
+        unlink(tmp_path);
+    }
+    rc = linkObject(dir, hash, fullpath);
+    if (rc != 0) {
+        releaseObject(dir, hash);
+    }
+    unlockObjectStore(lock_fd);
 
-            // Redirect the tar output to the write end of the pipe
-            dup2(pipefd[1], STDOUT_FILENO);
-            close(pipefd[1]);
+    if (rc != 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s'\n", fullpath);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(path_index.suffix));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
+}
 
-            // Create tar of .c files in smain directory and output it to stdout
-            snprintf(command, BUF_SIZE, "cd %s && tar -cvf - $(find . -type f -name '*.c')", cwd);
+// Function to handle OP_LINK: store fullpath without its body when the body's hash is already stored
+// Answers STATUS_MISSING when it is not, so the client falls back to a normal upload
+int linkCommandExecution(const char *filename, const char *fullpath, uint64_t payload_len, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    char dir[PATH_MAX];
+    char hash[STORE_HASH_LEN + 1];
+    int lock_fd;
+    int rc = 1;
 
-            // Execute the tar command
-            execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    if (payload_len != STORE_HASH_LEN) {
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Invalid link request\n");
+    }
+    if (recvAll(client_sock, hash, STORE_HASH_LEN) < 0) {
+        return -1;
+    }
+    hash[STORE_HASH_LEN] = '\0';
+    if (strspn(hash, "0123456789abcdef") != STORE_HASH_LEN) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Invalid link request\n");
+    }
 
-            // If execl fails
-            perror("execl error");
-            exit(EXIT_FAILURE);
-        } else {
-            // Parent process: read the tar output from the pipe and send it over the socket
-            close(pipefd[1]);  // Close the write end of the pipe
+    if (dedup_mode && openObjectStore(dir, sizeof(dir)) == 0 && (lock_fd = lockObjectStore(dir)) >= 0) {
+        rc = linkObject(dir, hash, fullpath);
+        unlockObjectStore(lock_fd);
+    }
+    if (rc == 1) {
+        return sendEnd(client_sock, request_id, STATUS_MISSING, "Content is not stored yet\n");
+    } else if (rc < 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s': %s\n", fullpath, strerror(errno));
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    printf("File '%s' linked to stored object %s\n", fullpath, hash);
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(path_index.suffix));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
+}
 
-            char buffer[BUF_SIZE];
-            ssize_t n;
+// Function to drop objects no path links to any more and uploads left behind by a crash
+void sweepObjectStore(void) {
+    char dir[PATH_MAX];
+    char sub[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *entry, *object;
+    struct stat st;
+    DIR *top, *bucket;
+    int lock_fd;
+    int removed = 0;
 
-            // Read the tar output and send it to the client
-            while ((n = read(pipefd[0], buffer, BUF_SIZE)) > 0) {
-                if (send(client_sock, buffer, n, 0) == -1) {
-                    perror("send error");
-                    break;
-                }
+    if (openObjectStore(dir, sizeof(dir)) < 0 || (lock_fd = lockObjectStore(dir)) < 0) {
+        return;
+    }
+    if ((top = opendir(dir)) != NULL) {
+        while ((entry = readdir(top)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            if (snprintf(sub, sizeof(sub), "%s/%s", dir, entry->d_name) >= (int)sizeof(sub)) {
+                continue;
+            }
+            if (strncmp(entry->d_name, "upload-", 7) == 0) {
+                removed += unlink(sub) == 0;
+                continue;
+            }
+            if ((bucket = opendir(sub)) == NULL) {
+                continue;
             }
-            if (n < 0) {
-                perror("read error");
+            while ((object = readdir(bucket)) != NULL) {
+                if (snprintf(path, sizeof(path), "%s/%s", sub, object->d_name) >= (int)sizeof(path)) {
+                    continue;
+                }
+                if (object->d_name[0] != '.' && lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+                    removed += unlink(path) == 0;
+                }
             }
-            close(pipefd[0]);  // Close the read end of the pipe
-            wait(NULL);  // Wait for the child process to finish
+            closedir(bucket);
         }
+        closedir(top);
+    }
+    unlockObjectStore(lock_fd);
+    printf("Content store: %d unreferenced files removed\n", removed);
+}
 
-        // Properly shut down the connection after sending all data
-        shutdown(client_sock, SHUT_WR);
-        printf("Tar file sent to client.\n");
+// Function to work out which bytes of a file a dfile range asks for
+// The range is "first-[last]", optionally followed by "@<sec>.<nsec>", the mtime of the copy the
+// client already holds part of. When that copy is out of date the whole file is sent instead.
+// Returns 0, -1 if the range is malformed, or -2 if it starts past the end of the file
+int parseByteRange(const char *range, const struct stat *st, uint64_t *offset, uint64_t *length) {
+    uint64_t size = st->st_size;
+    unsigned long long first, last = UINT64_MAX;
+    long long sec;
+    long nsec;
+    char *end;
 
-    } 
-    // Check if the file type is .pdf
-    else if (strcmp(filetype, ".pdf") == 0) {
-        // Handle .pdf file type by requesting the tar archive from Spdf server and sending it to the client
-        requestFileFromServer("pdf.tar", "127.0.0.1", 9801, client_sock);
-        printf("The .pdf tar file received from the Spdf server has been forwarded to the client.\n");
+    *offset = 0;
+    *length = size;
+    if (range == NULL || range[0] == '\0') {
+        return 0;
+    }
+    if (*range < '0' || *range > '9') {
+        return -1;
+    }
+    errno = 0;
+    first = strtoull(range, &end, 10);
+    if (*end != '-' || errno != 0) {
+        return -1;
+    }
+    range = end + 1;
+    if (*range >= '0' && *range <= '9') {
+        last = strtoull(range, &end, 10);
+        if (last < first || errno != 0) {
+            return -1;
+        }
+        range = end;
+    }
+    if (*range == '@') {
+        sec = strtoll(range + 1, &end, 10);
+        if (*end != '.') {
+            return -1;
+        }
+        nsec = strtol(end + 1, &end, 10);
+        if (*end != '\0') {
+            return -1;
+        }
+        if (sec != (long long)st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec) {
+            return 0;
+        }
+    } else if (*range != '\0') {
+        return -1;
+    }
+    if (first > size) {
+        return -2;
+    }
+    *offset = first;
+    *length = (last >= size ? size : last + 1) - first;
+    return 0;
+}
 
-    } 
-    // Check if the file type is .txt
-    else if (strcmp(filetype, ".txt") == 0) {
-        // Handle .txt file type by requesting the tar archive from Stext server and sending it to the client
-        requestFileFromServer("text.tar", "127.0.0.1", 9800, client_sock);
-        printf("The .txt tar file received from the Stext server has been forwarded to the client.\n");
+// Function to check the validator of a conditional dfile against the stored file
+// The client's copy is current when its size and mtime match. With the same size and another
+// mtime, as the copies of a replicated file have, the hashes are compared: the content store
+// keeps it, other files are hashed, which only costs a local read. fd -1 skips the hash check
+int copyIsCurrent(const char *validator, const struct stat *st, int fd) {
+    unsigned long long size;
+    long long sec;
+    long nsec;
+    char hash[STORE_HASH_LEN + 1];
+    const char *client_hash = strchr(validator, '#');
 
-    } else {
-        printf("Unsupported file type\n");
+    if (sscanf(validator, "%llu@%lld.%ld", &size, &sec, &nsec) != 3 || size != (unsigned long long)st->st_size) {
+        return 0;
+    }
+    if (sec == (long long)st->st_mtim.tv_sec && nsec == st->st_mtim.tv_nsec) {
+        return 1;
+    }
+    if (client_hash == NULL || fd < 0 || strlen(client_hash + 1) != STORE_HASH_LEN) {
+        return 0;
+    }
+    if (fgetxattr(fd, STORE_XATTR, hash, STORE_HASH_LEN) != STORE_HASH_LEN && hashOpenFile(fd, hash) < 0) {
+        return 0;
     }
+    return memcmp(client_hash + 1, hash, STORE_HASH_LEN) == 0;
 }
 
-// Function to request a list of files from servers
-void requestFileListFromServer(const char *server_ip, int server_port, const char *command, const char *subdir, char *file_list) {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUF_SIZE];
+// Function to compute the SHA-256 of an open file in hex, without moving its offset
+// hash must have room for STORE_HASH_LEN characters and the NUL
+int hashOpenFile(int fd, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i, digest_len;
+    EVP_MD_CTX *ctx;
+    char *buffer;
+    off_t offset = 0;
     ssize_t n;
 
-    // Create a socket to connect to servers
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return;
+    buffer = malloc(STORE_BUF_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL) {
+        free(buffer);
+        EVP_MD_CTX_free(ctx);
+        return -1;
     }
-    // Set up the address structure for the servers
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sock);
-        return;
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    while ((n = pread(fd, buffer, STORE_BUF_SIZE, offset)) > 0) {
+        EVP_DigestUpdate(ctx, buffer, n);
+        offset += n;
     }
-    // Connect to the servers
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return;
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+    if (n < 0) {
+        return -1;
+    }
+    for (i = 0; i < digest_len; i++) {
+        sprintf(hash + i * 2, "%02x", digest[i]);
     }
+    return 0;
+}
 
-    // Send the display command with the directory path to the servers
-    snprintf(buffer, BUF_SIZE, "%s %s", command, subdir);
-    send(sock, buffer, strlen(buffer), 0);
+// Function to send the requested bytes of an open file as one data frame
+// The frame name tells the client where the bytes belong: "<offset>/<file size>@<sec>.<nsec>"
+// With DFILE_IF_MATCH the range is the validator of the client's copy, and the whole file is
+// sent only when that copy is out of date
+int sendFileRange(int client_sock, uint32_t request_id, int fd, const struct stat *st, const char *range, uint32_t param) {
+    char content_range[BUF_SIZE];
+    uint64_t offset, length;
+    int rc;
 
-    // Receive the file list from the servers and append it to file_list
-    while ((n = recv(sock, buffer, BUF_SIZE, 0)) > 0) {
-        buffer[n] = '\0';  // Ensure null-terminated string
-        strcat(file_list, buffer);
+    if (param & DFILE_IF_MATCH) {
+        if (copyIsCurrent(range, st, fd)) {
+            return sendEnd(client_sock, request_id, STATUS_NOT_MODIFIED, NULL);
+        }
+        range = NULL;
+    }
+    rc = parseByteRange(range, st, &offset, &length);
+    if (rc == -1) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid byte range.\n");
+    } else if (rc == -2) {
+        return sendEnd(client_sock, request_id, STATUS_RANGE, "Error: the requested range starts past the end of the file.\n");
+    }
+    snprintf(content_range, sizeof(content_range), "%llu/%llu@%lld.%09ld", (unsigned long long)offset,
+             (unsigned long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+    // In the event loop a large body is written by the loop, not by this worker
+    if (event_conn && event_conn->sock == client_sock && length >= EVENT_OFFLOAD_MIN) {
+        return queueEventBody(event_conn, request_id, content_range, fd, NULL, offset, length);
+    }
+    // Corked, the frame header, the file and the END frame leave in full segments
+    setCork(client_sock, 1);
+    if (sendFrame(client_sock, OP_DATA, request_id, 0, content_range, NULL, length) < 0) {
+        perror("Send error");
+        rc = -1;
+    } else if (sendFileContents(client_sock, fd, offset, length) < 0) {
+        // The frame promised length bytes, so a short send leaves the connection unusable
+        rc = -1;
+    } else {
+        rc = sendEnd(client_sock, request_id, STATUS_OK, NULL);
     }
+    setCork(client_sock, 0);
+    return rc;
+}
+
+// Function to find the files of a resumable upload under the server's state directory
+// Returns 0, or -1 if the upload id is not valid or there is no state directory
+int uploadPaths(const char *upload_id, char *part_path, char *record_path, size_t size) {
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    size_t len = strlen(upload_id);
 
-    close(sock);
+    if (!home || len != UPLOAD_ID_LEN || strspn(upload_id, "0123456789abcdef") != len) {
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s/%s/%s", home, STATE_DIR, SERVER_NAME, UPLOAD_DIR);
+    if (createDir(dir) != 0) {
+        return -1;
+    }
+    snprintf(part_path, size, "%s/%s.part", dir, upload_id);
+    snprintf(record_path, size, "%s/%s.offset", dir, upload_id);
+    return 0;
 }
 
-// Function to collect files of a specific type from a directory
-void collectFiles(const char *directory, const char *filetype, char *output) {
-    char cmd[BUF_SIZE];
-    FILE *fp;
+// Function to read the committed offset of an upload, 0 if nothing was committed yet
+uint64_t readUploadOffset(const char *record_path) {
+    char text[32];
+    ssize_t n;
+    int fd;
 
-    // Construct the find command to find files of the specified type in the directory
-    snprintf(cmd, sizeof(cmd), "find %s -type f -name '*%s'", directory, filetype); 
+    if ((fd = open(record_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    text[n] = '\0';
+    return strtoull(text, NULL, 10);
+}
 
-    // Execute the command and open a pipe to read its output
-    fp = popen(cmd, "r");
-    if (fp == NULL) {
-        perror("Failed to run command");
-        return;
+// Function to record the committed offset of an upload, replacing the old record in one step
+int writeUploadOffset(const char *record_path, uint64_t offset) {
+    char tmp_path[PATH_MAX + 8];
+    char text[32];
+    int len;
+    int rc;
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", record_path);
+    len = snprintf(text, sizeof(text), "%llu\n", (unsigned long long)offset);
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
     }
-    // Read the output of the command and append it to the output buffer
-    while (fgets(cmd, sizeof(cmd), fp) != NULL) {
-        strcat(output, cmd);
+    rc = writeAll(fd, text, len);
+    if (rc == 0) {
+        rc = fdatasync(fd);
     }
+    close(fd);
+    if (rc == 0) {
+        rc = rename(tmp_path, record_path);
+    }
+    return rc;
+}
 
-    pclose(fp);
+// Function to end an upload request with the committed offset in the frame name
+int sendUploadOffset(int client_sock, uint32_t request_id, uint32_t status, uint64_t offset) {
+    char text[32];
+
+    snprintf(text, sizeof(text), "%llu", (unsigned long long)offset);
+    return sendFrame(client_sock, OP_END, request_id, status, text, NULL, 0);
 }
 
-void displayCommandExecution(const char *pathname, int client_sock) {
-    char c_files[BUF_SIZE * 10] = {0};  // Buffer for .c files
-    char pdf_files[BUF_SIZE * 10] = {0};  // Buffer for .pdf files
-    char txt_files[BUF_SIZE * 10] = {0};  // Buffer for .txt files
-    char combined_files[BUF_SIZE * 30] = {0};  // Combined buffer
-    char spdf_path[BUF_SIZE];
-    char stext_path[BUF_SIZE];
+// Function to handle OP_UQUERY: tell the client how much of an upload is already committed
+int uqueryCommandExecution(const char *upload_id, const char *fullpath, uint32_t request_id, int client_sock) {
+    char part_path[PATH_MAX];
+    char record_path[PATH_MAX];
+    uint64_t offset;
 
-    // Collect .c files from the provided directory
-    collectFiles(pathname, ".c", c_files);
+    if (uploadPaths(upload_id, part_path, record_path, sizeof(part_path)) < 0) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid upload id.\n");
+    }
+    offset = readUploadOffset(record_path);
+    printf("Upload %s of '%s' is at %llu bytes\n", upload_id, fullpath, (unsigned long long)offset);
+    return sendUploadOffset(client_sock, request_id, STATUS_OK, offset);
+}
 
-    // Copy the original path to spdf_path and handle both "/smain" and "/smain/"
-    strncpy(spdf_path, pathname, sizeof(spdf_path));
-    spdf_path[sizeof(spdf_path) - 1] = '\0'; // Ensure null termination
-    char *replace_spdf = strstr(spdf_path, "/smain");
-    if (replace_spdf) {
-        // Check if the path ends with "/smain" and not "/smain/"
-        if (replace_spdf[strlen(replace_spdf) - 1] == '/') {
-            snprintf(replace_spdf, BUF_SIZE - (replace_spdf - spdf_path), "/spdf/%s", replace_spdf + strlen("/smain/"));
-        } else {
-            snprintf(replace_spdf, BUF_SIZE - (replace_spdf - spdf_path), "/spdf%s", replace_spdf + strlen("/smain"));
-        }
+// Function to add a byte range of a parallel upload to its record once the range is on disk
+// The ranges of one upload are written side by side, so each is recorded with a single append
+int recordUploadRange(const char *ranges_path, uint64_t offset, uint64_t length) {
+    char text[64];
+    int len, rc, fd;
+
+    len = snprintf(text, sizeof(text), "%llu %llu\n", (unsigned long long)offset, (unsigned long long)length);
+    if ((fd = open(ranges_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        return -1;
     }
+    rc = writeAll(fd, text, len);
+    close(fd);
+    return rc;
+}
 
-    // Debug: Print the transformed path for Spdf
-    printf("Transformed path to send to Spdf: %s\n", spdf_path);
+// Function to check that the recorded byte ranges of a parallel upload leave no hole in [0, size)
+// Returns 1 if they cover it, 0 if not
+int uploadRangesCover(const char *ranges_path, uint64_t size) {
+    struct uploadRange *ranges = NULL, *grown;
+    unsigned long long start, length;
+    size_t count = 0, capacity = 0, i;
+    uint64_t covered = 0;
+    FILE *record;
 
-    // Collect .pdf files from Spdf directory
-    requestFileListFromServer("127.0.0.1", 9801, "display", spdf_path, pdf_files);
+    if ((record = fopen(ranges_path, "re")) == NULL) {
+        return size == 0;
+    }
+    while (fscanf(record, "%llu %llu", &start, &length) == 2) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            if ((grown = realloc(ranges, capacity * sizeof(*ranges))) == NULL) {
+                break;
+            }
+            ranges = grown;
+        }
+        ranges[count].start = start;
+        ranges[count].end = start + length;
+        count++;
+    }
+    fclose(record);
 
-    // Copy the original path to stext_path and handle both "/smain" and "/smain/"
-    strncpy(stext_path, pathname, sizeof(stext_path));
-    stext_path[sizeof(stext_path) - 1] = '\0'; // Ensure null termination
-    char *replace_stext = strstr(stext_path, "/smain");
-    if (replace_stext) {
-        // Check if the path ends with "/smain" and not "/smain/"
-        if (replace_stext[strlen(replace_stext) - 1] == '/') {
-            snprintf(replace_stext, BUF_SIZE - (replace_stext - stext_path), "/stext/%s", replace_stext + strlen("/smain/"));
-        } else {
-            snprintf(replace_stext, BUF_SIZE - (replace_stext - stext_path), "/stext%s", replace_stext + strlen("/smain"));
+    if (count > 0) {
+        qsort(ranges, count, sizeof(*ranges), compareUploadRanges);
+    }
+    for (i = 0; i < count && ranges[i].start <= covered; i++) {
+        if (ranges[i].end > covered) {
+            covered = ranges[i].end;
         }
     }
+    free(ranges);
+    return covered >= size;
+}
+
+int compareUploadRanges(const void *a, const void *b) {
+    const struct uploadRange *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Function to handle OP_UCHUNK: append one chunk of a resumable upload and checkpoint it
+// The chunk must start at or before the committed offset; the file is cut back to where it
+// starts, which drops bytes left from a chunk that never completed and lets a copy that got
+// ahead of the others continue with them. With UCHUNK_AT the chunk is one byte range of a parallel
+// upload instead, written in place alongside the others and noted in the upload's ranges
+// record. The last chunk moves the finished file into place
+int uchunkCommandExecution(const char *chunk, const char *fullpath, uint32_t param, uint64_t payload_len, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    char upload_id[BUF_SIZE];
+    char part_path[PATH_MAX];
+    char record_path[PATH_MAX];
+    char ranges_path[PATH_MAX + 8];
+    char old_hash[STORE_HASH_LEN + 1];
+    char dest_dir[BUF_SIZE];
+    char dir[PATH_MAX];
+    uint64_t offset, committed, done = 0;
+    int positional = (param & UCHUNK_AT) != 0;
+    const char *at = strrchr(chunk, '@');
+    const char *filename = strrchr(fullpath, '/') ? strrchr(fullpath, '/') + 1 : fullpath;
+    char *buffer;
+    ssize_t n;
+    int fd, body_fd, rc;
 
-    // Debug: Print the transformed path for Stext
-    printf("Transformed path to send to Stext: %s\n", stext_path);
+    snprintf(upload_id, sizeof(upload_id), "%.*s", at ? (int)(at - chunk) : 0, chunk);
+    if (at == NULL || uploadPaths(upload_id, part_path, record_path, sizeof(part_path)) < 0) {
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid upload id.\n");
+    }
+    offset = strtoull(at + 1, NULL, 10);
+    snprintf(ranges_path, sizeof(ranges_path), "%s.ranges", part_path);
 
-    // Collect .txt files from Stext directory
-    requestFileListFromServer("127.0.0.1", 9800, "display", stext_path, txt_files);
+    // Requests for the same upload are serialised on the partial file, except the byte ranges
+    // of a parallel upload, which never overlap
+    if ((fd = open(part_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 || (buffer = malloc(UPLOAD_BUF_SIZE)) == NULL) {
+        perror("Upload open error");
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+    }
+    flock(fd, positional && !(param & UCHUNK_LAST) ? LOCK_SH : LOCK_EX);
+    committed = positional ? offset : readUploadOffset(record_path);
+    if (offset < committed) {
+        committed = offset;
+    }
+    if (offset != committed || (!positional && ftruncate(fd, committed) < 0)) {
+        free(buffer);
+        close(fd);
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendUploadOffset(client_sock, request_id, STATUS_RANGE, committed);
+    }
+    if (!positional) {
+        // The truncated file no longer holds what a parallel attempt recorded
+        unlink(ranges_path);
+    }
 
-    // Combine all lists into one
-    strcat(combined_files, c_files);
-    strcat(combined_files, pdf_files);
-    strcat(combined_files, txt_files);
+    while (done < payload_len) {
+        n = recv(client_sock, buffer, payload_len - done < UPLOAD_BUF_SIZE ? payload_len - done : UPLOAD_BUF_SIZE, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The next attempt starts again from the last checkpoint
+            printf("Upload %s interrupted at %llu bytes\n", upload_id, (unsigned long long)(committed + done));
+            free(buffer);
+            close(fd);
+            return -1;
+        }
+        if (pwrite(fd, buffer, n, committed + done) != n) {
+            perror("Upload write error");
+            free(buffer);
+            close(fd);
+            if (drainPayload(client_sock, payload_len - done - n) < 0) {
+                return -1;
+            }
+            return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+        }
+        done += n;
+    }
+    free(buffer);
 
-    // Send the combined list to the client
-    send(client_sock, combined_files, strlen(combined_files), 0);
+    // The chunk only counts once it is on disk. Its checkpoint is always synced, so the data is
+    // synced before it even with --durability none, or a crash could leave a checkpoint that
+    // vouches for bytes the partial file never got
+    if ((durability_mode == DURABILITY_NONE ? fdatasync(fd) : commitFile(fd)) < 0 || (!positional && writeUploadOffset(record_path, committed + done) < 0) ||
+        (positional && done > 0 && recordUploadRange(ranges_path, committed, done) < 0)) {
+        perror("Upload checkpoint error");
+        close(fd);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+    }
+    if (!(param & UCHUNK_LAST)) {
+        close(fd);
+        return sendUploadOffset(client_sock, request_id, STATUS_OK, committed + done);
+    }
+    // A parallel upload is finished by a last chunk at the end of the file, once the ranges
+    // written before it leave no hole
+    struct stat st;
+    if (positional && (fstat(fd, &st) < 0 || (uint64_t)st.st_size != committed + done ||
+                       !uploadRangesCover(ranges_path, committed + done))) {
+        close(fd);
+        unlink(part_path);
+        unlink(ranges_path);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the upload is incomplete.\n");
+    }
 
-    // Properly close the write side of the socket to signal end of data
-    shutdown(client_sock, SHUT_WR);
+    // Move the finished file into place; a stored file it replaces gives up its reference
+    snprintf(dest_dir, BUF_SIZE, "%s", fullpath);
+    if (strrchr(dest_dir, '/') != NULL) {
+        *strrchr(dest_dir, '/') = '\0';
+        createDir(dest_dir);
+    }
+    // In dedup mode the finished file goes into the content store like a whole upload
+    if (dedup_mode) {
+        if ((body_fd = open(part_path, O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("Upload open error");
+            close(fd);
+            return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+        }
+        rc = ufileIntoStore(filename, fullpath, body_fd, committed + done, request_id, client_sock);
+        close(body_fd);
+        unlink(part_path);
+        unlink(record_path);
+        unlink(ranges_path);
+        close(fd);
+        printf("Upload %s of '%s' completed, %llu bytes\n", upload_id, fullpath, (unsigned long long)(committed + done));
+        return rc;
+    }
+    int replaced = storedHash(fullpath, old_hash) == 0;
+    if (rename(part_path, fullpath) < 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s': %s\n", fullpath, strerror(errno));
+        close(fd);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    close(fd);
+    unlink(record_path);
+    unlink(ranges_path);
+    if (replaced && openObjectStore(dir, sizeof(dir)) == 0) {
+        int lock_fd = lockObjectStore(dir);
+        if (lock_fd >= 0) {
+            releaseObject(dir, old_hash);
+            unlockObjectStore(lock_fd);
+        }
+    }
+    // Like finishUpload, the new name is only durable once the directory holding it is
+    if (commitDirectory(fullpath) < 0) {
+        perror("File commit error");
+        snprintf(response, BUF_SIZE, "Error: storing '%s' failed: %s\n", fullpath, strerror(errno));
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(path_index.suffix));
+    printf("Upload %s of '%s' completed, %llu bytes\n", upload_id, fullpath, (unsigned long long)(committed + done));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
 }
 
-// Function to expand ~ to the user's home directory
-void tildePathOperation(char *path, char *expanded_path, size_t size) {
-    if (path[0] == '~') {
-        const char *home_dir = getenv("HOME");
-        if (!home_dir) {
-            struct passwd *pw = getpwuid(getuid());
-            home_dir = pw->pw_dir;
+// Function to drop resumable uploads nobody continued within UPLOAD_EXPIRY seconds
+void expireUploads(void) {
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    time_t now = time(NULL);
+    DIR *uploads;
+
+    if (!home) {
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s/%s/%s", home, STATE_DIR, SERVER_NAME, UPLOAD_DIR);
+    if ((uploads = opendir(dir)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(uploads)) != NULL) {
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) {
+            continue;
+        }
+        if (entry->d_name[0] != '.' && lstat(path, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > UPLOAD_EXPIRY) {
+            unlink(path);
         }
-        snprintf(expanded_path, size, "%s%s", home_dir, path + 1);
-    } else {
-        snprintf(expanded_path, size, "%s", path);
     }
-} 
\ No newline at end of file
+    closedir(uploads);
+}
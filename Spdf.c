@@ -4,34 +4,393 @@
 // Parvathi Puthedath Joshy -110146653
 // Ardra Sanjiv Kumar - 110129179
 //------------------------------------------------------------------
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <zlib.h>
+#include <openssl/evp.h>
 
 #define PORT 9801
 #define BUF_SIZE 1024
+#define SERVER_NAME "spdf"
+#define STATE_DIR ".dfs"  // per-server state under $HOME, outside the served trees
+#define SENDFILE_CHUNK (16 * 1024 * 1024)  // largest single sendfile() call
 
-void handleCommandsfromClient(int client_sock);
-void rmfileCommandExecution(const char *filename, int client_sock);
-void ufileCommandExecution(const char *filename, const char *dest_path, const char *file_content, int client_sock);
+// Transfer chunks: --chunk-size fixes the buffer bodies are moved through, otherwise small
+// transfers use small buffers and large ones fewer, bigger system calls
+#define CHUNK_SMALL (64 * 1024)      // transfers up to CHUNK_SMALL_FILE bytes
+#define CHUNK_MEDIUM (256 * 1024)
+#define CHUNK_LARGE (1024 * 1024)    // transfers past CHUNK_LARGE_FILE bytes
+#define CHUNK_SMALL_FILE (1024 * 1024)
+#define CHUNK_LARGE_FILE (64 * 1024 * 1024)
+#define CHUNK_KB_MAX 16384
+#define SOCKET_BUFFER_KB_MAX 65536
+
+// Worker models for serving Smain connections
+#define MODEL_FORK 0
+#define MODEL_PREFORK 1
+#define MODEL_THREADS 2
+#define DEFAULT_QUEUE_SIZE 128
+#define EPOLL_MAX_EVENTS 64
+
+// Framed protocol shared by client24s, Smain, Spdf and Stext.
+// Every message starts with a fixed header in network byte order:
+//   magic(2) version(1) opcode(1) request_id(4) param(4) name_len(2) path_len(2) payload_len(8)
+// followed by name_len bytes of name, path_len bytes of path and payload_len bytes of payload.
+// A request is answered by zero or more OP_DATA frames and exactly one OP_END frame.
+#define PROTO_MAGIC 0x4446
+#define PROTO_VERSION 1
+#define FRAME_HEADER_SIZE 24
+
+#define OP_UFILE 1    // name = file name, path = destination directory, payload = file body
+#define OP_DFILE 2    // path = file to download, name = optional byte range (see parseByteRange), or the validator with DFILE_IF_MATCH
+#define OP_RMFILE 3   // path = file to remove
+#define OP_DISPLAY 4  // path = directory to list, name = cursor (list after this path), param = page size (0 = all)
+#define OP_DTAR 5     // name = file type, param = compression (DTAR_PARAM)
+#define OP_LINK 6     // name = file name, path = destination directory, payload = SHA-256 of the body in hex
+#define OP_UQUERY 7   // name = upload id, path = destination file; the END name is the committed offset
+#define OP_UCHUNK 8   // name = "<upload id>@<offset>", path = destination file, param = UCHUNK_LAST on the last chunk
+#define OP_DATA 64    // payload = a piece of the response body
+#define OP_END 65     // param = status, payload = message for the user, name = display cursor of the next page
+
+#define STATUS_OK 0
+#define STATUS_ERROR 1
+#define STATUS_MISSING 2  // OP_LINK: the body is not stored, upload it with OP_UFILE
+#define STATUS_RANGE 3    // OP_DFILE: the range starts past the end of the file; OP_UCHUNK: wrong offset
+#define STATUS_NOT_MODIFIED 4  // OP_DFILE with DFILE_IF_MATCH: the client's copy is current, no body follows
+
+#define UCHUNK_LAST 1  // OP_UCHUNK param: the upload is complete after this chunk
+#define UCHUNK_AT 2    // OP_UCHUNK param: write at the given offset without a checkpoint, for parallel streams
+
+#define DFILE_IF_MATCH 1  // OP_DFILE param: name is "<size>@<sec>.<nsec>[#<sha256>]" of the client's copy
+
+// dtar compression: codec in the low byte of param, level (0-9) in the next byte
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define DTAR_PARAM(codec, level) ((uint32_t)(codec) | ((uint32_t)(level) << 8))
+#define DTAR_CODEC(param) ((param) & 0xff)
+#define DTAR_LEVEL(param) (((param) >> 8) & 0xff)
+
+struct frameHeader {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    uint32_t param;
+    uint16_t name_len;
+    uint16_t path_len;
+    uint64_t payload_len;
+};
+
+// Native tar writer used by dtar
+#define TAR_BLOCK_SIZE 512
+#define TAR_HEADER_MAX (TAR_BLOCK_SIZE * 12)  // pax extended header plus the ustar header
+#define TAR_READAHEAD 8                       // files opened and prefetched ahead of the one being sent
+#define TAR_SMALL_FILE (64 * 1024)            // files up to this size are copied into the output buffer
+#define TAR_OUT_BUF_SIZE (512 * 1024)         // headers and small files are batched into sends of this size
+#define COMPRESS_BUF_SIZE (256 * 1024)        // input and output chunk of the gzip stage
+
+// In-memory index of the stored files, used by display and the dfile/rmfile existence checks
+#define INDEX_INITIAL_CAP 1024
+#define INDEX_BATCH_SIZE (64 * 1024)  // display data frame size
+
+// Content store used by --dedup: every stored path is a hard link to $HOME/.dfs/<server>/objects/<hash>
+#define STORE_DIR "objects"
+#define STORE_XATTR "user.dfs.sha256"  // hash of the object, shared by all of its links
+#define STORE_HASH_LEN 64                 // SHA-256 in hex
+#define STORE_BUF_SIZE (64 * 1024)
+
+// Resumable uploads: the partial file and its committed offset live under $HOME/.dfs/<server>/uploads
+#define UPLOAD_DIR "uploads"
+#define UPLOAD_ID_LEN 64                   // SHA-256 in hex, chosen by the client
+#define UPLOAD_BUF_SIZE (64 * 1024)
+#define UPLOAD_EXPIRY (7 * 24 * 60 * 60)   // seconds an unfinished upload is kept
+
+// Durability of stored uploads: the body goes to a temporary file next to its final name, is
+// made durable as the mode asks and is renamed over the final name, so a crash never leaves a
+// partial file under that name
+#define DURABILITY_NONE 0   // the page cache writes the file back in its own time
+#define DURABILITY_FSYNC 1  // every file is synced before it is acknowledged
+#define DURABILITY_GROUP 2  // concurrent uploads share one sync
+#define GROUP_COMMIT_MS 5   // longest a group commit waits for the uploads that usually join it
+
+// One regular file found by the tar walk
+struct tarEntry {
+    char *name;         // path inside the archive, e.g. "./a/x.c"
+    uint64_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    size_t header_len;  // bytes of header blocks in front of the file body
+};
+
+struct tarList {
+    struct tarEntry *entries;
+    size_t count;
+    size_t cap;
+};
+
+// Raw tar input of the compression stage: a finished archive file, or a list to build from
+struct tarSource {
+    int archive_fd;  // -1 when the archive is built from list
+    uint64_t size;
+    int root_fd;
+    struct tarList *list;
+    int out_fd;      // write end of the pipe to the compressor
+    int rc;          // result of the producer thread
+};
+
+// Sorted full paths of every .pdf file under root, so the files of a directory are one range
+struct pathIndex {
+    char root[PATH_MAX];
+    const char *suffix;
+    char **paths;
+    size_t count;
+    size_t cap;
+    int valid;            // 0 until built, or after a change the index could not follow
+    uint64_t generation;  // tar cache generation the index matches
+    int stamp_fd;         // tar cache stamp, read to notice changes made by other processes
+    pthread_rwlock_t lock;
+};
+
+static struct pathIndex path_index = {
+    .suffix = ".pdf", .stamp_fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// Bounded queue of connections with a request waiting for a worker thread
+struct connQueue {
+    int *fds;
+    int capacity;
+    int head;
+    int tail;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+// A byte range a parallel upload has written, as read back from its record
+struct uploadRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+// A file waiting for the group commit thread to make it durable
+struct commitRequest {
+    int fd;
+    dev_t dev;
+    int rc;
+    int done;
+    struct commitRequest *next;
+};
+
+// Files waiting for the next group commit, shared by the uploads of one process
+struct groupCommit {
+    struct commitRequest *pending;
+    int count;    // requests pending
+    int running;
+    pthread_once_t started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // the commit thread has work
+    pthread_cond_t done;  // a commit finished
+};
+
+static int dedup_mode = 0;  // store uploads once per distinct content
+static int durability_mode = DURABILITY_NONE;
+static int group_commit_ms = GROUP_COMMIT_MS;
+static size_t transfer_chunk = 0;  // --chunk-size, 0 sizes the chunks by the transfer
+static int socket_buffer = 0;      // --socket-buffer in bytes, 0 leaves the sizes to the kernel
+static struct groupCommit group_commit = {
+    .started = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+static int server_port = PORT;
+static const char *server_root = SERVER_NAME;  // directory under $HOME, and name of the state directory
+
+static struct connQueue conn_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER
+};
+static int conn_epoll = -1;  // thread model: connections waiting for their next request
+
+void runForkModel(int server_sock);
+void runPreforkModel(int server_sock, int workers);
+void preforkWorker(int server_sock);
+void runThreadModel(int server_sock, int workers, int queue_size);
+void *connWorker(void *arg);
+void armConnection(int client_sock);
+void serveConnection(int client_sock);
+int handleCommandsfromClient(int client_sock);
+int rmfileCommandExecution(const char *filename, uint32_t request_id, int client_sock);
+int ufileCommandExecution(uint8_t opcode, const char *filename, const char *dest_path, uint64_t file_size, uint32_t request_id, int client_sock);
 int createDir(const char *path);
-void dfileCommandExecution(const char *filename, int client_sock);
-void dtarCommandExecution(int client_sock);
-void displayCommandExecution(const char *directory, int client_sock);
+int dfileCommandExecution(const char *filename, const char *range, uint32_t param, uint32_t request_id, int client_sock);
+int dtarCommandExecution(uint32_t param, uint32_t request_id, int client_sock);
+int displayCommandExecution(const char *directory, const char *cursor, uint32_t limit, uint32_t request_id, int client_sock);
+int sendAll(int sock, const void *buf, size_t len);
+int sendAllFlags(int sock, const void *buf, size_t len, int flags);
+int recvAll(int sock, void *buf, size_t len);
+int sendFrame(int sock, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len);
+int recvFrame(int sock, struct frameHeader *hdr, char *name, char *path);
+int sendData(int sock, uint32_t request_id, const void *buf, size_t len);
+int sendEnd(int sock, uint32_t request_id, uint32_t status, const char *message);
+int drainPayload(int sock, uint64_t len);
+void setNoDelay(int sock);
+void setSocketBuffers(int sock);
+void setCork(int sock, int on);
+size_t transferChunk(uint64_t len);
+int sendFileContents(int sock, int fd, off_t offset, uint64_t len);
+int sendTarArchive(int sock, uint32_t request_id, uint32_t param, const char *root, const char *suffix);
+int sendCompressedArchive(int sock, uint32_t request_id, int level, struct tarSource *source);
+void *tarProducer(void *arg);
+int sendArchiveFile(int sock, uint32_t request_id, int fd, uint64_t size);
+int openTarCache(const char *suffix, char *cache_path, size_t size);
+uint64_t readTarGeneration(int stamp_fd);
+uint64_t invalidateTarCache(const char *suffix);
+int collectTarArchive(const char *root, const char *suffix, struct tarList *list, int *root_fd, uint64_t *total);
+int writeTarArchive(int out_fd, int root_fd, struct tarList *list);
+int collectTarEntries(int root_fd, char *rel, size_t rel_len, const char *suffix, struct tarList *list);
+int addTarEntry(struct tarList *list, const char *name, const struct stat *st);
+void freeTarList(struct tarList *list);
+size_t buildTarHeader(const struct tarEntry *entry, unsigned char *out);
+int sendTarBody(int out_fd, int fd, uint64_t size);
+int writeAll(int fd, const void *buf, size_t len);
+int storeUpload(int sock, const char *fullpath, uint64_t size, char *response, size_t response_size);
+int openUploadTemp(const char *fullpath, char *tmp_path, size_t size);
+int finishUpload(int fd, const char *tmp_path, const char *fullpath);
+int commitFile(int fd);
+int commitDirectory(const char *path);
+void startGroupCommit(void);
+void *groupCommitThread(void *arg);
+void readTarBody(int fd, char *out, uint64_t size);
+void initPathIndex(const char *root);
+int acquirePathIndex(struct pathIndex *index);
+int buildPathIndex(struct pathIndex *index);
+int walkPathIndex(struct pathIndex *index, char *path, size_t len);
+int appendIndexPath(struct pathIndex *index, const char *path);
+int comparePaths(const void *a, const void *b);
+size_t searchPathIndex(const struct pathIndex *index, const char *path);
+int indexedPath(const struct pathIndex *index, const char *path);
+int lookupPathIndex(struct pathIndex *index, const char *path);
+void updatePathIndex(struct pathIndex *index, const char *path, int present, uint64_t generation);
+struct pathIndex *openListing(const char *directory, struct pathIndex *scratch, char *prefix, size_t size);
+void closeListing(struct pathIndex *index);
+size_t fillIndexBatch(struct pathIndex *index, const char *prefix, char *last, char *batch, size_t size, size_t *limit);
+int openObjectStore(char *dir, size_t size);
+int objectPath(const char *dir, const char *hash, char *path, size_t size);
+int storedHash(const char *path, char *hash);
+int lockObjectStore(const char *dir);
+void unlockObjectStore(int lock_fd);
+void releaseObject(const char *dir, const char *hash);
+int linkObject(const char *dir, const char *hash, const char *path);
+int removeStoredFile(const char *path);
+int receiveIntoStore(int sock, uint64_t size, const char *dir, char *tmp_path, size_t tmp_size, char *hash);
+int ufileIntoStore(const char *filename, const char *fullpath, int body_fd, uint64_t file_size, uint32_t request_id, int client_sock);
+int linkCommandExecution(const char *filename, const char *fullpath, uint64_t payload_len, uint32_t request_id, int client_sock);
+void sweepObjectStore(void);
+int parseByteRange(const char *range, const struct stat *st, uint64_t *offset, uint64_t *length);
+int sendFileRange(int client_sock, uint32_t request_id, int fd, const struct stat *st, const char *range, uint32_t param);
+int copyIsCurrent(const char *validator, const struct stat *st, int fd);
+int hashOpenFile(int fd, char *hash);
+int uploadPaths(const char *upload_id, char *part_path, char *record_path, size_t size);
+uint64_t readUploadOffset(const char *record_path);
+int writeUploadOffset(const char *record_path, uint64_t offset);
+int sendUploadOffset(int client_sock, uint32_t request_id, uint32_t status, uint64_t offset);
+int uqueryCommandExecution(const char *upload_id, const char *fullpath, uint32_t request_id, int client_sock);
+int uchunkCommandExecution(const char *chunk, const char *fullpath, uint32_t param, uint64_t payload_len, uint32_t request_id, int client_sock);
+int recordUploadRange(const char *ranges_path, uint64_t offset, uint64_t length);
+int uploadRangesCover(const char *ranges_path, uint64_t size);
+int compareUploadRanges(const void *a, const void *b);
+void expireUploads(void);
 
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    pid_t child_pid;
+int main(int argc, char *argv[]) {
+    int server_sock;
+    struct sockaddr_in server_addr;
+    static struct option long_options[] = {
+        {"model", required_argument, NULL, 'm'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue", required_argument, NULL, 'q'},
+        {"dedup", no_argument, NULL, 'd'},
+        {"port", required_argument, NULL, 'P'},
+        {"root", required_argument, NULL, 'r'},
+        {"durability", required_argument, NULL, 'D'},
+        {"group-commit-ms", required_argument, NULL, 'G'},
+        {"chunk-size", required_argument, NULL, 'k'},
+        {"socket-buffer", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    int model = MODEL_FORK;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int queue_size = DEFAULT_QUEUE_SIZE;
+    int opt;
+
+    // Parse the worker model options
+    while ((opt = getopt_long(argc, argv, "m:w:q:dP:r:D:G:k:S:", long_options, NULL)) != -1) {
+        if (opt == 'm' && strcmp(optarg, "fork") == 0) {
+            model = MODEL_FORK;
+        } else if (opt == 'm' && strcmp(optarg, "prefork") == 0) {
+            model = MODEL_PREFORK;
+        } else if (opt == 'm' && strcmp(optarg, "threads") == 0) {
+            model = MODEL_THREADS;
+        } else if (opt == 'w') {
+            workers = atoi(optarg);
+        } else if (opt == 'q') {
+            queue_size = atoi(optarg);
+        } else if (opt == 'd') {
+            dedup_mode = 1;
+        } else if (opt == 'P' && atoi(optarg) > 0 && atoi(optarg) <= 65535) {
+            server_port = atoi(optarg);
+        } else if (opt == 'r' && optarg[0] && !strchr(optarg, '/') && strcmp(optarg, ".") != 0 && strcmp(optarg, "..") != 0) {
+            // Further servers of the same type on one host need their own directory
+            server_root = optarg;
+        } else if (opt == 'D' && strcmp(optarg, "none") == 0) {
+            durability_mode = DURABILITY_NONE;
+        } else if (opt == 'D' && strcmp(optarg, "fsync") == 0) {
+            durability_mode = DURABILITY_FSYNC;
+        } else if (opt == 'D' && strcmp(optarg, "group") == 0) {
+            durability_mode = DURABILITY_GROUP;
+        } else if (opt == 'G' && atoi(optarg) >= 1) {
+            group_commit_ms = atoi(optarg);
+        } else if (opt == 'k' && atoi(optarg) >= 4 && atoi(optarg) <= CHUNK_KB_MAX) {
+            transfer_chunk = (size_t)atoi(optarg) * 1024;
+        } else if (opt == 'S' && atoi(optarg) >= 0 && atoi(optarg) <= SOCKET_BUFFER_KB_MAX) {
+            socket_buffer = atoi(optarg) * 1024;
+        } else {
+            fprintf(stderr, "Usage: %s [--model fork|prefork|threads] [--workers N] [--queue N] [--dedup] [--port N] [--root NAME] [--durability none|fsync|group] [--group-commit-ms N] [--chunk-size KB] [--socket-buffer KB]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (workers <= 0) {
+        workers = 1;
+    }
+    if (queue_size <= 0) {
+        queue_size = DEFAULT_QUEUE_SIZE;
+    }
 
     // Create socket
     if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -39,9 +398,14 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    // Allow an immediate restart while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setSocketBuffers(server_sock);
+
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(server_port);
 
     // Bind socket to address and port
     if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
@@ -51,13 +415,47 @@ int main() {
     }
 
     // Listen for connections
-    if (listen(server_sock, 10) < 0) {
+    if (listen(server_sock, SOMAXCONN) < 0) {
         perror("Listen error");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
 
-    printf("Spdf server listening on port %d\n", PORT);
+    // A Smain connection that drops mid-transfer must not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+
+    // Index the stored .pdf files before serving any request
+    const char *home = getenv("HOME");
+    if (home) {
+        char root[PATH_MAX];
+        snprintf(root, sizeof(root), "%s/%s", home, server_root);
+        initPathIndex(root);
+    }
+    if (dedup_mode) {
+        sweepObjectStore();
+    }
+    expireUploads();
+
+    printf("Spdf server listening on port %d, storing in ~/%s\n", server_port, server_root);
+
+    if (model == MODEL_PREFORK) {
+        runPreforkModel(server_sock, workers);
+    } else if (model == MODEL_THREADS) {
+        runThreadModel(server_sock, workers, queue_size);
+    } else {
+        runForkModel(server_sock);
+    }
+
+    close(server_sock);
+    return 0;
+}
+
+// Fork one child per connection
+void runForkModel(int server_sock) {
+    int client_sock;
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    pid_t child_pid;
 
     while (1) {
         // Accept a connection
@@ -69,150 +467,334 @@ int main() {
         // Fork a child process to handle the client
         if ((child_pid = fork()) == 0) {
             close(server_sock);
-            handleCommandsfromClient(client_sock);
-            close(client_sock);
+            serveConnection(client_sock);
             exit(0);
         } else if (child_pid < 0) {
             perror("Fork error");
             close(client_sock);
         } else {
             close(client_sock);
-            waitpid(-1, NULL, WNOHANG);
+            while (waitpid(-1, NULL, WNOHANG) > 0);
         }
     }
-
-    close(server_sock);
-    return 0;
 }
 
-void handleCommandsfromClient(int client_sock) {
-    char buffer[BUF_SIZE];
-    ssize_t n;
+// Start a fixed set of processes that all accept on the listening socket
+void runPreforkModel(int server_sock, int workers) {
+    pid_t pid;
+    int i;
 
-    // Receive the command from the client
-    n = recv(client_sock, buffer, BUF_SIZE, 0);
-    if (n <= 0) {
-        if (n == 0) {
-            printf("Client disconnected before sending command\n");
-        } else {
-            perror("Recv error (command)");
+    // Non-blocking so a worker that loses the race for a connection goes back to its others
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL, 0) | O_NONBLOCK);
+
+    printf("Starting %d pre-forked workers\n", workers);
+    for (i = 0; i < workers; i++) {
+        if ((pid = fork()) == 0) {
+            preforkWorker(server_sock);
+        } else if (pid < 0) {
+            perror("Fork error");
+        }
+    }
+
+    // Replace any worker that exits so the pool keeps its size
+    while (1) {
+        pid = wait(NULL);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait error");
+            sleep(1);
+        }
+        if ((pid = fork()) == 0) {
+            preforkWorker(server_sock);
+        } else if (pid < 0) {
+            perror("Fork error");
+            sleep(1);
         }
-        close(client_sock);
-        return;
     }
-    buffer[n] = '\0';
-    printf("Received command: %s\n", buffer);
+}
 
-    // Handle the "dfile" command
-    if (strncmp(buffer, "dfile ", 6) == 0) {
-        char *received_filename = buffer + 6;
+// Serve the requests of every connection this process has accepted, one request at a time
+// Smain keeps idle connections open in its pool, so a worker waits for the next request on
+// all of them at once instead of holding on to one connection until it closes.
+void preforkWorker(int server_sock) {
+    struct epoll_event ev, events[EPOLL_MAX_EVENTS];
+    int epfd, i, n, client_sock;
 
-        // Trim any newline characters
-        received_filename[strcspn(received_filename, "\n")] = 0;
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 error");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = server_sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl error");
+        exit(EXIT_FAILURE);
+    }
 
-        // If the request is for pdf.tar, ensure it is created before sending
-        if (strcmp(received_filename, "pdf.tar") == 0) {
-            dtarCommandExecution(client_sock);
-        } else {
-            dfileCommandExecution(received_filename, client_sock);
+    while (1) {
+        n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait error");
+            }
+            continue;
         }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd != server_sock) {
+                // Closing the socket also removes it from the epoll set
+                if (handleCommandsfromClient(events[i].data.fd) <= 0) {
+                    close(events[i].data.fd);
+                }
+                continue;
+            }
+            // Take one connection per wakeup so that idle workers get their share of a burst
+            if ((client_sock = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("Accept error");
+                }
+                continue;
+            }
+            setNoDelay(client_sock);
+            ev.events = EPOLLIN;
+            ev.data.fd = client_sock;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+                perror("epoll_ctl error");
+                close(client_sock);
+            }
+        }
+    }
+}
+
+// Accept on the main thread and hand each request to a pool of worker threads
+// Connections wait in an epoll set between requests, so the connections Smain keeps open in
+// its pool only take a worker while one of their requests runs.
+void runThreadModel(int server_sock, int workers, int queue_size) {
+    struct epoll_event ev, events[EPOLL_MAX_EVENTS];
+    int client_sock;
+    int i, n;
+
+    conn_queue.fds = calloc(queue_size, sizeof(int));
+    if (!conn_queue.fds) {
+        perror("calloc error");
+        exit(EXIT_FAILURE);
+    }
+    conn_queue.capacity = queue_size;
+
+    if ((conn_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 error");
+        exit(EXIT_FAILURE);
     }
-    else if (strncmp(buffer, "dtar ", 5) == 0) {
-        // Handle the dtar command
-        dtarCommandExecution(client_sock);
+    ev.events = EPOLLIN;
+    ev.data.fd = server_sock;
+    if (epoll_ctl(conn_epoll, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl error");
+        exit(EXIT_FAILURE);
     }
-    else if (strncmp(buffer, "display", 7) == 0) {
-        char *directory = buffer + 8;
-        displayCommandExecution(directory, client_sock);
+
+    printf("Starting %d worker threads with a queue of %d requests\n", workers, queue_size);
+    for (i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, connWorker, NULL) != 0) {
+            perror("pthread_create error");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
     }
-    else if (strncmp(buffer, "rmfile ", 7) == 0) {
-        char *received_filename = buffer + 7;
-        rmfileCommandExecution(received_filename,client_sock);
-    } else {
-        // Parse ufile command
-        char *received_filename = strtok(buffer, "\n");
-        char *received_dest_path = strtok(NULL, "\n");
-        char *received_file_content = strtok(NULL, "\0");  // Capture the remaining content as file content
 
-        if (!received_filename || !received_dest_path) {
-            printf("Invalid command format\n");
+    while (1) {
+        n = epoll_wait(conn_epoll, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait error");
+            }
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            client_sock = events[i].data.fd;
+            if (client_sock == server_sock) {
+                if ((client_sock = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+                    if (errno != EINTR) {
+                        perror("Accept error");
+                    }
+                    continue;
+                }
+                setNoDelay(client_sock);
+                // One-shot so that only one worker owns the connection until it is re-armed
+                ev.events = EPOLLIN | EPOLLONESHOT;
+                ev.data.fd = client_sock;
+                if (epoll_ctl(conn_epoll, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+                    perror("epoll_ctl error");
+                    close(client_sock);
+                }
+                continue;
+            }
+
+            // Stop taking requests while the queue is full so the backlog applies back-pressure
+            pthread_mutex_lock(&conn_queue.lock);
+            while (conn_queue.count == conn_queue.capacity) {
+                pthread_cond_wait(&conn_queue.not_full, &conn_queue.lock);
+            }
+            conn_queue.fds[conn_queue.tail] = client_sock;
+            conn_queue.tail = (conn_queue.tail + 1) % conn_queue.capacity;
+            conn_queue.count++;
+            pthread_cond_signal(&conn_queue.not_empty);
+            pthread_mutex_unlock(&conn_queue.lock);
+        }
+    }
+}
+
+// Worker thread: run one request of a connection, then give the connection back to the epoll set
+void *connWorker(void *arg) {
+    int client_sock;
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&conn_queue.lock);
+        while (conn_queue.count == 0) {
+            pthread_cond_wait(&conn_queue.not_empty, &conn_queue.lock);
+        }
+        client_sock = conn_queue.fds[conn_queue.head];
+        conn_queue.head = (conn_queue.head + 1) % conn_queue.capacity;
+        conn_queue.count--;
+        pthread_cond_signal(&conn_queue.not_full);
+        pthread_mutex_unlock(&conn_queue.lock);
+
+        if (handleCommandsfromClient(client_sock) > 0) {
+            armConnection(client_sock);
+        } else {
+            // Closing the socket also removes it from the epoll set
             close(client_sock);
-            return;
         }
+    }
+    return NULL;
+}
+
+// Wait for the next request of a connection, the connection is closed if it cannot be watched
+void armConnection(int client_sock) {
+    struct epoll_event ev;
 
-        ufileCommandExecution(received_filename, received_dest_path, received_file_content, client_sock);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = client_sock;
+    if (epoll_ctl(conn_epoll, EPOLL_CTL_MOD, client_sock, &ev) < 0) {
+        perror("epoll_ctl error");
+        close(client_sock);
     }
+}
 
+// Fork model: serve one Smain connection and close it
+void serveConnection(int client_sock) {
+    setNoDelay(client_sock);
+    // Smain may send any number of requests over the same connection
+    while (handleCommandsfromClient(client_sock) > 0);
     close(client_sock);
 }
 
-void rmfileCommandExecution(const char *filename, int client_sock) {
+int handleCommandsfromClient(int client_sock) {
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    int rc;
+
+    // Receive the next request frame from Smain
+    rc = recvFrame(client_sock, &hdr, name, path);
+    if (rc <= 0) {
+        if (rc < 0) {
+            perror("Recv error (command)");
+        }
+        return rc;
+    }
+    printf("Received command: opcode %d %s %s\n", hdr.opcode, name, path);
+
+    // Option handling for dfile, dtar, display, rmfile, ufile
+    if (hdr.opcode == OP_DFILE) {
+        rc = dfileCommandExecution(path, name, hdr.param, hdr.request_id, client_sock);
+    } else if (hdr.opcode == OP_DTAR) {
+        rc = dtarCommandExecution(hdr.param, hdr.request_id, client_sock);
+    } else if (hdr.opcode == OP_DISPLAY) {
+        rc = displayCommandExecution(path, name, hdr.param, hdr.request_id, client_sock);
+    } else if (hdr.opcode == OP_RMFILE) {
+        rc = rmfileCommandExecution(path, hdr.request_id, client_sock);
+    } else if (hdr.opcode == OP_UQUERY) {
+        rc = uqueryCommandExecution(name, path, hdr.request_id, client_sock);
+    } else if (hdr.opcode == OP_UCHUNK) {
+        rc = uchunkCommandExecution(name, path, hdr.param, hdr.payload_len, hdr.request_id, client_sock);
+    } else if (hdr.opcode == OP_UFILE || hdr.opcode == OP_LINK) {
+        rc = ufileCommandExecution(hdr.opcode, name, path, hdr.payload_len, hdr.request_id, client_sock);
+    } else {
+        printf("Invalid command format\n");
+        if (drainPayload(client_sock, hdr.payload_len) < 0) {
+            return -1;
+        }
+        rc = sendEnd(client_sock, hdr.request_id, STATUS_ERROR, "Invalid command.\n");
+    }
+    return rc < 0 ? -1 : 1;
+}
+
+int rmfileCommandExecution(const char *filename, uint32_t request_id, int client_sock) {
     char response[BUF_SIZE];
+    uint32_t status = STATUS_OK;
     
-    // Perform the file deletion
-    if (remove(filename) == 0) {
+    // Perform the file deletion, unless the index already knows the file is not there
+    if (lookupPathIndex(&path_index, filename) == 0) {
+        snprintf(response, BUF_SIZE, "File deletion error: %s\n", strerror(ENOENT));
+        status = STATUS_ERROR;
+    } else if (removeStoredFile(filename) == 0) {
         snprintf(response, BUF_SIZE, "File is deleted successfully.\n");
         printf("File '%s' deleted successfully.\n", filename);
+        updatePathIndex(&path_index, filename, 0, invalidateTarCache(".pdf"));
     } else {
         snprintf(response, BUF_SIZE, "File deletion error: %s\n", strerror(errno));
+        status = STATUS_ERROR;
     }
 
     // Send the result back to Smain
-    send(client_sock, response, strlen(response), 0);
+    return sendEnd(client_sock, request_id, status, response);
 }
 
-void ufileCommandExecution(const char *filename, const char *dest_path, const char *file_content, int client_sock) {
-    char buffer[BUF_SIZE];
-    ssize_t n;
-    FILE *file;
+int ufileCommandExecution(uint8_t opcode, const char *filename, const char *dest_path, uint64_t file_size, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    int rc;
 
     // Create the directory if it doesn't exist
     if (createDir(dest_path) != 0) {
         perror("mkdir error");
-        return;
+        snprintf(response, BUF_SIZE, "Error: cannot create directory '%s': %s\n", dest_path, strerror(errno));
+        if (drainPayload(client_sock, file_size) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
     }
 
     char fullpath[BUF_SIZE];
     snprintf(fullpath, BUF_SIZE, "%s/%s", dest_path, filename);
-
-    // Open file for writing
-    if ((file = fopen(fullpath, "wb")) == NULL) {
-        perror("File open error");
-        return;
+    if (opcode == OP_LINK) {
+        return linkCommandExecution(filename, fullpath, file_size, request_id, client_sock);
+    } else if (dedup_mode) {
+        return ufileIntoStore(filename, fullpath, client_sock, file_size, request_id, client_sock);
     }
-    printf("Opened file for writing: %s\n", fullpath);
 
-    // Write the initially received file content if any
-    if (file_content) {
-        size_t content_len = strlen(file_content);
-        size_t written = fwrite(file_content, 1, content_len, file);
-        if (written != content_len) {
-            perror("fwrite error");
-            fclose(file);
-            return;
-        }
-        fflush(file);
-    }
-
-    // Receive and write additional file data
-    while ((n = recv(client_sock, buffer, BUF_SIZE, 0)) > 0) {
-        printf("Writing %ld bytes to file\n", n);  // Debug statement
-        printf("File content: %.*s\n", (int)n, buffer);  // Print file content
-        size_t written = fwrite(buffer, 1, n, file);
-        if (written != n) {
-            perror("fwrite error");
-            break;
-        }
-        fflush(file);  // Ensure data is written to the file immediately
+    // A file that shares its content with other paths is unlinked rather than overwritten
+    struct stat st;
+    if (stat(fullpath, &st) == 0 && st.st_nlink > 1) {
+        removeStoredFile(fullpath);
     }
 
-    if (n < 0) {
-        perror("Recv error (file data)");
-    } else {
-        printf("File '%s' successfully stored in directory '%s'\n", filename, dest_path);
+    // Receive exactly file_size bytes of file data into a temporary file that replaces the old
+    // one once it is complete
+    rc = storeUpload(client_sock, fullpath, file_size, response, BUF_SIZE);
+    if (rc == -1) {
+        printf("Smain disconnected before the whole file arrived\n");
+        return -1;
+    } else if (rc == -2) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
     }
-
-    fclose(file);
+    // The file was replaced, so the cached dtar archive is out of date
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(".pdf"));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    printf("File '%s' successfully stored in directory '%s'\n", filename, dest_path);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
 }
 
 int createDir(const char *path) {
@@ -239,145 +821,2259 @@ int createDir(const char *path) {
     return 0;
 }
 
-void dfileCommandExecution(const char *filename, int client_sock) {
+int dfileCommandExecution(const char *filename, const char *range, uint32_t param, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    struct stat st;
 
-    if (access(filename, F_OK) == -1) {
-        char response[BUF_SIZE];
+    int found = lookupPathIndex(&path_index, filename);
+    if (found == 0 || (found < 0 && access(filename, F_OK) == -1)) {
         snprintf(response, BUF_SIZE, "Error: File/Directory does not exist.\n");
-        send(client_sock, response, strlen(response), 0);
-        return;
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
     }
 
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
         perror("File open error");
-        return;
-    }
-
-
-    char buffer[BUF_SIZE];
-    ssize_t n;
-
-    // Read and send the file content to the client
-    while ((n = fread(buffer, 1, BUF_SIZE, file)) > 0) {
-        if (send(client_sock, buffer, n, 0) == -1) {
-            perror("Send error");
-            break;
+        snprintf(response, BUF_SIZE, "Error: cannot open '%s': %s\n", filename, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
         }
-        memset(buffer, 0, BUF_SIZE);  // Clear buffer after each send
-    }
-
-    if (n < 0) {
-        perror("fread error");
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
     }
 
-    // Ensure all data is sent before closing
-    if (shutdown(client_sock, SHUT_WR) == -1) {
-        perror("Shutdown error");
+    // Send the requested part of the file without copying it through user space
+    int rc = sendFileRange(client_sock, request_id, fd, &st, range, param);
+    if (rc < 0) {
+        printf("File '%s' could not be sent completely\n", filename);
+    } else {
+        printf("File '%s' sent to client.\n", filename);
     }
-
-    fclose(file);
-    printf("File '%s' sent to client.\n", filename);
+    close(fd);
+    return rc;
 }
 
-void dtarCommandExecution(int client_sock) {
-    char command[BUF_SIZE];
+int dtarCommandExecution(uint32_t param, uint32_t request_id, int client_sock) {
     char home_dir[BUF_SIZE];
-    int pipefd[2];
-    pid_t pid;
 
     // Get the user's home directory
     const char *home = getenv("HOME");
     if (!home) {
         perror("Unable to get the home directory");
-        return;
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: unable to get the home directory.\n");
     }
 
-    snprintf(home_dir, sizeof(home_dir), "%s/spdf", home);
+    snprintf(home_dir, sizeof(home_dir), "%s/%s", home, server_root);
+
+    // Stream a tar archive of all .pdf files in the ~/spdf directory
+    return sendTarArchive(client_sock, request_id, param, home_dir, ".pdf");
+}
+
+// With a limit, at most that many paths after the cursor are sent (used by paged display)
+int displayCommandExecution(const char *directory, const char *cursor, uint32_t limit, uint32_t request_id, int client_sock) {
+    struct pathIndex scratch;
+    struct pathIndex *index;
+    char prefix[PATH_MAX];
+    char last[PATH_MAX];
+    size_t remaining = limit;
+    char *batch;
+    size_t len;
 
-    // Create the command to tar all .pdf files in the ~/spdf directory
-    snprintf(command, BUF_SIZE, "cd %s && tar -cvf - $(find . -type f -name '*.pdf')", home_dir);
+    printf("Listing .pdf files in directory: %s\n", directory);
 
-    // Create a pipe to capture the output of the tar command
-    if (pipe(pipefd) == -1) {
-        perror("pipe error");
-        return;
+    // The names come from the path index instead of a walk of the directory
+    batch = malloc(INDEX_BATCH_SIZE);
+    if (batch == NULL || (index = openListing(directory, &scratch, prefix, sizeof(prefix))) == NULL) {
+        perror("Failed to list the directory");
+        free(batch);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot list the directory.\n");
     }
 
-    // Fork a process to run the tar command
-    if ((pid = fork()) == -1) {
-        perror("fork error");
-        return;
-    } else if (pid == 0) {
-        // Child process: Run the tar command
-        close(pipefd[0]);  // Close the read end of the pipe
-        dup2(pipefd[1], STDOUT_FILENO);  // Redirect stdout to the pipe
-        close(pipefd[1]);  // Close the write end after redirect
-
-        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
-        perror("execl error");  // If execl fails
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process: Read the tar output from the pipe and send it over the socket
-        close(pipefd[1]);  // Close the write end of the pipe
+    // Send the file names to Smain, batched into data frames of up to INDEX_BATCH_SIZE bytes
+    snprintf(last, sizeof(last), "%s", cursor);
+    while ((len = fillIndexBatch(index, prefix, last, batch, INDEX_BATCH_SIZE, limit > 0 ? &remaining : NULL)) > 0) {
+        if (sendData(client_sock, request_id, batch, len) < 0) {
+            closeListing(index);
+            free(batch);
+            return -1;
+        }
+    }
+    closeListing(index);
+    free(batch);
 
-        char buffer[BUF_SIZE];
-        ssize_t n;
+    printf("Completed handling display command and sent file list.\n");
+    return sendEnd(client_sock, request_id, STATUS_OK, NULL);
+}
 
-        // Read the tar output and send it to the client
-        while ((n = read(pipefd[0], buffer, BUF_SIZE)) > 0) {
-            if (send(client_sock, buffer, n, 0) == -1) {
-                perror("send error");
-                break;
+// Function to send the whole buffer, returns 0 on success
+int sendAll(int sock, const void *buf, size_t len) {
+    return sendAllFlags(sock, buf, len, 0);
+}
+
+// Function to send the whole buffer with send flags such as MSG_MORE
+int sendAllFlags(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(sock, p, len, flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return -1;
         }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
 
-        if (n < 0) {
-            perror("read error");
+// Function to receive exactly len bytes, returns 0 on success and -1 on error or EOF
+int recvAll(int sock, void *buf, size_t len) {
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(sock, p, len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to send a frame header with its name and path, the payload is sent by the caller
+int sendFrame(int sock, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len) {
+    unsigned char header[FRAME_HEADER_SIZE + 2 * BUF_SIZE];
+    size_t name_len = name ? strlen(name) : 0;
+    size_t path_len = path ? strlen(path) : 0;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
 
-        close(pipefd[0]);  // Close the read end of the pipe
-        wait(NULL);  // Wait for the child process to finish
+    if (name_len >= BUF_SIZE || path_len >= BUF_SIZE) {
+        return -1;
+    }
+    v16 = htons(PROTO_MAGIC);
+    memcpy(header, &v16, 2);
+    header[2] = PROTO_VERSION;
+    header[3] = opcode;
+    v32 = htonl(request_id);
+    memcpy(header + 4, &v32, 4);
+    v32 = htonl(param);
+    memcpy(header + 8, &v32, 4);
+    v16 = htons((uint16_t)name_len);
+    memcpy(header + 12, &v16, 2);
+    v16 = htons((uint16_t)path_len);
+    memcpy(header + 14, &v16, 2);
+    v64 = htobe64(payload_len);
+    memcpy(header + 16, &v64, 8);
+    if (name_len > 0) {
+        memcpy(header + FRAME_HEADER_SIZE, name, name_len);
+    }
+    if (path_len > 0) {
+        memcpy(header + FRAME_HEADER_SIZE + name_len, path, path_len);
+    }
+
+    // Header, name and path go out in one send, held back with MSG_MORE when a payload follows
+    return sendAllFlags(sock, header, FRAME_HEADER_SIZE + name_len + path_len, payload_len > 0 ? MSG_MORE : 0);
+}
+
+// Function to receive a frame header with its name and path (each up to BUF_SIZE - 1 bytes)
+// Returns 1 on success, 0 if the peer closed the connection between frames and -1 on error
+int recvFrame(int sock, struct frameHeader *hdr, char *name, char *path) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+    ssize_t n;
+
+    // Distinguish a clean close before the next frame from a truncated frame
+    do {
+        n = recv(sock, header, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n == 0 ? 0 : -1;
+    }
+    if (recvAll(sock, header + 1, FRAME_HEADER_SIZE - 1) < 0) {
+        return -1;
+    }
+
+    memcpy(&v16, header, 2);
+    if (ntohs(v16) != PROTO_MAGIC) {
+        fprintf(stderr, "Protocol error: bad frame magic\n");
+        return -1;
+    }
+    hdr->version = header[2];
+    hdr->opcode = header[3];
+    memcpy(&v32, header + 4, 4);
+    hdr->request_id = ntohl(v32);
+    memcpy(&v32, header + 8, 4);
+    hdr->param = ntohl(v32);
+    memcpy(&v16, header + 12, 2);
+    hdr->name_len = ntohs(v16);
+    memcpy(&v16, header + 14, 2);
+    hdr->path_len = ntohs(v16);
+    memcpy(&v64, header + 16, 8);
+    hdr->payload_len = be64toh(v64);
+
+    if (hdr->version != PROTO_VERSION) {
+        fprintf(stderr, "Protocol error: unsupported version %d\n", hdr->version);
+        return -1;
+    }
+    if (hdr->name_len >= BUF_SIZE || hdr->path_len >= BUF_SIZE) {
+        fprintf(stderr, "Protocol error: name or path too long\n");
+        return -1;
+    }
+    if (recvAll(sock, name, hdr->name_len) < 0 || recvAll(sock, path, hdr->path_len) < 0) {
+        return -1;
+    }
+    name[hdr->name_len] = '\0';
+    path[hdr->path_len] = '\0';
+    return 1;
+}
+
+// Function to send one piece of a response body
+int sendData(int sock, uint32_t request_id, const void *buf, size_t len) {
+    if (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, len) < 0) {
+        return -1;
     }
+    return sendAll(sock, buf, len);
+}
+
+// Function to finish a response with a status and a message for the user
+int sendEnd(int sock, uint32_t request_id, uint32_t status, const char *message) {
+    size_t len = message ? strlen(message) : 0;
 
-    // Properly shut down the connection after sending all data
-    shutdown(client_sock, SHUT_WR);
-    printf("Tar file sent to client directly from %s directory.\n", home_dir);
+    if (sendFrame(sock, OP_END, request_id, status, NULL, NULL, len) < 0) {
+        return -1;
+    }
+    return len > 0 ? sendAll(sock, message, len) : 0;
 }
 
-void displayCommandExecution(const char *directory, int client_sock) {
+// Function to read and discard a payload the receiver cannot use
+int drainPayload(int sock, uint64_t len) {
     char buffer[BUF_SIZE];
-    char cmd[BUF_SIZE];
-    FILE *fp;
 
-    // Debug: Print the directory being searched
-    printf("Searching for .pdf files in directory: %s\n", directory);
+    while (len > 0) {
+        size_t chunk = len < BUF_SIZE ? len : BUF_SIZE;
+        if (recvAll(sock, buffer, chunk) < 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to turn off Nagle's algorithm, frames are already written in as few sends as possible
+// and a small END frame would otherwise wait for the peer's delayed ACK
+void setNoDelay(int sock) {
+    int one = 1;
 
-    // Construct the command to find .pdf files in the specified directory
-    snprintf(cmd, sizeof(cmd), "find %s -type f -name '*.pdf'", directory);
-    
-    // Debug: Print the command being executed
-    printf("Executing command: %s\n", cmd);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
 
-    fp = popen(cmd, "r");
-    if (fp == NULL) {
-        perror("Failed to run command");
-        close(client_sock);
-        return;
+// Function to size the kernel buffers of a socket when --socket-buffer is given
+// Fixed sizes turn off the kernel's autotuning, so by default they are left alone. Set on the
+// listening socket they are inherited by every accepted connection.
+void setSocketBuffers(int sock) {
+    if (socket_buffer > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer));
+    }
+}
+
+// Function to hold back partial segments while a frame header, its body and the END frame are
+// written, uncorking sends whatever is left at once
+void setCork(int sock, int on) {
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Function to pick the chunk size bodies of len bytes are moved in
+size_t transferChunk(uint64_t len) {
+    size_t chunk = transfer_chunk;
+
+    if (chunk == 0) {
+        chunk = len <= CHUNK_SMALL_FILE ? CHUNK_SMALL : len <= CHUNK_LARGE_FILE ? CHUNK_MEDIUM : CHUNK_LARGE;
+    }
+    // A buffer bigger than the transfer itself is never filled
+    if (len > 0 && len < chunk) {
+        chunk = len;
     }
+    return chunk;
+}
+
+// Function to send len bytes of a file starting at offset, using sendfile() so the data
+// goes from the page cache to the socket without a user space copy
+// Falls back to large read/send chunks if sendfile() is not supported, returns 0 on success
+int sendFileContents(int sock, int fd, off_t offset, uint64_t len) {
+    char *buffer;
+    size_t chunk;
+    ssize_t n;
 
-    // Read the file names and send them to Smain
-    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-        send(client_sock, buffer, strlen(buffer), 0);
-        // Debug: Print each file sent
-        printf("Sending file: %s", buffer);
+    while (len > 0) {
+        n = sendfile(sock, fd, &offset, len < SENDFILE_CHUNK ? len : SENDFILE_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        if (n <= 0) {
+            // Send error, or the file shrank after its size was announced
+            return -1;
+        }
+        len -= n;
+    }
+    if (len == 0) {
+        return 0;
     }
 
-    pclose(fp);
+    chunk = transferChunk(len);
+    if ((buffer = malloc(chunk)) == NULL) {
+        return -1;
+    }
+    while (len > 0) {
+        n = pread(fd, buffer, len < chunk ? len : chunk, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || writeAll(sock, buffer, n) < 0) {
+            free(buffer);
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    free(buffer);
+    return 0;
+}
 
-    // Properly close the write side of the socket to signal end of data
-    shutdown(client_sock, SHUT_WR);
+// Function to send the tar archive of every regular file under root whose name ends in suffix
+// The archive is kept in the server's state directory and only rebuilt after a ufile or rmfile
+// of that type, so a repeated dtar is served from the cached file with sendfile().
+// param selects an optional compression codec and level (see DTAR_PARAM)
+int sendTarArchive(int sock, uint32_t request_id, uint32_t param, const char *root, const char *suffix) {
+    struct tarList list = {NULL, 0, 0};
+    struct tarSource source;
+    char cache_path[PATH_MAX];
+    char tmp_path[PATH_MAX + 64];
+    struct stat st;
+    uint64_t generation = 0;
+    uint64_t total = 0;
+    int root_fd = -1;
+    int fd = -1;
+    int stamp_fd, rc;
 
-    // Debug: Indicate that the display command has been handled
-    printf("Completed handling display command and sent file list.\n");
+    // Serve the cached archive while nothing of this type has changed
+    stamp_fd = openTarCache(suffix, cache_path, sizeof(cache_path));
+    if (stamp_fd >= 0 && (fd = open(cache_path, O_RDONLY | O_CLOEXEC)) >= 0 && fstat(fd, &st) == 0) {
+        total = st.st_size;
+        printf("Tar archive of %s files served from the cache\n", suffix);
+    } else {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (stamp_fd >= 0) {
+            flock(stamp_fd, LOCK_SH);
+            generation = readTarGeneration(stamp_fd);
+            flock(stamp_fd, LOCK_UN);
+        }
+
+        if (collectTarArchive(root, suffix, &list, &root_fd, &total) < 0) {
+            if (stamp_fd >= 0) {
+                close(stamp_fd);
+            }
+            return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot create the tar archive.\n");
+        }
+
+        // Build the archive into a temporary file next to the cache
+        if (stamp_fd >= 0) {
+            snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lx.tmp", cache_path, (int)getpid(), (unsigned long)pthread_self());
+            fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+        if (fd >= 0 && writeTarArchive(fd, root_fd, &list) < 0) {
+            unlink(tmp_path);
+            close(fd);
+            fd = -1;
+        } else if (fd >= 0) {
+            // Install it only if no ufile/rmfile of this type ran while it was being built
+            flock(stamp_fd, LOCK_EX);
+            if (readTarGeneration(stamp_fd) != generation || rename(tmp_path, cache_path) < 0) {
+                unlink(tmp_path);
+            }
+            flock(stamp_fd, LOCK_UN);
+        }
+        printf("Tar archive of %zu files (%llu bytes) built from %s\n", list.count, (unsigned long long)total, root);
+    }
+
+    source.archive_fd = fd;
+    source.size = total;
+    source.root_fd = root_fd;
+    source.list = &list;
+    if (DTAR_CODEC(param) == CODEC_GZIP && total > 0) {
+        rc = sendCompressedArchive(sock, request_id, DTAR_LEVEL(param), &source);
+    } else if (fd >= 0) {
+        rc = sendArchiveFile(sock, request_id, fd, total);
+    } else {
+        // Without a usable state directory the archive is streamed straight to the socket,
+        // corked so small headers and file tails are packed into full segments
+        rc = 0;
+        setCork(sock, 1);
+        if (total > 0 && (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, total) < 0 || writeTarArchive(sock, root_fd, &list) < 0)) {
+            // The frame promised more bytes than were sent, so the connection is unusable
+            rc = -1;
+        }
+        setCork(sock, 0);
+        if (rc == 0) {
+            rc = sendEnd(sock, request_id, STATUS_OK, NULL);
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (root_fd >= 0) {
+        close(root_fd);
+    }
+    if (stamp_fd >= 0) {
+        close(stamp_fd);
+    }
+    freeTarList(&list);
+    return rc;
+}
+
+// Function to send a gzip compressed archive
+// A producer thread feeds the raw tar (from the archive file or built on the fly) into a pipe
+// while this thread compresses, so reading the files and deflating run in parallel.
+// The compressed size is not known in advance, so it goes out as a series of data frames
+int sendCompressedArchive(int sock, uint32_t request_id, int level, struct tarSource *source) {
+    unsigned char *in, *out;
+    pthread_t producer;
+    z_stream zs;
+    int pipefd[2];
+    int flush = Z_NO_FLUSH;
+    int send_failed = 0;
+    ssize_t n;
+
+    if (level < 0 || level > 9) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 writes a gzip header and trailer instead of a raw zlib stream
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot start compression.\n");
+    }
+    in = malloc(COMPRESS_BUF_SIZE);
+    out = malloc(COMPRESS_BUF_SIZE);
+    if (in == NULL || out == NULL || pipe2(pipefd, O_CLOEXEC) < 0) {
+        free(in);
+        free(out);
+        deflateEnd(&zs);
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot start compression.\n");
+    }
+    source->out_fd = pipefd[1];
+    source->rc = 0;
+    if (pthread_create(&producer, NULL, tarProducer, source) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        free(in);
+        free(out);
+        deflateEnd(&zs);
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: cannot start compression.\n");
+    }
+
+    while (flush != Z_FINISH && !send_failed) {
+        n = read(pipefd[0], in, COMPRESS_BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // End of the tar stream (or a broken pipe, which the producer reports below)
+            n = 0;
+            flush = Z_FINISH;
+        }
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = COMPRESS_BUF_SIZE;
+            deflate(&zs, flush);
+            if (zs.avail_out < COMPRESS_BUF_SIZE && sendData(sock, request_id, out, COMPRESS_BUF_SIZE - zs.avail_out) < 0) {
+                send_failed = 1;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    }
+
+    // Closing the read end stops a producer that is still writing
+    close(pipefd[0]);
+    pthread_join(producer, NULL);
+    printf("Compressed archive: %lu bytes in, %lu bytes out\n", zs.total_in, zs.total_out);
+    deflateEnd(&zs);
+    free(in);
+    free(out);
+    if (send_failed) {
+        return -1;
+    }
+    if (source->rc < 0) {
+        // The gzip stream was cut short, tell the client not to keep it
+        return sendEnd(sock, request_id, STATUS_ERROR, "Error: the tar archive could not be read completely.\n");
+    }
+    return sendEnd(sock, request_id, STATUS_OK, NULL);
+}
+
+// Thread function: write the raw tar archive into the compression pipe
+void *tarProducer(void *arg) {
+    struct tarSource *source = arg;
+
+    if (source->archive_fd >= 0) {
+        source->rc = sendFileContents(source->out_fd, source->archive_fd, 0, source->size);
+    } else {
+        source->rc = writeTarArchive(source->out_fd, source->root_fd, source->list);
+    }
+    close(source->out_fd);
+    return NULL;
+}
+
+// Function to send a finished archive file as one data frame followed by the END frame
+int sendArchiveFile(int sock, uint32_t request_id, int fd, uint64_t size) {
+    if (size > 0) {
+        if (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, size) < 0 || sendFileContents(sock, fd, 0, size) < 0) {
+            return -1;
+        }
+    }
+    return sendEnd(sock, request_id, STATUS_OK, NULL);
+}
+
+// Function to open the stamp file that guards the cached archive for suffix
+// The stamp holds a generation counter bumped by every invalidation; the cache path is
+// stored in cache_path. Returns the stamp descriptor or -1 if there is no state directory
+int openTarCache(const char *suffix, char *cache_path, size_t size) {
+    char path[PATH_MAX];
+    const char *home = getenv("HOME");
+
+    if (!home) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", home, STATE_DIR, server_root);
+    if (createDir(path) != 0) {
+        return -1;
+    }
+    snprintf(cache_path, size, "%s/%s.tar", path, suffix + 1);
+    snprintf(path, sizeof(path), "%s.stamp", cache_path);
+    return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// Function to read the generation counter from a stamp file (0 if it was never written)
+uint64_t readTarGeneration(int stamp_fd) {
+    uint64_t generation = 0;
+
+    if (pread(stamp_fd, &generation, sizeof(generation), 0) != sizeof(generation)) {
+        return 0;
+    }
+    return generation;
+}
+
+// Function to drop the cached archive for suffix after a file of that type changed
+// Bumping the generation also stops a dtar that is building right now from installing its result.
+// Returns the new generation, or 0 if there is no state directory
+uint64_t invalidateTarCache(const char *suffix) {
+    char cache_path[PATH_MAX];
+    uint64_t generation;
+    int stamp_fd = openTarCache(suffix, cache_path, sizeof(cache_path));
+
+    if (stamp_fd < 0) {
+        return 0;
+    }
+    flock(stamp_fd, LOCK_EX);
+    generation = readTarGeneration(stamp_fd) + 1;
+    if (pwrite(stamp_fd, &generation, sizeof(generation), 0) != sizeof(generation)) {
+        perror("Tar cache stamp write error");
+    }
+    unlink(cache_path);
+    flock(stamp_fd, LOCK_UN);
+    close(stamp_fd);
+    return generation;
+}
+
+// Function to walk root and list the files of the archive, with the archive's total size
+// A missing root gives an empty list, like find on a missing directory
+int collectTarArchive(const char *root, const char *suffix, struct tarList *list, int *root_fd, uint64_t *total) {
+    char rel[PATH_MAX] = ".";
+    size_t i;
+
+    *total = 0;
+    if ((*root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    if (collectTarEntries(*root_fd, rel, 1, suffix, list) < 0) {
+        close(*root_fd);
+        *root_fd = -1;
+        freeTarList(list);
+        return -1;
+    }
+    if (list->count == 0) {
+        return 0;
+    }
+    *total = TAR_BLOCK_SIZE * 2;  // two zero blocks end the archive
+    for (i = 0; i < list->count; i++) {
+        *total += list->entries[i].header_len + (list->entries[i].size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// Function to write the archive for a collected list to a socket or file
+// Headers and small files are batched in one buffer, larger bodies go out with sendfile()
+int writeTarArchive(int out_fd, int root_fd, struct tarList *list) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE * 2];
+    int fds[TAR_READAHEAD];
+    size_t i, next_open = 0;
+    size_t out_len = 0;
+    char *out;
+    int rc = 0;
+
+    if (list->count == 0) {
+        return 0;
+    }
+    if ((out = malloc(TAR_OUT_BUF_SIZE)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < list->count && rc == 0; i++) {
+        struct tarEntry *entry = &list->entries[i];
+        size_t padded = (entry->size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        int fd;
+
+        // Keep the next few files open, with read-ahead requested for the large ones,
+        // so the disk works ahead of the output
+        while (next_open < list->count && next_open < i + TAR_READAHEAD) {
+            fd = openat(root_fd, list->entries[next_open].name, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0 && list->entries[next_open].size > TAR_SMALL_FILE) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            }
+            fds[next_open % TAR_READAHEAD] = fd;
+            next_open++;
+        }
+        fd = fds[i % TAR_READAHEAD];
+
+        // Flush the batch when this entry might not fit behind it
+        if (out_len + TAR_HEADER_MAX + (entry->size <= TAR_SMALL_FILE ? padded : 0) > TAR_OUT_BUF_SIZE) {
+            if (writeAll(out_fd, out, out_len) < 0) {
+                rc = -1;
+            }
+            out_len = 0;
+        }
+        out_len += buildTarHeader(entry, (unsigned char *)out + out_len);
+        if (rc == 0 && entry->size <= TAR_SMALL_FILE) {
+            // Small files are copied behind their header, padding included
+            readTarBody(fd, out + out_len, entry->size);
+            memset(out + out_len + entry->size, 0, padded - entry->size);
+            out_len += padded;
+        } else if (rc == 0) {
+            if (writeAll(out_fd, out, out_len) < 0 ||
+                sendTarBody(out_fd, fd, entry->size) < 0 ||
+                writeAll(out_fd, zeros, padded - entry->size) < 0) {
+                rc = -1;
+            }
+            out_len = 0;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    // Close the files that were opened ahead if the output failed early
+    for (; i < next_open; i++) {
+        if (fds[i % TAR_READAHEAD] >= 0) {
+            close(fds[i % TAR_READAHEAD]);
+        }
+    }
+    if (rc == 0 && (writeAll(out_fd, out, out_len) < 0 || writeAll(out_fd, zeros, sizeof(zeros)) < 0)) {
+        rc = -1;
+    }
+    free(out);
+    return rc;
+}
+
+// Function to walk the directory rel (relative to root_fd) and add the matching regular files
+// Like find, symbolic links are not followed and unreadable subdirectories are skipped
+int collectTarEntries(int root_fd, char *rel, size_t rel_len, const char *suffix, struct tarList *list) {
+    size_t suffix_len = strlen(suffix);
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int fd;
+    int rc = 0;
+
+    if ((fd = openat(root_fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return 0;
+    }
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (rel_len + 1 + name_len >= PATH_MAX) {
+            fprintf(stderr, "Skipping %s/%s: path too long\n", rel, de->d_name);
+            continue;
+        }
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        rel[rel_len] = '/';
+        memcpy(rel + rel_len + 1, de->d_name, name_len + 1);
+        if (S_ISDIR(st.st_mode)) {
+            rc = collectTarEntries(root_fd, rel, rel_len + 1 + name_len, suffix, list);
+        } else if (S_ISREG(st.st_mode) && name_len >= suffix_len && strcmp(de->d_name + name_len - suffix_len, suffix) == 0) {
+            rc = addTarEntry(list, rel, &st);
+        }
+        rel[rel_len] = '\0';
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Function to append a file to the tar list, returns -1 if out of memory
+int addTarEntry(struct tarList *list, const char *name, const struct stat *st) {
+    unsigned char header[TAR_HEADER_MAX];
+    struct tarEntry *entry;
+
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        struct tarEntry *entries = realloc(list->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        list->entries = entries;
+        list->cap = cap;
+    }
+    entry = &list->entries[list->count];
+    if ((entry->name = strdup(name)) == NULL) {
+        return -1;
+    }
+    entry->size = st->st_size;
+    entry->mode = st->st_mode & 07777;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->mtime = st->st_mtime;
+    entry->header_len = buildTarHeader(entry, header);
+    list->count++;
+    return 0;
+}
+
+// Function to release the tar list
+void freeTarList(struct tarList *list) {
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = list->cap = 0;
+}
+
+// Function to build the header blocks for one file: a ustar header, preceded by a pax
+// extended header when the path does not fit ustar's name/prefix fields or the size needs
+// more than 11 octal digits. Returns the number of bytes written to out
+size_t buildTarHeader(const struct tarEntry *entry, unsigned char *out) {
+    unsigned char *h = out;
+    size_t name_len = strlen(entry->name);
+    size_t split = 0;
+    size_t pax_len = 0;
+    char pax[TAR_HEADER_MAX - 2 * TAR_BLOCK_SIZE];
+    int need_path = 0;
+    int need_size = entry->size > 077777777777ULL;
+    unsigned int sum;
+    size_t i;
+
+    // ustar keeps up to 100 bytes of name plus a 155 byte prefix split at a '/'
+    if (name_len > 100) {
+        need_path = 1;
+        for (i = name_len - 1; i > 0; i--) {
+            if (entry->name[i] == '/' && i <= 155 && name_len - i - 1 <= 100 && name_len - i - 1 > 0) {
+                split = i;
+                need_path = 0;
+                break;
+            }
+        }
+    }
+
+    if (need_path || need_size) {
+        // Each pax record is "<length> <key>=<value>\n", where length counts the whole record
+        const char *keys[2] = {"path", "size"};
+        char size_value[32];
+        const char *values[2] = {entry->name, size_value};
+        int k;
+
+        snprintf(size_value, sizeof(size_value), "%llu", (unsigned long long)entry->size);
+        for (k = 0; k < 2; k++) {
+            size_t body, len, digits = 1;
+            if ((k == 0 && !need_path) || (k == 1 && !need_size)) {
+                continue;
+            }
+            body = strlen(keys[k]) + strlen(values[k]) + 3;  // space, '=' and newline
+            while (1) {
+                len = body + digits;
+                if (snprintf(NULL, 0, "%zu", len) == (int)digits) {
+                    break;
+                }
+                digits++;
+            }
+            pax_len += snprintf(pax + pax_len, sizeof(pax) - pax_len, "%zu %s=%s\n", len, keys[k], values[k]);
+        }
+
+        memset(h, 0, TAR_BLOCK_SIZE);
+        snprintf((char *)h, 100, "./PaxHeaders/%.80s", strrchr(entry->name, '/') + 1);
+        snprintf((char *)h + 100, 8, "%07o", 0644);
+        snprintf((char *)h + 108, 8, "%07o", (unsigned int)entry->uid & 07777777);
+        snprintf((char *)h + 116, 8, "%07o", (unsigned int)entry->gid & 07777777);
+        snprintf((char *)h + 124, 12, "%011zo", pax_len);
+        snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)entry->mtime & 077777777777ULL);
+        h[156] = 'x';
+        memcpy(h + 257, "ustar", 6);
+        memcpy(h + 263, "00", 2);
+        memset(h + 148, ' ', 8);
+        for (sum = 0, i = 0; i < TAR_BLOCK_SIZE; i++) {
+            sum += h[i];
+        }
+        snprintf((char *)h + 148, 8, "%06o", sum);
+        h += TAR_BLOCK_SIZE;
+
+        memset(h, 0, (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+        memcpy(h, pax, pax_len);
+        h += (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+
+    memset(h, 0, TAR_BLOCK_SIZE);
+    if (split) {
+        memcpy(h, entry->name + split + 1, name_len - split - 1);
+        memcpy(h + 345, entry->name, split);
+    } else {
+        // A pax path record overrides this (possibly truncated) name
+        memcpy(h, entry->name, name_len < 100 ? name_len : 100);
+    }
+    snprintf((char *)h + 100, 8, "%07o", (unsigned int)entry->mode);
+    snprintf((char *)h + 108, 8, "%07o", (unsigned int)entry->uid & 07777777);
+    snprintf((char *)h + 116, 8, "%07o", (unsigned int)entry->gid & 07777777);
+    snprintf((char *)h + 124, 12, "%011llo", need_size ? 0ULL : (unsigned long long)entry->size);
+    snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)entry->mtime & 077777777777ULL);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    for (sum = 0, i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += h[i];
+    }
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    h += TAR_BLOCK_SIZE;
+
+    return h - out;
+}
+
+// Function to send exactly size bytes of a file body for the tar stream
+// A file that shrank or can no longer be read is padded with zeros, as tar does, so the
+// archive keeps the size announced up front; returns -1 only if the output fails
+int sendTarBody(int out_fd, int fd, uint64_t size) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE * 8];
+    off_t offset = 0;
+    ssize_t n;
+
+    while (fd >= 0 && size > 0) {
+        n = sendfile(out_fd, fd, &offset, size < SENDFILE_CHUNK ? size : SENDFILE_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // sendfile() is not supported here, send the rest through a buffer
+            return sendFileContents(out_fd, fd, offset, size);
+        }
+        if (n <= 0) {
+            // An output error shows up again when the padding is written
+            break;
+        }
+        size -= n;
+    }
+    if (size > 0) {
+        fprintf(stderr, "A file shrank or became unreadable while archiving, padding %llu bytes with zeros\n", (unsigned long long)size);
+    }
+    while (size > 0) {
+        size_t chunk = size < sizeof(zeros) ? size : sizeof(zeros);
+        if (writeAll(out_fd, zeros, chunk) < 0) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function to write the whole buffer to a socket, pipe or file, returns 0 on success
+int writeAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to receive an upload body into a temporary file and store it under fullpath
+// Returns 0 when stored, -1 if the connection failed, or -2 if the file could not be stored
+// (response then says why and the body has been consumed)
+int storeUpload(int sock, const char *fullpath, uint64_t size, char *response, size_t response_size) {
+    char tmp_path[PATH_MAX];
+    size_t chunk = transferChunk(size);
+    char *buffer = malloc(chunk);
+    int write_failed = 0;
+    int fd = -1;
+    ssize_t n;
+
+    if (buffer == NULL || (fd = openUploadTemp(fullpath, tmp_path, sizeof(tmp_path))) < 0) {
+        perror("File open error");
+        snprintf(response, response_size, "Error: cannot open '%s': %s\n", fullpath, strerror(errno));
+        free(buffer);
+        return drainPayload(sock, size) < 0 ? -1 : -2;
+    }
+    while (size > 0) {
+        n = recv(sock, buffer, size < chunk ? size : chunk, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+        // After a failed write the rest of the body is still read, to keep the connection in step
+        if (!write_failed && writeAll(fd, buffer, n) < 0) {
+            perror("File write error");
+            snprintf(response, response_size, "Error: writing '%s' failed: %s\n", fullpath, strerror(errno));
+            write_failed = 1;
+        }
+    }
+    free(buffer);
+    if (size > 0 || write_failed) {
+        close(fd);
+        unlink(tmp_path);
+        return size > 0 ? -1 : -2;
+    }
+    if (finishUpload(fd, tmp_path, fullpath) < 0) {
+        perror("File commit error");
+        snprintf(response, response_size, "Error: storing '%s' failed: %s\n", fullpath, strerror(errno));
+        return -2;
+    }
+    return 0;
+}
+
+// Function to create the temporary file of an upload, in the directory of its final name so the
+// rename stays on one file system. Its name does not end in a served suffix, so the index and
+// dtar never see it. Returns the descriptor or -1
+int openUploadTemp(const char *fullpath, char *tmp_path, size_t size) {
+    const char *base = strrchr(fullpath, '/');
+    int fd;
+
+    base = base ? base + 1 : fullpath;
+    if (snprintf(tmp_path, size, "%.*s.%s.XXXXXX", (int)(base - fullpath), fullpath, base) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = mkostemp(tmp_path, O_CLOEXEC)) >= 0) {
+        fchmod(fd, 0644);
+    }
+    return fd;
+}
+
+// Function to make a written upload durable and put it under its final name
+// Closes fd. On failure the temporary file is removed and errno says why. Returns 0 or -1
+int finishUpload(int fd, const char *tmp_path, const char *fullpath) {
+    int rc, saved;
+
+    rc = commitFile(fd);
+    saved = errno;
+    if (close(fd) < 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc == 0 && rename(tmp_path, fullpath) < 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc < 0) {
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return commitDirectory(fullpath);
+}
+
+// Function to make a new name durable by committing the directory holding it, returns 0 or -1
+int commitDirectory(const char *path) {
+    char dir[PATH_MAX];
+    const char *base = strrchr(path, '/');
+    int dir_fd, rc, saved;
+
+    if (durability_mode == DURABILITY_NONE || base == NULL) {
+        return 0;
+    }
+    snprintf(dir, sizeof(dir), "%.*s", base == path ? 1 : (int)(base - path), path);
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    rc = commitFile(dir_fd);
+    saved = errno;
+    close(dir_fd);
+    errno = saved;
+    return rc;
+}
+
+// Function to make a file durable as durability_mode asks, returns 0 or -1
+// In group mode the caller waits for the commit thread, which syncs the files of every upload
+// that arrived meanwhile at once
+int commitFile(int fd) {
+    struct commitRequest request;
+    struct stat st;
+
+    if (durability_mode == DURABILITY_NONE) {
+        return 0;
+    }
+    if (durability_mode == DURABILITY_GROUP) {
+        pthread_once(&group_commit.started, startGroupCommit);
+    }
+    if (durability_mode == DURABILITY_FSYNC || !group_commit.running || fstat(fd, &st) < 0) {
+        return fdatasync(fd);
+    }
+    request.fd = fd;
+    request.dev = st.st_dev;
+    request.rc = 0;
+    request.done = 0;
+    pthread_mutex_lock(&group_commit.lock);
+    request.next = group_commit.pending;
+    group_commit.pending = &request;
+    group_commit.count++;
+    pthread_cond_signal(&group_commit.wake);
+    while (!request.done) {
+        pthread_cond_wait(&group_commit.done, &group_commit.lock);
+    }
+    pthread_mutex_unlock(&group_commit.lock);
+    if (request.rc < 0) {
+        errno = EIO;
+    }
+    return request.rc;
+}
+
+// Function to start the group commit thread of this process, the first time an upload needs it
+// Each forked process gets its own, so group commit pays off with the threaded models
+void startGroupCommit(void) {
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, groupCommitThread, NULL) != 0) {
+        perror("Group commit thread error");
+        return;
+    }
+    pthread_detach(tid);
+    group_commit.running = 1;
+}
+
+// Group commit thread: sync each file system of a batch once and wake every upload in it
+// Uploads that arrive during a sync make up the next batch. Once a batch is started, the thread
+// waits up to group_commit_ms for as many uploads as the last batch had, so a lone upload is
+// synced at once and concurrent ones keep sharing their syncs
+void *groupCommitThread(void *arg) {
+    struct commitRequest *batch, *request, *first;
+    struct timespec deadline;
+    int expected = 1;
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&group_commit.lock);
+        while (group_commit.pending == NULL) {
+            pthread_cond_wait(&group_commit.wake, &group_commit.lock);
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += group_commit_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (group_commit.count < expected &&
+               pthread_cond_timedwait(&group_commit.wake, &group_commit.lock, &deadline) == 0) {
+        }
+        batch = group_commit.pending;
+        expected = group_commit.count;
+        group_commit.pending = NULL;
+        group_commit.count = 0;
+        pthread_mutex_unlock(&group_commit.lock);
+
+        // syncfs writes back every file of the file system, so one call covers the whole batch
+        for (request = batch; request; request = request->next) {
+            for (first = batch; first != request && first->dev != request->dev; first = first->next) {
+            }
+            request->rc = first == request ? syncfs(request->fd) : first->rc;
+        }
+
+        // A request lives on its uploader's stack, so it is not touched once marked done and unlocked
+        pthread_mutex_lock(&group_commit.lock);
+        for (request = batch; request; request = request->next) {
+            request->done = 1;
+        }
+        pthread_cond_broadcast(&group_commit.done);
+        pthread_mutex_unlock(&group_commit.lock);
+    }
+    return NULL;
+}
+
+// Function to read a small file body into the tar output buffer
+// Bytes that can no longer be read are left as zeros, like sendTarBody does for large files
+void readTarBody(int fd, char *out, uint64_t size) {
+    uint64_t done = 0;
+    ssize_t n;
+
+    while (fd >= 0 && done < size) {
+        n = pread(fd, out + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done < size) {
+        fprintf(stderr, "A file shrank or became unreadable while archiving, padding %llu bytes with zeros\n", (unsigned long long)(size - done));
+        memset(out + done, 0, size - done);
+    }
+}
+
+// Function to set up the path index of root and build it
+// Called once at startup, before any worker exists
+void initPathIndex(const char *root) {
+    char cache_path[PATH_MAX];
+
+    snprintf(path_index.root, sizeof(path_index.root), "%s", root);
+    path_index.stamp_fd = openTarCache(path_index.suffix, cache_path, sizeof(cache_path));
+    pthread_rwlock_wrlock(&path_index.lock);
+    if (buildPathIndex(&path_index) == 0) {
+        printf("Indexed %zu %s files under %s\n", path_index.count, path_index.suffix, root);
+    }
+    pthread_rwlock_unlock(&path_index.lock);
+}
+
+// Function to take the read lock of an index, rebuilding it first if it is out of date
+// The index is stale when another process (a forked worker) changed files of this type,
+// which shows as a tar cache generation the index has not seen. Returns -1 if it cannot be built
+int acquirePathIndex(struct pathIndex *index) {
+    while (1) {
+        pthread_rwlock_rdlock(&index->lock);
+        if (index->valid && (index->stamp_fd < 0 || readTarGeneration(index->stamp_fd) == index->generation)) {
+            return 0;
+        }
+        pthread_rwlock_unlock(&index->lock);
+
+        pthread_rwlock_wrlock(&index->lock);
+        if ((!index->valid || (index->stamp_fd >= 0 && readTarGeneration(index->stamp_fd) != index->generation)) &&
+            buildPathIndex(index) < 0) {
+            pthread_rwlock_unlock(&index->lock);
+            return -1;
+        }
+        pthread_rwlock_unlock(&index->lock);
+    }
+}
+
+// Function to walk the root of an index and replace its contents, caller holds the write lock
+int buildPathIndex(struct pathIndex *index) {
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < index->count; i++) {
+        free(index->paths[i]);
+    }
+    index->count = 0;
+    index->valid = 0;
+    // Read the generation first so a change during the walk makes the next lookup rebuild
+    index->generation = index->stamp_fd >= 0 ? readTarGeneration(index->stamp_fd) : 0;
+    snprintf(path, sizeof(path), "%s", index->root);
+    if (walkPathIndex(index, path, strlen(path)) < 0) {
+        fprintf(stderr, "Path index of %s: out of memory\n", index->root);
+        return -1;
+    }
+    qsort(index->paths, index->count, sizeof(char *), comparePaths);
+    index->valid = 1;
+    return 0;
+}
+
+// Function to add every regular file under path whose name ends in the index suffix
+// Like find -type f, symbolic links are not followed and a missing directory adds nothing
+int walkPathIndex(struct pathIndex *index, char *path, size_t len) {
+    size_t suffix_len = strlen(index->suffix);
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int rc = 0;
+
+    if ((dir = opendir(path)) == NULL) {
+        return 0;
+    }
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+        unsigned char type = de->d_type;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (len + 1 + name_len >= PATH_MAX) {
+            fprintf(stderr, "Skipping %s/%s: path too long\n", path, de->d_name);
+            continue;
+        }
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, name_len + 1);
+        if (type == DT_DIR) {
+            rc = walkPathIndex(index, path, len + 1 + name_len);
+        } else if (type == DT_REG && name_len >= suffix_len && strcmp(de->d_name + name_len - suffix_len, index->suffix) == 0) {
+            rc = appendIndexPath(index, path);
+        }
+        path[len] = '\0';
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Function to append a path to an index without keeping it sorted, returns -1 if out of memory
+int appendIndexPath(struct pathIndex *index, const char *path) {
+    if (index->count == index->cap) {
+        size_t cap = index->cap ? index->cap * 2 : INDEX_INITIAL_CAP;
+        char **paths = realloc(index->paths, cap * sizeof(char *));
+        if (paths == NULL) {
+            return -1;
+        }
+        index->paths = paths;
+        index->cap = cap;
+    }
+    if ((index->paths[index->count] = strdup(path)) == NULL) {
+        return -1;
+    }
+    index->count++;
+    return 0;
+}
+
+int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to find the position of the first indexed path not less than path
+size_t searchPathIndex(const struct pathIndex *index, const char *path) {
+    size_t lo = 0, hi = index->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(index->paths[mid], path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Function to check that a file path can be answered from the index
+// It must lie under the root, carry the suffix and be written the way the walk writes it
+int indexedPath(const struct pathIndex *index, const char *path) {
+    size_t root_len = strlen(index->root);
+    size_t len = strlen(path);
+    size_t suffix_len = strlen(index->suffix);
+
+    if (root_len == 0 || len <= root_len + 1 || strncmp(path, index->root, root_len) != 0 || path[root_len] != '/') {
+        return 0;
+    }
+    if (len < suffix_len || strcmp(path + len - suffix_len, index->suffix) != 0) {
+        return 0;
+    }
+    return strstr(path + root_len, "//") == NULL && strstr(path + root_len, "/./") == NULL && strstr(path + root_len, "/../") == NULL;
+}
+
+// Function to check if a file exists using the index
+// Returns 1 or 0, or -1 if the index cannot answer and the caller has to look at the disk
+int lookupPathIndex(struct pathIndex *index, const char *path) {
+    size_t i;
+    int found;
+
+    if (!indexedPath(index, path) || acquirePathIndex(index) < 0) {
+        return -1;
+    }
+    i = searchPathIndex(index, path);
+    found = i < index->count && strcmp(index->paths[i], path) == 0;
+    pthread_rwlock_unlock(&index->lock);
+    return found;
+}
+
+// Function to record that a file was created (present = 1) or removed by this process
+// generation is the tar cache generation the change produced; if it is not the next one
+// after the index's, someone else changed files too and the index is rebuilt on next use
+void updatePathIndex(struct pathIndex *index, const char *path, int present, uint64_t generation) {
+    size_t i;
+    int found;
+
+    pthread_rwlock_wrlock(&index->lock);
+    if (!index->valid) {
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    if (generation != 0 && generation != index->generation + 1) {
+        index->valid = 0;
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    // The copies kept for other servers are under ~/<root>.replica, outside the index
+    if (strncmp(path, index->root, strlen(index->root)) != 0 || path[strlen(index->root)] != '/') {
+        index->generation = generation;
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    if (!indexedPath(index, path)) {
+        index->valid = 0;
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    index->generation = generation;
+    i = searchPathIndex(index, path);
+    found = i < index->count && strcmp(index->paths[i], path) == 0;
+    if (present && !found) {
+        // Append to grow the array, then move the new path into its sorted position
+        if (appendIndexPath(index, path) < 0) {
+            index->valid = 0;
+        } else {
+            char *added = index->paths[index->count - 1];
+            memmove(index->paths + i + 1, index->paths + i, (index->count - 1 - i) * sizeof(char *));
+            index->paths[i] = added;
+        }
+    } else if (!present && found) {
+        free(index->paths[i]);
+        memmove(index->paths + i, index->paths + i + 1, (index->count - i - 1) * sizeof(char *));
+        index->count--;
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to get the index that lists directory, and the prefix its files share there
+// A directory inside the root is served from the server's index; anything else is walked
+// into scratch. Release the result with closeListing. Returns NULL if out of memory
+struct pathIndex *openListing(const char *directory, struct pathIndex *scratch, char *prefix, size_t size) {
+    size_t root_len = strlen(path_index.root);
+    size_t len = strlen(directory);
+
+    // Trailing slashes do not change what is listed
+    while (len > 1 && directory[len - 1] == '/') {
+        len--;
+    }
+    if (len + 2 > size) {
+        return NULL;
+    }
+    memcpy(prefix, directory, len);
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+    if (root_len > 0 && len >= root_len && strncmp(prefix, path_index.root, root_len) == 0 && prefix[root_len] == '/' &&
+        strstr(prefix + root_len, "//") == NULL && strstr(prefix + root_len, "/./") == NULL && strstr(prefix + root_len, "/../") == NULL) {
+        return &path_index;
+    }
+
+    memset(scratch, 0, sizeof(*scratch));
+    scratch->suffix = path_index.suffix;
+    scratch->stamp_fd = -1;
+    pthread_rwlock_init(&scratch->lock, NULL);
+    snprintf(scratch->root, sizeof(scratch->root), "%.*s", (int)len, directory);
+    if (buildPathIndex(scratch) < 0) {
+        closeListing(scratch);
+        return NULL;
+    }
+    // Paths from the walk start with the directory as it was given
+    snprintf(prefix, size, "%s/", scratch->root);
+    return scratch;
+}
+
+// Function to release a listing from openListing
+void closeListing(struct pathIndex *index) {
+    size_t i;
+
+    if (index == &path_index) {
+        return;
+    }
+    for (i = 0; i < index->count; i++) {
+        free(index->paths[i]);
+    }
+    free(index->paths);
+    pthread_rwlock_destroy(&index->lock);
+}
+
+// Function to copy the next indexed paths under prefix into batch, one per line
+// last is the cursor: the last path already copied, or empty to start at the beginning.
+// With a limit, at most *limit paths are copied and *limit is reduced by the number copied.
+// The lock is only held per batch, so changes between batches are picked up in order
+size_t fillIndexBatch(struct pathIndex *index, const char *prefix, char *last, char *batch, size_t size, size_t *limit) {
+    size_t prefix_len = strlen(prefix);
+    size_t used = 0;
+    size_t i;
+
+    if ((limit != NULL && *limit == 0) || acquirePathIndex(index) < 0) {
+        return 0;
+    }
+    // Resume after the cursor, or at the start of the directory if the cursor lies before it
+    i = searchPathIndex(index, strcmp(last, prefix) > 0 ? last : prefix);
+    if (i < index->count && strcmp(index->paths[i], last) == 0) {
+        i++;
+    }
+    for (; i < index->count && strncmp(index->paths[i], prefix, prefix_len) == 0 && (limit == NULL || *limit > 0); i++) {
+        size_t len = strlen(index->paths[i]);
+        if (used + len + 1 > size) {
+            break;
+        }
+        memcpy(batch + used, index->paths[i], len);
+        batch[used + len] = '\n';
+        used += len + 1;
+        memcpy(last, index->paths[i], len + 1);
+        if (limit != NULL) {
+            (*limit)--;
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return used;
+}
+
+// Function to find the content store under the server's state directory, creating it if needed
+// Returns 0 with the store directory in dir, or -1 if there is none
+int openObjectStore(char *dir, size_t size) {
+    const char *home = getenv("HOME");
+
+    if (!home) {
+        return -1;
+    }
+    if (snprintf(dir, size, "%s/%s/%s/%s", home, STATE_DIR, server_root, STORE_DIR) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return createDir(dir);
+}
+
+// Function to build the store path of the object with the given hash
+// Returns 0, or -1 if the path does not fit
+int objectPath(const char *dir, const char *hash, char *path, size_t size) {
+    if (snprintf(path, size, "%s/%.2s/%s", dir, hash, hash) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read the hash of the object a stored path links to
+// Returns 0, or -1 if the path is not a link into the content store
+int storedHash(const char *path, char *hash) {
+    if (getxattr(path, STORE_XATTR, hash, STORE_HASH_LEN) != STORE_HASH_LEN) {
+        return -1;
+    }
+    hash[STORE_HASH_LEN] = '\0';
+    return 0;
+}
+
+// Function to take the lock that serialises linking and releasing objects between workers
+// Returns the lock descriptor, or -1 if the store cannot be locked
+int lockObjectStore(const char *dir) {
+    char path[PATH_MAX];
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/.lock", dir) >= (int)sizeof(path)) {
+        return -1;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        return -1;
+    }
+    flock(fd, LOCK_EX);
+    return fd;
+}
+
+void unlockObjectStore(int lock_fd) {
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// Function to remove an object once no stored path links to it any more
+// The object's own name is one link and every path referencing it adds one. Caller holds the lock
+void releaseObject(const char *dir, const char *hash) {
+    char object[PATH_MAX];
+    struct stat st;
+
+    if (objectPath(dir, hash, object, sizeof(object)) == 0 && stat(object, &st) == 0 && st.st_nlink == 1) {
+        unlink(object);
+        printf("Released stored object %s\n", hash);
+    }
+}
+
+// Function to point path at the stored object with the given hash
+// The link is made under a temporary name and renamed over path, so a file that was there
+// before is replaced in one step and its own object released. Caller holds the lock
+// Returns 0, 1 if the object is not stored, or -1 on error
+int linkObject(const char *dir, const char *hash, const char *path) {
+    char object[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char old_hash[STORE_HASH_LEN + 1];
+    int replaced;
+
+    if (objectPath(dir, hash, object, sizeof(object)) < 0 ||
+        snprintf(tmp_path, sizeof(tmp_path), "%s.link-%d", path, (int)getpid()) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    unlink(tmp_path);
+    if (link(object, tmp_path) < 0) {
+        return errno == ENOENT ? 1 : -1;
+    }
+    replaced = storedHash(path, old_hash) == 0;
+    if (rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    // rename() leaves both names alone when path already was this object
+    unlink(tmp_path);
+    if (replaced) {
+        releaseObject(dir, old_hash);
+    }
+    return 0;
+}
+
+// Function to remove a stored file, releasing its object when it was the last path linked to it
+// Returns 0 or -1 with errno set, like remove()
+int removeStoredFile(const char *path) {
+    char hash[STORE_HASH_LEN + 1];
+    char dir[PATH_MAX];
+    int lock_fd;
+    int rc;
+
+    if (storedHash(path, hash) < 0 || openObjectStore(dir, sizeof(dir)) < 0 || (lock_fd = lockObjectStore(dir)) < 0) {
+        return remove(path);
+    }
+    rc = remove(path);
+    if (rc == 0) {
+        releaseObject(dir, hash);
+    }
+    unlockObjectStore(lock_fd);
+    return rc;
+}
+
+// Function to receive a file body into a temporary file of the store, hashing it on the way
+// sock may also be the file of a finished resumable upload
+// Returns 0 with the temporary file in tmp_path and its SHA-256 in hash, -1 if the connection
+// failed, or -2 if the file could not be stored (the body has then been consumed)
+int receiveIntoStore(int sock, uint64_t size, const char *dir, char *tmp_path, size_t tmp_size, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i, digest_len;
+    EVP_MD_CTX *ctx;
+    char *buffer;
+    int write_failed = 0;
+    ssize_t n = 0;
+    int fd;
+
+    if (snprintf(tmp_path, tmp_size, "%s/upload-XXXXXX", dir) >= (int)tmp_size) {
+        fprintf(stderr, "Store path too long\n");
+        return drainPayload(sock, size) < 0 ? -1 : -2;
+    }
+    buffer = malloc(STORE_BUF_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL || (fd = mkstemp(tmp_path)) < 0) {
+        perror("Store open error");
+        free(buffer);
+        EVP_MD_CTX_free(ctx);
+        return drainPayload(sock, size) < 0 ? -1 : -2;
+    }
+    fchmod(fd, 0644);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+    while (size > 0) {
+        n = read(sock, buffer, size < STORE_BUF_SIZE ? size : STORE_BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size -= n;
+        EVP_DigestUpdate(ctx, buffer, n);
+        if (!write_failed && writeAll(fd, buffer, n) < 0) {
+            perror("Store write error");
+            write_failed = 1;
+        }
+    }
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+
+    for (i = 0; i < digest_len; i++) {
+        sprintf(hash + i * 2, "%02x", digest[i]);
+    }
+    // Every path linked to the object shares this attribute, so rmfile can find the object again
+    if (size == 0 && !write_failed && fsetxattr(fd, STORE_XATTR, hash, STORE_HASH_LEN, 0) < 0) {
+        perror("Store xattr error");
+        write_failed = 1;
+    }
+    if (size == 0 && !write_failed && commitFile(fd) < 0) {
+        perror("Store sync error");
+        write_failed = 1;
+    }
+    close(fd);
+
+    if (size > 0 || write_failed) {
+        unlink(tmp_path);
+        if (size > 0) {
+            return -1;
+        }
+        return -2;
+    }
+    return 0;
+}
+
+// Function to handle ufile in dedup mode: keep the body once under its hash and link fullpath to it
+// The body is read from body_fd, which is client_sock unless a finished resumable upload is stored
+int ufileIntoStore(const char *filename, const char *fullpath, int body_fd, uint64_t file_size, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    char dir[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char object[PATH_MAX];
+    char bucket[PATH_MAX];
+    char hash[STORE_HASH_LEN + 1];
+    int lock_fd;
+    int rc;
+
+    if (openObjectStore(dir, sizeof(dir)) < 0) {
+        if (body_fd == client_sock && drainPayload(client_sock, file_size) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the file store is unavailable.\n");
+    }
+    rc = receiveIntoStore(body_fd, file_size, dir, tmp_path, sizeof(tmp_path), hash);
+    if (rc == -1 && body_fd == client_sock) {
+        // Smain or the client went away in the middle of the upload
+        return -1;
+    } else if (rc < 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s'\n", fullpath);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+
+    if ((lock_fd = lockObjectStore(dir)) < 0) {
+        unlink(tmp_path);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the file store is unavailable.\n");
+    }
+    // A body that is already stored is dropped, otherwise it becomes the object
+    if (objectPath(dir, hash, object, sizeof(object)) < 0 ||
+        snprintf(bucket, sizeof(bucket), "%s/%.2s", dir, hash) >= (int)sizeof(bucket)) {
+        // Nothing is linked to a store path that was cut short
+        unlink(tmp_path);
+        unlockObjectStore(lock_fd);
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s': %s\n", fullpath, strerror(ENAMETOOLONG));
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    if (access(object, F_OK) == 0) {
+        unlink(tmp_path);
+        printf("File '%s' is a duplicate of stored object %s\n", fullpath, hash);
+    } else if (createDir(bucket) != 0 || rename(tmp_path, object) < 0) {
+        perror("Store rename error");
+        unlink(tmp_path);
+    }
+    rc = linkObject(dir, hash, fullpath);
+    if (rc != 0) {
+        releaseObject(dir, hash);
+    }
+    unlockObjectStore(lock_fd);
+
+    if (rc != 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s'\n", fullpath);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(path_index.suffix));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
+}
+
+// Function to handle OP_LINK: store fullpath without its body when the body's hash is already stored
+// Answers STATUS_MISSING when it is not, so the client falls back to a normal upload
+int linkCommandExecution(const char *filename, const char *fullpath, uint64_t payload_len, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    char dir[PATH_MAX];
+    char hash[STORE_HASH_LEN + 1];
+    int lock_fd;
+    int rc = 1;
+
+    if (payload_len != STORE_HASH_LEN) {
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Invalid link request\n");
+    }
+    if (recvAll(client_sock, hash, STORE_HASH_LEN) < 0) {
+        return -1;
+    }
+    hash[STORE_HASH_LEN] = '\0';
+    if (strspn(hash, "0123456789abcdef") != STORE_HASH_LEN) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Invalid link request\n");
+    }
+
+    if (dedup_mode && openObjectStore(dir, sizeof(dir)) == 0 && (lock_fd = lockObjectStore(dir)) >= 0) {
+        rc = linkObject(dir, hash, fullpath);
+        unlockObjectStore(lock_fd);
+    }
+    if (rc == 1) {
+        return sendEnd(client_sock, request_id, STATUS_MISSING, "Content is not stored yet\n");
+    } else if (rc < 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s': %s\n", fullpath, strerror(errno));
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    printf("File '%s' linked to stored object %s\n", fullpath, hash);
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(path_index.suffix));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
+}
+
+// Function to drop objects no path links to any more and uploads left behind by a crash
+void sweepObjectStore(void) {
+    char dir[PATH_MAX];
+    char sub[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *entry, *object;
+    struct stat st;
+    DIR *top, *bucket;
+    int lock_fd;
+    int removed = 0;
+
+    if (openObjectStore(dir, sizeof(dir)) < 0 || (lock_fd = lockObjectStore(dir)) < 0) {
+        return;
+    }
+    if ((top = opendir(dir)) != NULL) {
+        while ((entry = readdir(top)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            if (snprintf(sub, sizeof(sub), "%s/%s", dir, entry->d_name) >= (int)sizeof(sub)) {
+                continue;
+            }
+            if (strncmp(entry->d_name, "upload-", 7) == 0) {
+                removed += unlink(sub) == 0;
+                continue;
+            }
+            if ((bucket = opendir(sub)) == NULL) {
+                continue;
+            }
+            while ((object = readdir(bucket)) != NULL) {
+                if (snprintf(path, sizeof(path), "%s/%s", sub, object->d_name) >= (int)sizeof(path)) {
+                    continue;
+                }
+                if (object->d_name[0] != '.' && lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+                    removed += unlink(path) == 0;
+                }
+            }
+            closedir(bucket);
+        }
+        closedir(top);
+    }
+    unlockObjectStore(lock_fd);
+    printf("Content store: %d unreferenced files removed\n", removed);
+}
+
+// Function to work out which bytes of a file a dfile range asks for
+// The range is "first-[last]", optionally followed by "@<sec>.<nsec>", the mtime of the copy the
+// client already holds part of. When that copy is out of date the whole file is sent instead.
+// Returns 0, -1 if the range is malformed, or -2 if it starts past the end of the file
+int parseByteRange(const char *range, const struct stat *st, uint64_t *offset, uint64_t *length) {
+    uint64_t size = st->st_size;
+    unsigned long long first, last = UINT64_MAX;
+    long long sec;
+    long nsec;
+    char *end;
+
+    *offset = 0;
+    *length = size;
+    if (range == NULL || range[0] == '\0') {
+        return 0;
+    }
+    if (*range < '0' || *range > '9') {
+        return -1;
+    }
+    errno = 0;
+    first = strtoull(range, &end, 10);
+    if (*end != '-' || errno != 0) {
+        return -1;
+    }
+    range = end + 1;
+    if (*range >= '0' && *range <= '9') {
+        last = strtoull(range, &end, 10);
+        if (last < first || errno != 0) {
+            return -1;
+        }
+        range = end;
+    }
+    if (*range == '@') {
+        sec = strtoll(range + 1, &end, 10);
+        if (*end != '.') {
+            return -1;
+        }
+        nsec = strtol(end + 1, &end, 10);
+        if (*end != '\0') {
+            return -1;
+        }
+        if (sec != (long long)st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec) {
+            return 0;
+        }
+    } else if (*range != '\0') {
+        return -1;
+    }
+    if (first > size) {
+        return -2;
+    }
+    *offset = first;
+    *length = (last >= size ? size : last + 1) - first;
+    return 0;
+}
+
+// Function to check the validator of a conditional dfile against the stored file
+// The client's copy is current when its size and mtime match. With the same size and another
+// mtime, as the copies of a replicated file have, the hashes are compared: the content store
+// keeps it, other files are hashed, which only costs a local read. fd -1 skips the hash check
+int copyIsCurrent(const char *validator, const struct stat *st, int fd) {
+    unsigned long long size;
+    long long sec;
+    long nsec;
+    char hash[STORE_HASH_LEN + 1];
+    const char *client_hash = strchr(validator, '#');
+
+    if (sscanf(validator, "%llu@%lld.%ld", &size, &sec, &nsec) != 3 || size != (unsigned long long)st->st_size) {
+        return 0;
+    }
+    if (sec == (long long)st->st_mtim.tv_sec && nsec == st->st_mtim.tv_nsec) {
+        return 1;
+    }
+    if (client_hash == NULL || fd < 0 || strlen(client_hash + 1) != STORE_HASH_LEN) {
+        return 0;
+    }
+    if (fgetxattr(fd, STORE_XATTR, hash, STORE_HASH_LEN) != STORE_HASH_LEN && hashOpenFile(fd, hash) < 0) {
+        return 0;
+    }
+    return memcmp(client_hash + 1, hash, STORE_HASH_LEN) == 0;
+}
+
+// Function to compute the SHA-256 of an open file in hex, without moving its offset
+// hash must have room for STORE_HASH_LEN characters and the NUL
+int hashOpenFile(int fd, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i, digest_len;
+    EVP_MD_CTX *ctx;
+    char *buffer;
+    off_t offset = 0;
+    ssize_t n;
+
+    buffer = malloc(STORE_BUF_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL) {
+        free(buffer);
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    while ((n = pread(fd, buffer, STORE_BUF_SIZE, offset)) > 0) {
+        EVP_DigestUpdate(ctx, buffer, n);
+        offset += n;
+    }
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+    if (n < 0) {
+        return -1;
+    }
+    for (i = 0; i < digest_len; i++) {
+        sprintf(hash + i * 2, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+// Function to send the requested bytes of an open file as one data frame
+// The frame name tells the client where the bytes belong: "<offset>/<file size>@<sec>.<nsec>"
+// With DFILE_IF_MATCH the range is the validator of the client's copy, and the whole file is
+// sent only when that copy is out of date
+int sendFileRange(int client_sock, uint32_t request_id, int fd, const struct stat *st, const char *range, uint32_t param) {
+    char content_range[BUF_SIZE];
+    uint64_t offset, length;
+    int rc;
+
+    if (param & DFILE_IF_MATCH) {
+        if (copyIsCurrent(range, st, fd)) {
+            return sendEnd(client_sock, request_id, STATUS_NOT_MODIFIED, NULL);
+        }
+        range = NULL;
+    }
+    rc = parseByteRange(range, st, &offset, &length);
+    if (rc == -1) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid byte range.\n");
+    } else if (rc == -2) {
+        return sendEnd(client_sock, request_id, STATUS_RANGE, "Error: the requested range starts past the end of the file.\n");
+    }
+    snprintf(content_range, sizeof(content_range), "%llu/%llu@%lld.%09ld", (unsigned long long)offset,
+             (unsigned long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+    // Corked, the frame header, the file and the END frame leave in full segments
+    setCork(client_sock, 1);
+    if (sendFrame(client_sock, OP_DATA, request_id, 0, content_range, NULL, length) < 0) {
+        perror("Send error");
+        rc = -1;
+    } else if (sendFileContents(client_sock, fd, offset, length) < 0) {
+        // The frame promised length bytes, so a short send leaves the connection unusable
+        rc = -1;
+    } else {
+        rc = sendEnd(client_sock, request_id, STATUS_OK, NULL);
+    }
+    setCork(client_sock, 0);
+    return rc;
+}
+
+// Function to find the files of a resumable upload under the server's state directory
+// Returns 0, or -1 if the upload id is not valid or there is no state directory
+int uploadPaths(const char *upload_id, char *part_path, char *record_path, size_t size) {
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    size_t len = strlen(upload_id);
+
+    if (!home || len != UPLOAD_ID_LEN || strspn(upload_id, "0123456789abcdef") != len) {
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s/%s/%s", home, STATE_DIR, server_root, UPLOAD_DIR);
+    if (createDir(dir) != 0) {
+        return -1;
+    }
+    snprintf(part_path, size, "%s/%s.part", dir, upload_id);
+    snprintf(record_path, size, "%s/%s.offset", dir, upload_id);
+    return 0;
+}
+
+// Function to read the committed offset of an upload, 0 if nothing was committed yet
+uint64_t readUploadOffset(const char *record_path) {
+    char text[32];
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(record_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    text[n] = '\0';
+    return strtoull(text, NULL, 10);
+}
+
+// Function to record the committed offset of an upload, replacing the old record in one step
+int writeUploadOffset(const char *record_path, uint64_t offset) {
+    char tmp_path[PATH_MAX + 8];
+    char text[32];
+    int len;
+    int rc;
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", record_path);
+    len = snprintf(text, sizeof(text), "%llu\n", (unsigned long long)offset);
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    rc = writeAll(fd, text, len);
+    if (rc == 0) {
+        rc = fdatasync(fd);
+    }
+    close(fd);
+    if (rc == 0) {
+        rc = rename(tmp_path, record_path);
+    }
+    return rc;
+}
+
+// Function to end an upload request with the committed offset in the frame name
+int sendUploadOffset(int client_sock, uint32_t request_id, uint32_t status, uint64_t offset) {
+    char text[32];
+
+    snprintf(text, sizeof(text), "%llu", (unsigned long long)offset);
+    return sendFrame(client_sock, OP_END, request_id, status, text, NULL, 0);
+}
+
+// Function to handle OP_UQUERY: tell the client how much of an upload is already committed
+int uqueryCommandExecution(const char *upload_id, const char *fullpath, uint32_t request_id, int client_sock) {
+    char part_path[PATH_MAX];
+    char record_path[PATH_MAX];
+    uint64_t offset;
+
+    if (uploadPaths(upload_id, part_path, record_path, sizeof(part_path)) < 0) {
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid upload id.\n");
+    }
+    offset = readUploadOffset(record_path);
+    printf("Upload %s of '%s' is at %llu bytes\n", upload_id, fullpath, (unsigned long long)offset);
+    return sendUploadOffset(client_sock, request_id, STATUS_OK, offset);
+}
+
+// Function to add a byte range of a parallel upload to its record once the range is on disk
+// The ranges of one upload are written side by side, so each is recorded with a single append
+int recordUploadRange(const char *ranges_path, uint64_t offset, uint64_t length) {
+    char text[64];
+    int len, rc, fd;
+
+    len = snprintf(text, sizeof(text), "%llu %llu\n", (unsigned long long)offset, (unsigned long long)length);
+    if ((fd = open(ranges_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    rc = writeAll(fd, text, len);
+    close(fd);
+    return rc;
+}
+
+// Function to check that the recorded byte ranges of a parallel upload leave no hole in [0, size)
+// Returns 1 if they cover it, 0 if not
+int uploadRangesCover(const char *ranges_path, uint64_t size) {
+    struct uploadRange *ranges = NULL, *grown;
+    unsigned long long start, length;
+    size_t count = 0, capacity = 0, i;
+    uint64_t covered = 0;
+    FILE *record;
+
+    if ((record = fopen(ranges_path, "re")) == NULL) {
+        return size == 0;
+    }
+    while (fscanf(record, "%llu %llu", &start, &length) == 2) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            if ((grown = realloc(ranges, capacity * sizeof(*ranges))) == NULL) {
+                break;
+            }
+            ranges = grown;
+        }
+        ranges[count].start = start;
+        ranges[count].end = start + length;
+        count++;
+    }
+    fclose(record);
+
+    if (count > 0) {
+        qsort(ranges, count, sizeof(*ranges), compareUploadRanges);
+    }
+    for (i = 0; i < count && ranges[i].start <= covered; i++) {
+        if (ranges[i].end > covered) {
+            covered = ranges[i].end;
+        }
+    }
+    free(ranges);
+    return covered >= size;
+}
+
+int compareUploadRanges(const void *a, const void *b) {
+    const struct uploadRange *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Function to handle OP_UCHUNK: append one chunk of a resumable upload and checkpoint it
+// The chunk must start at or before the committed offset; the file is cut back to where it
+// starts, which drops bytes left from a chunk that never completed and lets a copy that got
+// ahead of the others continue with them. With UCHUNK_AT the chunk is one byte range of a parallel
+// upload instead, written in place alongside the others and noted in the upload's ranges
+// record. The last chunk moves the finished file into place
+int uchunkCommandExecution(const char *chunk, const char *fullpath, uint32_t param, uint64_t payload_len, uint32_t request_id, int client_sock) {
+    char response[BUF_SIZE];
+    char upload_id[BUF_SIZE];
+    char part_path[PATH_MAX];
+    char record_path[PATH_MAX];
+    char ranges_path[PATH_MAX + 8];
+    char old_hash[STORE_HASH_LEN + 1];
+    char dest_dir[BUF_SIZE];
+    char dir[PATH_MAX];
+    uint64_t offset, committed, done = 0;
+    int positional = (param & UCHUNK_AT) != 0;
+    const char *at = strrchr(chunk, '@');
+    const char *filename = strrchr(fullpath, '/') ? strrchr(fullpath, '/') + 1 : fullpath;
+    char *buffer;
+    ssize_t n;
+    int fd, body_fd, rc;
+
+    snprintf(upload_id, sizeof(upload_id), "%.*s", at ? (int)(at - chunk) : 0, chunk);
+    if (at == NULL || uploadPaths(upload_id, part_path, record_path, sizeof(part_path)) < 0) {
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: invalid upload id.\n");
+    }
+    offset = strtoull(at + 1, NULL, 10);
+    snprintf(ranges_path, sizeof(ranges_path), "%s.ranges", part_path);
+
+    // Requests for the same upload are serialised on the partial file, except the byte ranges
+    // of a parallel upload, which never overlap
+    if ((fd = open(part_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 || (buffer = malloc(UPLOAD_BUF_SIZE)) == NULL) {
+        perror("Upload open error");
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+    }
+    flock(fd, positional && !(param & UCHUNK_LAST) ? LOCK_SH : LOCK_EX);
+    committed = positional ? offset : readUploadOffset(record_path);
+    if (offset < committed) {
+        committed = offset;
+    }
+    if (offset != committed || (!positional && ftruncate(fd, committed) < 0)) {
+        free(buffer);
+        close(fd);
+        if (drainPayload(client_sock, payload_len) < 0) {
+            return -1;
+        }
+        return sendUploadOffset(client_sock, request_id, STATUS_RANGE, committed);
+    }
+    if (!positional) {
+        // The truncated file no longer holds what a parallel attempt recorded
+        unlink(ranges_path);
+    }
+
+    while (done < payload_len) {
+        n = recv(client_sock, buffer, payload_len - done < UPLOAD_BUF_SIZE ? payload_len - done : UPLOAD_BUF_SIZE, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The next attempt starts again from the last checkpoint
+            printf("Upload %s interrupted at %llu bytes\n", upload_id, (unsigned long long)(committed + done));
+            free(buffer);
+            close(fd);
+            return -1;
+        }
+        if (pwrite(fd, buffer, n, committed + done) != n) {
+            perror("Upload write error");
+            free(buffer);
+            close(fd);
+            if (drainPayload(client_sock, payload_len - done - n) < 0) {
+                return -1;
+            }
+            return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+        }
+        done += n;
+    }
+    free(buffer);
+
+    // The chunk only counts once it is on disk. Its checkpoint is always synced, so the data is
+    // synced before it even with --durability none, or a crash could leave a checkpoint that
+    // vouches for bytes the partial file never got
+    if ((durability_mode == DURABILITY_NONE ? fdatasync(fd) : commitFile(fd)) < 0 || (!positional && writeUploadOffset(record_path, committed + done) < 0) ||
+        (positional && done > 0 && recordUploadRange(ranges_path, committed, done) < 0)) {
+        perror("Upload checkpoint error");
+        close(fd);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+    }
+    if (!(param & UCHUNK_LAST)) {
+        close(fd);
+        return sendUploadOffset(client_sock, request_id, STATUS_OK, committed + done);
+    }
+    // A parallel upload is finished by a last chunk at the end of the file, once the ranges
+    // written before it leave no hole
+    struct stat st;
+    if (positional && (fstat(fd, &st) < 0 || (uint64_t)st.st_size != committed + done ||
+                       !uploadRangesCover(ranges_path, committed + done))) {
+        close(fd);
+        unlink(part_path);
+        unlink(ranges_path);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: the upload is incomplete.\n");
+    }
+
+    // Move the finished file into place; a stored file it replaces gives up its reference
+    snprintf(dest_dir, BUF_SIZE, "%s", fullpath);
+    if (strrchr(dest_dir, '/') != NULL) {
+        *strrchr(dest_dir, '/') = '\0';
+        createDir(dest_dir);
+    }
+    // In dedup mode the finished file goes into the content store like a whole upload
+    if (dedup_mode) {
+        if ((body_fd = open(part_path, O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("Upload open error");
+            close(fd);
+            return sendEnd(client_sock, request_id, STATUS_ERROR, "Error: cannot store the upload.\n");
+        }
+        rc = ufileIntoStore(filename, fullpath, body_fd, committed + done, request_id, client_sock);
+        close(body_fd);
+        unlink(part_path);
+        unlink(record_path);
+        unlink(ranges_path);
+        close(fd);
+        printf("Upload %s of '%s' completed, %llu bytes\n", upload_id, fullpath, (unsigned long long)(committed + done));
+        return rc;
+    }
+    int replaced = storedHash(fullpath, old_hash) == 0;
+    if (rename(part_path, fullpath) < 0) {
+        snprintf(response, BUF_SIZE, "Error: cannot store '%s': %s\n", fullpath, strerror(errno));
+        close(fd);
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    close(fd);
+    unlink(record_path);
+    unlink(ranges_path);
+    if (replaced && openObjectStore(dir, sizeof(dir)) == 0) {
+        int lock_fd = lockObjectStore(dir);
+        if (lock_fd >= 0) {
+            releaseObject(dir, old_hash);
+            unlockObjectStore(lock_fd);
+        }
+    }
+    // Like finishUpload, the new name is only durable once the directory holding it is
+    if (commitDirectory(fullpath) < 0) {
+        perror("File commit error");
+        snprintf(response, BUF_SIZE, "Error: storing '%s' failed: %s\n", fullpath, strerror(errno));
+        return sendEnd(client_sock, request_id, STATUS_ERROR, response);
+    }
+    updatePathIndex(&path_index, fullpath, 1, invalidateTarCache(path_index.suffix));
+    printf("Upload %s of '%s' completed, %llu bytes\n", upload_id, fullpath, (unsigned long long)(committed + done));
+    snprintf(response, BUF_SIZE, "File '%s' is successfully uploaded\n", filename);
+    return sendEnd(client_sock, request_id, STATUS_OK, response);
+}
+
+// Function to drop resumable uploads nobody continued within UPLOAD_EXPIRY seconds
+void expireUploads(void) {
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    time_t now = time(NULL);
+    DIR *uploads;
+
+    if (!home) {
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s/%s/%s", home, STATE_DIR, server_root, UPLOAD_DIR);
+    if ((uploads = opendir(dir)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(uploads)) != NULL) {
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) {
+            continue;
+        }
+        if (entry->d_name[0] != '.' && lstat(path, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > UPLOAD_EXPIRY) {
+            unlink(path);
+        }
+    }
+    closedir(uploads);
 }
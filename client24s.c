@@ -9,29 +9,331 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <limits.h>
+#include <openssl/evp.h>
 
 #define PORT 9678
 #define BUF_SIZE 1024
+#define DISPLAY_LINE_MAX 4096  // longest path display prints in full
+#define LINK_MIN_SIZE (64 * 1024)  // files from this size are offered to the server by hash before their body
+#define HASH_BUF_SIZE (64 * 1024)
+#define HASH_HEX_LEN 64            // SHA-256 in hex
+#define UPLOAD_CHUNKED_MIN (16 * 1024 * 1024)  // files from this size are uploaded in resumable chunks
+#define UPLOAD_CHUNK_SIZE (4 * 1024 * 1024)    // bytes the server commits per checkpoint
+#define PARALLEL_MIN_SIZE (8 * 1024 * 1024)    // files from this size are split across --streams connections
+#define MAX_STREAMS 16
+#define DEFAULT_INFLIGHT 16  // batch mode: requests sent ahead of their responses
+#define MAX_INFLIGHT 1024
+#define BATCH_BUF_SIZE (64 * 1024)
+
+// Transfer chunks: --chunk-size fixes the buffer bodies are moved through, otherwise small
+// transfers use small buffers and large ones fewer, bigger system calls
+#define CHUNK_SMALL (64 * 1024)      // transfers up to CHUNK_SMALL_FILE bytes
+#define CHUNK_MEDIUM (256 * 1024)
+#define CHUNK_LARGE (1024 * 1024)    // transfers past CHUNK_LARGE_FILE bytes
+#define CHUNK_SMALL_FILE (1024 * 1024)
+#define CHUNK_LARGE_FILE (64 * 1024 * 1024)
+#define CHUNK_KB_MAX 16384
+#define CHUNK_SWEEP_MIN (16 * 1024)  // --chunk-sweep runs the benchmark from this size to CHUNK_LARGE
+#define SOCKET_BUFFER_KB_MAX 65536
+
+// utar builds the tar stream itself, batching headers and small files into sends of this size
+#define TAR_BLOCK_SIZE 512
+#define TAR_HEADER_MAX (TAR_BLOCK_SIZE * 12)  // pax extended header plus the ustar header
+#define INGEST_BUF_SIZE (256 * 1024)
+
+// Downloaded files are kept under $HOME/.dfs/client24s/cache, keyed by the SHA-256 of their server
+// path, so dfile of an unchanged file only asks the server whether it changed
+#define CACHE_DIR ".dfs/client24s/cache"
+#define CACHE_COPY_MAX (256 * 1024 * 1024)  // larger files are cached only when they can be hard linked
+
+// Framed protocol shared by client24s, Smain, Spdf and Stext.
+// Every message starts with a fixed header in network byte order:
+//   magic(2) version(1) opcode(1) request_id(4) param(4) name_len(2) path_len(2) payload_len(8)
+// followed by name_len bytes of name, path_len bytes of path and payload_len bytes of payload.
+// A request is answered by zero or more OP_DATA frames and exactly one OP_END frame.
+#define PROTO_MAGIC 0x4446
+#define PROTO_VERSION 1
+#define FRAME_HEADER_SIZE 24
+
+#define OP_UFILE 1    // name = file name, path = destination directory, payload = file body
+#define OP_DFILE 2    // path = file to download, name = optional byte range "first-[last][@<sec>.<nsec>]", or the validator with DFILE_IF_MATCH
+#define OP_RMFILE 3   // path = file to remove
+#define OP_DISPLAY 4  // path = directory to list, name = cursor (list after this path), param = page size (0 = all)
+#define OP_DTAR 5     // name = file type, param = compression (DTAR_PARAM)
+#define OP_LINK 6     // name = file name, path = destination directory, payload = SHA-256 of the body in hex
+#define OP_UQUERY 7   // name = upload id, path = destination file; the END name is the committed offset
+#define OP_UCHUNK 8   // name = "<upload id>@<offset>", path = destination file, param = UCHUNK_LAST on the last chunk
+#define OP_INGEST 9   // path = destination directory, payload = tar stream of .c, .pdf and .txt files
+#define OP_DATA 64    // payload = a piece of the response body
+#define OP_END 65     // param = status, payload = message for the user, name = display cursor of the next page
+
+#define STATUS_OK 0
+#define STATUS_ERROR 1
+#define STATUS_MISSING 2  // OP_LINK: the body is not stored, upload it with OP_UFILE
+#define STATUS_RANGE 3    // OP_DFILE: the range starts past the end of the file; OP_UCHUNK: wrong offset
+#define STATUS_NOT_MODIFIED 4  // OP_DFILE with DFILE_IF_MATCH: the client's copy is current, no body follows
+
+#define UCHUNK_LAST 1  // OP_UCHUNK param: the upload is complete after this chunk
+#define UCHUNK_AT 2    // OP_UCHUNK param: write at the given offset without a checkpoint, for parallel streams
+
+#define DFILE_IF_MATCH 1  // OP_DFILE param: name is "<size>@<sec>.<nsec>[#<sha256>]" of the client's copy
+
+// dtar compression: codec in the low byte of param, level (0-9) in the next byte
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define DTAR_PARAM(codec, level) ((uint32_t)(codec) | ((uint32_t)(level) << 8))
+#define DTAR_CODEC(param) ((param) & 0xff)
+#define DTAR_LEVEL(param) (((param) >> 8) & 0xff)
+#define DEFAULT_GZIP_LEVEL 6
+
+struct frameHeader {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    uint32_t param;
+    uint16_t name_len;
+    uint16_t path_len;
+    uint64_t payload_len;
+};
+
+// Work and results of one benchmark thread
+struct benchJob {
+    uint8_t opcode;
+    uint32_t param;
+    char name[BUF_SIZE];
+    char path[BUF_SIZE];
+    int persistent;
+    int requests;
+    double *latencies;  // Latency of each successful request in milliseconds
+    int completed;      // Entries in latencies
+    long long bytes;
+    int failures;
+    int connect_failures;  // Failures that never got a connection, also counted in failures
+};
+
+// One byte range of a large ufile/dfile, moved over its own connection
+struct rangeJob {
+    const char *remote_path;  // dfile: file on the server, ufile: destination file
+    const char *local_path;   // ufile: file to read
+    const char *upload_id;    // ufile: upload the range belongs to
+    const char *validator;    // dfile: "<sec>.<nsec>" mtime of the version being fetched
+    int fd;                   // dfile: partial file the range is written into
+    uint64_t offset;
+    uint64_t length;
+    int rc;                   // 0 once the whole range was moved
+};
+
+// One regular file found by the tar walk
+struct tarEntry {
+    char *name;         // path inside the archive, e.g. "./a/x.c"
+    uint64_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    size_t header_len;  // bytes of header blocks in front of the file body
+};
+
+struct tarList {
+    struct tarEntry *entries;
+    size_t count;
+    size_t cap;
+};
+
+// One command of a batch, from the line it came from to its result
+struct batchCommand {
+    int line;
+    char text[BUF_SIZE];
+    uint8_t opcode;
+    uint32_t request_id;
+    char output[BUF_SIZE];  // dfile/dtar: local file the response body is written to
+    uint64_t sent_bytes;    // ufile: size of the body
+    struct timespec start;
+};
+
+// Batch commands sent but not answered yet; Smain answers them in the order they were sent
+struct batchQueue {
+    struct batchCommand *slots;
+    int capacity;
+    int head;
+    int count;
+    int done;    // the sender has sent its last command
+    int broken;  // the connection failed, nothing more is sent or read
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+// Totals of a batch, kept by the receiving thread
+struct batchStats {
+    int sock;
+    int commands;
+    int failures;
+    long long bytes;
+    struct batchQueue *queue;
+};
+
+// Request ids let each response be matched with the command that caused it
+static uint32_t next_request_id = 1;
+static int transfer_streams = 1;  // connections a large ufile/dfile is split across
+static size_t transfer_chunk = 0;  // --chunk-size, 0 sizes the chunks by the transfer
+static int socket_buffer = 0;      // --socket-buffer in bytes, 0 leaves the sizes to the kernel
 
 int connectToServer(); 
-void uploadFile(int sock, const char *filename, const char *dest_path);
-void downloadFile(int sock, const char *filename);
-void tarFile(int sock, const char *filetype);
-void displayFiles(int sock, const char *pathname);
+int uploadFile(int sock, const char *filename, const char *dest_path);
+int linkFile(int sock, FILE *file, const char *filename, const char *dest_path);
+int hashFile(FILE *file, char *hash);
+int uploadChunked(int sock, FILE *file, const struct stat *st, const char *filename, const char *dest_path);
+void uploadId(const char *filename, const struct stat *st, const char *fullpath, char *upload_id);
+int recvUploadOffset(int sock, uint64_t *offset, char *message, size_t size);
+int uploadParallel(int sock, const struct stat *st, const char *filename, const char *dest_path);
+int downloadParallel(int sock, const char *remote_path, const char *file_name, const char *part_name);
+int splitRanges(struct rangeJob *jobs, uint64_t size);
+int runRangeJobs(struct rangeJob *jobs, int count, void *(*worker)(void *));
+void *uploadRangeWorker(void *arg);
+void *downloadRangeWorker(void *arg);
+int removeFile(int sock, const char *filename);
+int downloadFile(int sock, const char *filename);
+int downloadRange(int sock, const char *remote_path, const char *file_name, const char *part_name, int resume, const char *validator);
+int cachePaths(const char *remote_path, char *body_path, char *meta_path, size_t size);
+int cachedValidator(const char *remote_path, char *validator, size_t size);
+void cacheDownload(const char *remote_path, const char *file_name);
+int restoreFromCache(const char *remote_path, const char *file_name, const char *part_name);
+int copyFile(const char *from, const char *to);
+int tarFile(int sock, const char *filetype, uint32_t param);
+int parseCompression(const char *arg, uint32_t *param);
+int displayFiles(int sock, const char *pathname, uint32_t page_size);
+void printDisplayLine(const char *line, const char *expanded_pathname, size_t base_len);
+int recvMessage(int sock, uint64_t len, char *message, size_t size);
 void tildePathOperation(char *path, char *expanded_path, size_t size);
 int validateCommands(const char *command);
 void trimLeadingWhiteSpaces(char *str);
-
-int main() {
+double elapsedMs(const struct timespec *start, const struct timespec *end);
+int compareDoubles(const void *a, const void *b);
+void *benchWorker(void *arg);
+void runBenchmark(const char *command, int requests, int concurrency, int persistent);
+int runBatch(const char *path, int inflight);
+int sendBatchCommand(int sock, struct batchCommand *cmd);
+void *batchReceiver(void *arg);
+int recvBatchResponse(int sock, struct batchCommand *cmd, char *message, long long *bytes);
+void tarFileName(const char *filetype, uint32_t param, char *tar_filename, size_t size);
+int ingestFiles(int sock, const char *source, const char *dest_path);
+int sendIngestRequest(int sock, uint32_t request_id, const char *source, const char *dest_path, uint64_t *sent);
+int collectIngestEntries(const char *root, char *rel, size_t rel_len, struct tarList *list);
+int sendIngestStream(int sock, const char *root, struct tarList *list, int archive_fd, uint64_t archive_size);
+int appendIngestData(int sock, char *out, size_t *used, int fd, uint64_t len);
+int addTarEntry(struct tarList *list, const char *name, const struct stat *st);
+void freeTarList(struct tarList *list);
+size_t buildTarHeader(const struct tarEntry *entry, unsigned char *out);
+int sendAll(int sock, const void *buf, size_t len);
+int sendAllFlags(int sock, const void *buf, size_t len, int flags);
+int recvAll(int sock, void *buf, size_t len);
+int sendFrame(int sock, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len);
+int recvFrame(int sock, struct frameHeader *hdr, char *name, char *path);
+int sendData(int sock, uint32_t request_id, const void *buf, size_t len);
+int sendEnd(int sock, uint32_t request_id, uint32_t status, const char *message);
+int drainPayload(int sock, uint64_t len);
+void setNoDelay(int sock);
+void setSocketBuffers(int sock);
+void setCork(int sock, int on);
+size_t transferChunk(uint64_t len);
+
+int main(int argc, char *argv[]) {
     int sock;
     struct sockaddr_in server_addr;
     char buffer[BUF_SIZE];
+    static struct option long_options[] = {
+        {"bench", required_argument, NULL, 'b'},
+        {"requests", required_argument, NULL, 'n'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"persistent", no_argument, NULL, 'p'},
+        {"streams", required_argument, NULL, 's'},
+        {"batch", required_argument, NULL, 'B'},
+        {"inflight", required_argument, NULL, 'i'},
+        {"chunk-size", required_argument, NULL, 'k'},
+        {"socket-buffer", required_argument, NULL, 'S'},
+        {"chunk-sweep", no_argument, NULL, 'W'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *bench_command = NULL;
+    const char *batch_path = NULL;
+    int batch_inflight = DEFAULT_INFLIGHT;
+    int bench_requests = 1000;
+    int bench_concurrency = 8;
+    int bench_persistent = 0;
+    int chunk_sweep = 0;
+    int opt;
+    int rc = 0;
+
+    // Parse the benchmark options
+    while ((opt = getopt_long(argc, argv, "b:n:c:ps:B:i:k:S:W", long_options, NULL)) != -1) {
+        if (opt == 'p') {
+            bench_persistent = 1;
+        } else if (opt == 'b') {
+            bench_command = optarg;
+        } else if (opt == 'n') {
+            bench_requests = atoi(optarg);
+        } else if (opt == 'c') {
+            bench_concurrency = atoi(optarg);
+        } else if (opt == 's' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_STREAMS) {
+            transfer_streams = atoi(optarg);
+        } else if (opt == 'B') {
+            batch_path = optarg;
+        } else if (opt == 'i' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_INFLIGHT) {
+            batch_inflight = atoi(optarg);
+        } else if (opt == 'k' && strcmp(optarg, "auto") == 0) {
+            transfer_chunk = 0;
+        } else if (opt == 'k' && atoi(optarg) >= 4 && atoi(optarg) <= CHUNK_KB_MAX) {
+            transfer_chunk = (size_t)atoi(optarg) * 1024;
+        } else if (opt == 'S' && atoi(optarg) >= 0 && atoi(optarg) <= SOCKET_BUFFER_KB_MAX) {
+            socket_buffer = atoi(optarg) * 1024;
+        } else if (opt == 'W') {
+            chunk_sweep = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--streams 1-%d] [--chunk-size KB|auto] [--socket-buffer KB] [--batch <file>|- [--inflight 1-%d]] [--bench \"<command>\" [--requests N] [--concurrency N] [--persistent] [--chunk-sweep]]\n", argv[0], MAX_STREAMS, MAX_INFLIGHT);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Run the benchmark instead of the interactive prompt when requested
+    if (bench_command) {
+        if (bench_requests <= 0 || bench_concurrency <= 0) {
+            fprintf(stderr, "Requests and concurrency must be positive\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!chunk_sweep) {
+            runBenchmark(bench_command, bench_requests, bench_concurrency, bench_persistent);
+            return 0;
+        }
+        // Run the same benchmark once for every chunk size, doubling it each time
+        for (transfer_chunk = CHUNK_SWEEP_MIN; transfer_chunk <= CHUNK_LARGE; transfer_chunk *= 2) {
+            printf("Chunk size: %zu KB\n", transfer_chunk / 1024);
+            runBenchmark(bench_command, bench_requests, bench_concurrency, bench_persistent);
+            printf("\n");
+        }
+        return 0;
+    }
+
+    // Run the commands of a file (or stdin) without prompting
+    if (batch_path) {
+        return runBatch(batch_path, batch_inflight) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     // Create socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -47,6 +349,7 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    setSocketBuffers(sock);
     // Connect to Smain server
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         printf("Connection refused. Closing..\n");
@@ -54,16 +357,15 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    setNoDelay(sock);
     printf("Connected to Smain server\n");
 
+    // Every command is sent over this one connection
     while (1) {
-        int sock = connectToServer();
-        if (sock == -1) {
-            printf("Could not connect to server.\n");
-            exit(EXIT_FAILURE);
-        }
         printf("Enter command: ");
-        fgets(buffer, BUF_SIZE, stdin);
+        if (fgets(buffer, BUF_SIZE, stdin) == NULL) {
+            break;
+        }
         buffer[strcspn(buffer, "\n")] = '\0'; // Remove newline character
 
         // Trim leading white spaces before the command
@@ -71,61 +373,49 @@ int main() {
 
         // Validate the command before sending it to the server
         if (!validateCommands(buffer)) {
-            close(sock);
             continue; // Skip this iteration if the command is invalid
         }
 
         if (strncmp(buffer, "ufile ", 6) == 0) {
-            // int sock = connectToServer(); // Reconnect for each command
-            // if (sock == -1) continue;
             char *filename = strtok(buffer + 6, " ");
             char *dest_path = strtok(NULL, " ");
             if (filename && dest_path) {
-                uploadFile(sock, filename, dest_path);
+                rc = uploadFile(sock, filename, dest_path);
             } else {
                 printf("Invalid command format\n");
             }
+        } else if (strncmp(buffer, "utar ", 5) == 0) {
+            char *source = strtok(buffer + 5, " ");
+            char *dest_path = strtok(NULL, " ");
+            rc = ingestFiles(sock, source, dest_path);
         } else if (strncmp(buffer, "rmfile ", 7) == 0) {
-            // Send the rmfile command to the server
-            send(sock, buffer, strlen(buffer), 0);
-            // Receive and print the response from the server
-            ssize_t n = recv(sock, buffer, BUF_SIZE, 0);
-            if (n > 0) {
-                buffer[n] = '\0';  // Null-terminate the string
-                printf("%s", buffer);  // Print the response from the server
-            }
-
+            rc = removeFile(sock, buffer + 7);
         } else if (strncmp(buffer, "dfile ", 6) == 0) {
-        int sock = connectToServer(); // Reconnect for each command
-        if (sock == -1) continue;
-
-        char *filename = buffer + 6;
-        if (filename) {
-            downloadFile(sock, filename);
-        } else {
-            printf("Invalid command format\n");
-        }
-        close(sock); // Close connection after download
-
-        }else if (strncmp(buffer, "dtar ", 5) == 0) {
-
-        int sock = connectToServer(); // Reconnect for each command
-        if (sock == -1) continue;
-        char *filetype = buffer + 5;
-        tarFile(sock, filetype);
+            rc = downloadFile(sock, buffer + 6);
+        } else if (strncmp(buffer, "dtar ", 5) == 0) {
+            char *filetype = strtok(buffer + 5, " ");
+            uint32_t param = DTAR_PARAM(CODEC_NONE, 0);
+            parseCompression(strtok(NULL, " "), &param);
+            rc = tarFile(sock, filetype, param);
         }
         else if (strncmp(buffer, "display ", 8) == 0) {
-            int sock = connectToServer(); // Reconnect for each command
-            if (sock == -1) continue;
-            char *pathname = buffer + 8;
-            if (pathname) {
-                displayFiles(sock, pathname);
-            } else {
-                printf("Invalid command format\n");
-            }
+            char *pathname = strtok(buffer + 8, " ");
+            char *page = strtok(NULL, " ");
+            rc = displayFiles(sock, pathname, page ? (uint32_t)atoi(page) : 0);
         }
         else {
-            printf("Invalid command: Please enter either ufile, dfile, rmfile, dtar or display commands.\n");
+            printf("Invalid command: Please enter either ufile, utar, dfile, rmfile, dtar or display commands.\n");
+        }
+
+        // Reconnect if Smain dropped the connection during the command
+        if (rc < 0) {
+            rc = 0;
+            close(sock);
+            sock = connectToServer();
+            if (sock == -1) {
+                printf("Could not connect to server.\n");
+                exit(EXIT_FAILURE);
+            }
         }
     }
 
@@ -151,12 +441,14 @@ int connectToServer() {
         return -1;
     }
 
+    setSocketBuffers(sock);
     // Connect to the server
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Connection failed");
         close(sock);
         return -1;
     }
+    setNoDelay(sock);
 
     return sock;
 }
@@ -170,220 +462,1934 @@ void trimLeadingWhiteSpaces(char *str) {
         start++;
     }
 
-    // Shift all characters back to the start of the string
-    memmove(str, start, strlen(start) + 1);
+    // Shift all characters back to the start of the string
+    memmove(str, start, strlen(start) + 1);
+}
+
+int uploadFile(int sock, const char *filename, const char *dest_path) {
+    char buffer[BUF_SIZE];
+    char expanded_dest_path[BUF_SIZE];
+    struct frameHeader hdr;
+    struct stat st;
+    FILE *file;
+    uint64_t remaining;
+    uint32_t request_id = next_request_id++;
+    char *body;
+    size_t chunk, n;
+
+    // Expand ~ in the destination path
+    tildePathOperation((char *)dest_path, expanded_dest_path, BUF_SIZE);
+
+    // Check if the file exists before sending the command to the server
+    if (access(filename, F_OK) == -1) {
+        printf("Error: File '%s' does not exist.\n", filename);
+        return 0;
+    }
+
+    if ((file = fopen(filename, "rb")) == NULL || fstat(fileno(file), &st) < 0) {
+        perror("File open error");
+        if (file) {
+            fclose(file);
+        }
+        return 0;
+    }
+
+    // A server that already stores the same content only needs its hash
+    if (st.st_size >= LINK_MIN_SIZE) {
+        int linked = linkFile(sock, file, filename, expanded_dest_path);
+        if (linked != 0) {
+            fclose(file);
+            return linked < 0 ? -1 : 0;
+        }
+        rewind(file);
+    }
+
+    // With --streams, large files are split into byte ranges sent over parallel connections
+    if (transfer_streams > 1 && st.st_size >= PARALLEL_MIN_SIZE) {
+        int rc = uploadParallel(sock, &st, filename, expanded_dest_path);
+        fclose(file);
+        return rc;
+    }
+
+    // Large files go in checkpointed chunks, so a broken connection does not lose what was sent
+    if (st.st_size >= UPLOAD_CHUNKED_MIN) {
+        int rc = uploadChunked(sock, file, &st, filename, expanded_dest_path);
+        fclose(file);
+        return rc;
+    }
+
+    remaining = st.st_size;
+    chunk = transferChunk(remaining);
+    if ((body = malloc(chunk)) == NULL) {
+        perror("malloc error");
+        fclose(file);
+        return 0;
+    }
+
+    // The request carries the file size so the server knows where the body ends, corked so
+    // the header and the tail of the file leave in full segments
+    setCork(sock, 1);
+    if (sendFrame(sock, OP_UFILE, request_id, 0, filename, expanded_dest_path, remaining) < 0) {
+        perror("Send error");
+        free(body);
+        fclose(file);
+        return -1;
+    }
+
+    while (remaining > 0 && (n = fread(body, 1, remaining < chunk ? remaining : chunk, file)) > 0) {
+        if (sendAll(sock, body, n) < 0) {
+            perror("Send error");
+            free(body);
+            fclose(file);
+            return -1;
+        }
+        remaining -= n;
+    }
+    setCork(sock, 0);
+    free(body);
+    fclose(file);
+    if (remaining > 0) {
+        // The file shrank while it was being read, the connection is out of step
+        printf("Error: File '%s' changed while uploading.\n", filename);
+        return -1;
+    }
+
+    // Wait for the server to confirm the upload
+    while (recvFrame(sock, &hdr, buffer, buffer) > 0) {
+        if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            printf("%s", buffer);
+            return 0;
+        }
+    }
+    perror("Receive error");
+    return -1;
+}
+
+// Function to offer a file to the server by the hash of its content
+// Returns 1 if the server stored it from content it already had, 0 if the body has to be
+// uploaded, or -1 if the connection failed
+int linkFile(int sock, FILE *file, const char *filename, const char *dest_path) {
+    char buffer[BUF_SIZE];
+    char hash[HASH_HEX_LEN + 1];
+    struct frameHeader hdr;
+    uint32_t request_id = next_request_id++;
+
+    if (hashFile(file, hash) < 0) {
+        return 0;
+    }
+    if (sendFrame(sock, OP_LINK, request_id, 0, filename, dest_path, HASH_HEX_LEN) < 0 ||
+        sendAll(sock, hash, HASH_HEX_LEN) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    while (recvFrame(sock, &hdr, buffer, buffer) > 0) {
+        if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            if (hdr.param == STATUS_MISSING) {
+                return 0;
+            }
+            printf("%s", buffer);
+            return 1;
+        }
+    }
+    perror("Receive error");
+    return -1;
+}
+
+// Function to compute the SHA-256 of a file as lowercase hex
+int hashFile(FILE *file, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i, digest_len;
+    EVP_MD_CTX *ctx;
+    char *buffer;
+    size_t n;
+    int rc = 0;
+
+    buffer = malloc(HASH_BUF_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (buffer == NULL || ctx == NULL) {
+        free(buffer);
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    while ((n = fread(buffer, 1, HASH_BUF_SIZE, file)) > 0) {
+        EVP_DigestUpdate(ctx, buffer, n);
+    }
+    if (ferror(file)) {
+        rc = -1;
+    }
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+
+    for (i = 0; i < digest_len; i++) {
+        sprintf(hash + i * 2, "%02x", digest[i]);
+    }
+    return rc;
+}
+
+// Function to upload a file in chunks the server commits one by one
+// The server is asked first how much of this upload it already holds, and the rest is sent from
+// there. The upload id is derived from the file and destination, so running ufile again after a
+// failure continues the same upload
+int uploadChunked(int sock, FILE *file, const struct stat *st, const char *filename, const char *dest_path) {
+    char buffer[BUF_SIZE];
+    char fullpath[BUF_SIZE];
+    char upload_id[HASH_HEX_LEN + 1];
+    char chunk[BUF_SIZE];
+    uint64_t size = st->st_size;
+    uint64_t offset, len, sent;
+    uint32_t param;
+    size_t chunk_size = transferChunk(size < UPLOAD_CHUNK_SIZE ? size : UPLOAD_CHUNK_SIZE);
+    char *body;
+    int status, rc = 0;
+    size_t n;
+
+    snprintf(fullpath, BUF_SIZE, "%s/%s", dest_path, filename);
+    uploadId(filename, st, fullpath, upload_id);
+
+    if (sendFrame(sock, OP_UQUERY, next_request_id++, 0, upload_id, fullpath, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    if ((status = recvUploadOffset(sock, &offset, buffer, BUF_SIZE)) < 0) {
+        return -1;
+    } else if (status != STATUS_OK) {
+        printf("%s", buffer);
+        return 0;
+    }
+    if (offset > 0) {
+        printf("Resuming upload of '%s' at %" PRIu64 " of %" PRIu64 " bytes\n", filename, offset, size);
+    }
+    if ((body = malloc(chunk_size)) == NULL) {
+        perror("malloc error");
+        return 0;
+    }
+
+    while (rc == 0) {
+        len = size - offset < UPLOAD_CHUNK_SIZE ? size - offset : UPLOAD_CHUNK_SIZE;
+        param = offset + len == size ? UCHUNK_LAST : 0;
+        snprintf(chunk, sizeof(chunk), "%s@%" PRIu64, upload_id, offset);
+        if (fseeko(file, offset, SEEK_SET) < 0) {
+            perror("File seek error");
+            rc = -1;
+            break;
+        }
+        // Each chunk is corked until its last byte, the checkpoint reply has to be waited for
+        setCork(sock, 1);
+        if (sendFrame(sock, OP_UCHUNK, next_request_id++, param, chunk, fullpath, len) < 0) {
+            perror("Send error");
+            rc = -1;
+            break;
+        }
+        for (sent = 0; sent < len; sent += n) {
+            n = fread(body, 1, len - sent < chunk_size ? len - sent : chunk_size, file);
+            if (n == 0) {
+                // The file shrank while it was being read, the connection is out of step
+                printf("Error: File '%s' changed while uploading.\n", filename);
+                rc = -1;
+                break;
+            }
+            if (sendAll(sock, body, n) < 0) {
+                perror("Send error");
+                printf("Upload of '%s' interrupted at %" PRIu64 " bytes, run ufile again to resume.\n", filename, offset);
+                rc = -1;
+                break;
+            }
+        }
+        setCork(sock, 0);
+        if (rc < 0) {
+            break;
+        }
+
+        if ((status = recvUploadOffset(sock, &offset, buffer, BUF_SIZE)) < 0) {
+            printf("Upload of '%s' interrupted, run ufile again to resume.\n", filename);
+            rc = -1;
+        } else if (status != STATUS_RANGE && (status != STATUS_OK || param == UCHUNK_LAST)) {
+            // STATUS_RANGE means the server holds a different amount than expected, the next
+            // chunk continues from its offset
+            printf("%s", buffer);
+            break;
+        }
+    }
+    free(body);
+    return rc;
+}
+
+// Function to upload a large file over transfer_streams connections at once
+// Every stream sends one byte range as a positional chunk of the same upload, and the main
+// connection finishes the upload once all of them are on the server
+int uploadParallel(int sock, const struct stat *st, const char *filename, const char *dest_path) {
+    char buffer[BUF_SIZE];
+    char fullpath[BUF_SIZE];
+    char upload_id[HASH_HEX_LEN + 1];
+    char chunk[BUF_SIZE];
+    struct rangeJob jobs[MAX_STREAMS];
+    uint64_t offset;
+    int count, i;
+
+    snprintf(fullpath, BUF_SIZE, "%s/%s", dest_path, filename);
+    uploadId(filename, st, fullpath, upload_id);
+    count = splitRanges(jobs, st->st_size);
+    for (i = 0; i < count; i++) {
+        jobs[i].remote_path = fullpath;
+        jobs[i].local_path = filename;
+        jobs[i].upload_id = upload_id;
+    }
+    if (runRangeJobs(jobs, count, uploadRangeWorker) < 0) {
+        printf("Error: parallel upload of '%s' failed.\n", filename);
+        return 0;
+    }
+
+    // An empty last chunk at the end of the file moves it into place
+    snprintf(chunk, sizeof(chunk), "%s@%lld", upload_id, (long long)st->st_size);
+    if (sendFrame(sock, OP_UCHUNK, next_request_id++, UCHUNK_AT | UCHUNK_LAST, chunk, fullpath, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    if (recvUploadOffset(sock, &offset, buffer, BUF_SIZE) < 0) {
+        return -1;
+    }
+    printf("%s", buffer);
+    return 0;
+}
+
+// Function to send one byte range of a parallel upload over a connection of its own
+void *uploadRangeWorker(void *arg) {
+    struct rangeJob *job = arg;
+    char message[BUF_SIZE];
+    char chunk[BUF_SIZE];
+    uint64_t offset, sent = 0;
+    size_t size = transferChunk(job->length);
+    char *buffer = malloc(size);
+    int fd = open(job->local_path, O_RDONLY | O_CLOEXEC);
+    int sock = connectToServer();
+    ssize_t n;
+
+    job->rc = -1;
+    snprintf(chunk, sizeof(chunk), "%s@%" PRIu64, job->upload_id, job->offset);
+    if (buffer != NULL && fd >= 0 && sock >= 0 &&
+        sendFrame(sock, OP_UCHUNK, 1, UCHUNK_AT, chunk, job->remote_path, job->length) == 0) {
+        while (sent < job->length) {
+            n = pread(fd, buffer, job->length - sent < size ? job->length - sent : size, job->offset + sent);
+            if (n <= 0 || sendAll(sock, buffer, n) < 0) {
+                break;
+            }
+            sent += n;
+        }
+        if (sent == job->length && recvUploadOffset(sock, &offset, message, BUF_SIZE) == STATUS_OK) {
+            job->rc = 0;
+        }
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Function to split a file into one byte range per stream
+// Returns the number of ranges, fewer than transfer_streams when the file is small
+int splitRanges(struct rangeJob *jobs, uint64_t size) {
+    uint64_t share = (size + transfer_streams - 1) / transfer_streams;
+    uint64_t offset;
+    int count = 0;
+
+    for (offset = 0; offset < size; offset += share) {
+        memset(&jobs[count], 0, sizeof(jobs[count]));
+        jobs[count].offset = offset;
+        jobs[count].length = size - offset < share ? size - offset : share;
+        count++;
+    }
+    return count;
+}
+
+// Function to move the byte ranges in parallel, one thread and connection each
+// Returns 0 if every range was moved, -1 otherwise
+int runRangeJobs(struct rangeJob *jobs, int count, void *(*worker)(void *)) {
+    pthread_t threads[MAX_STREAMS];
+    int started = 0;
+    int rc = 0;
+    int i;
+
+    for (started = 0; started < count; started++) {
+        if (pthread_create(&threads[started], NULL, worker, &jobs[started]) != 0) {
+            jobs[started].rc = -1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < count; i++) {
+        if (i >= started || jobs[i].rc != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+// Function to name an upload after the local file and its destination
+// A file that changed since an interrupted upload gets a new id, so its old chunks are not reused
+void uploadId(const char *filename, const struct stat *st, const char *fullpath, char *upload_id) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    char identity[BUF_SIZE * 3];
+    char local[PATH_MAX];
+    unsigned int i, digest_len;
+    int len;
+
+    if (realpath(filename, local) == NULL) {
+        snprintf(local, sizeof(local), "%s", filename);
+    }
+    len = snprintf(identity, sizeof(identity), "%s\n%lld\n%lld.%09ld\n%s", local, (long long)st->st_size,
+                   (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, fullpath);
+    EVP_Digest(identity, len, digest, &digest_len, EVP_sha256(), NULL);
+    for (i = 0; i < digest_len; i++) {
+        sprintf(upload_id + i * 2, "%02x", digest[i]);
+    }
+}
+
+// Function to read the answer to an upload request
+// Returns its status with the committed offset from the frame name and the message, or -1
+int recvUploadOffset(int sock, uint64_t *offset, char *message, size_t size) {
+    char name[BUF_SIZE];
+    struct frameHeader hdr;
+
+    while (recvFrame(sock, &hdr, name, message) > 0) {
+        if (recvMessage(sock, hdr.payload_len, message, size) < 0) {
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            *offset = strtoull(name, NULL, 10);
+            return hdr.param;
+        }
+    }
+    perror("Receive error");
+    return -1;
+}
+
+// Function to remove a file on the server
+int removeFile(int sock, const char *filename) {
+    char buffer[BUF_SIZE];
+    struct frameHeader hdr;
+    uint32_t request_id = next_request_id++;
+
+    // Send the rmfile command to the server
+    if (sendFrame(sock, OP_RMFILE, request_id, 0, NULL, filename, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    // Receive and print the response from the server
+    while (recvFrame(sock, &hdr, buffer, buffer) > 0) {
+        if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            printf("%s", buffer);  // Print the response from the server
+            return 0;
+        }
+    }
+    perror("Receive error");
+    return -1;
+}
+
+int downloadFile(int sock, const char *filename) {
+    char expanded_filename[BUF_SIZE];
+    char part_name[BUF_SIZE + 8];
+    char validator[BUF_SIZE];
+    int rc;
+
+    // Expand ~ in the filename path
+    tildePathOperation((char *)filename, expanded_filename, BUF_SIZE);
+
+    // Save the file under its name without the directory part
+    char *file_name_only = strrchr(expanded_filename, '/');
+    if (file_name_only == NULL) {
+        file_name_only = (char *)expanded_filename;  // No directory part in filename
+    } else {
+        file_name_only++;  // Skip the '/'
+    }
+
+    // The content is collected in <name>.part and renamed once complete, so an interrupted
+    // download leaves a partial file that the next dfile continues from
+    snprintf(part_name, sizeof(part_name), "%s.part", file_name_only);
+
+    // A copy cached by an earlier dfile is offered to the server, which sends the file only if
+    // it changed and otherwise answers "not modified" in one round trip
+    if (access(part_name, F_OK) != 0 && cachedValidator(expanded_filename, validator, sizeof(validator)) == 0) {
+        rc = downloadRange(sock, expanded_filename, file_name_only, part_name, 0, validator);
+        if (rc != 2) {
+            return rc < 0 ? -1 : 0;
+        }
+        if (restoreFromCache(expanded_filename, file_name_only, part_name) == 0) {
+            printf("File '%s' is not modified, kept the cached copy.\n", file_name_only);
+            return 0;
+        }
+        // The cached copy went away since it was offered, fetch the file again
+    }
+    if (transfer_streams > 1 && access(part_name, F_OK) != 0) {
+        rc = downloadParallel(sock, expanded_filename, file_name_only, part_name);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+    rc = downloadRange(sock, expanded_filename, file_name_only, part_name, 1, NULL);
+    if (rc == 1) {
+        // The partial file is longer than the file on the server, start again from the beginning
+        unlink(part_name);
+        rc = downloadRange(sock, expanded_filename, file_name_only, part_name, 0, NULL);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+// Function to find the cached body and record of a server path
+// Returns 0, or -1 without a home directory or when the cache directory cannot be created
+int cachePaths(const char *remote_path, char *body_path, char *meta_path, size_t size) {
+    const char *home = getenv("HOME");
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i, digest_len;
+    char dir[PATH_MAX];
+    char key[HASH_HEX_LEN + 1];
+    char *p;
+
+    if (!home || snprintf(dir, sizeof(dir), "%s/%s", home, CACHE_DIR) >= (int)sizeof(dir)) {
+        return -1;
+    }
+    // Create every missing directory on the way down
+    for (p = dir + strlen(home) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (EVP_Digest(remote_path, strlen(remote_path), digest, &digest_len, EVP_sha256(), NULL) != 1) {
+        return -1;
+    }
+    for (i = 0; i < digest_len; i++) {
+        sprintf(key + i * 2, "%02x", digest[i]);
+    }
+    snprintf(body_path, size, "%s/%s", dir, key);
+    snprintf(meta_path, size, "%s/%s.meta", dir, key);
+    return 0;
+}
+
+// Function to build the validator of the cached copy of a server path: "<size>@<sec>.<nsec>#<sha256>"
+// The copy must still have the size and mtime it was stored with, a copy that was changed in
+// place is not offered. Returns 0, or -1 when there is no usable copy
+int cachedValidator(const char *remote_path, char *validator, size_t size) {
+    char body_path[PATH_MAX];
+    char meta_path[PATH_MAX];
+    char path[BUF_SIZE];
+    char hash[HASH_HEX_LEN + 1];
+    unsigned long long file_size;
+    long long sec;
+    long nsec;
+    struct stat st;
+    FILE *meta;
+    int fields;
+
+    if (cachePaths(remote_path, body_path, meta_path, PATH_MAX) < 0 || (meta = fopen(meta_path, "r")) == NULL) {
+        return -1;
+    }
+    fields = fscanf(meta, "%llu %lld.%ld %64s\n", &file_size, &sec, &nsec, hash);
+    if (fgets(path, sizeof(path), meta) == NULL) {
+        fields = 0;
+    }
+    fclose(meta);
+    path[strcspn(path, "\n")] = '\0';
+    if (fields != 4 || strcmp(path, remote_path) != 0 || stat(body_path, &st) < 0 ||
+        (unsigned long long)st.st_size != file_size || st.st_mtim.tv_sec != sec || st.st_mtim.tv_nsec != nsec) {
+        return -1;
+    }
+    snprintf(validator, size, "%llu@%lld.%09ld#%s", file_size, sec, nsec, hash);
+    return 0;
+}
+
+// Function to keep a downloaded file in the cache, with its hash, size and mtime as the record
+// The body is a hard link to the download when both are on one file system, and a copy otherwise
+void cacheDownload(const char *remote_path, const char *file_name) {
+    char body_path[PATH_MAX];
+    char meta_path[PATH_MAX];
+    char temp_path[PATH_MAX + 8];
+    char hash[HASH_HEX_LEN + 1];
+    struct stat st;
+    FILE *file, *meta;
+    int rc;
+
+    if (cachePaths(remote_path, body_path, meta_path, PATH_MAX) < 0 || (file = fopen(file_name, "rb")) == NULL) {
+        return;
+    }
+    rc = fstat(fileno(file), &st) < 0 || hashFile(file, hash) < 0 ? -1 : 0;
+    fclose(file);
+    // The old record goes first, so a failure below leaves no record for a wrong body
+    unlink(meta_path);
+    unlink(body_path);
+    if (rc < 0 || (link(file_name, body_path) < 0 && (st.st_size > CACHE_COPY_MAX || copyFile(file_name, body_path) < 0))) {
+        return;
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", meta_path);
+    if ((meta = fopen(temp_path, "w")) == NULL) {
+        return;
+    }
+    fprintf(meta, "%llu %lld.%09ld %s\n%s\n", (unsigned long long)st.st_size, (long long)st.st_mtim.tv_sec,
+            st.st_mtim.tv_nsec, hash, remote_path);
+    if (fclose(meta) != 0 || rename(temp_path, meta_path) < 0) {
+        unlink(temp_path);
+    }
+}
+
+// Function to put the cached copy of a server path in place as the downloaded file
+// Returns 0, or -1 if the copy is gone or cannot be linked or copied
+int restoreFromCache(const char *remote_path, const char *file_name, const char *part_name) {
+    char body_path[PATH_MAX];
+    char meta_path[PATH_MAX];
+    struct stat body, current;
+
+    if (cachePaths(remote_path, body_path, meta_path, PATH_MAX) < 0 || stat(body_path, &body) < 0) {
+        return -1;
+    }
+    // The file in place may already be the cached copy itself
+    if (stat(file_name, &current) == 0 && current.st_dev == body.st_dev && current.st_ino == body.st_ino) {
+        return 0;
+    }
+    if (link(body_path, part_name) < 0 && copyFile(body_path, part_name) < 0) {
+        unlink(part_name);
+        return -1;
+    }
+    if (rename(part_name, file_name) < 0) {
+        perror("Rename error");
+        unlink(part_name);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to copy a file with its mtime, returns 0 or -1
+int copyFile(const char *from, const char *to) {
+    struct timespec times[2];
+    struct stat st;
+    char *buffer = malloc(HASH_BUF_SIZE);
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ssize_t n = -1;
+    int rc = -1;
+
+    if (buffer != NULL && in >= 0 && out >= 0 && fstat(in, &st) == 0) {
+        while ((n = read(in, buffer, HASH_BUF_SIZE)) > 0) {
+            if (write(out, buffer, n) != n) {
+                n = -1;
+                break;
+            }
+        }
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = st.st_mtim;
+        if (n == 0 && futimens(out, times) == 0) {
+            rc = 0;
+        }
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0 && close(out) < 0) {
+        rc = -1;
+    }
+    if (rc < 0 && out >= 0) {
+        unlink(to);
+    }
+    free(buffer);
+    return rc;
+}
+
+// Function to download a large file over transfer_streams connections at once
+// A one byte request gives the size and mtime of the file, then every stream fetches its own
+// range of that version and writes it in place. Returns 1 if the file is too small to split,
+// 0 when done, or -1 if the main connection failed
+int downloadParallel(int sock, const char *remote_path, const char *file_name, const char *part_name) {
+    char buffer[BUF_SIZE];
+    char name[BUF_SIZE];
+    char validator[64];
+    struct rangeJob jobs[MAX_STREAMS];
+    struct frameHeader hdr;
+    struct timespec times[2];
+    uint64_t offset, total = 0;
+    long long sec = 0;
+    long nsec = 0;
+    int status = -1;
+    int count, fd, i;
+
+    if (sendFrame(sock, OP_DFILE, next_request_id++, 0, "0-0", remote_path, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    while (recvFrame(sock, &hdr, name, buffer) > 0) {
+        if (hdr.opcode == OP_END) {
+            if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) == 0) {
+                status = hdr.param;
+            }
+            break;
+        }
+        if (sscanf(name, "%" SCNu64 "/%" SCNu64 "@%lld.%ld", &offset, &total, &sec, &nsec) != 4 ||
+            drainPayload(sock, hdr.payload_len) < 0) {
+            break;
+        }
+    }
+    if (status < 0) {
+        perror("Receive error");
+        return -1;
+    } else if (status != STATUS_OK) {
+        printf("%s", buffer);
+        return 0;
+    } else if (total < PARALLEL_MIN_SIZE) {
+        return 1;
+    }
+
+    if ((fd = open(part_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 || ftruncate(fd, total) < 0) {
+        perror("File open error");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    snprintf(validator, sizeof(validator), "%lld.%09ld", sec, nsec);
+    count = splitRanges(jobs, total);
+    for (i = 0; i < count; i++) {
+        jobs[i].remote_path = remote_path;
+        jobs[i].validator = validator;
+        jobs[i].fd = fd;
+    }
+    if (runRangeJobs(jobs, count, downloadRangeWorker) < 0) {
+        // The ranges that did arrive leave holes, so nothing is kept for a resume
+        close(fd);
+        unlink(part_name);
+        printf("Error: parallel download of '%s' failed.\n", file_name);
+        return 0;
+    }
+
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = sec;
+    times[1].tv_nsec = nsec;
+    futimens(fd, times);
+    close(fd);
+    if (rename(part_name, file_name) < 0) {
+        perror("Rename error");
+        return 0;
+    }
+    cacheDownload(remote_path, file_name);
+    printf("File '%s' downloaded successfully over %d streams.\n", file_name, count);
+    return 0;
+}
+
+// Function to fetch one byte range of a parallel download over a connection of its own
+void *downloadRangeWorker(void *arg) {
+    struct rangeJob *job = arg;
+    struct frameHeader hdr;
+    char name[BUF_SIZE];
+    char message[BUF_SIZE];
+    char range[BUF_SIZE];
+    uint64_t offset, received = 0;
+    size_t size = transferChunk(job->length);
+    char *buffer = malloc(size);
+    int sock = connectToServer();
+    ssize_t n;
+
+    job->rc = -1;
+    snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64 "@%s", job->offset, job->offset + job->length - 1, job->validator);
+    if (buffer != NULL && sock >= 0 && sendFrame(sock, OP_DFILE, 1, 0, range, job->remote_path, 0) == 0) {
+        while (recvFrame(sock, &hdr, name, message) > 0) {
+            if (hdr.opcode == OP_END) {
+                if (recvMessage(sock, hdr.payload_len, message, BUF_SIZE) == 0 && hdr.param == STATUS_OK && received == job->length) {
+                    job->rc = 0;
+                }
+                break;
+            }
+            // A file that changed since the first request comes back whole, which does not fit here
+            if (sscanf(name, "%" SCNu64 "/", &offset) != 1 || offset != job->offset || hdr.payload_len != job->length) {
+                break;
+            }
+            while (received < job->length) {
+                n = recv(sock, buffer, job->length - received < size ? job->length - received : size, 0);
+                if (n <= 0 || pwrite(job->fd, buffer, n, job->offset + received) != n) {
+                    break;
+                }
+                received += n;
+            }
+            if (received < job->length) {
+                break;
+            }
+        }
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Function to run one dfile request, continuing the partial file when resume is set
+// The partial file keeps the server's mtime of the file, which the server checks before it
+// sends only the missing bytes. With a validator the request is conditional on the cached copy.
+// Returns 0 when done, 1 if the server rejected the range, 2 if the cached copy is not modified,
+// or -1 if the connection failed (the partial file is kept)
+int downloadRange(int sock, const char *remote_path, const char *file_name, const char *part_name, int resume, const char *validator) {
+    char buffer[BUF_SIZE];
+    char name[BUF_SIZE];
+    char range[BUF_SIZE];
+    struct frameHeader hdr;
+    struct timespec times[2];
+    struct stat st;
+    uint32_t request_id = next_request_id++;
+    uint64_t offset = 0, total = 0, start = 0;
+    long long sec;
+    long nsec;
+    char *body = NULL;
+    size_t chunk = 0;
+    int fd = -1;
+    ssize_t n;
+
+    range[0] = '\0';
+    if (resume && stat(part_name, &st) == 0 && st.st_size > 0) {
+        snprintf(range, sizeof(range), "%llu-@%lld.%09ld", (unsigned long long)st.st_size,
+                 (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+
+    if (validator) {
+        snprintf(range, sizeof(range), "%s", validator);
+    }
+
+    // Send the dfile command to the server
+    if (sendFrame(sock, OP_DFILE, request_id, validator ? DFILE_IF_MATCH : 0, range, remote_path, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+
+    // Only the modification time is set, the access time is left alone
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = 0;
+    times[1].tv_nsec = UTIME_OMIT;
+
+    // Receive data frames until the server ends the response
+    while (recvFrame(sock, &hdr, name, buffer) > 0) {
+        if (hdr.opcode == OP_END) {
+            if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+                break;
+            }
+            free(body);
+            if (fd >= 0) {
+                futimens(fd, times);
+                close(fd);
+            }
+            if (hdr.param == STATUS_RANGE) {
+                return 1;
+            } else if (hdr.param == STATUS_NOT_MODIFIED) {
+                return 2;
+            } else if (hdr.param != STATUS_OK) {
+                printf("%s", buffer);  // Print the error message
+                return 0;
+            } else if (rename(part_name, file_name) < 0) {
+                perror("Rename error");
+                return 0;
+            }
+            cacheDownload(remote_path, file_name);
+            if (start > 0) {
+                printf("File '%s' downloaded successfully (resumed at %" PRIu64 " of %" PRIu64 " bytes).\n", file_name, start, total);
+            } else {
+                printf("File '%s' downloaded successfully.\n", file_name);
+            }
+            return 0;
+        }
+
+        // The frame name says where its bytes go: "<offset>/<file size>@<sec>.<nsec>"
+        if (sscanf(name, "%" SCNu64 "/%" SCNu64 "@%lld.%ld", &offset, &total, &sec, &nsec) != 4) {
+            printf("Error: the server did not say which part of the file it sent.\n");
+            break;
+        }
+        times[1].tv_sec = sec;
+        times[1].tv_nsec = nsec;
+        if (fd < 0) {
+            // Anything past the offset the server continues from is discarded
+            if ((fd = open(part_name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 || ftruncate(fd, offset) < 0) {
+                perror("File open error");
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return -1;
+            }
+            start = offset;
+        }
+        if (body == NULL) {
+            chunk = transferChunk(hdr.payload_len);
+            if ((body = malloc(chunk)) == NULL) {
+                perror("malloc error");
+                break;
+            }
+        }
+        uint64_t remaining = hdr.payload_len;
+        while (remaining > 0) {
+            n = recv(sock, body, remaining < chunk ? remaining : chunk, 0);
+            if (n <= 0) {
+                break;
+            }
+            if (pwrite(fd, body, n, offset) != n) {
+                perror("File write error");
+                free(body);
+                close(fd);
+                return -1;
+            }
+            offset += n;
+            remaining -= n;
+        }
+        if (remaining > 0) {
+            break;
+        }
+    }
+
+    perror("Receive error");
+    free(body);
+    if (fd >= 0) {
+        // Stamp what arrived so far, the next dfile continues after it
+        futimens(fd, times);
+        close(fd);
+        printf("Download of '%s' interrupted at %" PRIu64 " bytes, run dfile again to resume.\n", file_name, offset);
+    }
+    return -1;
+}
+
+// Function to parse the optional compression argument of dtar: gzip or gzip:<level>
+// Returns 0 and sets param on success, -1 if the argument is not understood
+int parseCompression(const char *arg, uint32_t *param) {
+    char *end;
+    long level = DEFAULT_GZIP_LEVEL;
+
+    if (arg == NULL) {
+        *param = DTAR_PARAM(CODEC_NONE, 0);
+        return 0;
+    }
+    if (strncmp(arg, "gzip", 4) != 0 || (arg[4] != '\0' && arg[4] != ':')) {
+        return -1;
+    }
+    if (arg[4] == ':') {
+        level = strtol(arg + 5, &end, 10);
+        if (end == arg + 5 || *end != '\0' || level < 0 || level > 9) {
+            return -1;
+        }
+    }
+    *param = DTAR_PARAM(CODEC_GZIP, level);
+    return 0;
+}
+
+int tarFile(int sock, const char *filetype, uint32_t param) {
+    char buffer[BUF_SIZE];
+    struct frameHeader hdr;
+    uint32_t request_id = next_request_id++;
+    char *body = NULL;
+    size_t chunk = 0;
+    ssize_t n;
+
+    // Send the dtar command to the server
+    if (sendFrame(sock, OP_DTAR, request_id, param, filetype, NULL, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+
+    // Determine the correct filename for the tar file
+    char tar_filename[BUF_SIZE];
+    tarFileName(filetype, param, tar_filename, BUF_SIZE);
+
+    FILE *file = fopen(tar_filename, "wb");
+    if (file == NULL) {
+        perror("File open error");
+        return -1;
+    }
+
+    size_t total_bytes_received = 0;
+    while (recvFrame(sock, &hdr, buffer, buffer) > 0) {
+        if (hdr.opcode == OP_END) {
+            if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+                break;
+            }
+            free(body);
+            fclose(file);
+            if (hdr.param != STATUS_OK) {
+                printf("%s", buffer);
+                remove(tar_filename);
+            } else if (total_bytes_received == 0) {
+                printf("No files exist to create the tar archive.\n");
+                remove(tar_filename); // Delete the empty tar file
+            } else {
+                printf("Tar file '%s' downloaded successfully.\n", tar_filename);
+            }
+            return 0;
+        }
+        if (body == NULL) {
+            chunk = transferChunk(hdr.payload_len);
+            if ((body = malloc(chunk)) == NULL) {
+                perror("malloc error");
+                break;
+            }
+        }
+        uint64_t remaining = hdr.payload_len;
+        while (remaining > 0) {
+            n = recv(sock, body, remaining < chunk ? remaining : chunk, 0);
+            if (n <= 0) {
+                break;
+            }
+            fwrite(body, 1, n, file);
+            total_bytes_received += n;
+            remaining -= n;
+        }
+        if (remaining > 0) {
+            break;
+        }
+    }
+
+    perror("Receive error");
+    free(body);
+    fclose(file);
+    return -1;
+}
+
+// Function to upload a directory tree, or an existing tar archive, as a single tar stream
+// Smain unpacks it as it arrives, so many small files cost one request instead of one each
+int ingestFiles(int sock, const char *source, const char *dest_path) {
+    char buffer[BUF_SIZE];
+    struct frameHeader hdr;
+    uint32_t request_id = next_request_id++;
+    uint64_t sent;
+    int rc;
+
+    rc = sendIngestRequest(sock, request_id, source, dest_path, &sent);
+    if (rc != 0) {
+        return rc < 0 ? -1 : 0;
+    }
+    // Receive and print the summary from the server
+    while (recvFrame(sock, &hdr, buffer, buffer) > 0) {
+        if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            printf("%s", buffer);
+            return 0;
+        }
+    }
+    perror("Receive error");
+    return -1;
+}
+
+// Function to send the utar request with its tar stream; only .c, .pdf and .txt files of a
+// directory are archived, an archive is sent as it is and Smain skips other members
+// Returns 0 when sent, 1 if nothing was sent or -1 if the connection failed
+int sendIngestRequest(int sock, uint32_t request_id, const char *source, const char *dest_path, uint64_t *sent) {
+    char expanded_source[BUF_SIZE];
+    char expanded_dest[BUF_SIZE];
+    char rel[PATH_MAX] = ".";
+    struct tarList list = {0};
+    struct stat st;
+    uint64_t total = 0;
+    int archive_fd = -1;
+    int rc;
+    size_t i;
+
+    tildePathOperation((char *)source, expanded_source, BUF_SIZE);
+    tildePathOperation((char *)dest_path, expanded_dest, BUF_SIZE);
+    if (stat(expanded_source, &st) < 0) {
+        printf("Error: cannot open '%s': %s\n", source, strerror(errno));
+        return 1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (collectIngestEntries(expanded_source, rel, 1, &list) < 0) {
+            printf("Error: out of memory while listing '%s'.\n", source);
+            freeTarList(&list);
+            return 1;
+        }
+        if (list.count == 0) {
+            printf("No .c, .pdf or .txt files found under '%s'.\n", source);
+            return 1;
+        }
+        // The stream size is announced up front: headers, bodies padded to blocks, two end blocks
+        for (i = 0; i < list.count; i++) {
+            total += list.entries[i].header_len + (list.entries[i].size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        }
+        total += 2 * TAR_BLOCK_SIZE;
+    } else if ((archive_fd = open(expanded_source, O_RDONLY)) < 0) {
+        printf("Error: cannot open '%s': %s\n", source, strerror(errno));
+        return 1;
+    } else {
+        total = st.st_size;
+    }
+
+    *sent = total;
+    rc = sendFrame(sock, OP_INGEST, request_id, 0, NULL, expanded_dest, total);
+    if (rc == 0) {
+        rc = sendIngestStream(sock, expanded_source, &list, archive_fd, st.st_size);
+    }
+    if (rc < 0) {
+        perror("Send error");
+    }
+    if (archive_fd >= 0) {
+        close(archive_fd);
+    }
+    freeTarList(&list);
+    return rc;
+}
+
+// Function to walk root/rel and list the .c, .pdf and .txt files under it for the tar stream
+// Unreadable directories are reported and left out; returns -1 only if out of memory
+int collectIngestEntries(const char *root, char *rel, size_t rel_len, struct tarList *list) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int rc = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    if ((dir = opendir(path)) == NULL) {
+        printf("Skipping '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    while (rc == 0 && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        char *ext = strrchr(entry->d_name, '.');
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || rel_len + len + 2 > PATH_MAX) {
+            continue;
+        }
+        snprintf(rel + rel_len, PATH_MAX - rel_len, "/%s", entry->d_name);
+        snprintf(path, sizeof(path), "%s/%s", root, rel);
+        if (lstat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                rc = collectIngestEntries(root, rel, rel_len + len + 1, list);
+            } else if (S_ISREG(st.st_mode) && ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".pdf") == 0 || strcmp(ext, ".txt") == 0)) {
+                rc = addTarEntry(list, rel, &st);
+            }
+        }
+        rel[rel_len] = '\0';
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Function to send the tar stream: the files of list under root, or archive_size bytes of an
+// existing archive when archive_fd is open. Returns 0 on success, -1 if sending failed
+int sendIngestStream(int sock, const char *root, struct tarList *list, int archive_fd, uint64_t archive_size) {
+    char path[PATH_MAX];
+    char *out = malloc(INGEST_BUF_SIZE);
+    size_t used = 0;
+    size_t i;
+    int rc = 0;
+
+    if (out == NULL) {
+        return -1;
+    }
+    if (archive_fd >= 0) {
+        rc = appendIngestData(sock, out, &used, archive_fd, archive_size);
+    }
+    for (i = 0; archive_fd < 0 && i < list->count && rc == 0; i++) {
+        struct tarEntry *entry = &list->entries[i];
+        int fd;
+
+        if (INGEST_BUF_SIZE - used < TAR_HEADER_MAX) {
+            rc = sendAllFlags(sock, out, used, MSG_MORE);
+            used = 0;
+        }
+        used += buildTarHeader(entry, (unsigned char *)out + used);
+        snprintf(path, sizeof(path), "%s/%s", root, entry->name + 2);
+        fd = open(path, O_RDONLY);
+        if (rc == 0) {
+            rc = appendIngestData(sock, out, &used, fd, entry->size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        // Bodies are padded with zeros to a whole block
+        if (rc == 0) {
+            rc = appendIngestData(sock, out, &used, -1, (TAR_BLOCK_SIZE - entry->size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+        }
+    }
+    // Two zero blocks end the archive
+    if (archive_fd < 0 && rc == 0) {
+        rc = appendIngestData(sock, out, &used, -1, 2 * TAR_BLOCK_SIZE);
+    }
+    if (rc == 0 && used > 0) {
+        rc = sendAll(sock, out, used);
+    }
+    free(out);
+    return rc;
+}
+
+// Function to append len bytes read from fd to the stream buffer, sending it whenever it is full
+// A file that shrank or cannot be read is padded with zeros so the stream keeps its announced
+// size, and fd -1 appends zeros only; returns -1 if sending failed
+int appendIngestData(int sock, char *out, size_t *used, int fd, uint64_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if (*used == INGEST_BUF_SIZE) {
+            if (sendAllFlags(sock, out, *used, MSG_MORE) < 0) {
+                return -1;
+            }
+            *used = 0;
+        }
+        size_t want = len < INGEST_BUF_SIZE - *used ? len : INGEST_BUF_SIZE - *used;
+        n = fd >= 0 ? read(fd, out + *used, want) : 0;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (fd >= 0) {
+                fprintf(stderr, "A file shrank or became unreadable while uploading, padding %llu bytes with zeros\n", (unsigned long long)len);
+                fd = -1;
+            }
+            memset(out + *used, 0, want);
+            n = want;
+        }
+        *used += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to append a file to the tar list, returns -1 if out of memory
+int addTarEntry(struct tarList *list, const char *name, const struct stat *st) {
+    unsigned char header[TAR_HEADER_MAX];
+    struct tarEntry *entry;
+
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        struct tarEntry *entries = realloc(list->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        list->entries = entries;
+        list->cap = cap;
+    }
+    entry = &list->entries[list->count];
+    if ((entry->name = strdup(name)) == NULL) {
+        return -1;
+    }
+    entry->size = st->st_size;
+    entry->mode = st->st_mode & 07777;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->mtime = st->st_mtime;
+    entry->header_len = buildTarHeader(entry, header);
+    list->count++;
+    return 0;
+}
+
+// Function to release the tar list
+void freeTarList(struct tarList *list) {
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = list->cap = 0;
+}
+
+// Function to build the header blocks for one file: a ustar header, preceded by a pax
+// extended header when the path does not fit ustar's name/prefix fields or the size needs
+// more than 11 octal digits. Returns the number of bytes written to out
+size_t buildTarHeader(const struct tarEntry *entry, unsigned char *out) {
+    unsigned char *h = out;
+    size_t name_len = strlen(entry->name);
+    size_t split = 0;
+    size_t pax_len = 0;
+    char pax[TAR_HEADER_MAX - 2 * TAR_BLOCK_SIZE];
+    int need_path = 0;
+    int need_size = entry->size > 077777777777ULL;
+    unsigned int sum;
+    size_t i;
+
+    // ustar keeps up to 100 bytes of name plus a 155 byte prefix split at a '/'
+    if (name_len > 100) {
+        need_path = 1;
+        for (i = name_len - 1; i > 0; i--) {
+            if (entry->name[i] == '/' && i <= 155 && name_len - i - 1 <= 100 && name_len - i - 1 > 0) {
+                split = i;
+                need_path = 0;
+                break;
+            }
+        }
+    }
+
+    if (need_path || need_size) {
+        // Each pax record is "<length> <key>=<value>\n", where length counts the whole record
+        const char *keys[2] = {"path", "size"};
+        char size_value[32];
+        const char *values[2] = {entry->name, size_value};
+        int k;
+
+        snprintf(size_value, sizeof(size_value), "%llu", (unsigned long long)entry->size);
+        for (k = 0; k < 2; k++) {
+            size_t body, len, digits = 1;
+            if ((k == 0 && !need_path) || (k == 1 && !need_size)) {
+                continue;
+            }
+            body = strlen(keys[k]) + strlen(values[k]) + 3;  // space, '=' and newline
+            while (1) {
+                len = body + digits;
+                if (snprintf(NULL, 0, "%zu", len) == (int)digits) {
+                    break;
+                }
+                digits++;
+            }
+            pax_len += snprintf(pax + pax_len, sizeof(pax) - pax_len, "%zu %s=%s\n", len, keys[k], values[k]);
+        }
+
+        memset(h, 0, TAR_BLOCK_SIZE);
+        snprintf((char *)h, 100, "./PaxHeaders/%.80s", strrchr(entry->name, '/') + 1);
+        snprintf((char *)h + 100, 8, "%07o", 0644);
+        snprintf((char *)h + 108, 8, "%07o", (unsigned int)entry->uid & 07777777);
+        snprintf((char *)h + 116, 8, "%07o", (unsigned int)entry->gid & 07777777);
+        snprintf((char *)h + 124, 12, "%011zo", pax_len);
+        snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)entry->mtime & 077777777777ULL);
+        h[156] = 'x';
+        memcpy(h + 257, "ustar", 6);
+        memcpy(h + 263, "00", 2);
+        memset(h + 148, ' ', 8);
+        for (sum = 0, i = 0; i < TAR_BLOCK_SIZE; i++) {
+            sum += h[i];
+        }
+        snprintf((char *)h + 148, 8, "%06o", sum);
+        h += TAR_BLOCK_SIZE;
+
+        memset(h, 0, (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+        memcpy(h, pax, pax_len);
+        h += (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+
+    memset(h, 0, TAR_BLOCK_SIZE);
+    if (split) {
+        memcpy(h, entry->name + split + 1, name_len - split - 1);
+        memcpy(h + 345, entry->name, split);
+    } else {
+        // A pax path record overrides this (possibly truncated) name
+        memcpy(h, entry->name, name_len < 100 ? name_len : 100);
+    }
+    snprintf((char *)h + 100, 8, "%07o", (unsigned int)entry->mode);
+    snprintf((char *)h + 108, 8, "%07o", (unsigned int)entry->uid & 07777777);
+    snprintf((char *)h + 116, 8, "%07o", (unsigned int)entry->gid & 07777777);
+    snprintf((char *)h + 124, 12, "%011llo", need_size ? 0ULL : (unsigned long long)entry->size);
+    snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)entry->mtime & 077777777777ULL);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    for (sum = 0, i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += h[i];
+    }
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    h += TAR_BLOCK_SIZE;
+
+    return h - out;
+}
+
+// Function to list the files under a directory, optionally page_size files at a time
+// Lines are printed as soon as they arrive; between pages the user is asked whether to go on
+int displayFiles(int sock, const char *pathname, uint32_t page_size) {
+    char buffer[BUF_SIZE];
+    char cursor[BUF_SIZE] = "";  // last path of the previous page
+    char path[BUF_SIZE];
+    char line[DISPLAY_LINE_MAX];
+    char expanded_pathname[BUF_SIZE];
+    struct frameHeader hdr;
+    uint32_t request_id;
+    size_t line_len = 0;
+    size_t base_len;
+    int files_found = 0;  // Variable to track if any files are found
+    int ended;
+
+    // Expand ~ in the pathname
+    tildePathOperation((char *)pathname, expanded_pathname, BUF_SIZE);
+
+    // Trim trailing slash, if present
+    size_t path_len = strlen(expanded_pathname);
+    if (path_len > 1 && expanded_pathname[path_len - 1] == '/') {
+        expanded_pathname[path_len - 1] = '\0';
+    }
+    
+    base_len = strlen(expanded_pathname);
+
+    // One request per page, each resuming after the cursor of the previous one
+    while (1) {
+        request_id = next_request_id++;
+        if (sendFrame(sock, OP_DISPLAY, request_id, page_size, cursor, expanded_pathname, 0) < 0) {
+            perror("Send error");
+            return -1;
+        }
+
+        // Receive the list of filenames from the server
+        ended = 0;
+        while (recvFrame(sock, &hdr, cursor, path) > 0) {
+            if (hdr.opcode == OP_END) {
+                ended = 1;
+                break;
+            }
+
+            // Data frames are read in buffer sized pieces, a line may span several of them
+            uint64_t remaining = hdr.payload_len;
+            while (remaining > 0) {
+                size_t chunk = remaining < BUF_SIZE ? remaining : BUF_SIZE;
+                if (recvAll(sock, buffer, chunk) < 0) {
+                    break;
+                }
+                remaining -= chunk;
+
+                for (size_t i = 0; i < chunk; i++) {
+                    if (buffer[i] != '\n') {
+                        // Paths longer than the line buffer are cut short
+                        if (line_len < sizeof(line) - 1) {
+                            line[line_len++] = buffer[i];
+                        }
+                        continue;
+                    }
+                    line[line_len] = '\0';
+                    line_len = 0;
+                    if (!files_found) {
+                        printf("List of files in %s:\n", expanded_pathname);  // Print the message only once when the first file is found
+                        files_found = 1;
+                    }
+                    printDisplayLine(line, expanded_pathname, base_len);
+                }
+            }
+            if (remaining > 0) {
+                break;
+            }
+        }
+        if (!ended) {
+            perror("Receive error");
+            return -1;
+        }
+        if (recvMessage(sock, hdr.payload_len, buffer, BUF_SIZE) < 0) {
+            perror("Receive error");
+            return -1;
+        }
+        if (hdr.param != STATUS_OK) {
+            printf("%s", buffer);
+            return 0;
+        }
+
+        // The final frame names the cursor of the next page, if there is one
+        if (cursor[0] == '\0') {
+            break;
+        }
+        printf("-- More -- (Enter for the next %u files, q to stop): ", page_size);
+        fflush(stdout);
+        if (fgets(buffer, BUF_SIZE, stdin) == NULL || buffer[0] == 'q') {
+            break;
+        }
+    }
+
+    if (files_found == 0) {
+        printf("There are no files in %s.\n", expanded_pathname);  // Print if no files are found
+    } else {
+        printf("\nDisplay command completed.\n");
+    }
+    return 0;
 }
 
-void uploadFile(int sock, const char *filename, const char *dest_path) {
-    char buffer[BUF_SIZE];
-    char expanded_dest_path[BUF_SIZE];
-    FILE *file;
-    size_t n;
-
-    // Expand ~ in the destination path
-    tildePathOperation((char *)dest_path, expanded_dest_path, BUF_SIZE);
+// Function to print one listed path relative to the directory that was asked for
+// Storage servers list the same directory with their own directory name in place of smain
+void printDisplayLine(const char *line, const char *expanded_pathname, size_t base_len) {
+    const char *smain = strstr(expanded_pathname, "/smain");
+    const char *dir_end = NULL;
+    size_t home_len, rest_len;
 
-    // Check if the file exists before sending the command to the server
-    if (access(filename, F_OK) == -1) {
-        printf("Error: File '%s' does not exist.\n", filename);
+    // Check if the line starts with the expanded pathname and remove the base path
+    if (strncmp(line, expanded_pathname, base_len) == 0) {
+        printf("%s\n", line + base_len + (line[base_len] == '/'));
         return;
     }
+    // Otherwise skip the server's directory and the part of the pathname below smain
+    if (smain) {
+        home_len = smain - expanded_pathname;
+        rest_len = base_len - home_len - strlen("/smain");
+        while (rest_len > 0 && smain[strlen("/smain") + rest_len - 1] == '/') {
+            rest_len--;
+        }
+        if (strncmp(line, expanded_pathname, home_len) == 0 && line[home_len] == '/') {
+            dir_end = strchr(line + home_len + 1, '/');
+        }
+        if (dir_end && strncmp(dir_end, smain + strlen("/smain"), rest_len) == 0 && dir_end[rest_len] == '/') {
+            printf("%s\n", dir_end + rest_len + 1);
+            return;
+        }
+    }
+    // If the line doesn't match any base path, just print it
+    printf("%s\n", line);
+}
 
-    snprintf(buffer, BUF_SIZE, "ufile\n%s\n%s\n", filename, expanded_dest_path);
-    send(sock, buffer, strlen(buffer), 0);
-    //printf("Sent command: %s %s\n", filename, expanded_dest_path);
+// Function to receive a text payload into message, dropping what does not fit
+int recvMessage(int sock, uint64_t len, char *message, size_t size) {
+    size_t keep = len < size - 1 ? len : size - 1;
 
-    if ((file = fopen(filename, "rb")) == NULL) {
-        perror("File open error");
-        return;
+    if (recvAll(sock, message, keep) < 0 || drainPayload(sock, len - keep) < 0) {
+        return -1;
     }
+    message[keep] = '\0';
+    return 0;
+}
 
-    while ((n = fread(buffer, 1, BUF_SIZE, file)) > 0) {
-        send(sock, buffer, n, 0);
-    }
-    printf("File '%s' is successfully uploaded\n",filename);
+// Function to return the milliseconds between two monotonic timestamps
+double elapsedMs(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
 
-    fclose(file);
-    shutdown(sock, SHUT_WR); // Close the write side of the socket to signal EOF
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
 }
 
-void downloadFile(int sock, const char *filename) {
+// Benchmark thread: one connection per request, like the interactive client
+void *benchWorker(void *arg) {
+    struct benchJob *job = arg;
     char buffer[BUF_SIZE];
-    char expanded_filename[BUF_SIZE];
-    ssize_t n;
-
-    // Expand ~ in the filename path
-    tildePathOperation((char *)filename, expanded_filename, BUF_SIZE);
+    struct frameHeader hdr;
+    struct timespec start, end;
+    int sock = -1;
+    int i, rc, failed;
 
-    // Send the dfile command to the server
-    snprintf(buffer, BUF_SIZE, "dfile %s", expanded_filename);
-    send(sock, buffer, strlen(buffer), 0);
-
-    // Receive the initial response from the server
-    n = recv(sock, buffer, BUF_SIZE, 0);
-    if (n <= 0) {
-        perror("Receive error");
-        close(sock);
-        return;
+    for (i = 0; i < job->requests; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (sock == -1) {
+            sock = connectToServer();
+        }
+        if (sock == -1) {
+            // Counted apart, a refused connection would otherwise pass for the fastest request
+            job->failures++;
+            job->connect_failures++;
+            continue;
+        }
+        failed = 0;
+        rc = sendFrame(sock, job->opcode, (uint32_t)i, job->param, job->name, job->path, 0);
+        // Read the whole response, counting the body bytes
+        while (rc == 0 && (rc = recvFrame(sock, &hdr, buffer, buffer)) > 0) {
+            job->bytes += hdr.payload_len;
+            if (drainPayload(sock, hdr.payload_len) < 0) {
+                rc = -1;
+                break;
+            }
+            if (hdr.opcode == OP_END) {
+                failed = hdr.param != STATUS_OK;
+                rc = 0;
+                break;
+            }
+            rc = 0;
+        }
+        if (rc != 0) {
+            failed = 1;
+        }
+        job->failures += failed;
+        // Without --persistent every request pays for its own connection, like the old client
+        if (rc != 0 || !job->persistent) {
+            close(sock);
+            sock = -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!failed) {
+            job->latencies[job->completed++] = elapsedMs(&start, &end);
+        }
     }
-    buffer[n] = '\0';  // Null-terminate the received data
-
-    // Check if the response contains an error message
-    if (strstr(buffer, "Error:") != NULL) {
-        printf("%s", buffer);  // Print the error message
+    if (sock != -1) {
         close(sock);
-        return;
     }
+    return NULL;
+}
 
-    // If no error, proceed to create the file for writing
-    char *file_name_only = strrchr(expanded_filename, '/');
-    if (file_name_only == NULL) {
-        file_name_only = (char *)expanded_filename;  // No directory part in filename
+// Function to measure connections per second and latency percentiles of one command
+void runBenchmark(const char *command, int requests, int concurrency, int persistent) {
+    char expanded[BUF_SIZE] = "";
+    uint32_t param = 0;
+    uint8_t opcode;
+    struct benchJob *jobs;
+    pthread_t *threads;
+    struct timespec start, end;
+    double *all, total_ms;
+    long long bytes = 0;
+    int failures = 0, connect_failures = 0;
+    int i, j, k = 0;
+
+    // Expand ~ in the argument the same way the interactive commands do
+    const char *arg = strchr(command, ' ');
+    if (arg) {
+        tildePathOperation((char *)arg + 1, expanded, BUF_SIZE);
+    }
+    if (strncmp(command, "dfile ", 6) == 0) {
+        opcode = OP_DFILE;
+    } else if (strncmp(command, "display ", 8) == 0) {
+        opcode = OP_DISPLAY;
+    } else if (strncmp(command, "dtar ", 5) == 0) {
+        // dtar <filetype> [gzip[:level]]
+        char *codec = strchr(expanded, ' ');
+        if (codec) {
+            *codec++ = '\0';
+        }
+        if (parseCompression(codec, &param) < 0) {
+            fprintf(stderr, "Compression must be gzip or gzip:<0-9>\n");
+            exit(EXIT_FAILURE);
+        }
+        opcode = OP_DTAR;
     } else {
-        file_name_only++;  // Skip the '/'
+        fprintf(stderr, "Only dfile, display and dtar can be benchmarked\n");
+        exit(EXIT_FAILURE);
     }
 
-    FILE *file = fopen(file_name_only, "wb");
-    if (file == NULL) {
-        perror("File open error");
-        close(sock);
-        return;
+    jobs = calloc(concurrency, sizeof(struct benchJob));
+    threads = calloc(concurrency, sizeof(pthread_t));
+    all = calloc(requests, sizeof(double));
+    if (!jobs || !threads || !all) {
+        perror("calloc error");
+        exit(EXIT_FAILURE);
     }
 
-    // Write the initial buffer to the file (since it's part of the file content)
-    fwrite(buffer, 1, n, file);
-
-    // Clear the buffer before continuing to receive the rest of the data
-    memset(buffer, 0, BUF_SIZE);
-
-    // Receive the remaining file data from the server and write it to the file
-    while ((n = recv(sock, buffer, BUF_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, n, file);
-        memset(buffer, 0, BUF_SIZE);  // Clear buffer after each write to avoid leftover data
+    printf("Benchmarking '%s': %d requests, %d concurrent clients, %s connections\n",
+           command, requests, concurrency, persistent ? "persistent" : "per-request");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < concurrency; i++) {
+        jobs[i].opcode = opcode;
+        jobs[i].param = param;
+        snprintf(opcode == OP_DTAR ? jobs[i].name : jobs[i].path, BUF_SIZE, "%s", expanded);
+        jobs[i].persistent = persistent;
+        jobs[i].requests = requests / concurrency + (i < requests % concurrency);
+        jobs[i].latencies = calloc(jobs[i].requests + 1, sizeof(double));
+        pthread_create(&threads[i], NULL, benchWorker, &jobs[i]);
     }
-
-    if (n == 0) {
-        // This means the server has closed the connection (end of file transmission)
-        printf("File '%s' downloaded successfully.\n", file_name_only);
-    } else if (n < 0) {
-        perror("Receive error");
+    for (i = 0; i < concurrency; i++) {
+        pthread_join(threads[i], NULL);
+        for (j = 0; j < jobs[i].completed; j++) {
+            all[k++] = jobs[i].latencies[j];
+        }
+        bytes += jobs[i].bytes;
+        failures += jobs[i].failures;
+        connect_failures += jobs[i].connect_failures;
+        free(jobs[i].latencies);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total_ms = elapsedMs(&start, &end);
+
+    qsort(all, k, sizeof(double), compareDoubles);
+    printf("Completed in %.1f ms, %d failures (%d could not connect)\n", total_ms, failures, connect_failures);
+    printf("Requests/sec: %.1f\n", requests / (total_ms / 1000.0));
+    printf("Throughput: %.2f MB/s\n", bytes / (1024.0 * 1024.0) / (total_ms / 1000.0));
+    // The percentiles are of the successful requests only
+    if (k == 0) {
+        printf("Latency: no request succeeded\n");
+    } else {
+        printf("Latency p50: %.3f ms, p99: %.3f ms, max: %.3f ms\n",
+               all[k / 2], all[(int)(k * 0.99) < k ? (int)(k * 0.99) : k - 1], all[k - 1]);
     }
 
-    fclose(file);
-    close(sock);
+    free(all);
+    free(threads);
+    free(jobs);
 }
 
-void tarFile(int sock, const char *filetype) {
-    char buffer[BUF_SIZE];
-    ssize_t n;
-
-    // Send the dtar command to the server
-    snprintf(buffer, BUF_SIZE, "dtar %s", filetype);
-    send(sock, buffer, strlen(buffer), 0);
+// Function to name the local archive of a dtar for the file type
+void tarFileName(const char *filetype, uint32_t param, char *tar_filename, size_t size) {
+    const char *tar_ext = DTAR_CODEC(param) == CODEC_GZIP ? ".tar.gz" : ".tar";
 
-    // Determine the correct filename for the tar file
-    char tar_filename[BUF_SIZE];
     if (strcmp(filetype, ".c") == 0) {
-        snprintf(tar_filename, BUF_SIZE, "cfiles.tar");
+        snprintf(tar_filename, size, "cfiles%s", tar_ext);
     } else if (strcmp(filetype, ".pdf") == 0) {
-        snprintf(tar_filename, BUF_SIZE, "pdf.tar");
+        snprintf(tar_filename, size, "pdf%s", tar_ext);
     } else if (strcmp(filetype, ".txt") == 0){
-        snprintf(tar_filename, BUF_SIZE, "text.tar");
+        snprintf(tar_filename, size, "text%s", tar_ext);
     } else {
-        snprintf(tar_filename, BUF_SIZE, "%sfiles.tar", filetype + 1);  // Fallback: Create the filename without the dot
+        snprintf(tar_filename, size, "%sfiles%s", filetype + 1, tar_ext);  // Fallback: Create the filename without the dot
     }
+}
 
-    FILE *file = fopen(tar_filename, "wb");
-    if (file == NULL) {
-        perror("File open error");
-        return;
+// Function to run the commands of a file, or stdin for "-", over one connection
+// Up to inflight requests are sent ahead of their responses, which a second thread reads in
+// order. Every command gets a status line and the batch ends with its totals.
+// Returns 0 if every command succeeded, -1 otherwise
+int runBatch(const char *path, int inflight) {
+    char line[BUF_SIZE];
+    struct batchQueue queue = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER,
+        .not_full = PTHREAD_COND_INITIALIZER
+    };
+    struct batchStats stats = { .queue = &queue };
+    struct batchCommand cmd;
+    struct timespec start, end;
+    pthread_t receiver;
+    FILE *input;
+    double total_ms;
+    int invalid = 0;
+    int line_no = 0;
+
+    input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (input == NULL) {
+        perror("Batch file open error");
+        return -1;
     }
-
-    size_t total_bytes_received = 0;
-    while ((n = recv(sock, buffer, BUF_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, n, file);
-        total_bytes_received += n;
-        memset(buffer, 0, BUF_SIZE);
+    queue.capacity = inflight;
+    queue.slots = calloc(inflight, sizeof(struct batchCommand));
+    if (queue.slots == NULL || (stats.sock = connectToServer()) < 0) {
+        printf("Could not connect to server.\n");
+        free(queue.slots);
+        if (input != stdin) {
+            fclose(input);
+        }
+        return -1;
     }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&receiver, NULL, batchReceiver, &stats);
+
+    while (fgets(line, sizeof(line), input) != NULL) {
+        line_no++;
+        line[strcspn(line, "\n")] = '\0';
+        trimLeadingWhiteSpaces(line);
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.line = line_no;
+        snprintf(cmd.text, sizeof(cmd.text), "%s", line);
+        if (!validateCommands(line)) {
+            printf("[%d] %s: invalid command\n", line_no, cmd.text);
+            invalid++;
+            continue;
+        }
 
-    fclose(file);
-
-    if (total_bytes_received == 0) {
-        printf("No files exist to create the tar archive.\n");
-        remove(tar_filename); // Delete the empty tar file
-    } else if (n == 0) {
-        printf("Tar file '%s' downloaded successfully.\n", tar_filename);
-    } else if (n < 0) {
-        perror("Receive error");
+        // Wait for room in the window; the command is queued before it is sent so the
+        // receiver always knows what the next response belongs to
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == queue.capacity && !queue.broken) {
+            pthread_cond_wait(&queue.not_full, &queue.lock);
+        }
+        if (queue.broken) {
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        struct batchCommand *slot = &queue.slots[(queue.head + queue.count) % queue.capacity];
+        *slot = cmd;
+        slot->request_id = next_request_id++;
+        clock_gettime(CLOCK_MONOTONIC, &slot->start);
+        pthread_mutex_unlock(&queue.lock);
+
+        // Only this thread writes the slot until the count below hands it to the receiver
+        int rc = sendBatchCommand(stats.sock, slot);
+        pthread_mutex_lock(&queue.lock);
+        if (rc < 0) {
+            queue.broken = 1;
+        } else if (rc > 0) {
+            // Nothing was sent for this command, it already has its status line
+            invalid++;
+        } else {
+            queue.count++;
+            pthread_cond_signal(&queue.not_empty);
+        }
+        pthread_mutex_unlock(&queue.lock);
+        if (rc < 0) {
+            break;
+        }
     }
 
-    close(sock);
+    pthread_mutex_lock(&queue.lock);
+    queue.done = 1;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(receiver, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total_ms = elapsedMs(&start, &end);
+
+    printf("Batch: %d commands, %d failed, %d not sent, %.1f ms\n", stats.commands, stats.failures, invalid, total_ms);
+    printf("Commands/sec: %.1f\n", stats.commands / (total_ms / 1000.0));
+    printf("Throughput: %.2f MB/s\n", stats.bytes / (1024.0 * 1024.0) / (total_ms / 1000.0));
+
+    close(stats.sock);
+    free(queue.slots);
+    if (input != stdin) {
+        fclose(input);
+    }
+    return stats.failures == 0 && invalid == 0 && !queue.broken ? 0 : -1;
 }
 
-void displayFiles(int sock, const char *pathname) {
-    char buffer[BUF_SIZE];
-    char expanded_pathname[BUF_SIZE];
-    ssize_t n;
-    size_t base_len;
-    int files_found = 0;  // Variable to track if any files are found
+// Function to send the request of one batch command, with the file body for ufile
+// Returns 0 when sent, 1 if the command was rejected before anything was sent, or -1 if the
+// connection failed
+int sendBatchCommand(int sock, struct batchCommand *cmd) {
+    char args[BUF_SIZE];
+    char expanded[BUF_SIZE];
+    char buffer[BATCH_BUF_SIZE];
+    char *name, *arg;
+    uint32_t param = 0;
+    struct stat st;
+    size_t n;
 
-    // Expand ~ in the pathname
-    tildePathOperation((char *)pathname, expanded_pathname, BUF_SIZE);
+    snprintf(args, sizeof(args), "%s", cmd->text);
+    strtok(args, " ");
+    name = strtok(NULL, " ");
+    arg = strtok(NULL, " ");
+    tildePathOperation(name, expanded, BUF_SIZE);
+
+    if (strcmp(args, "ufile") == 0) {
+        char dest[BUF_SIZE];
+        FILE *file = fopen(name, "rb");
+        if (file == NULL || fstat(fileno(file), &st) < 0) {
+            printf("[%d] %s: ERROR cannot open '%s': %s\n", cmd->line, cmd->text, name, strerror(errno));
+            if (file) {
+                fclose(file);
+            }
+            return 1;
+        }
+        tildePathOperation(arg, dest, BUF_SIZE);
+        cmd->opcode = OP_UFILE;
+        cmd->sent_bytes = st.st_size;
+        if (sendFrame(sock, OP_UFILE, cmd->request_id, 0, name, dest, st.st_size) < 0) {
+            fclose(file);
+            return -1;
+        }
+        uint64_t remaining = st.st_size;
+        while (remaining > 0 && (n = fread(buffer, 1, remaining < sizeof(buffer) ? remaining : sizeof(buffer), file)) > 0) {
+            if (sendAll(sock, buffer, n) < 0) {
+                fclose(file);
+                return -1;
+            }
+            remaining -= n;
+        }
+        fclose(file);
+        // A file that shrank while it was read leaves the connection out of step
+        return remaining > 0 ? -1 : 0;
+    } else if (strcmp(args, "utar") == 0) {
+        cmd->opcode = OP_INGEST;
+        return sendIngestRequest(sock, cmd->request_id, name, arg, &cmd->sent_bytes);
+    } else if (strcmp(args, "dfile") == 0) {
+        char *base = strrchr(expanded, '/');
+        snprintf(cmd->output, sizeof(cmd->output), "%s", base ? base + 1 : expanded);
+        cmd->opcode = OP_DFILE;
+        return sendFrame(sock, OP_DFILE, cmd->request_id, 0, NULL, expanded, 0);
+    } else if (strcmp(args, "rmfile") == 0) {
+        cmd->opcode = OP_RMFILE;
+        return sendFrame(sock, OP_RMFILE, cmd->request_id, 0, NULL, expanded, 0);
+    } else if (strcmp(args, "dtar") == 0) {
+        parseCompression(arg, &param);
+        tarFileName(name, param, cmd->output, sizeof(cmd->output));
+        cmd->opcode = OP_DTAR;
+        return sendFrame(sock, OP_DTAR, cmd->request_id, param, name, NULL, 0);
+    }
+    // The whole listing is printed, batch mode does not page
+    cmd->opcode = OP_DISPLAY;
+    return sendFrame(sock, OP_DISPLAY, cmd->request_id, 0, NULL, expanded, 0);
+}
 
-    // Trim trailing slash, if present
-    size_t path_len = strlen(expanded_pathname);
-    if (path_len > 1 && expanded_pathname[path_len - 1] == '/') {
-        expanded_pathname[path_len - 1] = '\0';
+// Batch receiving thread: read the responses in the order the commands were sent
+void *batchReceiver(void *arg) {
+    struct batchStats *stats = arg;
+    struct batchQueue *queue = stats->queue;
+    struct batchCommand *cmd;
+    struct timespec end;
+    char message[BUF_SIZE];
+    long long bytes;
+    int status;
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->done && !queue->broken) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        if (queue->count == 0 || queue->broken) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        cmd = &queue->slots[queue->head];
+        pthread_mutex_unlock(&queue->lock);
+
+        bytes = cmd->sent_bytes;
+        status = recvBatchResponse(stats->sock, cmd, message, &bytes);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->commands++;
+        stats->bytes += bytes;
+        if (status != STATUS_OK) {
+            stats->failures++;
+        }
+        message[strcspn(message, "\n")] = '\0';
+        printf("[%d] %s: %s %.3f ms %lld bytes%s%s\n", cmd->line, cmd->text,
+               status == STATUS_OK ? "OK" : "ERROR", elapsedMs(&cmd->start, &end), bytes,
+               message[0] ? " - " : "", message);
+
+        pthread_mutex_lock(&queue->lock);
+        if (status < 0) {
+            queue->broken = 1;
+        }
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+        if (status < 0) {
+            printf("Lost the connection to Smain, stopping the batch.\n");
+            break;
+        }
     }
-    
-    base_len = strlen(expanded_pathname);
+    return NULL;
+}
 
-    // Send the display command to the server
-    snprintf(buffer, BUF_SIZE, "display %s", expanded_pathname);
-    send(sock, buffer, strlen(buffer), 0);
-
-    // Receive the list of filenames from the server
-    while ((n = recv(sock, buffer, BUF_SIZE - 1, 0)) > 0) {
-        buffer[n] = '\0';  // Null-terminate the received data
-
-        // Process each line in the buffer to strip the base path
-        char *line = strtok(buffer, "\n");
-        while (line != NULL) {
-            if (!files_found) {
-                printf("List of files in %s:\n", expanded_pathname);  // Print the message only once when the first file is found
-                files_found = 1;
-            }
-
-            // Check if the line starts with the expanded pathname or spdf/stext and remove the base path accordingly
-            if (strncmp(line, expanded_pathname, base_len) == 0) {
-                // Print only the part after the base path
-                printf("%s\n", line + base_len + 1);  // +1 to remove the leading slash
-            } else if (strstr(line, "/spdf/") != NULL) {
-                // Print the part after the base path and remove "/spdf/"
-                printf("%s\n", line + base_len);
-            } else if (strstr(line, "/stext/") != NULL) {
-                // Print the part after the base path and remove "/stext/"
-                printf("%s\n", line + base_len + 1);
-            } else {
-                // If the line doesn't match any base path, just print it
-                printf("%s\n", line);
+// Function to read the response of one batch command, writing or printing its body
+// Returns the status of the response, or -1 if the connection failed
+int recvBatchResponse(int sock, struct batchCommand *cmd, char *message, long long *bytes) {
+    char name[BUF_SIZE];
+    char buffer[BATCH_BUF_SIZE];
+    struct frameHeader hdr;
+    FILE *file = NULL;
+    ssize_t n;
+
+    message[0] = '\0';
+    while (recvFrame(sock, &hdr, name, message) > 0) {
+        if (hdr.request_id != cmd->request_id) {
+            snprintf(message, BUF_SIZE, "response to request %u out of order", hdr.request_id);
+            break;
+        }
+        if (hdr.opcode == OP_END) {
+            if (recvMessage(sock, hdr.payload_len, message, BUF_SIZE) < 0) {
+                break;
             }
-            line = strtok(NULL, "\n");
+            if (file) {
+                fclose(file);
+                if (hdr.param != STATUS_OK) {
+                    remove(cmd->output);
+                }
+            }
+            return hdr.param;
         }
-    }
 
-    if (files_found == 0) {
-        printf("There are no files in %s.\n", expanded_pathname);  // Print if no files are found
+        // Body frames go to the output file of dfile/dtar, or to stdout for display
+        if (file == NULL && cmd->output[0] != '\0' && (file = fopen(cmd->output, "wb")) == NULL) {
+            snprintf(message, BUF_SIZE, "cannot open '%.900s': %s", cmd->output, strerror(errno));
+            break;
+        }
+        uint64_t remaining = hdr.payload_len;
+        while (remaining > 0) {
+            n = recv(sock, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer), 0);
+            if (n <= 0) {
+                break;
+            }
+            fwrite(buffer, 1, n, file ? file : stdout);
+            *bytes += n;
+            remaining -= n;
+        }
+        if (remaining > 0) {
+            break;
+        }
     }
-
-    if (n == 0 && files_found) {
-        printf("\nDisplay command completed.\n");
-    } else if (n < 0) {
-        perror("Receive error");
+    if (file) {
+        fclose(file);
     }
-
-    // Close the socket after finishing the command
-    close(sock);
+    return -1;
 }
 
 // Function to expand ~ to the user's home directory
@@ -443,6 +2449,30 @@ int validateCommands(const char *command) {
             return 0;
         }
 
+    } else if (strcmp(cmd, "utar") == 0) {
+        // utar directory|archive.tar destination_path
+        filename = strtok(NULL, " ");
+        dest_path = strtok(NULL, " ");
+        extra_arg = strtok(NULL, " ");
+
+        if (!filename || !dest_path || extra_arg) {
+            printf("Usage: utar <directory|archive.tar> <destination_path>\n");
+            return 0;
+        }
+
+        // Validate the tilde usage in the source and destination path
+        if ((filename[0] == '~' && filename[1] != '/') || (dest_path[0] == '~' && dest_path[1] != '/')) {
+            printf("Error: Invalid path. Use '~/smain' or '/home/username/smain' instead.\n");
+            return 0;
+        }
+
+        // Validate that the path starts with ~/smain or /home/username/smain
+        if (!(strncmp(dest_path, "~/smain", 7) == 0 || strncmp(dest_path, home_dir, strlen(home_dir)) == 0) ||
+            (strncmp(dest_path, home_dir, strlen(home_dir)) == 0 && strncmp(dest_path + strlen(home_dir), "/smain", 6) != 0)) {
+            printf("Error: Path must start with '~/smain' or '/home/username/smain'.\n");
+            return 0;
+        }
+
     } else if (strcmp(cmd, "dfile") == 0 || strcmp(cmd, "rmfile") == 0) {
         // dfile pathname or rmfile filename
         filename = strtok(NULL, " ");
@@ -474,12 +2504,19 @@ int validateCommands(const char *command) {
         }
 
     } else if (strcmp(cmd, "dtar") == 0) {
-        // dtar filetype
+        // dtar filetype [gzip[:level]]
         char *filetype = strtok(NULL, " ");
+        char *compression = strtok(NULL, " ");
+        uint32_t param;
         extra_arg = strtok(NULL, " ");
 
         if (!filetype || extra_arg) {
-            printf("Usage: dtar <filetype>\n");
+            printf("Usage: dtar <filetype> [gzip[:level]]\n");
+            return 0;
+        }
+
+        if (parseCompression(compression, &param) < 0) {
+            printf("Invalid compression. Use gzip or gzip:<level> with a level from 0 to 9.\n");
             return 0;
         }
 
@@ -495,12 +2532,18 @@ int validateCommands(const char *command) {
         }
 
     } else if (strcmp(cmd, "display") == 0) {
-        // display pathname
+        // display pathname [page_size]
         char *pathname = strtok(NULL, " ");
+        char *page = strtok(NULL, " ");
         extra_arg = strtok(NULL, " ");
 
         if (!pathname || extra_arg) {
-            printf("Usage: display <pathname>\n");
+            printf("Usage: display <pathname> [page_size]\n");
+            return 0;
+        }
+
+        if (page && (strspn(page, "0123456789") != strlen(page) || atoi(page) <= 0)) {
+            printf("Invalid page size. Use a positive number of files per page.\n");
             return 0;
         }
 
@@ -530,3 +2573,215 @@ int validateCommands(const char *command) {
 
     return 1; // Command is valid
 }
+
+// Function to send the whole buffer, returns 0 on success
+int sendAll(int sock, const void *buf, size_t len) {
+    return sendAllFlags(sock, buf, len, 0);
+}
+
+// Function to send the whole buffer with send flags such as MSG_MORE
+int sendAllFlags(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(sock, p, len, flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to receive exactly len bytes, returns 0 on success and -1 on error or EOF
+int recvAll(int sock, void *buf, size_t len) {
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(sock, p, len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to send a frame header with its name and path, the payload is sent by the caller
+int sendFrame(int sock, uint8_t opcode, uint32_t request_id, uint32_t param, const char *name, const char *path, uint64_t payload_len) {
+    unsigned char header[FRAME_HEADER_SIZE + 2 * BUF_SIZE];
+    size_t name_len = name ? strlen(name) : 0;
+    size_t path_len = path ? strlen(path) : 0;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    if (name_len >= BUF_SIZE || path_len >= BUF_SIZE) {
+        return -1;
+    }
+    v16 = htons(PROTO_MAGIC);
+    memcpy(header, &v16, 2);
+    header[2] = PROTO_VERSION;
+    header[3] = opcode;
+    v32 = htonl(request_id);
+    memcpy(header + 4, &v32, 4);
+    v32 = htonl(param);
+    memcpy(header + 8, &v32, 4);
+    v16 = htons((uint16_t)name_len);
+    memcpy(header + 12, &v16, 2);
+    v16 = htons((uint16_t)path_len);
+    memcpy(header + 14, &v16, 2);
+    v64 = htobe64(payload_len);
+    memcpy(header + 16, &v64, 8);
+    if (name_len > 0) {
+        memcpy(header + FRAME_HEADER_SIZE, name, name_len);
+    }
+    if (path_len > 0) {
+        memcpy(header + FRAME_HEADER_SIZE + name_len, path, path_len);
+    }
+
+    // Header, name and path go out in one send, held back with MSG_MORE when a payload follows
+    return sendAllFlags(sock, header, FRAME_HEADER_SIZE + name_len + path_len, payload_len > 0 ? MSG_MORE : 0);
+}
+
+// Function to receive a frame header with its name and path (each up to BUF_SIZE - 1 bytes)
+// Returns 1 on success, 0 if the peer closed the connection between frames and -1 on error
+int recvFrame(int sock, struct frameHeader *hdr, char *name, char *path) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+    ssize_t n;
+
+    // Distinguish a clean close before the next frame from a truncated frame
+    do {
+        n = recv(sock, header, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n == 0 ? 0 : -1;
+    }
+    if (recvAll(sock, header + 1, FRAME_HEADER_SIZE - 1) < 0) {
+        return -1;
+    }
+
+    memcpy(&v16, header, 2);
+    if (ntohs(v16) != PROTO_MAGIC) {
+        fprintf(stderr, "Protocol error: bad frame magic\n");
+        return -1;
+    }
+    hdr->version = header[2];
+    hdr->opcode = header[3];
+    memcpy(&v32, header + 4, 4);
+    hdr->request_id = ntohl(v32);
+    memcpy(&v32, header + 8, 4);
+    hdr->param = ntohl(v32);
+    memcpy(&v16, header + 12, 2);
+    hdr->name_len = ntohs(v16);
+    memcpy(&v16, header + 14, 2);
+    hdr->path_len = ntohs(v16);
+    memcpy(&v64, header + 16, 8);
+    hdr->payload_len = be64toh(v64);
+
+    if (hdr->version != PROTO_VERSION) {
+        fprintf(stderr, "Protocol error: unsupported version %d\n", hdr->version);
+        return -1;
+    }
+    if (hdr->name_len >= BUF_SIZE || hdr->path_len >= BUF_SIZE) {
+        fprintf(stderr, "Protocol error: name or path too long\n");
+        return -1;
+    }
+    if (recvAll(sock, name, hdr->name_len) < 0 || recvAll(sock, path, hdr->path_len) < 0) {
+        return -1;
+    }
+    name[hdr->name_len] = '\0';
+    path[hdr->path_len] = '\0';
+    return 1;
+}
+
+// Function to send one piece of a response body
+int sendData(int sock, uint32_t request_id, const void *buf, size_t len) {
+    if (sendFrame(sock, OP_DATA, request_id, 0, NULL, NULL, len) < 0) {
+        return -1;
+    }
+    return sendAll(sock, buf, len);
+}
+
+// Function to finish a response with a status and a message for the user
+int sendEnd(int sock, uint32_t request_id, uint32_t status, const char *message) {
+    size_t len = message ? strlen(message) : 0;
+
+    if (sendFrame(sock, OP_END, request_id, status, NULL, NULL, len) < 0) {
+        return -1;
+    }
+    return len > 0 ? sendAll(sock, message, len) : 0;
+}
+
+// Function to read and discard a payload the receiver cannot use
+int drainPayload(int sock, uint64_t len) {
+    char small[BUF_SIZE];
+    size_t size = len <= BUF_SIZE ? BUF_SIZE : transferChunk(len);
+    char *buffer = size == BUF_SIZE ? small : malloc(size);
+
+    if (buffer == NULL) {
+        return -1;
+    }
+    while (len > 0) {
+        size_t chunk = len < size ? len : size;
+        if (recvAll(sock, buffer, chunk) < 0) {
+            break;
+        }
+        len -= chunk;
+    }
+    if (buffer != small) {
+        free(buffer);
+    }
+    return len > 0 ? -1 : 0;
+}
+
+// Function to turn off Nagle's algorithm, frames are already written in as few sends as possible
+// and a small END frame would otherwise wait for the peer's delayed ACK
+void setNoDelay(int sock) {
+    int one = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Function to size the kernel buffers of a socket when --socket-buffer is given
+// Fixed sizes turn off the kernel's autotuning, so by default they are left alone. They have to
+// be set before connecting for the receive window to be scaled to them.
+void setSocketBuffers(int sock) {
+    if (socket_buffer > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer));
+    }
+}
+
+// Function to hold back partial segments while a request and its body are written, uncorking
+// sends whatever is left at once
+void setCork(int sock, int on) {
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Function to pick the chunk size bodies of len bytes are moved in
+size_t transferChunk(uint64_t len) {
+    size_t chunk = transfer_chunk;
+
+    if (chunk == 0) {
+        chunk = len <= CHUNK_SMALL_FILE ? CHUNK_SMALL : len <= CHUNK_LARGE_FILE ? CHUNK_MEDIUM : CHUNK_LARGE;
+    }
+    // A buffer bigger than the transfer itself is never filled
+    if (len > 0 && len < chunk) {
+        chunk = len;
+    }
+    return chunk;
+}